@@ -72,6 +72,7 @@
 #include "jlog_config.h"
 #include "jlog_private.h"
 #include "jlog_compress.h"
+#include "jlog_hash.h"
 #if HAVE_UNISTD_H
 #include <unistd.h>
 #endif
@@ -101,10 +102,46 @@
 #include <pthread.h>
 #include <assert.h>
 
-#define BUFFERED_INDICES 1024
+#define BUFFERED_INDICES (128*1024)
+#define RESYNC_READ_SIZE (1024*1024)
 #define PRE_COMMIT_BUFFER_SIZE_DEFAULT 0
 #define IS_COMPRESS_MAGIC_HDR(hdr) ((hdr & DEFAULT_HDR_MAGIC_COMPRESSION) == DEFAULT_HDR_MAGIC_COMPRESSION)
 #define IS_COMPRESS_MAGIC(ctx) IS_COMPRESS_MAGIC_HDR((ctx)->meta->hdr_magic)
+/* the extended metastore continues with struct _jlog_meta_ext */
+#define META_LEN(ctx) (sizeof(struct _jlog_meta_info) + \
+  ((ctx)->meta_has_ext ? sizeof(struct _jlog_meta_ext) : 0))
+#define HAS_SEQUENCE(ctx) (((ctx)->meta_ext->features & JLOG_FEATURE_SEQUENCE) != 0)
+#define HAS_RETENTION(ctx) ((ctx)->retention->retain_bytes || (ctx)->retention->retain_age || \
+                            (ctx)->retention->retain_segments)
+#define HAS_KEYS(ctx) (((ctx)->meta_ext->features & JLOG_FEATURE_KEYS) != 0)
+#define HAS_COMPACT_INDEX(ctx) (((ctx)->meta_ext->features & JLOG_FEATURE_COMPACT_INDEX) != 0)
+/* An index entry is a record's offset in its segment: 64 bits wide, or 32
+ * in a compact index, as records always start below the unit limit */
+#define IDX_ENTRY_SIZE(ctx) \
+  (HAS_COMPACT_INDEX(ctx) ? sizeof(u_int32_t) : sizeof(u_int64_t))
+#define HAS_SPARSE_INDEX(ctx) \
+  (((ctx)->meta_ext->features & JLOG_FEATURE_SPARSE_INDEX) != 0 && (ctx)->meta_ext->index_stride > 1)
+/* A sparse index holds the offsets of records 1, 1 + stride, ... only, and
+ * once sealed the record count ahead of its close marker */
+#define IDX_STRIDE(ctx) (HAS_SPARSE_INDEX(ctx) ? (ctx)->meta_ext->index_stride : 1)
+#define SPARSE_WALK_READ 8192
+#define HAS_EXT_HDR(ctx) \
+  (((ctx)->meta_ext->features & (JLOG_FEATURE_SEQUENCE|JLOG_FEATURE_KEYS)) != 0)
+/* A record header on disk is the base header, followed by the extension
+ * header when the jlog has sequence numbers or keys */
+#define BASE_HDR_SIZE(ctx) (IS_COMPRESS_MAGIC(ctx) ? \
+  sizeof(jlog_message_header_compressed) : sizeof(jlog_message_header))
+#define HDR_SIZE(ctx) (BASE_HDR_SIZE(ctx) + \
+  (HAS_EXT_HDR(ctx) ? sizeof(jlog_message_header_ext) : 0))
+#define MAX_HDR_SIZE \
+  (sizeof(jlog_message_header_compressed) + sizeof(jlog_message_header_ext))
+/* Records of a fixed size are found by arithmetic, so have no index */
+#define HAS_FIXED_RECORDS(ctx) (((ctx)->meta_ext->features & JLOG_FEATURE_FIXED_RECORDS) != 0)
+#define FIXED_RECORD_SIZE(ctx) (HDR_SIZE(ctx) + (ctx)->meta_ext->record_size)
+/* A header found there that is not a record's means the segment is torn */
+#define FIXED_RECORD_BAD(ctx, m) (HAS_FIXED_RECORDS(ctx) && \
+  ((m)->aligned_header.reserved != (ctx)->meta->hdr_magic || \
+   (m)->aligned_header.mlen != (ctx)->meta_ext->record_size))
 
 static jlog_file *__jlog_open_writer(jlog_ctx *ctx);
 static int __jlog_close_writer(jlog_ctx *ctx);
@@ -122,7 +159,55 @@ static int __jlog_teardown_reader(jlog_ctx *ctx);
 static int __jlog_metastore_atomic_increment(jlog_ctx *ctx);
 static int __jlog_get_storage_bounds(jlog_ctx *ctx, unsigned int *earliest, unsigned *latest);
 static int repair_metastore(jlog_ctx *ctx, const char *pth, unsigned int lat);
-static int validate_metastore(const struct _jlog_meta_info *info, struct _jlog_meta_info *out);
+static int validate_metastore(const struct _jlog_meta_info *info,
+                              const struct _jlog_meta_ext *ext,
+                              struct _jlog_meta_info *out);
+static int __jlog_lazy_get(jlog_ctx *ctx, jlog_id *id);
+static int __jlog_lazy_force(jlog_ctx *ctx, const jlog_id *id);
+static void __jlog_lazy_stop(jlog_ctx *ctx);
+static int __jlog_read_eviction(jlog_ctx *ctx, const char *s, struct _jlog_eviction *ev);
+static int __jlog_take_eviction(jlog_ctx *ctx);
+
+/* Unpack the on-disk record header at `buf` into `m`.  On a jlog with
+ * extension headers the header is also kept with its extension in `full`,
+ * when given, and m->header then points there. */
+static void __jlog_unpack_header(jlog_ctx *ctx, jlog_message *m, const void *buf,
+                                 jlog_message_header_full *full) {
+  size_t base_size = BASE_HDR_SIZE(ctx);
+
+  memcpy(&m->aligned_header, buf, base_size);
+  m->header = &m->aligned_header;
+  if (full && HAS_EXT_HDR(ctx)) {
+    full->hdr = m->aligned_header;
+    memcpy(&full->ext, (const char *)buf + base_size, sizeof(full->ext));
+    m->header = &full->hdr;
+  }
+}
+
+static int __jlog_pread_header(jlog_ctx *ctx, jlog_message *m, off_t off,
+                               jlog_message_header_full *full) {
+  char buf[MAX_HDR_SIZE];
+
+  if (!jlog_file_pread(ctx->data, buf, HDR_SIZE(ctx), off)) return 0;
+  __jlog_unpack_header(ctx, m, buf, full);
+  return 1;
+}
+
+/* Make room for the extension headers of a read of `count` messages */
+static int __jlog_reserve_ext_headers(jlog_ctx *ctx, int count) {
+  jlog_message_header_full *h;
+
+  if (!HAS_EXT_HDR(ctx) || ctx->ext_headers_len >= count) return 0;
+  if ((h = realloc(ctx->ext_headers, count * sizeof(*h))) == NULL) {
+    ctx->last_error = JLOG_ERR_FILE_READ;
+    ctx->last_errno = ENOMEM;
+    return -1;
+  }
+  ctx->ext_headers = h;
+  ctx->ext_headers_len = count;
+  return 0;
+}
+#define EXT_HEADER(ctx, i) (HAS_EXT_HDR(ctx) ? &(ctx)->ext_headers[i] : NULL)
 
 int jlog_snprint_logid(char *b, int n, const jlog_id *id) {
   return snprintf(b, n, "%08x:%08x", id->log, id->marker);
@@ -131,10 +216,9 @@ int jlog_snprint_logid(char *b, int n, const jlog_id *id) {
 int jlog_repair_datafile(jlog_ctx *ctx, u_int32_t log)
 {
   jlog_message_header_compressed hdr;
-  size_t hdr_size = sizeof(jlog_message_header);
+  size_t base_size = BASE_HDR_SIZE(ctx), hdr_size = HDR_SIZE(ctx);
   uint32_t *message_disk_len = &hdr.mlen;
   if (IS_COMPRESS_MAGIC(ctx)) {
-    hdr_size = sizeof(jlog_message_header_compressed);
     message_disk_len = &hdr.compressed_len;
   }
   char *this, *next, *afternext = NULL, *mmap_end;
@@ -188,19 +272,19 @@ int jlog_repair_datafile(jlog_ctx *ctx, u_int32_t log)
       break;
     }
     if (next + hdr_size > mmap_end) goto error;
-    memcpy(&hdr, next, hdr_size);
+    memcpy(&hdr, next, base_size);
     if (hdr.reserved != ctx->meta->hdr_magic) goto error;
     this = next;
     continue;
   error:
     for (next = this + hdr_size; next + hdr_size <= mmap_end; next++) {
-      memcpy(&hdr, next, hdr_size);
+      memcpy(&hdr, next, base_size);
       if (hdr.reserved == ctx->meta->hdr_magic) {
         afternext = next + hdr_size + *message_disk_len;
         if (afternext <= (char *)ctx->mmap_base) continue;
         if (afternext == mmap_end) break;
         if (afternext + hdr_size > mmap_end) continue;
-        memcpy(&hdr, afternext, hdr_size);
+        memcpy(&hdr, afternext, base_size);
         if (hdr.reserved == ctx->meta->hdr_magic) break;
       }
     }
@@ -256,8 +340,10 @@ finish:
 
 int jlog_inspect_datafile(jlog_ctx *ctx, u_int32_t log, int verbose)
 {
+  jlog_message hdrm;
+  jlog_message_header_full full;
   jlog_message_header_compressed hdr;
-  size_t hdr_size = sizeof(jlog_message_header);
+  size_t hdr_size;
   uint32_t *message_disk_len = &hdr.mlen;
   char *this, *next, *mmap_end;
   int i;
@@ -266,9 +352,9 @@ int jlog_inspect_datafile(jlog_ctx *ctx, u_int32_t log, int verbose)
   char tbuff[128];
 
   if (IS_COMPRESS_MAGIC(ctx)) {
-    hdr_size = sizeof(jlog_message_header_compressed);
     message_disk_len = &hdr.compressed_len;
   }
+  hdr_size = HDR_SIZE(ctx);
 
   ctx->last_error = JLOG_ERR_SUCCESS;
 
@@ -283,7 +369,8 @@ int jlog_inspect_datafile(jlog_ctx *ctx, u_int32_t log, int verbose)
   i = 0;
   while (this + hdr_size <= mmap_end) {
     int initial = 1;
-    memcpy(&hdr, this, hdr_size);
+    __jlog_unpack_header(ctx, &hdrm, this, &full);
+    memcpy(&hdr, &hdrm.aligned_header, sizeof(hdr));
     i++;
     if (hdr.reserved != ctx->meta->hdr_magic) {
       fprintf(stderr, "Message %d at [%ld] has invalid reserved value %u\n",
@@ -318,6 +405,10 @@ int jlog_inspect_datafile(jlog_ctx *ctx, u_int32_t log, int verbose)
     localtime_r(&timet, &tm);
     strftime(tbuff, sizeof(tbuff), "%c", &tm);
     if(verbose) fprintf(stderr, "\n\ttime: %s\n\tmlen: %u\n", tbuff, hdr.mlen);
+    if(verbose && HAS_SEQUENCE(ctx))
+      fprintf(stderr, "\tseq: %llu\n", (unsigned long long)full.ext.seq);
+    if(verbose && HAS_KEYS(ctx))
+      fprintf(stderr, "\tkey: %.*s\n", JLOG_KEY_LEN, full.ext.key);
     this = next;
   }
   if (this < mmap_end) {
@@ -331,42 +422,251 @@ finish:
   return -1;
 }
 
-int jlog_idx_details(jlog_ctx *ctx, u_int32_t log,
-                     u_int32_t *marker, int *closed)
-{
+/* Read `count` entries of an index from entry `first` on as 64-bit
+ * offsets, whichever width the index stores them at.
+ * @return 1 on success, 0 on failure, as jlog_file_pread */
+static int __jlog_index_pread(jlog_ctx *ctx, jlog_file *idx, u_int64_t *offs,
+                              size_t count, u_int64_t first) {
+  u_int32_t *narrow = (u_int32_t *)offs;
+  size_t i;
+
+  if (!HAS_COMPACT_INDEX(ctx))
+    return jlog_file_pread(idx, offs, count * sizeof(*offs),
+                           first * sizeof(*offs));
+  if (!jlog_file_pread(idx, narrow, count * sizeof(*narrow),
+                       first * sizeof(*narrow)))
+    return 0;
+  /* widen in place from the back, where no entry is overwritten unread */
+  for (i = count; i-- > 0;) offs[i] = narrow[i];
+  return 1;
+}
+
+/* Write `count` 64-bit offsets as entries of an index from entry `first`
+ * on.  A compact index is narrowed in place, so `offs` is clobbered.
+ * @return 1 on success, 0 on failure, as jlog_file_pwrite */
+static int __jlog_index_pwrite(jlog_ctx *ctx, jlog_file *idx, u_int64_t *offs,
+                               size_t count, u_int64_t first) {
+  u_int32_t *narrow = (u_int32_t *)offs;
+  size_t i;
+
+  if (!HAS_COMPACT_INDEX(ctx))
+    return jlog_file_pwrite(idx, offs, count * sizeof(*offs),
+                            first * sizeof(*offs));
+  for (i = 0; i < count; i++) {
+    if (offs[i] > UINT32_MAX) {
+      errno = EFBIG;
+      return 0;
+    }
+    narrow[i] = (u_int32_t)offs[i];
+  }
+  return jlog_file_pwrite(idx, narrow, count * sizeof(*narrow),
+                          first * sizeof(*narrow));
+}
+
+/* Walk the record headers of segment `data` from the record at `off`,
+ * passing over `skip` records and then noting the offsets of up to `count`
+ * more in `offs`, which may be NULL to only count them.  The walk ends at
+ * the first record not wholly in the segment.
+ * @return records noted, or -1 on a read error or a stray header */
+static int __jlog_index_walk(jlog_ctx *ctx, jlog_file *data, u_int64_t off,
+                             u_int32_t skip, u_int64_t *offs, u_int32_t count) {
+  jlog_message_header_compressed hdr;
+  u_int32_t *disk_len = IS_COMPRESS_MAGIC(ctx) ? &hdr.compressed_len : &hdr.mlen;
+  size_t base_size = BASE_HDR_SIZE(ctx), hdr_size = HDR_SIZE(ctx);
+  size_t map_len = 0, buf_len = 0;
+  const char *map = NULL;
+  char buf[SPARSE_WALK_READ];
+  u_int64_t buf_off = 0, next;
+  off_t data_len;
+  u_int32_t n = 0;
+
+  if ((data_len = jlog_file_size(data)) == -1) return -1;
+  /* a reader's mapping of the segment spares the reads */
+  if (data == ctx->data && ctx->mmap_base) {
+    map = ctx->mmap_base;
+    map_len = ctx->mmap_len;
+  }
+  while (n < count && off + hdr_size <= (u_int64_t)data_len) {
+    if (off + base_size <= map_len) {
+      memcpy(&hdr, map + off, base_size);
+    } else {
+      if (off < buf_off || off + base_size > buf_off + buf_len) {
+        buf_off = off;
+        buf_len = data_len - off;
+        if (buf_len > sizeof(buf)) buf_len = sizeof(buf);
+        if (!jlog_file_pread(data, buf, buf_len, buf_off)) return -1;
+      }
+      memcpy(&hdr, buf + (off - buf_off), base_size);
+    }
+    if (hdr.reserved != ctx->meta->hdr_magic) {
+      errno = EINVAL;
+      return -1;
+    }
+    if ((next = off + hdr_size + *disk_len) > (u_int64_t)data_len) break;
+    if (skip) skip--;
+    else {
+      if (offs) offs[n] = off;
+      n++;
+    }
+    off = next;
+  }
+  return n;
+}
+
+/* Offsets of records first..first+count-1 of a segment, counting from 0.
+ * A sparse index is read at the entry at or before `first` and the rest
+ * found by walking segment `data` from there.  Fixed records need neither.
+ * @return 1 on success, 0 on failure, as jlog_file_pread */
+static int __jlog_index_offsets(jlog_ctx *ctx, jlog_file *idx, jlog_file *data,
+                                u_int64_t *offs, size_t count, u_int64_t first) {
+  u_int32_t stride = IDX_STRIDE(ctx);
+  u_int64_t off;
+  size_t i;
+
+  if (HAS_FIXED_RECORDS(ctx)) {
+    for (i = 0; i < count; i++) offs[i] = (first + i) * FIXED_RECORD_SIZE(ctx);
+    return 1;
+  }
+  if (stride == 1) return __jlog_index_pread(ctx, idx, offs, count, first);
+  if (count == 0) return 1;
+  if (!__jlog_index_pread(ctx, idx, &off, 1, first / stride)) return 0;
+  return __jlog_index_walk(ctx, data, off, first % stride, offs, count) == (int)count;
+}
+
+/* Size up index `idx` without touching its segment: *entries offsets,
+ * followed by a close marker if *closed.  *marker is the record count,
+ * or for an open sparse index that of the records up to its last entry. */
+static int __jlog_index_tail(jlog_ctx *ctx, jlog_file *idx, u_int64_t *entries,
+                             u_int32_t *marker, int *closed) {
+  u_int32_t stride = IDX_STRIDE(ctx);
+  u_int64_t tail[2];
   off_t index_len;
-  u_int64_t index;
 
-  __jlog_open_indexer(ctx, log);
-  if (!ctx->index)
-    SYS_FAIL(JLOG_ERR_IDX_OPEN);
-  if ((index_len = jlog_file_size(ctx->index)) == -1)
+  *closed = 0;
+  if ((index_len = jlog_file_size(idx)) == -1)
     SYS_FAIL(JLOG_ERR_IDX_SEEK);
-  if (index_len % sizeof(u_int64_t))
+  if (index_len % IDX_ENTRY_SIZE(ctx))
     SYS_FAIL(JLOG_ERR_IDX_CORRUPT);
-  if (index_len > sizeof(u_int64_t)) {
-    if (!jlog_file_pread(ctx->index, &index, sizeof(u_int64_t),
-                         index_len - sizeof(u_int64_t)))
-    {
+  *entries = index_len / IDX_ENTRY_SIZE(ctx);
+  if (*entries > 1) {
+    if (!__jlog_index_pread(ctx, idx, tail, 2, *entries - 2))
       SYS_FAIL(JLOG_ERR_IDX_READ);
-    }
-    if (index) {
-      *marker = index_len / sizeof(u_int64_t);
-      *closed = 0;
-    } else {
-      *marker = (index_len / sizeof(u_int64_t)) - 1;
+    if (tail[1] == 0) {
       *closed = 1;
+      *entries -= stride == 1 ? 1 : 2;
+      *marker = stride == 1 ? *entries : tail[0];
+      return 0;
     }
-  } else {
-    *marker = index_len / sizeof(u_int64_t);
-    *closed = 0;
   }
+  *marker = *entries ? (*entries - 1) * stride + 1 : 0;
+  return 0;
+ finish:
+  return -1;
+}
+
+/* How many records index `idx` covers and whether it is sealed.  The
+ * records past an open sparse index's last entry are walked in `data`. */
+static int __jlog_index_extent(jlog_ctx *ctx, jlog_file *idx, jlog_file *data,
+                               u_int32_t *marker, int *closed) {
+  u_int64_t entries, off;
+  int n;
 
+  if (__jlog_index_tail(ctx, idx, &entries, marker, closed) != 0) return -1;
+  if (*closed || entries == 0 || !HAS_SPARSE_INDEX(ctx)) return 0;
+  if (!__jlog_index_pread(ctx, idx, &off, 1, entries - 1))
+    SYS_FAIL(JLOG_ERR_IDX_READ);
+  if ((n = __jlog_index_walk(ctx, data, off, 0, NULL, UINT32_MAX)) < 0)
+    SYS_FAIL(JLOG_ERR_FILE_READ);
+  /* the record at the last entry is counted in both */
+  if (n > 0) *marker += n - 1;
   return 0;
-finish:
+ finish:
+  return -1;
+}
+
+/* How many records segment `log` of fixed records holds: as many as fit
+ * whole.  It is sealed once the writer has moved past it, and then must
+ * end on a record boundary. */
+static int __jlog_fixed_extent(jlog_ctx *ctx, jlog_file *data, u_int32_t log,
+                               u_int32_t *marker, int *closed) {
+  off_t data_len;
+
+  /* the writer finishes a segment before it moves on, so look first */
+  *closed = log < ctx->meta->storage_log;
+  __sync_synchronize();
+  if ((data_len = jlog_file_size(data)) == -1)
+    SYS_FAIL(JLOG_ERR_FILE_SEEK);
+  *marker = data_len / FIXED_RECORD_SIZE(ctx);
+  if (*closed && data_len % FIXED_RECORD_SIZE(ctx))
+    SYS_FAIL(JLOG_ERR_FILE_CORRUPT);
+  return 0;
+ finish:
   return -1;
 }
 
+/* A writer that died mid-record leaves a torn one at the end of the
+ * active segment, which would put every record appended after it out of
+ * step.  Cut it off, under the data lock, before appending at *len. */
+static int __jlog_fixed_whole(jlog_ctx *ctx, off_t *len) {
+  off_t torn;
+
+  if (!HAS_FIXED_RECORDS(ctx) || (torn = *len % FIXED_RECORD_SIZE(ctx)) == 0)
+    return 0;
+  if (!jlog_file_truncate(ctx->data, *len - torn))
+    return -1;
+  *len -= torn;
+  return 0;
+}
+
+/* Write a sealed index of the `count` records at `offs` to `idx`.  `offs`
+ * needs room for two more entries and is clobbered. */
+static int __jlog_index_seal(jlog_ctx *ctx, jlog_file *idx, u_int64_t *offs,
+                             u_int32_t count) {
+  u_int32_t stride = IDX_STRIDE(ctx), i, n = 0;
+
+  for (i = 0; i < count; i += stride) offs[n++] = offs[i];
+  if (stride > 1) offs[n++] = count;
+  offs[n++] = 0;
+  return __jlog_index_pwrite(ctx, idx, offs, n, 0);
+}
+
+/* The length of the sealed index __jlog_index_seal writes */
+static off_t __jlog_index_sealed_len(jlog_ctx *ctx, u_int32_t count) {
+  u_int32_t stride = IDX_STRIDE(ctx);
+
+  return (off_t)((count + stride - 1) / stride + (stride > 1 ? 2 : 1)) *
+         IDX_ENTRY_SIZE(ctx);
+}
+
+int jlog_idx_details(jlog_ctx *ctx, u_int32_t log,
+                     u_int32_t *marker, int *closed)
+{
+  char file[MAXPATHLEN];
+  jlog_file *data = NULL;
+  int rv = -1;
+
+  if (!HAS_FIXED_RECORDS(ctx)) {
+    __jlog_open_indexer(ctx, log);
+    if (!ctx->index)
+      SYS_FAIL(JLOG_ERR_IDX_OPEN);
+  }
+  if (HAS_FIXED_RECORDS(ctx) || HAS_SPARSE_INDEX(ctx)) {
+    /* an open sparse index is finished off from the segment, and fixed
+     * records are counted from it alone */
+    memset(file, 0, sizeof(file));
+    STRSETDATAFILE(ctx, file, log);
+    if ((data = jlog_file_open(file, 0, ctx->file_mode, ctx->multi_process)) == NULL)
+      SYS_FAIL(JLOG_ERR_FILE_OPEN);
+  }
+  if (HAS_FIXED_RECORDS(ctx))
+    rv = __jlog_fixed_extent(ctx, data, log, marker, closed);
+  else
+    rv = __jlog_index_extent(ctx, ctx->index, data, marker, closed);
+finish:
+  if (data) jlog_file_close(data);
+  return rv;
+}
+
 static int __jlog_unlink_datafile(jlog_ctx *ctx, u_int32_t log) {
   char file[MAXPATHLEN];
   int len;
@@ -390,9 +690,211 @@ static int __jlog_unlink_datafile(jlog_ctx *ctx, u_int32_t log) {
   fprintf(stderr, "unlinking %s\n", file);
 #endif
   unlink(file);
+
+  memcpy(file + len, TIME_INDEX_EXT, sizeof(TIME_INDEX_EXT));
+#ifdef DEBUG
+  fprintf(stderr, "unlinking %s\n", file);
+#endif
+  unlink(file);
+  return 0;
+}
+
+/* Like __jlog_unlink_datafile, but leaves the unlinking to the background
+ * reclaimer when the context asked for that. */
+static int __jlog_reclaim_datafile(jlog_ctx *ctx, u_int32_t log) {
+  char file[MAXPATHLEN];
+
+  if (!ctx->async_reclaim) return __jlog_unlink_datafile(ctx, log);
+  if(ctx->current_log == log) {
+    __jlog_close_reader(ctx);
+    __jlog_close_indexer(ctx);
+  }
+  memset(file, 0, sizeof(file));
+  STRSETDATAFILE(ctx, file, log);
+  if (__jlog_reclaim_enqueue(file, ctx->reclaim_rate) != 0)
+    return __jlog_unlink_datafile(ctx, log);
+  return 0;
+}
+
+static int __jlog_time_index_filename(jlog_ctx *ctx, u_int32_t log, char *file) {
+  int len;
+
+  memset(file, 0, MAXPATHLEN);
+  STRSETDATAFILE(ctx, file, log);
+  len = strlen(file);
+  if((len + sizeof(TIME_INDEX_EXT)) > MAXPATHLEN) return -1;
+  memcpy(file + len, TIME_INDEX_EXT, sizeof(TIME_INDEX_EXT));
+  return 0;
+}
+
+/* Read the header of message `marker` in the segment whose reader and
+ * index are currently open */
+static int __jlog_read_header_at(jlog_ctx *ctx, u_int32_t marker,
+                                 jlog_message *m, jlog_message_header_full *full) {
+  u_int64_t data_off;
+
+  if (!__jlog_index_offsets(ctx, ctx->index, ctx->data, &data_off, 1, marker - 1))
+    SYS_FAIL(JLOG_ERR_IDX_READ);
+  if (!__jlog_pread_header(ctx, m, data_off, full))
+    SYS_FAIL(JLOG_ERR_FILE_READ);
+  if (m->header->reserved != ctx->meta->hdr_magic || FIXED_RECORD_BAD(ctx, m))
+    SYS_FAIL(JLOG_ERR_FILE_CORRUPT);
+  return 0;
+ finish:
+  return -1;
+}
+
+/* A block's key summary is a 32-bit bloom filter with two bits per key:
+ * one from the first byte, so a prefix can be tested too, and one from
+ * a hash of the whole (NUL padded) key. */
+static u_int32_t __jlog_key_summary(const char *key) {
+  u_int32_t h = 2166136261u;
+  int i;
+
+  for (i = 0; i < JLOG_KEY_LEN; i++) {
+    h ^= (unsigned char)key[i];
+    h *= 16777619u;
+  }
+  return (1u << ((unsigned char)key[0] & 31)) | (1u << (h >> 27));
+}
+
+static int __jlog_filter_key(const jlog_filter *filter, const char *key) {
+  size_t len;
+  int i;
+
+  if (!filter || (filter->nkeys == 0 && !filter->prefix)) return 1;
+  for (i = 0; i < filter->nkeys; i++) {
+    len = strlen(filter->keys[i]);
+    if (len <= JLOG_KEY_LEN && !memcmp(key, filter->keys[i], len) &&
+        (len == JLOG_KEY_LEN || key[len] == '\0'))
+      return 1;
+  }
+  if (filter->prefix) {
+    len = strlen(filter->prefix);
+    if (len <= JLOG_KEY_LEN && !memcmp(key, filter->prefix, len)) return 1;
+  }
+  return 0;
+}
+
+/* can any key in a block with this summary pass the filter? */
+static int __jlog_filter_summary(const jlog_filter *filter, u_int32_t summary) {
+  char key[JLOG_KEY_LEN];
+  u_int32_t bits;
+  size_t len;
+  int i;
+
+  if (!filter || (filter->nkeys == 0 && !filter->prefix)) return 1;
+  for (i = 0; i < filter->nkeys; i++) {
+    if ((len = strlen(filter->keys[i])) > JLOG_KEY_LEN) continue;
+    memset(key, 0, sizeof(key));
+    memcpy(key, filter->keys[i], len);
+    bits = __jlog_key_summary(key);
+    if ((summary & bits) == bits) return 1;
+  }
+  if (filter->prefix) {
+    if (filter->prefix[0] == '\0') return 1;
+    if (summary & (1u << ((unsigned char)filter->prefix[0] & 31))) return 1;
+  }
   return 0;
 }
 
+/* Write the time index for a closed segment of `count` messages; the
+ * segment's reader and index must be open (and the index locked) */
+static int __jlog_write_time_index(jlog_ctx *ctx, u_int32_t log, u_int32_t count) {
+  char file[MAXPATHLEN];
+  struct _jlog_time_index_header *tih;
+  struct _jlog_time_index_entry *tie;
+  jlog_message hdr;
+  jlog_message_header_full full;
+  jlog_file *f = NULL;
+  u_int32_t marker, n;
+  u_int64_t *offs = NULL;
+  size_t len;
+  char *buf;
+
+  n = (count + TIME_INDEX_INTERVAL - 1) / TIME_INDEX_INTERVAL;
+  len = sizeof(*tih) + n * sizeof(*tie);
+  if ((buf = calloc(1, len)) == NULL) {
+    ctx->last_error = JLOG_ERR_FILE_WRITE;
+    ctx->last_errno = ENOMEM;
+    return -1;
+  }
+  tih = (struct _jlog_time_index_header *)buf;
+  tih->magic = TIME_INDEX_MAGIC;
+  tih->interval = TIME_INDEX_INTERVAL;
+  tie = (struct _jlog_time_index_entry *)(buf + sizeof(*tih));
+  for (marker = 1; marker <= count; marker += TIME_INDEX_INTERVAL, tie++) {
+    if (__jlog_read_header_at(ctx, marker, &hdr, NULL) != 0) goto finish;
+    tie->marker = marker;
+    tie->tv_sec = hdr.header->tv_sec;
+    tie->tv_usec = hdr.header->tv_usec;
+  }
+  if (HAS_KEYS(ctx)) {
+    /* summarize every key, so read the whole index in one go */
+    tie = (struct _jlog_time_index_entry *)(buf + sizeof(*tih));
+    if ((offs = malloc(count * sizeof(*offs))) == NULL) {
+      ctx->last_error = JLOG_ERR_FILE_WRITE;
+      ctx->last_errno = ENOMEM;
+      goto finish;
+    }
+    if (!__jlog_index_offsets(ctx, ctx->index, ctx->data, offs, count, 0))
+      SYS_FAIL(JLOG_ERR_IDX_READ);
+    for (marker = 1; marker <= count; marker++) {
+      if (!__jlog_pread_header(ctx, &hdr, offs[marker - 1], &full))
+        SYS_FAIL(JLOG_ERR_FILE_READ);
+      tie[(marker - 1) / TIME_INDEX_INTERVAL].keys |= __jlog_key_summary(full.ext.key);
+    }
+  }
+
+  if (__jlog_time_index_filename(ctx, log, file) != 0)
+    SYS_FAIL(JLOG_ERR_FILE_OPEN);
+  f = jlog_file_open(file, O_CREAT, ctx->file_mode, ctx->multi_process);
+  if (!f)
+    SYS_FAIL(JLOG_ERR_FILE_OPEN);
+  if (!jlog_file_truncate(f, 0) || !jlog_file_pwrite(f, buf, len, 0))
+    SYS_FAIL(JLOG_ERR_FILE_WRITE);
+
+ finish:
+  if (f) jlog_file_close(f);
+  free(offs);
+  free(buf);
+  if (ctx->last_error == JLOG_ERR_SUCCESS) return 0;
+  return -1;
+}
+
+/* Load the time index of a closed segment of `count` messages.  A missing,
+ * stale or torn index simply isn't used; the caller can rebuild it.
+ * @return number of entries, or -1 if there is no usable index */
+static int __jlog_read_time_index(jlog_ctx *ctx, u_int32_t log, u_int32_t count,
+                                  struct _jlog_time_index_entry **entries) {
+  char file[MAXPATHLEN];
+  struct _jlog_time_index_header tih;
+  jlog_file *f;
+  off_t len;
+  u_int32_t n;
+  int rv = -1;
+
+  *entries = NULL;
+  if (__jlog_time_index_filename(ctx, log, file) != 0) return -1;
+  if ((f = jlog_file_open(file, 0, ctx->file_mode, ctx->multi_process)) == NULL)
+    return -1;
+  if ((len = jlog_file_size(f)) < (off_t)sizeof(tih)) goto out;
+  if (!jlog_file_pread(f, &tih, sizeof(tih), 0)) goto out;
+  if (tih.magic != TIME_INDEX_MAGIC || tih.interval == 0) goto out;
+  n = (count + tih.interval - 1) / tih.interval;
+  if (len != sizeof(tih) + n * sizeof(**entries)) goto out;
+  if ((*entries = malloc(n * sizeof(**entries) + 1)) == NULL) goto out;
+  if (!jlog_file_pread(f, *entries, n * sizeof(**entries), sizeof(tih))) {
+    free(*entries);
+    *entries = NULL;
+    goto out;
+  }
+  rv = n;
+ out:
+  jlog_file_close(f);
+  return rv;
+}
+
 static int __jlog_open_metastore(jlog_ctx *ctx, int create)
 {
   char file[MAXPATHLEN];
@@ -403,7 +905,7 @@ static int __jlog_open_metastore(jlog_ctx *ctx, int create)
   fprintf(stderr, "__jlog_open_metastore\n");
 #endif
   len = strlen(ctx->path);
-  if((len + 1 /* IFS_CH */ + 9 /* "metastore" */ + 1) > MAXPATHLEN) {
+  if((len + 1 /* IFS_CH */ + sizeof(METASTORE_EXT_FILE)) > MAXPATHLEN) {
 #ifdef ENAMETOOLONG
     ctx->last_errno = ENAMETOOLONG;
 #endif
@@ -413,9 +915,22 @@ static int __jlog_open_metastore(jlog_ctx *ctx, int create)
   }
   memcpy(file, ctx->path, len);
   file[len++] = IFS_CH;
-  memcpy(&file[len], "metastore", 10); /* "metastore" + '\0' */
 
-  ctx->metastore = jlog_file_open(file, create ? O_CREAT : O_RDWR, ctx->file_mode, ctx->multi_process);
+  /* a jlog using any feature has the extended metastore in place of the
+   * plain one, so that older libraries cannot open it */
+  if (create) ctx->meta_has_ext = ctx->pre_init_ext.features != 0;
+  else {
+    memcpy(&file[len], METASTORE_EXT_FILE, sizeof(METASTORE_EXT_FILE));
+    ctx->metastore = jlog_file_open(file, O_RDWR, ctx->file_mode, ctx->multi_process);
+    ctx->meta_has_ext = ctx->metastore != NULL;
+  }
+  if (!ctx->metastore) {
+    if (ctx->meta_has_ext)
+      memcpy(&file[len], METASTORE_EXT_FILE, sizeof(METASTORE_EXT_FILE));
+    else
+      memcpy(&file[len], METASTORE_FILE, sizeof(METASTORE_FILE));
+    ctx->metastore = jlog_file_open(file, create ? O_CREAT : O_RDWR, ctx->file_mode, ctx->multi_process);
+  }
 
   if (!ctx->metastore) {
     ctx->last_errno = errno;
@@ -476,12 +991,8 @@ static int __jlog_open_pre_commit(jlog_ctx *ctx)
 }
 
 
-/* exported */
-int __jlog_pending_readers(jlog_ctx *ctx, u_int32_t log) {
-  return jlog_pending_readers(ctx, log, NULL);
-}
-int jlog_pending_readers(jlog_ctx *ctx, u_int32_t log,
-                         u_int32_t *earliest_out) {
+static int __jlog_scan_pending_readers(jlog_ctx *ctx, u_int32_t log,
+                                       u_int32_t *earliest_out) {
   int readers;
   DIR *dir;
   struct dirent *ent;
@@ -560,7 +1071,7 @@ int jlog_ctx_list_subscribers_dispose(jlog_ctx *ctx, char **subs) {
   return 0;
 }
 
-int jlog_ctx_list_subscribers(jlog_ctx *ctx, char ***subs) {
+static int __jlog_scan_subscribers(jlog_ctx *ctx, char ***subs) {
   struct _jlog_subs js = { NULL, 0, 0 };
   DIR *dir;
   struct dirent *ent;
@@ -612,87 +1123,420 @@ int jlog_ctx_list_subscribers(jlog_ctx *ctx, char ***subs) {
   return js.used;
 }
 
-static int __jlog_save_metastore(jlog_ctx *ctx, int ilocked)
-{
-#ifdef DEBUG
-  fprintf(stderr, "__jlog_save_metastore\n");
-#endif
+/* ------------------ subscriber table ----------- */
 
-  if(ctx->context_mode == JLOG_READ) {
-    FASSERT(ctx, 0, "__jlog_save_metastore: illegal call in JLOG_READ mode");
-    ctx->last_error = JLOG_ERR_ILLEGAL_WRITE;
-    ctx->last_errno = EPERM;
-    return -1;
-  }
+#define SUBTAB_SIZE(n) (sizeof(struct _jlog_subscriber_table) + \
+                        (size_t)(n) * sizeof(struct _jlog_subscriber_slot))
+#define SUBTAB(ctx) ((struct _jlog_subscriber_table *)(ctx)->subtab_map)
+#define SUBTAB_SLOTS(ctx) ((struct _jlog_subscriber_slot *) \
+  ((char *)(ctx)->subtab_map + sizeof(struct _jlog_subscriber_table)))
 
-  if (!ilocked && !jlog_file_lock(ctx->metastore)) {
-    FASSERT(ctx, 0, "__jlog_save_metastore: cannot get lock");
-    ctx->last_error = JLOG_ERR_LOCK;
-    return -1;
-  }
+static void __jlog_subtab_unmap(jlog_ctx *ctx) {
+  if (ctx->subtab_map) munmap(ctx->subtab_map, ctx->subtab_len);
+  ctx->subtab_map = NULL;
+  ctx->subtab_len = 0;
+}
 
-  if(ctx->meta_is_mapped) {
-    int rv, flags = MS_INVALIDATE;
-    if(ctx->meta->safety == JLOG_SAFE) flags |= MS_SYNC;
-    rv = msync((void *)(ctx->meta), sizeof(*ctx->meta), flags);
-    FASSERT(ctx, rv >= 0, "jlog_save_metastore");
-    if (!ilocked) jlog_file_unlock(ctx->metastore);
-    if ( rv < 0 )
-      ctx->last_error = JLOG_ERR_FILE_WRITE;
-    return rv;
+static void __jlog_close_subtab(jlog_ctx *ctx) {
+  __jlog_subtab_unmap(ctx);
+  if (ctx->subtab) {
+    jlog_file_close(ctx->subtab);
+    ctx->subtab = NULL;
   }
-  else {
-    if (!jlog_file_pwrite(ctx->metastore, ctx->meta, sizeof(*ctx->meta), 0)) {
-      if (!ilocked) jlog_file_unlock(ctx->metastore);
-      FASSERT(ctx, 0, "jlog_file_pwrite failed");
-      ctx->last_error = JLOG_ERR_FILE_WRITE;
+}
+
+/* Bring the mapping in line with the file, which another process may have
+ * grown or rebuilt; the caller holds the table lock.  Returns 1 for a
+ * well-formed table, 0 if it needs rebuilding and -1 on failure. */
+static int __jlog_subtab_remap(jlog_ctx *ctx) {
+  off_t len = jlog_file_size(ctx->subtab);
+
+  if (len < 0) return -1;
+  if (!ctx->subtab_map || (size_t)len != ctx->subtab_len) {
+    __jlog_subtab_unmap(ctx);
+    if ((size_t)len < sizeof(struct _jlog_subscriber_table)) return 0;
+    if (!jlog_file_map_rdwr(ctx->subtab, &ctx->subtab_map, &ctx->subtab_len)) {
+      ctx->subtab_map = NULL;
+      ctx->subtab_len = 0;
       return -1;
     }
-    if (ctx->meta->safety == JLOG_SAFE) {
-      jlog_file_sync(ctx->metastore);
-    }
   }
+  if (SUBTAB(ctx)->magic != SUBSCRIBER_TABLE_MAGIC ||
+      SUBTAB_SIZE(SUBTAB(ctx)->nslots) != ctx->subtab_len) return 0;
+  return 1;
+}
 
-  if (!ilocked) jlog_file_unlock(ctx->metastore);
+static int __jlog_subtab_resize(jlog_ctx *ctx, u_int32_t nslots) {
+  __jlog_subtab_unmap(ctx);
+  if (!jlog_file_truncate(ctx->subtab, SUBTAB_SIZE(nslots))) return -1;
+  if (!jlog_file_map_rdwr(ctx->subtab, &ctx->subtab_map, &ctx->subtab_len)) {
+    ctx->subtab_map = NULL;
+    ctx->subtab_len = 0;
+    return -1;
+  }
+  SUBTAB(ctx)->nslots = nslots;
   return 0;
 }
 
-static int __jlog_restore_metastore(jlog_ctx *ctx, int ilocked, int readonly)
-{
-  void *base = NULL;
-  size_t len = 0;
-  if(ctx->meta_is_mapped) return 0;
-#ifdef DEBUG
-  fprintf(stderr, "__jlog_restore_metastore\n");
-#endif
+/* A slot's live position is 8-byte aligned and only ever accessed whole,
+ * as a lazy reader stores its own without taking the table lock */
+static void __jlog_live_store(jlog_id *live, const jlog_id *id) {
+  u_int64_t v;
 
-  if (!ilocked && !jlog_file_lock(ctx->metastore)) {
-    FASSERT(ctx, 0, "__jlog_restore_metastore: cannot get lock");
-    ctx->last_error = JLOG_ERR_LOCK;
-    return -1;
+  memcpy(&v, id, sizeof(v));
+  __atomic_store_n((u_int64_t *)live, v, __ATOMIC_RELEASE);
+}
+
+static jlog_id __jlog_live_load(const jlog_id *live) {
+  u_int64_t v = __atomic_load_n((const u_int64_t *)live, __ATOMIC_ACQUIRE);
+  jlog_id id;
+
+  memcpy(&id, &v, sizeof(id));
+  return id;
+}
+
+static void __jlog_subtab_low(jlog_ctx *ctx) {
+  struct _jlog_subscriber_table *t = SUBTAB(ctx);
+  struct _jlog_subscriber_slot *slots = SUBTAB_SLOTS(ctx);
+  u_int32_t i, used = 0, low = 0;
+
+  for (i = 0; i < t->nslots; i++) {
+    if (!slots[i].in_use) continue;
+    if (!used || slots[i].id.log < low) low = slots[i].id.log;
+    used++;
   }
+  t->used = used;
+  t->low = low;
+}
 
-  if(ctx->meta_is_mapped == 0) {
-    int rv;
-    if (readonly == 1) {
-      rv = jlog_file_map_read(ctx->metastore, &base, &len);
-    } else {
-      rv = jlog_file_map_rdwr(ctx->metastore, &base, &len);
-    }
+/* Record subscriber s at id, growing the table if it is full.  A name
+ * that does not fit a slot marks the table as overflowed instead. */
+static int __jlog_subtab_put(jlog_ctx *ctx, const char *s, const jlog_id *id) {
+  struct _jlog_subscriber_slot *slots, *slot = NULL;
+  u_int32_t i, nslots;
 
-    FASSERT(ctx, rv == 1, "jlog_file_map_r*");
-    if(rv != 1) {
-      if (!ilocked) jlog_file_unlock(ctx->metastore);
-      ctx->last_error = JLOG_ERR_OPEN;
-      return -1;
+  if (strlen(s) >= SUBSCRIBER_NAME_MAX) {
+    SUBTAB(ctx)->overflow = 1;
+    return 0;
+  }
+  nslots = SUBTAB(ctx)->nslots;
+  slots = SUBTAB_SLOTS(ctx);
+  for (i = 0; i < nslots; i++) {
+    if (slots[i].in_use) {
+      if (!strcmp(slots[i].name, s)) {
+        slot = &slots[i];
+        break;
+      }
     }
-    if(len == 12) {
+    else if (!slot) slot = &slots[i];
+  }
+  if (!slot) {
+    if (__jlog_subtab_resize(ctx, nslots * 2) != 0) {
+      /* leave it to be rebuilt by whoever looks next */
+      u_int32_t zero = 0;
+      (void) jlog_file_pwrite(ctx->subtab, &zero, sizeof(zero), 0);
+      return -1;
+    }
+    slot = &SUBTAB_SLOTS(ctx)[nslots];
+  }
+  if (!slot->in_use) {
+    memset(slot, 0, sizeof(*slot));
+    strcpy(slot->name, s);
+    slot->in_use = 1;
+    __jlog_live_store(&slot->live, id);
+  }
+  /* a lazy checkpoint's live position is ahead of what gets persisted */
+  else if (!ctx->lazy_persister) {
+    __jlog_live_store(&slot->live, id);
+  }
+  else {
+    jlog_id live = __jlog_live_load(&slot->live);
+    if (JLOG_ID_BEFORE(&live, id)) __jlog_live_store(&slot->live, id);
+  }
+  slot->id = *id;
+  __jlog_subtab_low(ctx);
+  return 0;
+}
+
+static void __jlog_subtab_drop(jlog_ctx *ctx, const char *s) {
+  struct _jlog_subscriber_slot *slots = SUBTAB_SLOTS(ctx);
+  u_int32_t i;
+
+  for (i = 0; i < SUBTAB(ctx)->nslots; i++) {
+    if (slots[i].in_use && !strcmp(slots[i].name, s)) {
+      memset(&slots[i], 0, sizeof(slots[i]));
+      __jlog_subtab_low(ctx);
+      __atomic_add_fetch(&SUBTAB(ctx)->gen, 1, __ATOMIC_RELEASE);
+      return;
+    }
+  }
+}
+
+/* Reconcile the table with the cp.* files, rewriting it if they disagree.
+ * The checkpoints are read without their locks: a writer holding one is
+ * about to take the table lock we hold and will then bring its slot up to
+ * date itself. */
+static int __jlog_subtab_rebuild(jlog_ctx *ctx, int valid) {
+  char **subs = NULL;
+  jlog_id *ids = NULL, *lives = NULL;
+  struct _jlog_subscriber_slot *slots;
+  int nsubs, i, n = 0, rv = -1;
+  u_int32_t nslots = SUBSCRIBER_TABLE_SLOTS, gen = 1, j, had = 0;
+
+  if ((nsubs = __jlog_scan_subscribers(ctx, &subs)) < 0) return -1;
+  ids = calloc(nsubs + 1, sizeof(*ids));
+  lives = calloc(nsubs + 1, sizeof(*lives));
+  if (!ids || !lives) goto out;
+  for (i = 0; i < nsubs; i++) {
+    jlog_file *cp = __jlog_open_named_checkpoint(ctx, subs[i], 0);
+    /* an empty checkpoint is a subscriber still being added */
+    if (cp && jlog_file_size(cp) >= (off_t)sizeof(jlog_id) &&
+        jlog_file_pread(cp, &ids[n], sizeof(jlog_id), 0)) {
+      if (n != i) {
+        char *tmp = subs[n];
+        subs[n] = subs[i];
+        subs[i] = tmp;
+      }
+      n++;
+    }
+    if (cp) jlog_file_close(cp);
+  }
+
+  if (valid && SUBTAB(ctx)->used == (u_int32_t)n) {
+    struct _jlog_subscriber_slot *slots = SUBTAB_SLOTS(ctx);
+    int matched = 0;
+    u_int32_t j;
+    for (i = 0; i < n; i++) {
+      for (j = 0; j < SUBTAB(ctx)->nslots; j++) {
+        if (slots[j].in_use && !strcmp(slots[j].name, subs[i])) {
+          if (slots[j].id.log == ids[i].log &&
+              slots[j].id.marker == ids[i].marker) matched++;
+          break;
+        }
+      }
+    }
+    if (matched == n && !SUBTAB(ctx)->overflow) {
+      rv = 0;
+      goto out;
+    }
+  }
+
+  /* rewritten in place and never shrunk, as lazy readers map their slots;
+   * the live positions they published ahead of their checkpoints carry over */
+  if (ctx->subtab_len >= sizeof(struct _jlog_subscriber_table)) {
+    gen = SUBTAB(ctx)->gen + 1;
+    had = (ctx->subtab_len - sizeof(struct _jlog_subscriber_table)) /
+          sizeof(struct _jlog_subscriber_slot);
+    while (SUBTAB_SIZE(nslots) < ctx->subtab_len) nslots *= 2;
+  }
+  for (i = 0; i < n; i++) {
+    lives[i] = ids[i];
+    for (j = 0, slots = SUBTAB_SLOTS(ctx); j < had; j++) {
+      if (slots[j].in_use && !strncmp(slots[j].name, subs[i], SUBSCRIBER_NAME_MAX)) {
+        jlog_id live = __jlog_live_load(&slots[j].live);
+        if (JLOG_ID_BEFORE(&ids[i], &live)) lives[i] = live;
+        break;
+      }
+    }
+  }
+  while (nslots < (u_int32_t)n) nslots *= 2;
+  if (__jlog_subtab_resize(ctx, nslots) != 0) goto out;
+  memset(ctx->subtab_map, 0, ctx->subtab_len);
+  SUBTAB(ctx)->nslots = nslots;
+  for (i = 0; i < n; i++) {
+    if (__jlog_subtab_put(ctx, subs[i], &ids[i]) != 0) goto out;
+  }
+  for (i = 0; i < n; i++) {
+    for (j = 0, slots = SUBTAB_SLOTS(ctx); j < nslots; j++) {
+      if (slots[j].in_use && !strcmp(slots[j].name, subs[i])) {
+        __jlog_live_store(&slots[j].live, &lives[i]);
+        break;
+      }
+    }
+  }
+  __jlog_subtab_low(ctx);
+  SUBTAB(ctx)->magic = SUBSCRIBER_TABLE_MAGIC;
+  __atomic_store_n(&SUBTAB(ctx)->gen, gen, __ATOMIC_RELEASE);
+  rv = 0;
+
+ out:
+  free(ids);
+  free(lives);
+  jlog_ctx_list_subscribers_dispose(ctx, subs);
+  return rv;
+}
+
+/* Lock the subscriber table, opening it on first use and reconciling it
+ * with the checkpoints whenever the directory has changed since, as a
+ * library that does not keep the table still adds and removes cp.* files.
+ * Returns 0 with the lock held, or -1 when the table is unavailable and
+ * callers must scan the checkpoints instead. */
+static int __jlog_subtab_lock(jlog_ctx *ctx) {
+  char file[MAXPATHLEN];
+  struct stat sb;
+  time_t mtime = 0;
+  int len, first = 0, state;
+
+  if (!ctx->subtab) {
+    len = strlen(ctx->path);
+    if (len + 1 + sizeof(SUBSCRIBER_TABLE_FILE) > sizeof(file)) return -1;
+    memcpy(file, ctx->path, len);
+    file[len++] = IFS_CH;
+    memcpy(file + len, SUBSCRIBER_TABLE_FILE, sizeof(SUBSCRIBER_TABLE_FILE));
+    ctx->subtab = jlog_file_open(file, O_CREAT, ctx->file_mode, ctx->multi_process);
+    if (!ctx->subtab) return -1;
+    first = 1;
+  }
+  if (!jlog_file_lock(ctx->subtab)) return -1;
+  if ((state = __jlog_subtab_remap(ctx)) < 0) goto fail;
+  /* an mtime still in this second may change again without moving, so it
+   * is only trusted once it is in the past */
+  if (stat(ctx->path, &sb) == 0 && sb.st_mtime < time(NULL)) mtime = sb.st_mtime;
+  if (first || state == 0 || mtime == 0 || mtime != ctx->subtab_mtime) {
+    if (__jlog_subtab_rebuild(ctx, state) != 0) goto fail;
+    ctx->subtab_mtime = mtime;
+  }
+  return 0;
+
+ fail:
+  jlog_file_unlock(ctx->subtab);
+  return -1;
+}
+
+/* exported */
+int __jlog_pending_readers(jlog_ctx *ctx, u_int32_t log) {
+  return jlog_pending_readers(ctx, log, NULL);
+}
+int jlog_pending_readers(jlog_ctx *ctx, u_int32_t log,
+                         u_int32_t *earliest_out) {
+  struct _jlog_subscriber_slot *slots;
+  int readers = 0;
+  u_int32_t i;
+
+  if (__jlog_subtab_lock(ctx) != 0)
+    return __jlog_scan_pending_readers(ctx, log, earliest_out);
+  if (SUBTAB(ctx)->overflow) {
+    jlog_file_unlock(ctx->subtab);
+    return __jlog_scan_pending_readers(ctx, log, earliest_out);
+  }
+  slots = SUBTAB_SLOTS(ctx);
+  for (i = 0; i < SUBTAB(ctx)->nslots; i++)
+    if (slots[i].in_use && slots[i].id.log <= log) readers++;
+  if (earliest_out) *earliest_out = SUBTAB(ctx)->used ? SUBTAB(ctx)->low : 0;
+  jlog_file_unlock(ctx->subtab);
+  return readers;
+}
+
+int jlog_ctx_list_subscribers(jlog_ctx *ctx, char ***subs) {
+  struct _jlog_subscriber_slot *slots;
+  char **list;
+  u_int32_t i;
+  int n = 0;
+
+  if (__jlog_subtab_lock(ctx) != 0)
+    return __jlog_scan_subscribers(ctx, subs);
+  if (SUBTAB(ctx)->overflow) {
+    jlog_file_unlock(ctx->subtab);
+    return __jlog_scan_subscribers(ctx, subs);
+  }
+  list = calloc(SUBTAB(ctx)->used + 1, sizeof(char *));
+  if (!list) {
+    jlog_file_unlock(ctx->subtab);
+    return -1;
+  }
+  slots = SUBTAB_SLOTS(ctx);
+  for (i = 0; i < SUBTAB(ctx)->nslots && n < (int)SUBTAB(ctx)->used; i++)
+    if (slots[i].in_use) list[n++] = strdup(slots[i].name);
+  jlog_file_unlock(ctx->subtab);
+  *subs = list;
+  return n;
+}
+
+static int __jlog_save_metastore(jlog_ctx *ctx, int ilocked)
+{
+#ifdef DEBUG
+  fprintf(stderr, "__jlog_save_metastore\n");
+#endif
+
+  if(ctx->context_mode == JLOG_READ) {
+    FASSERT(ctx, 0, "__jlog_save_metastore: illegal call in JLOG_READ mode");
+    ctx->last_error = JLOG_ERR_ILLEGAL_WRITE;
+    ctx->last_errno = EPERM;
+    return -1;
+  }
+
+  if (!ilocked && !jlog_file_lock(ctx->metastore)) {
+    FASSERT(ctx, 0, "__jlog_save_metastore: cannot get lock");
+    ctx->last_error = JLOG_ERR_LOCK;
+    return -1;
+  }
+
+  if(ctx->meta_is_mapped) {
+    int rv, flags = MS_INVALIDATE;
+    if(ctx->meta->safety == JLOG_SAFE) flags |= MS_SYNC;
+    rv = msync((void *)(ctx->meta), META_LEN(ctx), flags);
+    FASSERT(ctx, rv >= 0, "jlog_save_metastore");
+    if (!ilocked) jlog_file_unlock(ctx->metastore);
+    if ( rv < 0 )
+      ctx->last_error = JLOG_ERR_FILE_WRITE;
+    return rv;
+  }
+  else {
+    if (!jlog_file_pwrite(ctx->metastore, ctx->meta, sizeof(*ctx->meta), 0) ||
+        (ctx->meta_has_ext &&
+         !jlog_file_pwrite(ctx->metastore, ctx->meta_ext, sizeof(*ctx->meta_ext),
+                           sizeof(*ctx->meta)))) {
+      if (!ilocked) jlog_file_unlock(ctx->metastore);
+      FASSERT(ctx, 0, "jlog_file_pwrite failed");
+      ctx->last_error = JLOG_ERR_FILE_WRITE;
+      return -1;
+    }
+    if (ctx->meta->safety == JLOG_SAFE) {
+      jlog_file_sync(ctx->metastore);
+    }
+  }
+
+  if (!ilocked) jlog_file_unlock(ctx->metastore);
+  return 0;
+}
+
+static int __jlog_restore_metastore(jlog_ctx *ctx, int ilocked, int readonly)
+{
+  void *base = NULL;
+  size_t len = 0;
+  if(ctx->meta_is_mapped) return 0;
+#ifdef DEBUG
+  fprintf(stderr, "__jlog_restore_metastore\n");
+#endif
+
+  if (!ilocked && !jlog_file_lock(ctx->metastore)) {
+    FASSERT(ctx, 0, "__jlog_restore_metastore: cannot get lock");
+    ctx->last_error = JLOG_ERR_LOCK;
+    return -1;
+  }
+
+  if(ctx->meta_is_mapped == 0) {
+    int rv;
+    if (readonly == 1) {
+      rv = jlog_file_map_read(ctx->metastore, &base, &len);
+    } else {
+      rv = jlog_file_map_rdwr(ctx->metastore, &base, &len);
+    }
+
+    FASSERT(ctx, rv == 1, "jlog_file_map_r*");
+    if(rv != 1) {
+      if (!ilocked) jlog_file_unlock(ctx->metastore);
+      ctx->last_error = JLOG_ERR_OPEN;
+      return -1;
+    }
+    if(len == 12 && !ctx->meta_has_ext) {
       /* old metastore format doesn't have the new magic hdr in it
        * we need to extend it by four bytes, but we know the hdr was
        * previously 0, so we write out zero.
        */
       u_int32_t dummy = 0;
       jlog_file_pwrite(ctx->metastore, &dummy, sizeof(dummy), 12);
+      munmap(base, len);
       if (readonly == 1) {
         rv = jlog_file_map_read(ctx->metastore, &base, &len);
       } else {
@@ -708,7 +1552,9 @@ static int __jlog_restore_metastore(jlog_ctx *ctx, int ilocked, int readonly)
     }
     else {
       struct _jlog_meta_info *meta = base;
-      if(len != sizeof(*meta) || !validate_metastore(meta, NULL)) {
+      if(len != META_LEN(ctx) ||
+         !validate_metastore(meta, ctx->meta_has_ext ?
+                             (struct _jlog_meta_ext *)(meta + 1) : NULL, NULL)) {
         if(!repair_metastore(ctx, NULL, meta->storage_log)) {
           if (!ilocked) jlog_file_unlock(ctx->metastore);
           ctx->last_error = JLOG_ERR_OPEN;
@@ -717,12 +1563,16 @@ static int __jlog_restore_metastore(jlog_ctx *ctx, int ilocked, int readonly)
       }
     }
     FASSERT(ctx, rv == 1, "jlog_file_map_r*");
-    if(rv != 1 || len != sizeof(*ctx->meta)) {
+    if(rv != 1 || len != META_LEN(ctx)) {
       if (!ilocked) jlog_file_unlock(ctx->metastore);
       ctx->last_error = JLOG_ERR_OPEN;
       return -1;
     }
     ctx->meta = base;
+    if (ctx->meta_has_ext)
+      ctx->meta_ext = (struct _jlog_meta_ext *)(ctx->meta + 1);
+    else
+      memset(ctx->meta_ext, 0, sizeof(*ctx->meta_ext));
     ctx->meta_is_mapped = 1;
 
     if (IS_COMPRESS_MAGIC(ctx)) {
@@ -796,7 +1646,8 @@ static int __jlog_map_pre_commit(jlog_ctx *ctx)
 }
 
 
-int jlog_get_checkpoint(jlog_ctx *ctx, const char *s, jlog_id *id) {
+/* What the checkpoint file holds, even for our own lazy checkpoint */
+static int __jlog_get_checkpoint(jlog_ctx *ctx, const char *s, jlog_id *id) {
   jlog_file *f;
   int rv = -1;
 
@@ -818,12 +1669,26 @@ int jlog_get_checkpoint(jlog_ctx *ctx, const char *s, jlog_id *id) {
   return rv;
 }
 
-static int __jlog_set_checkpoint(jlog_ctx *ctx, const char *s, const jlog_id *id)
+int jlog_get_checkpoint(jlog_ctx *ctx, const char *s, jlog_id *id) {
+  if(ctx->lazy && (s == NULL || !strcmp(ctx->subscriber_name, s)))
+    return __jlog_lazy_get(ctx, id);
+  return __jlog_get_checkpoint(ctx, s, id);
+}
+
+/* Move s's checkpoint to id. A check, when given, sees the position
+ * being replaced while the checkpoint is still locked, and keeps the
+ * checkpoint where it is by returning more than zero, which is then
+ * returned from here too. */
+static int __jlog_move_checkpoint(jlog_ctx *ctx, const char *s, const jlog_id *id,
+                                  int (*check)(jlog_ctx *, const jlog_id *, void *),
+                                  void *arg)
 {
   jlog_file *f;
   int rv = -1;
   jlog_id old_id;
-  u_int32_t log;
+  u_int32_t log, trim = 0;
+  unsigned int earliest, latest;
+  int use_table = 0;
 
   if(ctx->subscriber_name && !strcmp(ctx->subscriber_name, s)) {
     if(!ctx->checkpoint) {
@@ -839,11 +1704,16 @@ static int __jlog_set_checkpoint(jlog_ctx *ctx, const char *s, const jlog_id *id
 
   if (jlog_file_size(f) == 0) {
     /* we're setting it for the first time, no segments were pending on it */
-    old_id.log = id->log;
+    old_id = *id;
   } else {
     if (!jlog_file_pread(f, &old_id, sizeof(old_id), 0))
       goto failset;
   }
+  if (check && (rv = check(ctx, &old_id, arg)) != 0) {
+    jlog_file_unlock(f);
+    goto failset;
+  }
+  rv = -1;
   if (!jlog_file_pwrite(f, id, sizeof(*id), 0)) {
     FASSERT(ctx, 0, "jlog_file_pwrite failed in jlog_set_checkpoint");
     ctx->last_error = JLOG_ERR_FILE_WRITE;
@@ -852,12 +1722,36 @@ static int __jlog_set_checkpoint(jlog_ctx *ctx, const char *s, const jlog_id *id
   if (ctx->meta->safety == JLOG_SAFE) {
     jlog_file_sync(f);
   }
+  /* the table is only ever locked inside a checkpoint's lock */
+  if (__jlog_subtab_lock(ctx) == 0) {
+    if (__jlog_subtab_put(ctx, s, id) == 0 && !SUBTAB(ctx)->overflow) {
+      trim = SUBTAB(ctx)->low;
+      use_table = 1;
+    }
+    jlog_file_unlock(ctx->subtab);
+  }
   jlog_file_unlock(f);
   rv = 0;
 
-  for (log = old_id.log; log < id->log; log++) {
-    if (__jlog_pending_readers(ctx, log) == 0) {
-      __jlog_unlink_datafile(ctx, log);
+  /* a segment whose reclaim queue was lost with its process is still on
+   * disk behind old_id; crossing into a new segment picks it up again */
+  if (old_id.log < id->log) {
+    earliest = old_id.log;
+    if (__jlog_get_storage_bounds(ctx, &earliest, &latest) &&
+        earliest < old_id.log)
+      old_id.log = earliest;
+  }
+  if (use_table) {
+    /* everything below the lowest checkpoint is unread by anyone */
+    if (trim > id->log) trim = id->log;
+    for (log = old_id.log; log < trim; log++)
+      __jlog_reclaim_datafile(ctx, log);
+  }
+  else {
+    for (log = old_id.log; log < id->log; log++) {
+      if (__jlog_scan_pending_readers(ctx, log, NULL) == 0) {
+        __jlog_reclaim_datafile(ctx, log);
+      }
     }
   }
 
@@ -866,19 +1760,113 @@ static int __jlog_set_checkpoint(jlog_ctx *ctx, const char *s, const jlog_id *id
   return rv;
 }
 
+static int __jlog_set_checkpoint(jlog_ctx *ctx, const char *s, const jlog_id *id)
+{
+  if(ctx->lazy && !strcmp(ctx->subscriber_name, s))
+    return __jlog_lazy_force(ctx, id);
+  return __jlog_move_checkpoint(ctx, s, id, NULL, NULL);
+}
+
 static int __jlog_close_metastore(jlog_ctx *ctx) {
   if (ctx->metastore) {
     jlog_file_close(ctx->metastore);
     ctx->metastore = NULL;
   }
   if (ctx->meta_is_mapped) {
-    munmap((void *)ctx->meta, sizeof(*ctx->meta));
+    munmap((void *)ctx->meta, META_LEN(ctx));
     ctx->meta = &ctx->pre_init;
+    ctx->meta_ext = &ctx->pre_init_ext;
     ctx->meta_is_mapped = 0;
   }
   return 0;
 }
 
+/* Map the jlog's retention policy, creating an empty one when asked to.
+ * Without one ctx keeps a zeroed policy, and this may be tried again. */
+static int __jlog_map_retention(jlog_ctx *ctx, int create)
+{
+  char file[MAXPATHLEN];
+  struct _jlog_retention fresh;
+  void *base = NULL;
+  size_t len = 0;
+  off_t size;
+  int rv;
+
+  if (ctx->retention_is_mapped) return 0;
+  if (!ctx->retainstore) {
+    if (snprintf(file, sizeof(file), "%s%c%s", ctx->path, IFS_CH,
+                 RETENTION_FILE) >= (int)sizeof(file)) {
+      ctx->last_error = JLOG_ERR_CREATE_META;
+      return -1;
+    }
+    ctx->retainstore = jlog_file_open(file, create ? O_CREAT : O_RDWR,
+                                      ctx->file_mode, ctx->multi_process);
+    if (!ctx->retainstore) {
+      if (!create && errno == ENOENT) {
+        memset(&ctx->pre_init_retention, 0, sizeof(ctx->pre_init_retention));
+        return 0;
+      }
+      ctx->last_errno = errno;
+      ctx->last_error = JLOG_ERR_CREATE_META;
+      return -1;
+    }
+  }
+  if (!jlog_file_lock(ctx->retainstore)) {
+    ctx->last_errno = errno;
+    ctx->last_error = JLOG_ERR_LOCK;
+    return -1;
+  }
+  if ((size = jlog_file_size(ctx->retainstore)) == 0 && create) {
+    memset(&fresh, 0, sizeof(fresh));
+    fresh.magic = RETENTION_MAGIC;
+    if (!jlog_file_pwrite(ctx->retainstore, &fresh, sizeof(fresh), 0)) {
+      ctx->last_errno = errno;
+      ctx->last_error = JLOG_ERR_FILE_WRITE;
+      jlog_file_unlock(ctx->retainstore);
+      return -1;
+    }
+    size = sizeof(fresh);
+  }
+  if (size == 0) {
+    /* still being created */
+    jlog_file_unlock(ctx->retainstore);
+    memset(&ctx->pre_init_retention, 0, sizeof(ctx->pre_init_retention));
+    return 0;
+  }
+  if (ctx->context_mode == JLOG_READ)
+    rv = jlog_file_map_read(ctx->retainstore, &base, &len);
+  else
+    rv = jlog_file_map_rdwr(ctx->retainstore, &base, &len);
+  jlog_file_unlock(ctx->retainstore);
+  if (rv != 1) {
+    ctx->last_errno = errno;
+    ctx->last_error = JLOG_ERR_OPEN;
+    return -1;
+  }
+  if (len != sizeof(fresh) ||
+      ((struct _jlog_retention *)base)->magic != RETENTION_MAGIC) {
+    munmap(base, len);
+    ctx->last_error = JLOG_ERR_FILE_CORRUPT;
+    return -1;
+  }
+  ctx->retention = base;
+  ctx->retention_is_mapped = 1;
+  return 0;
+}
+
+static int __jlog_close_retention(jlog_ctx *ctx) {
+  if (ctx->retainstore) {
+    jlog_file_close(ctx->retainstore);
+    ctx->retainstore = NULL;
+  }
+  if (ctx->retention_is_mapped) {
+    munmap((void *)ctx->retention, sizeof(*ctx->retention));
+    ctx->retention = &ctx->pre_init_retention;
+    ctx->retention_is_mapped = 0;
+  }
+  return 0;
+}
+
 static int __jlog_close_pre_commit(jlog_ctx *ctx) {
   if (ctx->pre_commit) {
     jlog_file_close(ctx->pre_commit);
@@ -896,17 +1884,17 @@ static int __jlog_close_pre_commit(jlog_ctx *ctx) {
 }
 
 /* path is assumed to be MAXPATHLEN */
-static char *compute_checkpoint_filename(jlog_ctx *ctx, const char *subscriber, char *name)
+static char *compute_subscriber_filename(jlog_ctx *ctx, const char *prefix,
+                                         const char *subscriber, char *name)
 {
   const char *sub;
   int len;
 
-  /* build checkpoint filename */
+  /* build <prefix>.<hex subscriber> */
   len = strlen(ctx->path);
   memcpy(name, ctx->path, len);
   name[len++] = IFS_CH;
-  name[len++] = 'c';
-  name[len++] = 'p';
+  while (*prefix) name[len++] = *prefix++;
   name[len++] = '.';
   for (sub = subscriber; *sub; ) {
     name[len++] = __jlog_hexchars[((*sub & 0xf0) >> 4)];
@@ -916,11 +1904,16 @@ static char *compute_checkpoint_filename(jlog_ctx *ctx, const char *subscriber,
   name[len] = '\0';
 
 #ifdef DEBUG
-  fprintf(stderr, "checkpoint %s filename is %s\n", subscriber, name);
+  fprintf(stderr, "%s %s filename is %s\n", prefix, subscriber, name);
 #endif
   return name;
 }
 
+static char *compute_checkpoint_filename(jlog_ctx *ctx, const char *subscriber, char *name)
+{
+  return compute_subscriber_filename(ctx, "cp", subscriber, name);
+}
+
 static jlog_file *__jlog_open_named_checkpoint(jlog_ctx *ctx, const char *cpname, int flags)
 {
   char name[MAXPATHLEN];
@@ -1107,21 +2100,171 @@ static int __jlog_close_indexer(jlog_ctx *ctx) {
   return 0;
 }
 
+/* ------------------ published index length ----------- */
+
+static void __jlog_close_index_length(jlog_ctx *ctx) {
+  if (ctx->idxlen_map) munmap(ctx->idxlen_map, sizeof(*ctx->idxlen_map));
+  ctx->idxlen_map = NULL;
+  if (ctx->idxlen) {
+    jlog_file_close(ctx->idxlen);
+    ctx->idxlen = NULL;
+  }
+}
+
+/* Map the published index length, creating it on first use.  Returns
+ * NULL when it is unavailable; the index lock then covers everything. */
+static struct _jlog_index_length *__jlog_index_length(jlog_ctx *ctx) {
+  char file[MAXPATHLEN];
+  void *base;
+  size_t len;
+  off_t size;
+
+  if (ctx->idxlen_map || ctx->idxlen_failed) return ctx->idxlen_map;
+  ctx->idxlen_failed = 1;
+  if (snprintf(file, sizeof(file), "%s%c%s", ctx->path, IFS_CH,
+               INDEX_LENGTH_FILE) >= (int)sizeof(file)) return NULL;
+  if (!(ctx->idxlen = jlog_file_open(file, O_CREAT, ctx->file_mode, ctx->multi_process)))
+    return NULL;
+  /* growing an empty file to the same size twice is harmless */
+  if ((size = jlog_file_size(ctx->idxlen)) == 0 &&
+      jlog_file_truncate(ctx->idxlen, sizeof(struct _jlog_index_length)))
+    size = sizeof(struct _jlog_index_length);
+  if (size != sizeof(struct _jlog_index_length) ||
+      !jlog_file_map_rdwr(ctx->idxlen, &base, &len)) {
+    __jlog_close_index_length(ctx);
+    return NULL;
+  }
+  ctx->idxlen_map = base;
+  (void)__sync_bool_compare_and_swap(&ctx->idxlen_map->magic, 0, INDEX_LENGTH_MAGIC);
+  if (ctx->idxlen_map->magic != INDEX_LENGTH_MAGIC) {
+    __jlog_close_index_length(ctx);
+    return NULL;
+  }
+  ctx->idxlen_failed = 0;
+  return ctx->idxlen_map;
+}
+
+/* Called holding the lock of log's index once its lengths are known.
+ * Publishers of different indexes race for the sequence; a loser leaves
+ * the other's lengths in place, which only costs readers the lock. */
+static void __jlog_publish_index_length(jlog_ctx *ctx, u_int32_t log,
+                                        off_t index_len, off_t data_len,
+                                        u_int32_t marker, int closed) {
+  struct _jlog_index_length *il = __jlog_index_length(ctx);
+  u_int32_t seq;
+
+  if (!il) return;
+  seq = *(volatile u_int32_t *)&il->seq;
+  if ((seq & 1) || !__sync_bool_compare_and_swap(&il->seq, seq, seq + 1)) return;
+  il->log = log;
+  il->closed = closed;
+  il->marker = marker;
+  il->index_len = index_len;
+  il->data_len = data_len;
+  __sync_synchronize();
+  *(volatile u_int32_t *)&il->seq = seq + 2;
+}
+
+static int __jlog_read_index_length(jlog_ctx *ctx, struct _jlog_index_length *out) {
+  struct _jlog_index_length *il = __jlog_index_length(ctx);
+  u_int32_t seq;
+
+  if (!il) return 0;
+  seq = *(volatile u_int32_t *)&il->seq;
+  if (seq & 1) return 0;
+  __sync_synchronize();
+  memcpy(out, il, sizeof(*out));
+  __sync_synchronize();
+  return *(volatile u_int32_t *)&il->seq == seq;
+}
+
+/* Where log's index ends, if that can be told without its lock: it is
+ * closed, or it and the segment are still at their published lengths.
+ * Returns 1 with *last and *closed set as ___jlog_resync_index would. */
+static int __jlog_index_length_current(jlog_ctx *ctx, u_int32_t log,
+                                       jlog_id *last, int *closed) {
+  struct _jlog_index_length il;
+  u_int64_t tail[2], entries;
+  off_t index_len, data_len;
+  u_int32_t marker;
+  int is_closed = 0;
+
+  __jlog_open_indexer(ctx, log);
+  if (!ctx->index || (index_len = jlog_file_size(ctx->index)) <= 0 ||
+      index_len % IDX_ENTRY_SIZE(ctx))
+    return 0;
+  if (__jlog_read_index_length(ctx, &il) && il.log == log &&
+      il.index_len == (u_int64_t)index_len) {
+    is_closed = il.closed;
+    if (!is_closed) {
+      if (log < ctx->meta->storage_log) return 0;  /* it needs closing */
+      if ((data_len = jlog_file_size(ctx->data)) < 0 ||
+          (u_int64_t)data_len != il.data_len)
+        return 0;
+    }
+    marker = il.marker;
+  }
+  else {
+    /* a closed index never changes, so needs no lock either */
+    entries = index_len / IDX_ENTRY_SIZE(ctx);
+    if (log >= ctx->meta->storage_log || entries <= 1 ||
+        !__jlog_index_pread(ctx, ctx->index, tail, 2, entries - 2) ||
+        tail[1] != 0)
+      return 0;
+    is_closed = 1;
+    marker = HAS_SPARSE_INDEX(ctx) ? tail[0] : entries - 1;
+  }
+  if (last) {
+    last->log = log;
+    last->marker = marker;
+  }
+  if (closed) *closed = is_closed;
+  return 1;
+}
+
+/* Fixed records have no index to bring up to date, so the segment is
+ * only measured; an empty sealed one goes, as with an index. */
+static int __jlog_resync_fixed(jlog_ctx *ctx, u_int32_t log, jlog_id *last,
+                               int *closed) {
+  u_int32_t marker;
+  int is_closed;
+
+  if (__jlog_fixed_extent(ctx, ctx->data, log, &marker, &is_closed) != 0)
+    return -1;
+  if (marker == 0 && is_closed) {
+    __jlog_reclaim_datafile(ctx, log);
+    ctx->last_error = JLOG_ERR_FILE_OPEN;
+    ctx->last_errno = ENOENT;
+    return -1;
+  }
+  if (last) {
+    last->log = log;
+    last->marker = marker;
+  }
+  if (closed) *closed = is_closed;
+  return 0;
+}
+
 static int
 ___jlog_resync_index(jlog_ctx *ctx, u_int32_t log, jlog_id *last, int *closed) 
 {
-  u_int64_t indices[BUFFERED_INDICES];
+  u_int64_t *indices = NULL;
+  char *chunk = NULL;
   jlog_message_header_compressed logmhdr;
   uint32_t *message_disk_len = &logmhdr.mlen;
-  off_t index_off, data_off, data_len, recheck_data_len;
-  size_t hdr_size = sizeof(jlog_message_header);
-  u_int64_t index;
+  off_t index_off, data_off, data_len, recheck_data_len, chunk_off;
+  size_t base_size, hdr_size, entry_size, indices_len = 0, chunk_len, want;
+  u_int64_t tail[2], entries;
+  u_int32_t stride, marker;
   int i, second_try = 0;
 
   if (IS_COMPRESS_MAGIC(ctx)) {
-    hdr_size = sizeof(jlog_message_header_compressed);
     message_disk_len = &logmhdr.compressed_len;
   }
+  base_size = BASE_HDR_SIZE(ctx);
+  hdr_size = HDR_SIZE(ctx);
+  entry_size = IDX_ENTRY_SIZE(ctx);
+  stride = IDX_STRIDE(ctx);
 
   ctx->last_error = JLOG_ERR_SUCCESS;
   if(closed) *closed = 0;
@@ -1132,6 +2275,9 @@ ___jlog_resync_index(jlog_ctx *ctx, u_int32_t log, jlog_id *last, int *closed)
     ctx->last_errno = errno;
     return -1;
   }
+  if (HAS_FIXED_RECORDS(ctx)) return __jlog_resync_fixed(ctx, log, last, closed);
+  /* only a reader that has something to add takes the index lock */
+  if (__jlog_index_length_current(ctx, log, last, closed)) return 0;
 
 #define RESTART do { \
   if (second_try == 0) { \
@@ -1149,64 +2295,69 @@ restart:
   if (!ctx->index) {
     ctx->last_error = JLOG_ERR_IDX_OPEN;
     ctx->last_errno = errno;
-    return -1;
+    goto out;
   }
   if (!jlog_file_lock(ctx->index)) {
     ctx->last_error = JLOG_ERR_LOCK;
     ctx->last_errno = errno;
-    return -1;
+    goto out;
   }
 
   data_off = 0;
   if ((data_len = jlog_file_size(ctx->data)) == -1)
     SYS_FAIL(JLOG_ERR_FILE_SEEK);
   if (data_len == 0 && log < ctx->meta->storage_log) {
-    __jlog_unlink_datafile(ctx, log);
+    __jlog_reclaim_datafile(ctx, log);
     ctx->last_error = JLOG_ERR_FILE_OPEN;
     ctx->last_errno = ENOENT;
-    return -1;
+    goto out;
   }
   if ((index_off = jlog_file_size(ctx->index)) == -1)
     SYS_FAIL(JLOG_ERR_IDX_SEEK);
 
-  if (index_off % sizeof(u_int64_t)) {
+  if (index_off % entry_size) {
 #ifdef DEBUG
     fprintf(stderr, "corrupt index [%llu]\n", index_off);
 #endif
     RESTART;
   }
 
-  if (index_off > sizeof(u_int64_t)) {
-    if (!jlog_file_pread(ctx->index, &index, sizeof(index),
-                         index_off - sizeof(u_int64_t)))
+  entries = index_off / entry_size;
+  marker = 0;
+  if (entries > 1) {
+    if (!__jlog_index_pread(ctx, ctx->index, tail, 2, entries - 2))
     {
       SYS_FAIL(JLOG_ERR_IDX_READ);
     }
-    if (index == 0) {
+    if (tail[1] == 0) {
       /* This log file has been "closed" */
 #ifdef DEBUG
       fprintf(stderr, "index closed\n");
 #endif
+      marker = stride == 1 ? entries - 1 : tail[0];
       if(last) {
         last->log = log;
-        last->marker = (index_off / sizeof(u_int64_t)) - 1;
+        last->marker = marker;
       }
       if(closed) *closed = 1;
+      __jlog_publish_index_length(ctx, log, index_off, data_len, marker, 1);
       goto finish;
     } else {
-      if (index > data_len) {
+      if (tail[1] > data_len) {
 #ifdef DEBUG
         fprintf(stderr, "index told me to seek somehwere I can't\n");
 #endif
         RESTART;
       }
-      data_off = index;
+      data_off = tail[1];
     }
   }
 
-  if (index_off > 0) {
-    /* We are adding onto a partial index so we must advance a record */
-    if (!jlog_file_pread(ctx->data, &logmhdr, hdr_size, data_off))
+  if (entries > 0) {
+    /* We are adding onto a partial index so we must advance a record;
+     * a sparse one is counted again from its last entry */
+    marker = (entries - 1) * stride + 1;
+    if (!jlog_file_pread(ctx->data, &logmhdr, base_size, data_off))
       SYS_FAIL(JLOG_ERR_FILE_READ);
     if ((data_off += hdr_size + *message_disk_len) > data_len) {
 #ifdef DEBUG
@@ -1217,12 +2368,37 @@ restart:
     }
   }
 
+  /* A backlog is indexed from megabyte reads of the segment, and its
+   * offsets are written in as few writes as memory allows */
+  if (data_off + (off_t)hdr_size <= data_len) {
+    want = (data_len - data_off) / hdr_size + 1;
+    if (want > BUFFERED_INDICES) want = BUFFERED_INDICES;
+    if (want > indices_len) {
+      free(indices);
+      if ((indices = malloc(want * sizeof(u_int64_t))) == NULL) {
+        indices_len = 0;
+        SYS_FAIL(JLOG_ERR_IDX_WRITE);
+      }
+      indices_len = want;
+    }
+    if (!chunk && (chunk = malloc(RESYNC_READ_SIZE)) == NULL)
+      SYS_FAIL(JLOG_ERR_FILE_READ);
+  }
+  chunk_off = 0;
+  chunk_len = 0;
+
   i = 0;
   while (data_off + hdr_size <= data_len) {
     off_t next_off = data_off;
 
-    if (!jlog_file_pread(ctx->data, &logmhdr, hdr_size, data_off))
-      SYS_FAIL(JLOG_ERR_FILE_READ);
+    if (data_off < chunk_off || data_off + base_size > chunk_off + chunk_len) {
+      chunk_off = data_off;
+      chunk_len = data_len - data_off;
+      if (chunk_len > RESYNC_READ_SIZE) chunk_len = RESYNC_READ_SIZE;
+      if (!jlog_file_pread(ctx->data, chunk, chunk_len, chunk_off))
+        SYS_FAIL(JLOG_ERR_FILE_READ);
+    }
+    memcpy(&logmhdr, chunk + (data_off - chunk_off), base_size);
     if (logmhdr.reserved != ctx->meta->hdr_magic) {
 #ifdef DEBUG
       fprintf(stderr, "logmhdr.reserved == %d\n", logmhdr.reserved);
@@ -1233,14 +2409,14 @@ restart:
       break;
 
     /* Write our new index offset */
-    indices[i++] = data_off;
-    if(i >= BUFFERED_INDICES) {
+    if (marker++ % stride == 0) indices[i++] = data_off;
+    if(i >= indices_len) {
 #ifdef DEBUG
       fprintf(stderr, "writing %i offsets\n", i);
 #endif
-      if (!jlog_file_pwrite(ctx->index, indices, i * sizeof(u_int64_t), index_off))
+      if (!__jlog_index_pwrite(ctx, ctx->index, indices, i, index_off / entry_size))
         RESTART;
-      index_off += i * sizeof(u_int64_t);
+      index_off += i * entry_size;
       i = 0;
     }
     data_off = next_off;
@@ -1249,13 +2425,13 @@ restart:
 #ifdef DEBUG
     fprintf(stderr, "writing %i offsets\n", i);
 #endif
-    if (!jlog_file_pwrite(ctx->index, indices, i * sizeof(u_int64_t), index_off))
+    if (!__jlog_index_pwrite(ctx, ctx->index, indices, i, index_off / entry_size))
       RESTART;
-    index_off += i * sizeof(u_int64_t);
+    index_off += i * entry_size;
   }
   if(last) {
     last->log = log;
-    last->marker = index_off / sizeof(u_int64_t);
+    last->marker = marker;
   }
   if(log < ctx->meta->storage_log) {
 
@@ -1293,18 +2469,29 @@ restart:
     /* Special case: if we are closing, we next write a '0'
      * we can't write the closing marker if the data segment had no records
      * in it, since it will be confused with an index to offset 0 by the
-     * next reader; this only happens when segments are repaired */
+     * next reader; this only happens when segments are repaired.  A sparse
+     * index records its count ahead of the '0'. */
     if (index_off) {
-      index = 0;
-      if (!jlog_file_pwrite(ctx->index, &index, sizeof(u_int64_t), index_off)) {
+      tail[0] = marker;
+      tail[1] = 0;
+      i = stride == 1 ? 1 : 2;
+      if (!__jlog_index_pwrite(ctx, ctx->index, tail + 2 - i, i, index_off / entry_size)) {
 #ifdef DEBUG
         fprintf(stderr, "null index\n");
 #endif
         RESTART;
       }
-      index_off += sizeof(u_int64_t);
+      index_off += i * entry_size;
+      /* best effort; jlog_ctx_seek_time rebuilds a missing time index */
+      __jlog_write_time_index(ctx, log, marker);
+      ctx->last_error = JLOG_ERR_SUCCESS;
     }
     if(closed) *closed = 1;
+    /* an empty index has no close marker to tell readers it is final */
+    if (index_off) __jlog_publish_index_length(ctx, log, index_off, data_len, marker, 1);
+  }
+  else {
+    __jlog_publish_index_length(ctx, log, index_off, data_off, marker, 0);
   }
 #undef RESTART
 
@@ -1313,6 +2500,9 @@ finish:
 #ifdef DEBUG
   fprintf(stderr, "index is %s\n", closed?(*closed?"closed":"open"):"unknown");
 #endif
+out:
+  free(indices);
+  free(chunk);
   if(ctx->last_error == JLOG_ERR_SUCCESS) return 0;
   return -1;
 }
@@ -1328,20 +2518,33 @@ static int __jlog_resync_index(jlog_ctx *ctx, u_int32_t log, jlog_id *last, int
     /* We can't fix the file if someone may write to it again */
     if(log >= ctx->meta->storage_log) break;
 
-    jlog_file_lock(ctx->index);
-    /* it doesn't really matter what jlog_repair_datafile returns
-     * we'll keep retrying anyway */
-    jlog_repair_datafile(ctx, log);
-    jlog_file_truncate(ctx->index, 0);
-    jlog_file_unlock(ctx->index);
-  }
-  return rv;
-}
-
+    if(HAS_FIXED_RECORDS(ctx)) {
+      /* a torn record is cut out, which brings the rest back in line */
+      jlog_repair_datafile(ctx, log);
+    }
+    else {
+      jlog_file_lock(ctx->index);
+      /* it doesn't really matter what jlog_repair_datafile returns
+       * we'll keep retrying anyway */
+      jlog_repair_datafile(ctx, log);
+      jlog_file_truncate(ctx->index, 0);
+      jlog_file_unlock(ctx->index);
+    }
+    {
+      /* the repair may have moved messages, so the time index is stale */
+      char file[MAXPATHLEN];
+      if(__jlog_time_index_filename(ctx, log, file) == 0) unlink(file);
+    }
+  }
+  return rv;
+}
+
 jlog_ctx *jlog_new(const char *path) {
   jlog_ctx *ctx;
   ctx = calloc(1, sizeof(*ctx));
   ctx->meta = &ctx->pre_init;
+  ctx->meta_ext = &ctx->pre_init_ext;
+  ctx->retention = &ctx->pre_init_retention;
   ctx->pre_init.unit_limit = DEFAULT_UNIT_LIMIT;
   ctx->pre_init.safety = DEFAULT_SAFETY;
   ctx->pre_init.hdr_magic = DEFAULT_HDR_MAGIC;
@@ -1423,6 +2626,7 @@ const char *jlog_err_string(int err) {
     MSG_O_MATIC( JLOG_ERR_CHECKPOINT);
     MSG_O_MATIC( JLOG_ERR_NOT_SUPPORTED);
     MSG_O_MATIC( JLOG_ERR_CLOSE_LOGID);
+    MSG_O_MATIC( JLOG_ERR_SUBSCRIBER_EVICTED);
     default: return "Unknown";
   }
 }
@@ -1452,8 +2656,53 @@ int jlog_ctx_alter_safety(jlog_ctx *ctx, jlog_safety safety) {
   return -1;
 }
 
+int jlog_ctx_set_retention(jlog_ctx *ctx, u_int64_t max_bytes, u_int32_t max_age,
+                           u_int32_t max_segments) {
+  if(ctx->context_mode == JLOG_APPEND ||
+     ctx->context_mode == JLOG_NEW) {
+    int flags = MS_INVALIDATE;
+    if(ctx->context_mode == JLOG_NEW) {
+      ctx->retention->retain_bytes = max_bytes;
+      ctx->retention->retain_age = max_age;
+      ctx->retention->retain_segments = max_segments;
+      return 0;
+    }
+    if(__jlog_map_retention(ctx, 1) != 0) {
+      FASSERT(ctx, 0, "jlog_ctx_set_retention calls jlog_map_retention");
+      goto finish;
+    }
+    if(!jlog_file_lock(ctx->retainstore))
+      SYS_FAIL(JLOG_ERR_LOCK);
+    ctx->retention->retain_bytes = max_bytes;
+    ctx->retention->retain_age = max_age;
+    ctx->retention->retain_segments = max_segments;
+    if(ctx->meta->safety == JLOG_SAFE) flags |= MS_SYNC;
+    if(msync((void *)ctx->retention, sizeof(*ctx->retention), flags) != 0) {
+      jlog_file_unlock(ctx->retainstore);
+      SYS_FAIL(JLOG_ERR_FILE_WRITE);
+    }
+    jlog_file_unlock(ctx->retainstore);
+    return 0;
+  }
+  ctx->last_error = JLOG_ERR_ILLEGAL_WRITE;
+ finish:
+  return -1;
+}
+
 int jlog_ctx_set_multi_process(jlog_ctx *ctx, uint8_t mp) {
-  ctx->multi_process = mp;
+  /* a backend already chosen survives turning multi-process mode on */
+  if (mp == 0) ctx->multi_process = 0;
+  else if (mp <= JLOG_LOCK_SHARED_MUTEX) ctx->multi_process = mp;
+  else ctx->multi_process = JLOG_LOCK_FCNTL;
+  return 0;
+}
+
+int jlog_ctx_set_lock_backend(jlog_ctx *ctx, jlog_lock_backend backend) {
+  if (backend < JLOG_LOCK_FCNTL || backend > JLOG_LOCK_SHARED_MUTEX) {
+    ctx->last_error = JLOG_ERR_NOT_SUPPORTED;
+    return -1;
+  }
+  ctx->multi_process = backend;
   return 0;
 }
 
@@ -1476,6 +2725,78 @@ int jlog_ctx_set_compression_provider(jlog_ctx *ctx, jlog_compression_provider_c
   return 0;
 }
 
+int jlog_ctx_set_async_reclaim(jlog_ctx *ctx, int enable, u_int32_t segments_per_sec) {
+  ctx->async_reclaim = enable ? 1 : 0;
+  ctx->reclaim_rate = segments_per_sec;
+  return 0;
+}
+
+int jlog_ctx_set_decompression_threads(jlog_ctx *ctx, int nthreads) {
+  if (nthreads < 0) return -1;
+  if (ctx->decompress_pool && nthreads != ctx->decompress_threads) {
+    jlog_decompress_pool_destroy(ctx->decompress_pool);
+    ctx->decompress_pool = NULL;
+  }
+  ctx->decompress_threads = nthreads;
+  return 0;
+}
+
+int jlog_ctx_set_sequence_numbers(jlog_ctx *ctx, int enable) {
+  if (ctx->context_mode != JLOG_NEW) {
+    ctx->last_error = JLOG_ERR_ILLEGAL_INIT;
+    return -1;
+  }
+  if (enable) ctx->pre_init_ext.features |= JLOG_FEATURE_SEQUENCE;
+  else ctx->pre_init_ext.features &= ~JLOG_FEATURE_SEQUENCE;
+  return 0;
+}
+
+int jlog_ctx_set_record_keys(jlog_ctx *ctx, int enable) {
+  if (ctx->context_mode != JLOG_NEW) {
+    ctx->last_error = JLOG_ERR_ILLEGAL_INIT;
+    return -1;
+  }
+  if (enable) ctx->pre_init_ext.features |= JLOG_FEATURE_KEYS;
+  else ctx->pre_init_ext.features &= ~JLOG_FEATURE_KEYS;
+  return 0;
+}
+
+int jlog_ctx_set_compact_index(jlog_ctx *ctx, int enable) {
+  if (ctx->context_mode != JLOG_NEW) {
+    ctx->last_error = JLOG_ERR_ILLEGAL_INIT;
+    return -1;
+  }
+  if (enable) ctx->pre_init_ext.features |= JLOG_FEATURE_COMPACT_INDEX;
+  else ctx->pre_init_ext.features &= ~JLOG_FEATURE_COMPACT_INDEX;
+  return 0;
+}
+
+int jlog_ctx_set_sparse_index(jlog_ctx *ctx, u_int32_t stride) {
+  if (ctx->context_mode != JLOG_NEW) {
+    ctx->last_error = JLOG_ERR_ILLEGAL_INIT;
+    return -1;
+  }
+  if (stride > 1) {
+    ctx->pre_init_ext.features |= JLOG_FEATURE_SPARSE_INDEX;
+    ctx->pre_init_ext.index_stride = stride;
+  } else {
+    ctx->pre_init_ext.features &= ~JLOG_FEATURE_SPARSE_INDEX;
+    ctx->pre_init_ext.index_stride = 0;
+  }
+  return 0;
+}
+
+int jlog_ctx_set_fixed_records(jlog_ctx *ctx, u_int32_t size) {
+  if (ctx->context_mode != JLOG_NEW) {
+    ctx->last_error = JLOG_ERR_ILLEGAL_INIT;
+    return -1;
+  }
+  if (size) ctx->pre_init_ext.features |= JLOG_FEATURE_FIXED_RECORDS;
+  else ctx->pre_init_ext.features &= ~JLOG_FEATURE_FIXED_RECORDS;
+  ctx->pre_init_ext.record_size = size;
+  return 0;
+}
+
 int jlog_ctx_set_pre_commit_buffer_size(jlog_ctx *ctx, size_t s) {
   ctx->desired_pre_commit_buffer_len = s;
   ctx->pre_commit_buffer_size_specified = 1;
@@ -1514,6 +2835,8 @@ _jlog_ctx_flush_pre_commit_buffer_no_lock(jlog_ctx *ctx)
 
   if ((current_offset = jlog_file_size(ctx->data)) == -1)
     SYS_FAIL(JLOG_ERR_FILE_SEEK);
+  if (__jlog_fixed_whole(ctx, &current_offset) != 0)
+    SYS_FAIL(JLOG_ERR_FILE_WRITE);
   if(ctx->meta->unit_limit <= current_offset) {
     jlog_file_unlock(ctx->data);
     __jlog_close_writer(ctx);
@@ -1610,6 +2933,10 @@ int jlog_ctx_open_writer(jlog_ctx *ctx) {
     FASSERT(ctx, 0, "jlog_ctx_open_writer calls jlog_restore_metastore");
     SYS_FAIL(JLOG_ERR_META_OPEN);
   }
+  if(__jlog_map_retention(ctx, 0) != 0) {
+    FASSERT(ctx, 0, "jlog_ctx_open_writer calls jlog_map_retention");
+    SYS_FAIL(JLOG_ERR_META_OPEN);
+  }
   if (__jlog_open_pre_commit(ctx) != 0) {
     FASSERT(ctx, 0, "jlog_ctx_open_writer calls jlog_open_pre_commit");
     SYS_FAIL(JLOG_ERR_PRE_COMMIT_OPEN);
@@ -1679,6 +3006,10 @@ int jlog_ctx_open_reader(jlog_ctx *ctx, const char *subscriber) {
     FASSERT(ctx, 0, "jlog_ctx_open_reader calls jlog_restore_metastore");
     SYS_FAIL(JLOG_ERR_META_OPEN);
   }
+  if(__jlog_map_retention(ctx, 0) != 0) {
+    FASSERT(ctx, 0, "jlog_ctx_open_reader calls jlog_map_retention");
+    SYS_FAIL(JLOG_ERR_META_OPEN);
+  }
  finish:
   if(ctx->last_error == JLOG_ERR_SUCCESS) return 0;
   ctx->context_mode = JLOG_INVALID;
@@ -1690,7 +3021,7 @@ int jlog_ctx_init(jlog_ctx *ctx) {
   struct stat sb;
   int dirmode;
 
-  ctx->multi_process = 1;
+  if(ctx->multi_process == 0) ctx->multi_process = JLOG_LOCK_FCNTL;
   ctx->last_error = JLOG_ERR_SUCCESS;
   if(strlen(ctx->path) > MAXLOGPATHLEN-1) {
     ctx->last_error = JLOG_ERR_CREATE_PATHLEN;
@@ -1700,6 +3031,13 @@ int jlog_ctx_init(jlog_ctx *ctx) {
     ctx->last_error = JLOG_ERR_ILLEGAL_INIT;
     return -1;
   }
+  /* compressed records vary in size however long the payloads are */
+  if((ctx->pre_init_ext.features & JLOG_FEATURE_FIXED_RECORDS) &&
+     IS_COMPRESS_MAGIC_HDR(ctx->pre_init.hdr_magic)) {
+    ctx->last_error = JLOG_ERR_NOT_SUPPORTED;
+    ctx->last_errno = EINVAL;
+    return -1;
+  }
   ctx->context_mode = JLOG_INIT;
   while((rv = stat(ctx->path, &sb)) == -1 && errno == EINTR);
   if(rv == 0 || errno != ENOENT) {
@@ -1712,6 +3050,15 @@ int jlog_ctx_init(jlog_ctx *ctx) {
   if(mkdir(ctx->path, dirmode) == -1)
     SYS_FAIL(JLOG_ERR_CREATE_MKDIR);
   chmod(ctx->path, dirmode);
+  /* the lock table goes in before any file that it would lock */
+  if(ctx->multi_process == JLOG_LOCK_SHARED_MUTEX &&
+     !jlog_file_create_lock_table(ctx->path, ctx->file_mode)) {
+    int err = errno;
+    /* nothing is in it yet; leave no jlog behind that lacks its table */
+    rmdir(ctx->path);
+    errno = err;
+    SYS_FAIL(err == ENOTSUP ? JLOG_ERR_NOT_SUPPORTED : JLOG_ERR_CREATE_META);
+  }
   // fassertxsetpath(ctx->path);
   /* Setup our initial state and store our instance metadata */
   if(__jlog_open_metastore(ctx,1) != 0) {
@@ -1722,6 +3069,18 @@ int jlog_ctx_init(jlog_ctx *ctx) {
     FASSERT(ctx, 0, "jlog_ctx_init calls jlog_save_metastore");
     SYS_FAIL(JLOG_ERR_CREATE_META);
   }
+  if(HAS_RETENTION(ctx)) {
+    struct _jlog_retention *policy = &ctx->pre_init_retention;
+    if(__jlog_map_retention(ctx, 1) != 0) {
+      FASSERT(ctx, 0, "jlog_ctx_init calls jlog_map_retention");
+      SYS_FAIL(JLOG_ERR_CREATE_META);
+    }
+    ctx->retention->retain_bytes = policy->retain_bytes;
+    ctx->retention->retain_age = policy->retain_age;
+    ctx->retention->retain_segments = policy->retain_segments;
+    if(msync((void *)ctx->retention, sizeof(*ctx->retention), MS_SYNC) != 0)
+      SYS_FAIL(JLOG_ERR_CREATE_META);
+  }
   //  FASSERT(ctx, 0, "Start of fassert log");
  finish:
   FASSERT(ctx, ctx->last_error == JLOG_ERR_SUCCESS, "jlog_ctx_init failed");
@@ -1730,23 +3089,36 @@ int jlog_ctx_init(jlog_ctx *ctx) {
 }
 
 int jlog_ctx_close(jlog_ctx *ctx) {
+  __jlog_lazy_stop(ctx);
+  if(ctx->group) {
+    if(ctx->group_leased) jlog_ctx_group_release(ctx);
+    jlog_file_close(ctx->group);
+  }
   jlog_ctx_flush_pre_commit_buffer(ctx);
   __jlog_close_writer(ctx);
   __jlog_close_pre_commit(ctx);
   __jlog_close_indexer(ctx);
   __jlog_close_reader(ctx);
   __jlog_close_metastore(ctx);
+  __jlog_close_retention(ctx);
   __jlog_close_checkpoint(ctx);
+  __jlog_close_subtab(ctx);
+  __jlog_close_index_length(ctx);
+  if(ctx->async_reclaim) jlog_reclaim_drain();
   free(ctx->subscriber_name);
   free(ctx->path);
   free(ctx->compressed_data_buffer);
   free(ctx->mess_data);
+  jlog_decompress_pool_destroy(ctx->decompress_pool);
+  free(ctx->decompress_jobs);
+  free(ctx->ext_headers);
   free(ctx);
   return 0;
 }
 
 static int __jlog_metastore_atomic_increment(jlog_ctx *ctx) {
   char file[MAXPATHLEN] = {0};
+  int rolled = 0;
 
 #ifdef DEBUG
   fprintf(stderr, "atomic increment on %u\n", ctx->current_log);
@@ -1771,6 +3143,7 @@ static int __jlog_metastore_atomic_increment(jlog_ctx *ctx) {
               "jlog_metastore_atomic_increment calls jlog_save_metastore");
       SYS_FAIL(JLOG_ERR_META_OPEN);
     }
+    rolled = 1;
   }
  finish:
   jlog_file_unlock(ctx->metastore);
@@ -1778,16 +3151,24 @@ static int __jlog_metastore_atomic_increment(jlog_ctx *ctx) {
    * it may have advanced farther than we know.
    */
   ctx->current_log = ctx->meta->storage_log;
-  if(ctx->last_error == JLOG_ERR_SUCCESS) return 0;
-  return -1;
+  if(ctx->last_error != JLOG_ERR_SUCCESS) return -1;
+  /* the writer that starts a segment enforces retention; a failure there
+   * must not fail the write, the next segment will try again */
+  if(rolled && jlog_ctx_enforce_retention(ctx) < 0) {
+    ctx->last_error = JLOG_ERR_SUCCESS;
+    ctx->last_errno = 0;
+  }
+  return 0;
 }
 
-int jlog_ctx_write_message(jlog_ctx *ctx, jlog_message *mess, struct timeval *when) {
+static int __jlog_write_message(jlog_ctx *ctx, jlog_message *mess, struct timeval *when,
+                                const void *key, size_t key_len) {
   struct timeval now;
   jlog_message_header_compressed hdr;
+  jlog_message_header_ext ext;
   off_t current_offset = 0;
   size_t hdr_size = sizeof(jlog_message_header);
-  int i = 0;
+  int i = 0, iovcnt = 2;
 
   if (IS_COMPRESS_MAGIC(ctx)) {
     hdr_size = sizeof(jlog_message_header_compressed);
@@ -1799,6 +3180,12 @@ int jlog_ctx_write_message(jlog_ctx *ctx, jlog_message *mess, struct timeval *wh
     ctx->last_errno = EPERM;
     return -1;
   }
+  /* one record of another size would throw every later offset off */
+  if(HAS_FIXED_RECORDS(ctx) && mess->mess_len != ctx->meta_ext->record_size) {
+    ctx->last_error = JLOG_ERR_ILLEGAL_WRITE;
+    ctx->last_errno = EINVAL;
+    return -1;
+  }
 
   /* build the data we want to write outside of any lock */
   hdr.reserved = ctx->meta->hdr_magic;
@@ -1814,28 +3201,38 @@ int jlog_ctx_write_message(jlog_ctx *ctx, jlog_message *mess, struct timeval *wh
   /* we store the original message size in the header */
   hdr.mlen = mess->mess_len;
 
-  struct iovec v[2];
+  struct iovec v[3], *pv = &v[1];
   v[0].iov_base = (void *) &hdr;
   v[0].iov_len = hdr_size;
+  if (HAS_EXT_HDR(ctx)) {
+    /* the sequence number itself is assigned under the lock below */
+    memset(&ext, 0, sizeof(ext));
+    if (key_len) memcpy(ext.key, key, key_len);
+    v[1].iov_base = (void *) &ext;
+    v[1].iov_len = sizeof(ext);
+    pv = &v[2];
+    iovcnt = 3;
+  }
 
   /* create a stack space to compress into which is large enough for most messages to compress into */
   char compress_space[16384] = {0};
-  v[1].iov_base = compress_space;
+  pv->iov_base = compress_space;
   size_t compressed_len = sizeof(compress_space);
 
   if (IS_COMPRESS_MAGIC(ctx)) {
-    if (jlog_compress(mess->mess, mess->mess_len, (char **)&v[1].iov_base, &compressed_len) != 0) {
+    if (jlog_compress(mess->mess, mess->mess_len, (char **)&pv->iov_base, &compressed_len) != 0) {
       FASSERT(ctx, 0, "jlog_compress failed in jlog_ctx_write_message");
       SYS_FAIL(JLOG_ERR_FILE_WRITE);
     }
     hdr.compressed_len = compressed_len;
-    v[1].iov_len = hdr.compressed_len;
+    pv->iov_len = hdr.compressed_len;
   } else {
-    v[1].iov_base = mess->mess;
-    v[1].iov_len = mess->mess_len;
+    pv->iov_base = mess->mess;
+    pv->iov_len = mess->mess_len;
   }
 
-  size_t total_size = v[0].iov_len + v[1].iov_len;
+  size_t total_size = 0;
+  for (i = 0; i < iovcnt; i++) total_size += v[i].iov_len;
 
   /* now grab the file lock and write to pre_commit or file depending */
   /** 
@@ -1870,6 +3267,8 @@ int jlog_ctx_write_message(jlog_ctx *ctx, jlog_message *mess, struct timeval *wh
 
     if ((current_offset = jlog_file_size(ctx->data)) == -1)
       SYS_FAIL(JLOG_ERR_FILE_SEEK);
+    if (__jlog_fixed_whole(ctx, &current_offset) != 0)
+      SYS_FAIL(JLOG_ERR_FILE_WRITE);
 
     if(ctx->meta->unit_limit <= current_offset) {
       jlog_file_unlock(ctx->data);
@@ -1891,28 +3290,33 @@ int jlog_ctx_write_message(jlog_ctx *ctx, jlog_message *mess, struct timeval *wh
     *ctx->pre_commit_pointer = 0;
   }
 
+  if (HAS_SEQUENCE(ctx)) {
+    /* under the data file lock, so sequence order is log order */
+    ext.seq = __sync_add_and_fetch(&ctx->meta_ext->last_seq, 1);
+  }
+
   if (total_size <= (ctx->pre_commit_buffer_len - sizeof(*ctx->pre_commit_pointer))) {
     /**
      * Write the iovecs to the pre-commit buffer 
      * 
      * This is protected by the file lock on the main data file so needs no special treatment
      */
-    for (i = 0; i < 2; i++) {
+    for (i = 0; i < iovcnt; i++) {
       memcpy(ctx->pre_commit_pos, v[i].iov_base, v[i].iov_len);
       ctx->pre_commit_pos += v[i].iov_len;
       *ctx->pre_commit_pointer += v[i].iov_len;
     }
   } else {
     /* incoming message won't fit in pre_commit buffer, it was flushed above so write to file directly. */
-    if (!jlog_file_pwritev_verify_return_value(ctx->data, v, 2, current_offset, total_size)) {
+    if (!jlog_file_pwritev_verify_return_value(ctx->data, v, iovcnt, current_offset, total_size)) {
       FASSERT(ctx, 0, "jlog_file_pwritev failed in jlog_ctx_write_message");
       SYS_FAIL(JLOG_ERR_FILE_WRITE);
     }
     current_offset += total_size;;
   }
 
-  if (IS_COMPRESS_MAGIC(ctx) && v[1].iov_base != compress_space) {
-    free(v[1].iov_base);
+  if (IS_COMPRESS_MAGIC(ctx) && pv->iov_base != compress_space) {
+    free(pv->iov_base);
   }
 
   if(ctx->meta->unit_limit <= current_offset) {
@@ -1929,6 +3333,238 @@ int jlog_ctx_write_message(jlog_ctx *ctx, jlog_message *mess, struct timeval *wh
   return -1;
 }
 
+/* ------------------ lazy checkpoints ----------- */
+
+struct _jlog_lazy_checkpoint {
+  jlog_ctx *persister;      /* private reader the thread checkpoints with */
+  pthread_t thread;
+  pthread_mutex_t persist;  /* serializes writes of the checkpoint file */
+  pthread_mutex_t lock;     /* guards everything below */
+  pthread_cond_t cv;
+  jlog_id pending;          /* the subscriber's position as readers see it */
+  jlog_id persisted;
+  u_int32_t unpersisted;    /* messages checkpointed since persisted */
+  u_int32_t interval_ms;
+  u_int32_t messages;
+  int dirty;
+  int urgent;
+  int stop;
+  /* the reader's own, published without a lock on every checkpoint */
+  void *live_map;           /* a mapping of the subscriber table */
+  size_t live_map_len;
+  jlog_id *live;            /* the subscriber's live position in it */
+  u_int32_t live_gen;       /* the table's gen when that was found */
+};
+
+static int __jlog_lazy_get(jlog_ctx *ctx, jlog_id *id) {
+  pthread_mutex_lock(&ctx->lazy->lock);
+  *id = ctx->lazy->pending;
+  pthread_mutex_unlock(&ctx->lazy->lock);
+  return 0;
+}
+
+/* Write the pending position to the checkpoint file, freeing segments
+ * behind it as an eager checkpoint would. */
+static int __jlog_lazy_persist(struct _jlog_lazy_checkpoint *lz) {
+  jlog_id id;
+  int rv = 0;
+
+  pthread_mutex_lock(&lz->persist);
+  pthread_mutex_lock(&lz->lock);
+  id = lz->pending;
+  lz->dirty = lz->urgent = 0;
+  lz->unpersisted = 0;
+  pthread_mutex_unlock(&lz->lock);
+  if (id.log != lz->persisted.log || id.marker != lz->persisted.marker) {
+    rv = __jlog_set_checkpoint(lz->persister, lz->persister->subscriber_name, &id);
+    if (rv == 0) lz->persisted = id;
+    else {
+      /* try again on the next round */
+      pthread_mutex_lock(&lz->lock);
+      lz->dirty = 1;
+      pthread_mutex_unlock(&lz->lock);
+    }
+  }
+  pthread_mutex_unlock(&lz->persist);
+  return rv;
+}
+
+static void *__jlog_lazy_thread(void *arg) {
+  struct _jlog_lazy_checkpoint *lz = arg;
+  struct timespec ts;
+  struct timeval now;
+
+  pthread_mutex_lock(&lz->lock);
+  while (!lz->stop) {
+    if (!lz->dirty) {
+      pthread_cond_wait(&lz->cv, &lz->lock);
+      continue;
+    }
+    /* the first unpersisted checkpoint starts the clock */
+    gettimeofday(&now, NULL);
+    now.tv_usec += (lz->interval_ms % 1000) * 1000;
+    ts.tv_sec = now.tv_sec + lz->interval_ms / 1000 + now.tv_usec / 1000000;
+    ts.tv_nsec = (now.tv_usec % 1000000) * 1000;
+    while (!lz->stop && !lz->urgent) {
+      if (lz->interval_ms == 0) pthread_cond_wait(&lz->cv, &lz->lock);
+      else if (pthread_cond_timedwait(&lz->cv, &lz->lock, &ts) == ETIMEDOUT) break;
+    }
+    if (lz->stop) break;
+    pthread_mutex_unlock(&lz->lock);
+    __jlog_lazy_persist(lz);
+    pthread_mutex_lock(&lz->lock);
+  }
+  pthread_mutex_unlock(&lz->lock);
+  return NULL;
+}
+
+/* Find the subscriber's slot in a mapping of the table of the lazy
+ * reader's own, as ctx's is remapped whenever the table grows; it stays
+ * valid since the table never shrinks.  Without a slot live stays NULL. */
+static void __jlog_lazy_map_live(jlog_ctx *ctx) {
+  struct _jlog_lazy_checkpoint *lz = ctx->lazy;
+  struct _jlog_subscriber_slot *slots;
+  u_int32_t i;
+
+  if (lz->live_map) munmap(lz->live_map, lz->live_map_len);
+  lz->live_map = NULL;
+  lz->live = NULL;
+  if (__jlog_subtab_lock(ctx) != 0) return;
+  slots = SUBTAB_SLOTS(ctx);
+  for (i = 0; i < SUBTAB(ctx)->nslots && !SUBTAB(ctx)->overflow; i++) {
+    if (!slots[i].in_use || strcmp(slots[i].name, ctx->subscriber_name)) continue;
+    if (jlog_file_map_rdwr(ctx->subtab, &lz->live_map, &lz->live_map_len)) {
+      lz->live = &((struct _jlog_subscriber_slot *)((char *)lz->live_map +
+                   sizeof(struct _jlog_subscriber_table)))[i].live;
+      lz->live_gen = SUBTAB(ctx)->gen;
+    }
+    else lz->live_map = NULL;
+    break;
+  }
+  jlog_file_unlock(ctx->subtab);
+}
+
+static void __jlog_lazy_update(jlog_ctx *ctx, const jlog_id *id) {
+  struct _jlog_lazy_checkpoint *lz = ctx->lazy;
+  struct _jlog_subscriber_table *t = lz->live_map;
+
+  pthread_mutex_lock(&lz->lock);
+  /* a new segment may leave one free: persist so it can be reclaimed */
+  if (id->log != lz->pending.log) lz->urgent = 1;
+  else if (id->marker > lz->pending.marker)
+    lz->unpersisted += id->marker - lz->pending.marker;
+  if (lz->messages && lz->unpersisted >= lz->messages) lz->urgent = 1;
+  lz->pending = *id;
+  if (!lz->dirty || lz->urgent) pthread_cond_signal(&lz->cv);
+  lz->dirty = 1;
+  pthread_mutex_unlock(&lz->lock);
+
+  /* only a rebuilt table costs a lock */
+  if (t && __atomic_load_n(&t->gen, __ATOMIC_ACQUIRE) != lz->live_gen)
+    __jlog_lazy_map_live(ctx);
+  if (lz->live) __jlog_live_store(lz->live, id);
+}
+
+/* Anything other than jlog_ctx_read_checkpoint that moves the subscriber
+ * (seeks, group commits) is persisted at once. */
+static int __jlog_lazy_force(jlog_ctx *ctx, const jlog_id *id) {
+  struct _jlog_lazy_checkpoint *lz = ctx->lazy;
+
+  pthread_mutex_lock(&lz->lock);
+  lz->pending = *id;
+  lz->dirty = 1;
+  pthread_mutex_unlock(&lz->lock);
+  return __jlog_lazy_persist(lz);
+}
+
+static void __jlog_lazy_stop(jlog_ctx *ctx) {
+  struct _jlog_lazy_checkpoint *lz = ctx->lazy;
+
+  if (!lz) return;
+  pthread_mutex_lock(&lz->lock);
+  lz->stop = 1;
+  pthread_cond_signal(&lz->cv);
+  pthread_mutex_unlock(&lz->lock);
+  pthread_join(lz->thread, NULL);
+  if (__jlog_lazy_persist(lz) != 0) {
+    ctx->last_error = JLOG_ERR_CHECKPOINT;
+    ctx->last_errno = 0;
+  }
+  ctx->lazy = NULL;
+  if (lz->live_map) munmap(lz->live_map, lz->live_map_len);
+  jlog_ctx_close(lz->persister);
+  pthread_cond_destroy(&lz->cv);
+  pthread_mutex_destroy(&lz->lock);
+  pthread_mutex_destroy(&lz->persist);
+  free(lz);
+}
+
+int jlog_ctx_set_lazy_checkpoint(jlog_ctx *ctx, u_int32_t interval_ms,
+                                 u_int32_t messages) {
+  struct _jlog_lazy_checkpoint *lz;
+  jlog_id id;
+
+  ctx->last_error = JLOG_ERR_SUCCESS;
+  if(ctx->context_mode != JLOG_READ) {
+    ctx->last_error = JLOG_ERR_ILLEGAL_CHECKPOINT;
+    ctx->last_errno = EPERM;
+    return -1;
+  }
+  if(interval_ms == 0 && messages == 0) {
+    __jlog_lazy_stop(ctx);
+    return ctx->last_error == JLOG_ERR_SUCCESS ? 0 : -1;
+  }
+  if((lz = ctx->lazy) != NULL) {
+    pthread_mutex_lock(&lz->lock);
+    lz->interval_ms = interval_ms;
+    lz->messages = messages;
+    pthread_cond_signal(&lz->cv);
+    pthread_mutex_unlock(&lz->lock);
+    return 0;
+  }
+  if(jlog_get_checkpoint(ctx, ctx->subscriber_name, &id) != 0) {
+    ctx->last_error = JLOG_ERR_INVALID_SUBSCRIBER;
+    return -1;
+  }
+
+  lz = calloc(1, sizeof(*lz));
+  if(!lz) {
+    ctx->last_error = JLOG_ERR_CHECKPOINT;
+    ctx->last_errno = ENOMEM;
+    return -1;
+  }
+  lz->persister = jlog_new(ctx->path);
+  jlog_ctx_set_multi_process(lz->persister, ctx->multi_process);
+  jlog_ctx_set_async_reclaim(lz->persister, ctx->async_reclaim, ctx->reclaim_rate);
+  lz->persister->lazy_persister = 1;
+  if(jlog_ctx_open_reader(lz->persister, ctx->subscriber_name) != 0) {
+    ctx->last_error = lz->persister->last_error;
+    ctx->last_errno = lz->persister->last_errno;
+    jlog_ctx_close(lz->persister);
+    free(lz);
+    return -1;
+  }
+  lz->pending = lz->persisted = id;
+  lz->interval_ms = interval_ms;
+  lz->messages = messages;
+  pthread_mutex_init(&lz->persist, NULL);
+  pthread_mutex_init(&lz->lock, NULL);
+  pthread_cond_init(&lz->cv, NULL);
+  if(pthread_create(&lz->thread, NULL, __jlog_lazy_thread, lz) != 0) {
+    ctx->last_error = JLOG_ERR_CHECKPOINT;
+    ctx->last_errno = errno;
+    jlog_ctx_close(lz->persister);
+    pthread_cond_destroy(&lz->cv);
+    pthread_mutex_destroy(&lz->lock);
+    pthread_mutex_destroy(&lz->persist);
+    free(lz);
+    return -1;
+  }
+  ctx->lazy = lz;
+  __jlog_lazy_map_live(ctx);
+  return 0;
+}
+
 int jlog_ctx_read_checkpoint(jlog_ctx *ctx, const jlog_id *chkpt) {
   ctx->last_error = JLOG_ERR_SUCCESS;
   
@@ -1937,6 +3573,10 @@ int jlog_ctx_read_checkpoint(jlog_ctx *ctx, const jlog_id *chkpt) {
     ctx->last_errno = EPERM;
     return -1;
   }
+  if(ctx->lazy) {
+    __jlog_lazy_update(ctx, chkpt);
+    return 0;
+  }
   if(__jlog_set_checkpoint(ctx, ctx->subscriber_name, chkpt) != 0) {
     ctx->last_error = JLOG_ERR_CHECKPOINT;
     ctx->last_errno = 0;
@@ -1947,10 +3587,31 @@ int jlog_ctx_read_checkpoint(jlog_ctx *ctx, const jlog_id *chkpt) {
 
 int jlog_ctx_remove_subscriber(jlog_ctx *ctx, const char *s) {
   char name[MAXPATHLEN];
-  int rv;
-
+  jlog_file *cp;
+  int rv, save;
+
+  compute_subscriber_filename(ctx, "gl", s, name);
+  unlink(name);
+  compute_subscriber_filename(ctx, "ev", s, name);
+  unlink(name);
+  /* hold the checkpoint so a concurrent set cannot put the slot back */
+  cp = __jlog_open_named_checkpoint(ctx, s, 0);
+  if (cp && !jlog_file_lock(cp)) {
+    jlog_file_close(cp);
+    cp = NULL;
+  }
   compute_checkpoint_filename(ctx, s, name);
   rv = unlink(name);
+  save = errno;
+  if (rv == 0 && __jlog_subtab_lock(ctx) == 0) {
+    __jlog_subtab_drop(ctx, s);
+    jlog_file_unlock(ctx->subtab);
+  }
+  if (cp) {
+    jlog_file_unlock(cp);
+    jlog_file_close(cp);
+  }
+  errno = save;
 
   if (rv == 0) {
     ctx->last_error = JLOG_ERR_SUCCESS;
@@ -2073,6 +3734,26 @@ int jlog_ctx_set_subscriber_checkpoint(jlog_ctx *ctx, const char *s,
 }
 
 
+int jlog_ctx_write_message(jlog_ctx *ctx, jlog_message *mess, struct timeval *when) {
+  return __jlog_write_message(ctx, mess, when, NULL, 0);
+}
+
+int jlog_ctx_write_message_key(jlog_ctx *ctx, jlog_message *mess, struct timeval *when,
+                               const void *key, size_t key_len) {
+  ctx->last_error = JLOG_ERR_SUCCESS;
+  if (ctx->context_mode == JLOG_APPEND && !HAS_KEYS(ctx)) {
+    ctx->last_error = JLOG_ERR_NOT_SUPPORTED;
+    ctx->last_errno = EINVAL;
+    return -1;
+  }
+  if (key_len > JLOG_KEY_LEN) {
+    ctx->last_error = JLOG_ERR_ILLEGAL_WRITE;
+    ctx->last_errno = ENAMETOOLONG;
+    return -1;
+  }
+  return __jlog_write_message(ctx, mess, when, key, key_len);
+}
+
 int jlog_ctx_write(jlog_ctx *ctx, const void *data, size_t len) {
   jlog_message m;
   m.mess = (void *)data;
@@ -2129,10 +3810,73 @@ static int __jlog_find_first_log_after(jlog_ctx *ctx, jlog_id *chkpt,
   memcpy(finish, &last, sizeof(last));
   return 0;
 }
-int jlog_ctx_read_message(jlog_ctx *ctx, const jlog_id *id, jlog_message *m) {
+/* Where message `marker` starts in the segment whose reader and index are
+ * open.  Reading the close marker fails with JLOG_ERR_CLOSE_LOGID. */
+static int __jlog_index_locate(jlog_ctx *ctx, u_int32_t marker, u_int64_t *data_off) {
+  u_int32_t stride = IDX_STRIDE(ctx), count;
+  u_int64_t entries, off;
   off_t index_len;
+  int closed, n;
+
+  if (HAS_FIXED_RECORDS(ctx)) {
+    if (__jlog_fixed_extent(ctx, ctx->data, ctx->current_log, &count, &closed) != 0)
+      return -1;
+    if (closed && marker == count + 1)
+      goto close_tag;
+    if (marker > count)
+      SYS_FAIL(JLOG_ERR_ILLEGAL_LOGID);
+    *data_off = (u_int64_t)(marker - 1) * FIXED_RECORD_SIZE(ctx);
+    return 0;
+  }
+  if (stride > 1) {
+    if (__jlog_index_tail(ctx, ctx->index, &entries, &count, &closed) != 0)
+      return -1;
+    if (closed && marker == count + 1)
+      goto close_tag;
+    if ((closed && marker > count) || (marker - 1) / stride >= entries)
+      SYS_FAIL(JLOG_ERR_ILLEGAL_LOGID);
+    if (!__jlog_index_pread(ctx, ctx->index, &off, 1, (marker - 1) / stride))
+      SYS_FAIL(JLOG_ERR_IDX_READ);
+    /* a header out of step means the index is stale */
+    if ((n = __jlog_index_walk(ctx, ctx->data, off, (marker - 1) % stride,
+                               data_off, 1)) < 0)
+      SYS_FAIL(JLOG_ERR_IDX_CORRUPT);
+    if (n == 0)
+      SYS_FAIL(JLOG_ERR_ILLEGAL_LOGID);
+    return 0;
+  }
+
+  if ((index_len = jlog_file_size(ctx->index)) == -1)
+    SYS_FAIL(JLOG_ERR_IDX_SEEK);
+  if (index_len % IDX_ENTRY_SIZE(ctx))
+    SYS_FAIL(JLOG_ERR_IDX_CORRUPT);
+  if (marker * IDX_ENTRY_SIZE(ctx) > index_len) {
+    SYS_FAIL(JLOG_ERR_ILLEGAL_LOGID);
+  }
+
+  if (!__jlog_index_pread(ctx, ctx->index, data_off, 1, marker - 1))
+  {
+    SYS_FAIL(JLOG_ERR_IDX_READ);
+  }
+  if (*data_off == 0 && marker != 1) {
+    if (marker * IDX_ENTRY_SIZE(ctx) == index_len) goto close_tag;
+    /* an offset of 0 in the middle of an index means corruption */
+    SYS_FAIL(JLOG_ERR_IDX_CORRUPT);
+  }
+  return 0;
+
+ close_tag:
+  /* not a real offset */
+  ctx->last_error = JLOG_ERR_CLOSE_LOGID;
+  ctx->last_errno = 0;
+  return -1;
+ finish:
+  return -1;
+}
+
+int jlog_ctx_read_message(jlog_ctx *ctx, const jlog_id *id, jlog_message *m) {
   u_int64_t data_off;
-  int with_lock = 0;
+  int with_lock = 0, retried = 0;
   size_t hdr_size = 0;
   uint32_t *message_disk_len = &m->aligned_header.mlen;
   /* We don't want the style to change mid-read, so use whatever
@@ -2140,13 +3884,12 @@ int jlog_ctx_read_message(jlog_ctx *ctx, const jlog_id *id, jlog_message *m) {
   jlog_read_method_type read_method = ctx->read_method;
 
   if (IS_COMPRESS_MAGIC(ctx)) {
-    hdr_size = sizeof(jlog_message_header_compressed);
     message_disk_len = &m->aligned_header.compressed_len;
-  } else {
-    hdr_size = sizeof(jlog_message_header);
   }
+  hdr_size = HDR_SIZE(ctx);
+  if (__jlog_reserve_ext_headers(ctx, 1) != 0) return -1;
 
- once_more_with_lock:
+ once_more:
 
   ctx->last_error = JLOG_ERR_SUCCESS;
   if (ctx->context_mode != JLOG_READ)
@@ -2158,9 +3901,11 @@ int jlog_ctx_read_message(jlog_ctx *ctx, const jlog_id *id, jlog_message *m) {
   __jlog_open_reader(ctx, id->log);
   if(!ctx->data)
     SYS_FAIL(JLOG_ERR_FILE_OPEN);
-  __jlog_open_indexer(ctx, id->log);
-  if(!ctx->index)
-    SYS_FAIL(JLOG_ERR_IDX_OPEN);
+  if(!HAS_FIXED_RECORDS(ctx)) {
+    __jlog_open_indexer(ctx, id->log);
+    if(!ctx->index)
+      SYS_FAIL(JLOG_ERR_IDX_OPEN);
+  }
 
   if(with_lock) {
     if (!jlog_file_lock(ctx->index)) {
@@ -2169,30 +3914,12 @@ int jlog_ctx_read_message(jlog_ctx *ctx, const jlog_id *id, jlog_message *m) {
     }
   }
 
-  if ((index_len = jlog_file_size(ctx->index)) == -1)
-    SYS_FAIL(JLOG_ERR_IDX_SEEK);
-  if (index_len % sizeof(u_int64_t))
-    SYS_FAIL(JLOG_ERR_IDX_CORRUPT);
-  if (id->marker * sizeof(u_int64_t) > index_len) {
-    SYS_FAIL(JLOG_ERR_ILLEGAL_LOGID);
-  }
-
-  if (!jlog_file_pread(ctx->index, &data_off, sizeof(u_int64_t),
-                       (id->marker - 1) * sizeof(u_int64_t)))
-  {
-    SYS_FAIL(JLOG_ERR_IDX_READ);
-  }
-  if (data_off == 0 && id->marker != 1) {
-    if (id->marker * sizeof(u_int64_t) == index_len) {
-      /* close tag; not a real offset */
-      ctx->last_error = JLOG_ERR_CLOSE_LOGID;
-      ctx->last_errno = 0;
+  if (__jlog_index_locate(ctx, id->marker, &data_off) != 0) {
+    if (ctx->last_error == JLOG_ERR_CLOSE_LOGID) {
       if(with_lock) jlog_file_unlock(ctx->index);
       return -1;
-    } else {
-      /* an offset of 0 in the middle of an index means corruption */
-      SYS_FAIL(JLOG_ERR_IDX_CORRUPT);
     }
+    goto finish;
   }
 
   if(__jlog_setup_reader(ctx, id->log, 0) != 0)
@@ -2207,8 +3934,10 @@ int jlog_ctx_read_message(jlog_ctx *ctx, const jlog_id *id, jlog_message *m) {
         SYS_FAIL(JLOG_ERR_IDX_CORRUPT);
       }
 
-      memcpy(&m->aligned_header, ((u_int8_t *)ctx->mmap_base) + data_off,
-             hdr_size);
+      __jlog_unpack_header(ctx, m, ((u_int8_t *)ctx->mmap_base) + data_off,
+                           EXT_HEADER(ctx, 0));
+      if (FIXED_RECORD_BAD(ctx, m))
+        SYS_FAIL(JLOG_ERR_FILE_CORRUPT);
 
       if(data_off + hdr_size + *message_disk_len > ctx->mmap_len) {
 #ifdef DEBUG
@@ -2216,7 +3945,6 @@ int jlog_ctx_read_message(jlog_ctx *ctx, const jlog_id *id, jlog_message *m) {
 #endif
         SYS_FAIL(JLOG_ERR_IDX_CORRUPT);
       }
-      m->header = &m->aligned_header;
       if (IS_COMPRESS_MAGIC(ctx)) {
         if (ctx->mess_data_size < m->aligned_header.mlen) {
           ctx->mess_data = realloc(ctx->mess_data, m->aligned_header.mlen * 2);
@@ -2238,17 +3966,18 @@ int jlog_ctx_read_message(jlog_ctx *ctx, const jlog_id *id, jlog_message *m) {
 #endif
         SYS_FAIL(JLOG_ERR_IDX_CORRUPT);
       }
-      if (!jlog_file_pread(ctx->data, &m->aligned_header, hdr_size, data_off))
+      if (!__jlog_pread_header(ctx, m, data_off, EXT_HEADER(ctx, 0)))
       {
         SYS_FAIL(JLOG_ERR_IDX_READ);
       }
+      if (FIXED_RECORD_BAD(ctx, m))
+        SYS_FAIL(JLOG_ERR_FILE_CORRUPT);
       if(data_off + hdr_size + *message_disk_len > ctx->data_file_size) {
 #ifdef DEBUG
         fprintf(stderr, "read idx off end: %llu %llu\n", data_off, ctx->data_file_size);
 #endif
         SYS_FAIL(JLOG_ERR_IDX_CORRUPT);
       }
-      m->header = &m->aligned_header;
       if (ctx->mess_data_size < m->aligned_header.mlen) {
         ctx->mess_data_size = m->aligned_header.mlen * 2;
         ctx->mess_data = realloc(ctx->mess_data, ctx->mess_data_size);
@@ -2278,38 +4007,110 @@ int jlog_ctx_read_message(jlog_ctx *ctx, const jlog_id *id, jlog_message *m) {
  finish:
   if(with_lock) jlog_file_unlock(ctx->index);
   if(ctx->last_error == JLOG_ERR_SUCCESS) return 0;
-  if(!with_lock) {
-    if (ctx->last_error == JLOG_ERR_IDX_CORRUPT) {
+  if(!retried) {
+    jlog_id last;
+    int closed;
+    if (ctx->last_error == JLOG_ERR_IDX_CORRUPT && ctx->index) {
       if (jlog_file_lock(ctx->index)) {
         jlog_file_truncate(ctx->index, 0);
         jlog_file_unlock(ctx->index);
       }
     }
-    ___jlog_resync_index(ctx, id->log, NULL, NULL);
-    with_lock = 1;
+    retried = 1;
+    /* an index the resync found to cover the read cannot shrink under
+     * it short of a repair, so only retry under the lock otherwise;
+     * fixed records have no index to lock */
+    with_lock = !HAS_FIXED_RECORDS(ctx) &&
+                !(___jlog_resync_index(ctx, id->log, &last, &closed) == 0 &&
+                  id->marker <= last.marker + closed);
 #ifdef DEBUG
-    fprintf(stderr, "read retrying with lock\n");
+    fprintf(stderr, "read retrying%s\n", with_lock ? " with lock" : "");
 #endif
-    goto once_more_with_lock;
+    goto once_more;
   }
   return -1;
 }
 
-static int __jlog_ctx_bulk_read_messages_compressed(jlog_ctx *ctx, const jlog_id *id, const int count,
-                                                    jlog_message *m, u_int64_t data_off,
-                                                    jlog_read_method_type read_method) {
-  assert(IS_COMPRESS_MAGIC(ctx));
-  assert(ctx->reader_is_initialized);
+/* Decompress a batch whose headers have already been read into m[] and
+ * validated; every message lands at a precomputed offset in ctx->mess_data
+ * so the workers never contend on output space. */
+static int __jlog_bulk_decompress_parallel(jlog_ctx *ctx, const int count, jlog_message *m,
+                                           u_int64_t data_off, u_int64_t span,
+                                           jlog_read_method_type read_method) {
+  const size_t hdr_size = HDR_SIZE(ctx);
+  char *base, *uncompressed_data_ptr = ctx->mess_data;
+  u_int64_t rel_off = 0;
+  int i;
 
-  int i = 0;
-  uint64_t uncompressed_size = 0, compressed_size = 0;
-  const size_t hdr_size = sizeof(jlog_message_header_compressed);
-  jlog_message *msg = NULL;
-  u_int64_t data_off_iter = data_off;
+  switch(read_method) {
+    case JLOG_READ_METHOD_MMAP:
+      base = ((char *)ctx->mmap_base) + data_off;
+      break;
+    case JLOG_READ_METHOD_PREAD:
+      /* pull the whole batch in with a single read */
+      if (ctx->compressed_data_buffer_len < span) {
+        ctx->compressed_data_buffer_len = span;
+        ctx->compressed_data_buffer = realloc(ctx->compressed_data_buffer, ctx->compressed_data_buffer_len);
+      }
+      if (!jlog_file_pread(ctx->data, ctx->compressed_data_buffer, span, data_off)) {
+        SYS_FAIL(JLOG_ERR_FILE_READ);
+      }
+      base = ctx->compressed_data_buffer;
+      break;
+    default:
+      SYS_FAIL(JLOG_ERR_NOT_SUPPORTED);
+  }
+
+  if (ctx->decompress_jobs_len < count) {
+    free(ctx->decompress_jobs);
+    ctx->decompress_jobs = calloc(count, sizeof(jlog_decompress_job));
+    if (ctx->decompress_jobs == NULL) {
+      ctx->decompress_jobs_len = 0;
+      SYS_FAIL(JLOG_ERR_FILE_READ);
+    }
+    ctx->decompress_jobs_len = count;
+  }
+  if (ctx->decompress_pool == NULL) {
+    ctx->decompress_pool = jlog_decompress_pool_create(ctx->decompress_threads);
+    if (ctx->decompress_pool == NULL) SYS_FAIL(JLOG_ERR_NOT_SUPPORTED);
+  }
 
   for (i=0; i < count; i++) {
-    msg = &m[i];
-    switch(read_method) {
+    jlog_message *msg = &m[i];
+    jlog_decompress_job *job = &ctx->decompress_jobs[i];
+    job->source = base + rel_off + hdr_size;
+    job->source_bytes = msg->header->compressed_len;
+    job->dest = uncompressed_data_ptr;
+    job->dest_bytes = msg->header->mlen;
+    job->rv = 0;
+    msg->mess_len = msg->header->mlen;
+    msg->mess = uncompressed_data_ptr;
+    rel_off += (hdr_size + msg->header->compressed_len);
+    uncompressed_data_ptr += msg->header->mlen;
+  }
+  if (jlog_decompress_pool_run(ctx->decompress_pool, ctx->decompress_jobs, count) != 0) {
+    SYS_FAIL(JLOG_ERR_FILE_CORRUPT);
+  }
+  return 0;
+ finish:
+  return -1;
+}
+
+static int __jlog_ctx_bulk_read_messages_compressed(jlog_ctx *ctx, const jlog_id *id, const int count,
+                                                    jlog_message *m, u_int64_t data_off,
+                                                    jlog_read_method_type read_method) {
+  assert(IS_COMPRESS_MAGIC(ctx));
+  assert(ctx->reader_is_initialized);
+
+  int i = 0;
+  uint64_t uncompressed_size = 0, compressed_size = 0;
+  const size_t hdr_size = HDR_SIZE(ctx);
+  jlog_message *msg = NULL;
+  u_int64_t data_off_iter = data_off;
+
+  for (i=0; i < count; i++) {
+    msg = &m[i];
+    switch(read_method) {
       case JLOG_READ_METHOD_MMAP:
         if(data_off_iter > ctx->mmap_len - hdr_size) {
 #ifdef DEBUG
@@ -2317,7 +4118,8 @@ static int __jlog_ctx_bulk_read_messages_compressed(jlog_ctx *ctx, const jlog_id
 #endif
           SYS_FAIL(JLOG_ERR_IDX_CORRUPT);
         }
-        memcpy(&msg->aligned_header, ((u_int8_t *)ctx->mmap_base) + data_off_iter, hdr_size);
+        __jlog_unpack_header(ctx, msg, ((u_int8_t *)ctx->mmap_base) + data_off_iter,
+                             EXT_HEADER(ctx, i));
         break;
       case JLOG_READ_METHOD_PREAD:
         if(data_off_iter > ctx->data_file_size - hdr_size) {
@@ -2326,7 +4128,7 @@ static int __jlog_ctx_bulk_read_messages_compressed(jlog_ctx *ctx, const jlog_id
 #endif
           SYS_FAIL(JLOG_ERR_IDX_CORRUPT);
         }
-        if (!jlog_file_pread(ctx->data, &msg->aligned_header, hdr_size, data_off_iter)) {
+        if (!__jlog_pread_header(ctx, msg, data_off_iter, EXT_HEADER(ctx, i))) {
           SYS_FAIL(JLOG_ERR_IDX_READ);
         }
         break;
@@ -2334,7 +4136,8 @@ static int __jlog_ctx_bulk_read_messages_compressed(jlog_ctx *ctx, const jlog_id
         SYS_FAIL(JLOG_ERR_NOT_SUPPORTED);
         break;
     }
-    msg->header = &msg->aligned_header;
+    if (FIXED_RECORD_BAD(ctx, msg))
+      SYS_FAIL(JLOG_ERR_FILE_CORRUPT);
     compressed_size += msg->header->compressed_len;
     uncompressed_size += msg->header->mlen;
     data_off_iter += (hdr_size + msg->header->compressed_len);
@@ -2350,6 +4153,14 @@ static int __jlog_ctx_bulk_read_messages_compressed(jlog_ctx *ctx, const jlog_id
     ctx->mess_data = realloc(ctx->mess_data, uncompressed_size + 1);
     ctx->mess_data_size = uncompressed_size;
   }
+  if (ctx->decompress_threads > 1 && count > 1) {
+    if (__jlog_bulk_decompress_parallel(ctx, count, m, data_off,
+                                        (hdr_size * count) + compressed_size,
+                                        read_method) != 0) {
+      SYS_FAIL(ctx->last_error);
+    }
+    goto finish;
+  }
   char *uncompressed_data_ptr = ctx->mess_data;
   for (i=0; i < count; i++) {
     msg = &m[i];
@@ -2392,7 +4203,7 @@ static int __jlog_ctx_bulk_pread_messages_uncompressed(jlog_ctx *ctx, const jlog
 
   int i = 0;
   uint64_t total_size = 0;
-  const size_t hdr_size = sizeof(jlog_message_header);
+  const size_t hdr_size = HDR_SIZE(ctx);
   jlog_message *msg = NULL;
   u_int64_t data_off_iter = data_off;
 
@@ -2404,10 +4215,11 @@ static int __jlog_ctx_bulk_pread_messages_uncompressed(jlog_ctx *ctx, const jlog
 #endif
       SYS_FAIL(JLOG_ERR_IDX_CORRUPT);
     }
-    if (!jlog_file_pread(ctx->data, &msg->aligned_header, hdr_size, data_off_iter)) {
+    if (!__jlog_pread_header(ctx, msg, data_off_iter, EXT_HEADER(ctx, i))) {
       SYS_FAIL(JLOG_ERR_IDX_READ);
     }
-    msg->header = &msg->aligned_header;
+    if (FIXED_RECORD_BAD(ctx, msg))
+      SYS_FAIL(JLOG_ERR_FILE_CORRUPT);
     total_size += msg->header->mlen;
     data_off_iter += (hdr_size + msg->header->mlen);
   }
@@ -2442,9 +4254,8 @@ static int __jlog_ctx_bulk_pread_messages_uncompressed(jlog_ctx *ctx, const jlog
 }
 
 int jlog_ctx_bulk_read_messages(jlog_ctx *ctx, const jlog_id *id, const int count, jlog_message *m) {
-  off_t index_len;
   u_int64_t data_off;
-  int with_lock = 0;
+  int with_lock = 0, retried = 0;
   size_t hdr_size = 0;
   uint32_t *message_disk_len;
   int i;
@@ -2455,8 +4266,9 @@ int jlog_ctx_bulk_read_messages(jlog_ctx *ctx, const jlog_id *id, const int coun
   if (count <= 0) {
     return 0;
   }
+  if (__jlog_reserve_ext_headers(ctx, count) != 0) return -1;
 
- once_more_with_lock:
+ once_more:
 
   data_off = 0;
 
@@ -2470,9 +4282,11 @@ int jlog_ctx_bulk_read_messages(jlog_ctx *ctx, const jlog_id *id, const int coun
   __jlog_open_reader(ctx, id->log);
   if(!ctx->data)
     SYS_FAIL(JLOG_ERR_FILE_OPEN);
-  __jlog_open_indexer(ctx, id->log);
-  if(!ctx->index)
-    SYS_FAIL(JLOG_ERR_IDX_OPEN);
+  if(!HAS_FIXED_RECORDS(ctx)) {
+    __jlog_open_indexer(ctx, id->log);
+    if(!ctx->index)
+      SYS_FAIL(JLOG_ERR_IDX_OPEN);
+  }
 
   if(with_lock) {
     if (!jlog_file_lock(ctx->index)) {
@@ -2481,31 +4295,12 @@ int jlog_ctx_bulk_read_messages(jlog_ctx *ctx, const jlog_id *id, const int coun
     }
   }
 
-  if ((index_len = jlog_file_size(ctx->index)) == -1)
-    SYS_FAIL(JLOG_ERR_IDX_SEEK);
-  if (index_len % sizeof(u_int64_t))
-    SYS_FAIL(JLOG_ERR_IDX_CORRUPT);
-  if (id->marker * sizeof(u_int64_t) > index_len) {
-    SYS_FAIL(JLOG_ERR_ILLEGAL_LOGID);
-  }
-
-  if (!jlog_file_pread(ctx->index, &data_off, sizeof(u_int64_t),
-                       (id->marker - 1) * sizeof(u_int64_t)))
-  {
-    SYS_FAIL(JLOG_ERR_IDX_READ);
-  }
-
-  if (data_off == 0 && id->marker != 1) {
-    if (id->marker * sizeof(u_int64_t) == index_len) {
-      /* close tag; not a real offset */
-      ctx->last_error = JLOG_ERR_CLOSE_LOGID;
-      ctx->last_errno = 0;
+  if (__jlog_index_locate(ctx, id->marker, &data_off) != 0) {
+    if (ctx->last_error == JLOG_ERR_CLOSE_LOGID) {
       if(with_lock) jlog_file_unlock(ctx->index);
       return -1;
-    } else {
-      /* an offset of 0 in the middle of an index means curruption */
-      SYS_FAIL(JLOG_ERR_IDX_CORRUPT);
     }
+    goto finish;
   }
 
   if(__jlog_setup_reader(ctx, id->log, 0) != 0)
@@ -2528,7 +4323,7 @@ int jlog_ctx_bulk_read_messages(jlog_ctx *ctx, const jlog_id *id, const int coun
       for (i=0; i < count; i++) {
         jlog_message *msg = &m[i];
         message_disk_len = &msg->aligned_header.mlen;
-        hdr_size = sizeof(jlog_message_header);
+        hdr_size = HDR_SIZE(ctx);
 
         if(data_off > ctx->mmap_len - hdr_size) {
 #ifdef DEBUG
@@ -2537,8 +4332,10 @@ int jlog_ctx_bulk_read_messages(jlog_ctx *ctx, const jlog_id *id, const int coun
           SYS_FAIL(JLOG_ERR_IDX_CORRUPT);
         }
 
-        memcpy(&msg->aligned_header, ((u_int8_t *)ctx->mmap_base) + data_off,
-               hdr_size);
+        __jlog_unpack_header(ctx, msg, ((u_int8_t *)ctx->mmap_base) + data_off,
+                             EXT_HEADER(ctx, i));
+        if (FIXED_RECORD_BAD(ctx, msg))
+          SYS_FAIL(JLOG_ERR_FILE_CORRUPT);
 
         if(data_off + hdr_size + *message_disk_len > ctx->mmap_len) {
 #ifdef DEBUG
@@ -2547,7 +4344,6 @@ int jlog_ctx_bulk_read_messages(jlog_ctx *ctx, const jlog_id *id, const int coun
           SYS_FAIL(JLOG_ERR_IDX_CORRUPT);
         }
 
-        msg->header = &msg->aligned_header;
         msg->mess_len = msg->header->mlen;
         msg->mess = (((u_int8_t *)ctx->mmap_base) + data_off + hdr_size);
         data_off += (msg->mess_len + hdr_size);
@@ -2560,205 +4356,2484 @@ int jlog_ctx_bulk_read_messages(jlog_ctx *ctx, const jlog_id *id, const int coun
  finish:
   if(with_lock) jlog_file_unlock(ctx->index);
   if(ctx->last_error == JLOG_ERR_SUCCESS) return 0;
-  if(!with_lock) {
-    if (ctx->last_error == JLOG_ERR_IDX_CORRUPT) {
+  if(!retried) {
+    jlog_id last;
+    int closed;
+    if (ctx->last_error == JLOG_ERR_IDX_CORRUPT && ctx->index) {
       if (jlog_file_lock(ctx->index)) {
         jlog_file_truncate(ctx->index, 0);
         jlog_file_unlock(ctx->index);
       }
     }
-    ___jlog_resync_index(ctx, id->log, NULL, NULL);
-    with_lock = 1;
+    retried = 1;
+    /* an index the resync found to cover the read cannot shrink under
+     * it short of a repair, so only retry under the lock otherwise;
+     * fixed records have no index to lock */
+    with_lock = !HAS_FIXED_RECORDS(ctx) &&
+                !(___jlog_resync_index(ctx, id->log, &last, &closed) == 0 &&
+                  id->marker + count - 1 <= last.marker + closed);
 #ifdef DEBUG
-    fprintf(stderr, "read retrying with lock\n");
+    fprintf(stderr, "read retrying%s\n", with_lock ? " with lock" : "");
 #endif
-    goto once_more_with_lock;
+    goto once_more;
+  }
+  return -1;
+}
+/* Map segment log and copy out its index for jlog_shared: both stay valid
+ * whatever becomes of ctx's own files. */
+int __jlog_segment_map(jlog_ctx *ctx, u_int32_t log, void **base, size_t *len,
+                       u_int64_t **offsets, u_int32_t *count, int *sealed) {
+  u_int64_t *offs = NULL;
+  jlog_id last;
+  int closed;
+
+  *base = NULL;
+  *len = 0;
+  *offsets = NULL;
+  *count = 0;
+  *sealed = 0;
+  if (__jlog_resync_index(ctx, log, &last, &closed) != 0) return -1;
+  ctx->last_error = JLOG_ERR_SUCCESS;
+  if (last.marker > 0) {
+    if ((offs = malloc(last.marker * sizeof(*offs))) == NULL)
+      SYS_FAIL(JLOG_ERR_IDX_READ);
+    if (!__jlog_index_offsets(ctx, ctx->index, ctx->data, offs, last.marker, 0))
+      SYS_FAIL(JLOG_ERR_IDX_READ);
+    if (!jlog_file_map_read(ctx->data, base, len)) {
+      *base = NULL;
+      *len = 0;
+      SYS_FAIL(JLOG_ERR_FILE_READ);
+    }
+  }
+  *offsets = offs;
+  *count = last.marker;
+  *sealed = closed;
+
+ finish:
+  if (ctx->last_error == JLOG_ERR_SUCCESS) return 0;
+  free(offs);
+  return -1;
+}
+
+/* Decode the record at off of a segment mapped by __jlog_segment_map;
+ * only ctx's metastore is consulted, so any thread may call this.  The
+ * header and its extension, if any, are kept at the front of *buf, ahead
+ * of a decompressed payload. */
+int __jlog_segment_message(jlog_ctx *ctx, const void *base, size_t len,
+                           u_int64_t off, jlog_message *m,
+                           char **buf, size_t *buf_len) {
+  size_t hdr_size = HDR_SIZE(ctx);
+  size_t ext = HAS_EXT_HDR(ctx) ? sizeof(jlog_message_header_full) : 0, need;
+  const char *rec = (const char *)base + off;
+  u_int32_t disk_len;
+
+  if (off > len || len - off < hdr_size) return -1;
+  __jlog_unpack_header(ctx, m, rec, NULL);
+  if (m->aligned_header.reserved != ctx->meta->hdr_magic || FIXED_RECORD_BAD(ctx, m)) return -1;
+  disk_len = IS_COMPRESS_MAGIC(ctx) ? m->aligned_header.compressed_len
+                                    : m->aligned_header.mlen;
+  if (len - off - hdr_size < disk_len) return -1;
+  need = ext + (IS_COMPRESS_MAGIC(ctx) ? m->aligned_header.mlen : 0);
+  if (need && (*buf_len < need || *buf == NULL)) {
+    char *b = realloc(*buf, need * 2 + 1);
+    if (b == NULL) return -1;
+    *buf = b;
+    *buf_len = need * 2 + 1;
+  }
+  if (ext) __jlog_unpack_header(ctx, m, rec, (jlog_message_header_full *)*buf);
+  m->mess_len = m->aligned_header.mlen;
+  if (!IS_COMPRESS_MAGIC(ctx)) {
+    m->mess = (void *)(rec + hdr_size);
+    return 0;
+  }
+  if (jlog_decompress(rec + hdr_size, disk_len, *buf + ext, *buf_len - ext) != 0) return -1;
+  m->mess = *buf + ext;
+  return 0;
+}
+
+int jlog_ctx_bulk_read_filtered(jlog_ctx *ctx, const jlog_filter *filter,
+                                const jlog_id *start, int count,
+                                jlog_message *m, jlog_id *ids) {
+  struct _jlog_time_index_entry *summary = NULL;
+  jlog_read_method_type read_method = ctx->read_method;
+  u_int64_t *offs = NULL, *hits = NULL, limit, total = 0;
+  u_int32_t marker, last, interval = TIME_INDEX_INTERVAL;
+  size_t hdr_size;
+  char *out;
+  int i, n = 0, closed;
+
+  ctx->last_error = JLOG_ERR_SUCCESS;
+  if (ctx->context_mode != JLOG_READ)
+    SYS_FAIL(JLOG_ERR_ILLEGAL_WRITE);
+  if (!HAS_KEYS(ctx))
+    SYS_FAIL(JLOG_ERR_NOT_SUPPORTED);
+  if (count <= 0) return 0;
+  if (start->marker < 1)
+    SYS_FAIL(JLOG_ERR_ILLEGAL_LOGID);
+  hdr_size = HDR_SIZE(ctx);
+
+  __jlog_open_reader(ctx, start->log);
+  if (!ctx->data)
+    SYS_FAIL(JLOG_ERR_FILE_OPEN);
+  if (jlog_idx_details(ctx, start->log, &last, &closed) != 0)
+    goto finish;
+  if (start->marker + count - 1 > last)
+    SYS_FAIL(JLOG_ERR_ILLEGAL_LOGID);
+  if (__jlog_setup_reader(ctx, start->log, 0) != 0)
+    SYS_FAIL(ctx->last_error);
+  limit = read_method == JLOG_READ_METHOD_MMAP ? ctx->mmap_len : ctx->data_file_size;
+
+  offs = malloc(count * sizeof(*offs));
+  hits = malloc(count * sizeof(*hits));
+  if (!offs || !hits) {
+    ctx->last_error = JLOG_ERR_FILE_READ;
+    ctx->last_errno = ENOMEM;
+    goto finish;
+  }
+  if (!__jlog_index_offsets(ctx, ctx->index, ctx->data, offs, count, start->marker - 1))
+    SYS_FAIL(JLOG_ERR_IDX_READ);
+  if (__jlog_reserve_ext_headers(ctx, count) != 0) goto finish;
+  /* a sealed segment may carry key summaries for every block */
+  if (closed && __jlog_read_time_index(ctx, start->log, last, &summary) < 0)
+    summary = NULL;
+
+  /* headers only: decide what to return */
+  for (i = 0; i < count; i++) {
+    marker = start->marker + i;
+    if (summary && (i == 0 || (marker - 1) % interval == 0) &&
+        !__jlog_filter_summary(filter, summary[(marker - 1) / interval].keys)) {
+      /* on to the start of the next block */
+      i += interval - (marker - 1) % interval - 1;
+      continue;
+    }
+    if (offs[i] > limit - hdr_size)
+      SYS_FAIL(JLOG_ERR_IDX_CORRUPT);
+    if (read_method == JLOG_READ_METHOD_MMAP)
+      __jlog_unpack_header(ctx, &m[n], (u_int8_t *)ctx->mmap_base + offs[i],
+                           EXT_HEADER(ctx, n));
+    else if (!__jlog_pread_header(ctx, &m[n], offs[i], EXT_HEADER(ctx, n)))
+      SYS_FAIL(JLOG_ERR_FILE_READ);
+    if (m[n].header->reserved != ctx->meta->hdr_magic || FIXED_RECORD_BAD(ctx, &m[n]))
+      SYS_FAIL(JLOG_ERR_FILE_CORRUPT);
+    if (!__jlog_filter_key(filter, EXT_HEADER(ctx, n)->ext.key)) continue;
+    if (offs[i] + hdr_size +
+        (IS_COMPRESS_MAGIC(ctx) ? m[n].header->compressed_len : m[n].header->mlen) > limit)
+      SYS_FAIL(JLOG_ERR_IDX_CORRUPT);
+    if (ids) {
+      ids[n].log = start->log;
+      ids[n].marker = marker;
+    }
+    hits[n] = offs[i];
+    total += m[n].header->mlen;
+    n++;
+  }
+
+  /* then payloads, for the survivors only */
+  if ((IS_COMPRESS_MAGIC(ctx) || read_method != JLOG_READ_METHOD_MMAP) &&
+      ctx->mess_data_size < total) {
+    ctx->mess_data = realloc(ctx->mess_data, total + 1);
+    ctx->mess_data_size = total;
+  }
+  out = ctx->mess_data;
+  for (i = 0; i < n; i++) {
+    jlog_message *msg = &m[i];
+    char *payload = (char *)ctx->mmap_base + hits[i] + hdr_size;
+    msg->mess_len = msg->header->mlen;
+    if (!IS_COMPRESS_MAGIC(ctx)) {
+      if (read_method == JLOG_READ_METHOD_MMAP) {
+        msg->mess = payload;
+        continue;
+      }
+      if (!jlog_file_pread(ctx->data, out, msg->mess_len, hits[i] + hdr_size))
+        SYS_FAIL(JLOG_ERR_FILE_READ);
+    } else {
+      if (read_method != JLOG_READ_METHOD_MMAP) {
+        if (ctx->compressed_data_buffer_len < msg->header->compressed_len) {
+          ctx->compressed_data_buffer_len = msg->header->compressed_len * 2;
+          ctx->compressed_data_buffer = realloc(ctx->compressed_data_buffer,
+                                                ctx->compressed_data_buffer_len);
+        }
+        if (!jlog_file_pread(ctx->data, ctx->compressed_data_buffer,
+                             msg->header->compressed_len, hits[i] + hdr_size))
+          SYS_FAIL(JLOG_ERR_FILE_READ);
+        payload = ctx->compressed_data_buffer;
+      }
+      if (jlog_decompress(payload, msg->header->compressed_len, out, msg->mess_len) != 0)
+        SYS_FAIL(JLOG_ERR_FILE_CORRUPT);
+    }
+    msg->mess = out;
+    out += msg->mess_len;
+  }
+
+ finish:
+  free(summary);
+  free(offs);
+  free(hits);
+  if (ctx->last_error == JLOG_ERR_SUCCESS) return n;
+  return -1;
+}
+
+int jlog_ctx_read_interval(jlog_ctx *ctx, jlog_id *start, jlog_id *finish) {
+  jlog_id chkpt;
+  int count = 0;
+
+  ctx->last_error = JLOG_ERR_SUCCESS;
+  if(ctx->context_mode != JLOG_READ) {
+    ctx->last_error = JLOG_ERR_ILLEGAL_WRITE;
+    ctx->last_errno = EPERM;
+    return -1;
+  }
+
+  __jlog_restore_metastore(ctx, 0, 1);
+  if(HAS_RETENTION(ctx) && __jlog_take_eviction(ctx) != 0)
+    goto finish;
+  if(jlog_get_checkpoint(ctx, ctx->subscriber_name, &chkpt))
+    SYS_FAIL(JLOG_ERR_INVALID_SUBSCRIBER);
+  if(__jlog_find_first_log_after(ctx, &chkpt, start, finish) != 0)
+    goto finish; /* Leave whatever error was set in find_first_log_after */
+  if(start->log != chkpt.log) start->marker = 0;
+  else start->marker = chkpt.marker;
+  if(start->log != chkpt.log) {
+    /* We've advanced our checkpoint, let's not do this work again */
+    if(__jlog_set_checkpoint(ctx, ctx->subscriber_name, start) != 0)
+      SYS_FAIL(JLOG_ERR_CHECKPOINT);
+    /* and look again for a retention policy set since we opened */
+    if(__jlog_map_retention(ctx, 0) != 0)
+      goto finish;
+  }
+  /* Here 'start' is actually the checkpoint, so we must advance it one.
+     However, that may not be possible, if there are no messages, so first
+     make sure finish is bigger */
+  count = finish->marker - start->marker;
+  if(finish->marker > start->marker) start->marker++;
+
+  /* If the count is less than zero, the checkpoint is off the end
+   * of the file. When this happens, we need to set it to the end of
+   * the file */
+  if (count < 0) {
+    fprintf(stderr, "need to repair checkpoint for %s - start (%08x:%08x) > finish (%08x:%08x)\n", ctx->path, 
+        start->log, start->marker, finish->log, finish->marker);
+    if(__jlog_set_checkpoint(ctx, ctx->subscriber_name, finish) != 0) {
+      fprintf(stderr, "failed repairing checkpoint for %s\n", ctx->path);
+      SYS_FAIL(JLOG_ERR_CHECKPOINT);
+    }
+    if(jlog_get_checkpoint(ctx, ctx->subscriber_name, &chkpt)) {
+      /* Should never happen */
+      SYS_FAIL(JLOG_ERR_INVALID_SUBSCRIBER);
+    }
+    fprintf(stderr, "repaired checkpoint for %s: %08x:%08x\n", ctx->path, chkpt.log, chkpt.marker);
+    ctx->last_error = JLOG_ERR_SUCCESS;
+    count = 0;
+  }
+
+  /* We need to munmap it, so that we can remap it with more data if needed */
+  __jlog_teardown_reader(ctx);
+ finish:
+  if(ctx->last_error == JLOG_ERR_SUCCESS) return count;
+  return -1;
+}
+
+int jlog_ctx_read_interval_after(jlog_ctx *ctx, const jlog_id *after,
+                                 jlog_id *start, jlog_id *finish) {
+  jlog_id chkpt;
+  int count = 0;
+
+  ctx->last_error = JLOG_ERR_SUCCESS;
+  if(ctx->context_mode != JLOG_READ) {
+    ctx->last_error = JLOG_ERR_ILLEGAL_WRITE;
+    ctx->last_errno = EPERM;
+    return -1;
+  }
+
+  __jlog_restore_metastore(ctx, 0, 1);
+  memcpy(&chkpt, after, sizeof(chkpt));
+  if(__jlog_find_first_log_after(ctx, &chkpt, start, finish) != 0)
+    return -1;
+  if(start->log != after->log) start->marker = 0;
+  else start->marker = after->marker;
+  count = finish->marker - start->marker;
+  if(finish->marker > start->marker) start->marker++;
+  /* a position off the end of the segment simply has nothing to read */
+  if(count < 0) {
+    memcpy(start, finish, sizeof(*start));
+    count = 0;
+  }
+
+  __jlog_teardown_reader(ctx);
+  return count;
+}
+
+int jlog_ctx_first_log_id(jlog_ctx *ctx, jlog_id *id) {
+  DIR *d;
+  struct dirent *de;
+  ctx->last_error = JLOG_ERR_SUCCESS;
+  u_int32_t log;
+  int found = 0;
+
+  id->log = 0xffffffff;
+  id->marker = 0;
+  d = opendir(ctx->path);
+  if (!d) return -1;
+
+  while ((de = readdir(d))) {
+    int i;
+    char *cp = de->d_name;
+    if(strlen(cp) != 8) continue;
+    log = 0;
+    for(i=0;i<8;i++) {
+      log <<= 4;
+      if(cp[i] >= '0' && cp[i] <= '9') log |= (cp[i] - '0');
+      else if(cp[i] >= 'a' && cp[i] <= 'f') log |= (cp[i] - 'a' + 0xa);
+      else if(cp[i] >= 'A' && cp[i] <= 'F') log |= (cp[i] - 'A' + 0xa);
+      else break;
+    }
+    if(i != 8) continue;
+    found = 1;
+    if(log < id->log) id->log = log;
+  }
+  if(!found) id->log = 0;
+  closedir(d);
+  return 0;
+}
+
+int jlog_ctx_last_storage_log(jlog_ctx *ctx, uint32_t *logid) {
+  ctx->last_error = JLOG_ERR_SUCCESS;
+  if(ctx->context_mode != JLOG_READ) {
+    ctx->last_error = JLOG_ERR_ILLEGAL_WRITE;
+    ctx->last_errno = EPERM;
+    return -1;
+  }
+  if (__jlog_restore_metastore(ctx, 0, 1) != 0) return -1;
+  *logid = ctx->meta->storage_log;
+  return 0;
+}
+
+int jlog_ctx_last_log_id(jlog_ctx *ctx, jlog_id *id) {
+  ctx->last_error = JLOG_ERR_SUCCESS;
+  if(ctx->context_mode != JLOG_READ) {
+    ctx->last_error = JLOG_ERR_ILLEGAL_WRITE;
+    ctx->last_errno = EPERM;
+    return -1;
   }
+  if (__jlog_restore_metastore(ctx, 0, 1) != 0) return -1;
+  ___jlog_resync_index(ctx, ctx->meta->storage_log, id, NULL);
+  if(ctx->last_error == JLOG_ERR_SUCCESS) return 0;
   return -1;
 }
-int jlog_ctx_read_interval(jlog_ctx *ctx, jlog_id *start, jlog_id *finish) {
-  jlog_id chkpt;
-  int count = 0;
 
-  ctx->last_error = JLOG_ERR_SUCCESS;
-  if(ctx->context_mode != JLOG_READ) {
-    ctx->last_error = JLOG_ERR_ILLEGAL_WRITE;
-    ctx->last_errno = EPERM;
+int jlog_ctx_advance_id(jlog_ctx *ctx, jlog_id *cur, 
+                        jlog_id *start, jlog_id *finish)
+{
+  int rv;
+  if(memcmp(cur, finish, sizeof(jlog_id))) {
+    start->marker++;
+  } else {
+    if((rv = __jlog_find_first_log_after(ctx, cur, start, finish)) != 0) {
+      return rv;
+    }
+    if(cur->log != start->log) {
+      start->marker = 1;
+    }
+    else start->marker = cur->marker;
+  }
+  return 0;
+}
+
+#define TIME_BEFORE(sec, usec, tv) \
+  ((time_t)(sec) < (tv)->tv_sec || \
+   ((time_t)(sec) == (tv)->tv_sec && (suseconds_t)(usec) < (tv)->tv_usec))
+
+/* @return 1 and the first message's header, 0 if the segment is empty or
+ * gone, -1 on error */
+static int __jlog_segment_first_header(jlog_ctx *ctx, u_int32_t log,
+                                       jlog_message *hdr,
+                                       jlog_message_header_full *full) {
+  jlog_id last;
+
+  if (__jlog_resync_index(ctx, log, &last, NULL) != 0) {
+    if (ctx->last_error == JLOG_ERR_FILE_OPEN && ctx->last_errno == ENOENT) {
+      ctx->last_error = JLOG_ERR_SUCCESS;
+      return 0;
+    }
+    return -1;
+  }
+  if (last.marker == 0) return 0;
+  if (__jlog_read_header_at(ctx, 1, hdr, full) != 0) return -1;
+  return 1;
+}
+
+/* Like __jlog_segment_first_header, for the first segment from *log on
+ * (up to hi) that has a record, moving *log to it.  Segment numbers have
+ * gaps where compaction or a resync removed emptied segments, and a
+ * bisection must compare against a real record on either side of them.
+ * @return 1 found, 0 none up to hi, -1 error */
+static int __jlog_next_first_header(jlog_ctx *ctx, u_int32_t *log, u_int32_t hi,
+                                    jlog_message *hdr,
+                                    jlog_message_header_full *full) {
+  int rv;
+
+  for (;;) {
+    if ((rv = __jlog_segment_first_header(ctx, *log, hdr, full)) != 0) return rv;
+    if (*log >= hi) return 0;
+    (*log)++;
+  }
+}
+
+int jlog_ctx_seek_time(jlog_ctx *ctx, const struct timeval *when, jlog_id *id) {
+  struct _jlog_time_index_entry *entries = NULL;
+  jlog_message hdr;
+  jlog_id first, last;
+  jlog_file *tdx_lock;
+  u_int32_t lo, hi, mid, probe, seg = 0;
+  int closed, rv, n, found = 0;
+
+  ctx->last_error = JLOG_ERR_SUCCESS;
+  if(ctx->context_mode != JLOG_READ) {
+    ctx->last_error = JLOG_ERR_ILLEGAL_WRITE;
+    ctx->last_errno = EPERM;
+    return -1;
+  }
+  if (__jlog_restore_metastore(ctx, 0, 1) != 0) return -1;
+  if (jlog_ctx_first_log_id(ctx, &first) != 0)
+    SYS_FAIL(JLOG_ERR_NOTDIR);
+
+  /* find the last segment whose first message is before `when` */
+  lo = first.log;
+  hi = ctx->meta->storage_log;
+  while (lo <= hi) {
+    mid = lo + (hi - lo) / 2;
+    probe = mid;
+    if ((rv = __jlog_next_first_header(ctx, &probe, hi, &hdr, NULL)) < 0) goto finish;
+    if (rv > 0 && TIME_BEFORE(hdr.header->tv_sec, hdr.header->tv_usec, when)) {
+      /* [mid, probe) holds no records */
+      seg = probe;
+      found = 1;
+      lo = probe + 1;
+    } else {
+      if (mid == 0) break;
+      hi = mid - 1;
+    }
+  }
+  if (!found) {
+    /* everything we have is at or after `when` */
+    id->log = first.log;
+    id->marker = 1;
+    goto finish;
+  }
+
+  if (__jlog_resync_index(ctx, seg, &last, &closed) != 0) goto finish;
+  /* message 1 is before `when`; the answer is in [lo, hi] with hi meaning
+   * "just past the end of the segment" */
+  lo = 2;
+  hi = last.marker + 1;
+  /* a sealed segment of fixed records is written by nobody, so its lock
+   * is free to stand in for the index's */
+  tdx_lock = HAS_FIXED_RECORDS(ctx) ? ctx->data : ctx->index;
+  if (closed && jlog_file_lock(tdx_lock)) {
+    if ((n = __jlog_read_time_index(ctx, seg, last.marker, &entries)) < 0 &&
+        __jlog_write_time_index(ctx, seg, last.marker) == 0)
+      n = __jlog_read_time_index(ctx, seg, last.marker, &entries);
+    jlog_file_unlock(tdx_lock);
+    ctx->last_error = JLOG_ERR_SUCCESS;
+    if (n > 0) {
+      int l = 0, h = n - 1, m;
+      /* the last entry before `when`; entries[0] is message 1 */
+      while (l < h) {
+        m = l + (h - l + 1) / 2;
+        if (TIME_BEFORE(entries[m].tv_sec, entries[m].tv_usec, when)) l = m;
+        else h = m - 1;
+      }
+      lo = entries[l].marker + 1;
+      if (l + 1 < n) hi = entries[l + 1].marker;
+    }
+    free(entries);
+  }
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (__jlog_read_header_at(ctx, mid, &hdr, NULL) != 0) goto finish;
+    if (TIME_BEFORE(hdr.header->tv_sec, hdr.header->tv_usec, when)) lo = mid + 1;
+    else hi = mid;
+  }
+  id->log = seg;
+  id->marker = lo;
+  if (lo > last.marker && closed) {
+    /* the next record is in the next segment that has any */
+    probe = seg + 1;
+    if (probe <= ctx->meta->storage_log &&
+        __jlog_next_first_header(ctx, &probe, ctx->meta->storage_log, &hdr, NULL) < 0)
+      goto finish;
+    id->log = probe;
+    id->marker = 1;
+  }
+
+ finish:
+  if (ctx->last_error == JLOG_ERR_SUCCESS) return 0;
+  return -1;
+}
+
+int jlog_ctx_seek_seq(jlog_ctx *ctx, u_int64_t seq, jlog_id *id) {
+  jlog_message m;
+  jlog_message_header_full full;
+  jlog_id first, last;
+  u_int32_t lo, hi, mid, probe, seg = 0;
+  u_int64_t first_seq = 0;
+  int closed, rv, found = 0;
+
+  ctx->last_error = JLOG_ERR_SUCCESS;
+  if(ctx->context_mode != JLOG_READ) {
+    ctx->last_error = JLOG_ERR_ILLEGAL_WRITE;
+    ctx->last_errno = EPERM;
+    return -1;
+  }
+  if (__jlog_restore_metastore(ctx, 0, 1) != 0) return -1;
+  if (!HAS_SEQUENCE(ctx))
+    SYS_FAIL(JLOG_ERR_NOT_SUPPORTED);
+  if (jlog_ctx_first_log_id(ctx, &first) != 0)
+    SYS_FAIL(JLOG_ERR_NOTDIR);
+
+  /* find the last segment whose first record is at or before `seq` */
+  lo = first.log;
+  hi = ctx->meta->storage_log;
+  while (lo <= hi) {
+    mid = lo + (hi - lo) / 2;
+    probe = mid;
+    if ((rv = __jlog_next_first_header(ctx, &probe, hi, &m, &full)) < 0) goto finish;
+    if (rv > 0 && full.ext.seq <= seq) {
+      /* [mid, probe) holds no records */
+      seg = probe;
+      first_seq = full.ext.seq;
+      found = 1;
+      lo = probe + 1;
+    } else {
+      if (mid == 0) break;
+      hi = mid - 1;
+    }
+  }
+  if (!found) {
+    id->log = first.log;
+    id->marker = 1;
+    goto finish;
+  }
+
+  if (__jlog_resync_index(ctx, seg, &last, &closed) != 0) goto finish;
+  /* sequence numbers are dense within a segment (a write that fails after
+   * taking one leaves a hole), so address the record directly first */
+  if (seq - first_seq < last.marker) {
+    if (__jlog_read_header_at(ctx, seq - first_seq + 1, &m, &full) != 0) goto finish;
+    if (full.ext.seq == seq) {
+      id->log = seg;
+      id->marker = seq - first_seq + 1;
+      goto finish;
+    }
+  }
+  lo = 2;
+  hi = last.marker + 1;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (__jlog_read_header_at(ctx, mid, &m, &full) != 0) goto finish;
+    if (full.ext.seq < seq) lo = mid + 1;
+    else hi = mid;
+  }
+  id->log = seg;
+  id->marker = lo;
+  if (lo > last.marker && closed) {
+    /* the next record is in the next segment that has any */
+    probe = seg + 1;
+    if (probe <= ctx->meta->storage_log &&
+        __jlog_next_first_header(ctx, &probe, ctx->meta->storage_log, &m, NULL) < 0)
+      goto finish;
+    id->log = probe;
+    id->marker = 1;
+  }
+
+ finish:
+  if (ctx->last_error == JLOG_ERR_SUCCESS) return 0;
+  return -1;
+}
+
+u_int64_t jlog_message_seq(jlog_ctx *ctx, const jlog_message *m) {
+  /* reads of a jlog with sequence numbers leave the header in front of
+   * its extension, never in m->aligned_header */
+  if (!HAS_SEQUENCE(ctx) || m->header == NULL || m->header == &m->aligned_header)
+    return 0;
+  return ((const jlog_message_header_full *)m->header)->ext.seq;
+}
+
+const char *jlog_message_key(jlog_ctx *ctx, const jlog_message *m) {
+  if (!HAS_KEYS(ctx) || m->header == NULL || m->header == &m->aligned_header)
+    return NULL;
+  return ((const jlog_message_header_full *)m->header)->ext.key;
+}
+
+int jlog_ctx_set_subscriber_checkpoint_time(jlog_ctx *ctx, const char *s,
+                                            const struct timeval *when) {
+  jlog_id id;
+
+  if (jlog_ctx_seek_time(ctx, when, &id) != 0) return -1;
+  /* a checkpoint names the last message consumed */
+  id.marker--;
+  if (s == NULL) s = ctx->subscriber_name;
+  if (jlog_ctx_set_subscriber_checkpoint(ctx, s, &id) != 0) {
+    if (ctx->last_error == JLOG_ERR_SUCCESS) {
+      ctx->last_error = JLOG_ERR_CHECKPOINT;
+      ctx->last_errno = 0;
+    }
+    return -1;
+  }
+  return 0;
+}
+
+#define GROUP_SLOT_OFF(i) \
+  ((off_t)(sizeof(struct _jlog_group_header) + (i) * sizeof(struct _jlog_group_slot)))
+
+/* Opens (creating if needed) the reader's lease table and takes the
+ * table lock: the jlog_file mutex for threads, an fcntl lock over the
+ * header for other processes.  `slots` is filled from disk. */
+static int __jlog_group_lock(jlog_ctx *ctx, struct _jlog_group_slot *slots) {
+  struct _jlog_group_header hdr;
+  char name[MAXPATHLEN];
+
+  ctx->last_error = JLOG_ERR_SUCCESS;
+  if (ctx->context_mode != JLOG_READ) {
+    ctx->last_error = JLOG_ERR_ILLEGAL_CHECKPOINT;
+    ctx->last_errno = EPERM;
+    return -1;
+  }
+  if (!ctx->group) {
+    compute_subscriber_filename(ctx, "gl", ctx->subscriber_name, name);
+    /* slot ownership is always by fcntl, the mutex covers the threads */
+    ctx->group = jlog_file_open(name, O_CREAT, ctx->file_mode, 0);
+    if (!ctx->group) {
+      ctx->last_error = JLOG_ERR_FILE_OPEN;
+      ctx->last_errno = errno;
+      return -1;
+    }
+  }
+  if (!jlog_file_lock(ctx->group)) {
+    ctx->last_error = JLOG_ERR_LOCK;
+    ctx->last_errno = errno;
+    return -1;
+  }
+  if (!jlog_file_lock_range(ctx->group, 0, sizeof(hdr), 1)) {
+    ctx->last_errno = errno;
+    jlog_file_unlock(ctx->group);
+    ctx->last_error = JLOG_ERR_LOCK;
+    return -1;
+  }
+  if (jlog_file_size(ctx->group) < GROUP_SLOT_OFF(GROUP_LEASE_SLOTS)) {
+    hdr.magic = GROUP_LEASE_MAGIC;
+    hdr.nslots = GROUP_LEASE_SLOTS;
+    memset(slots, 0, GROUP_LEASE_SLOTS * sizeof(*slots));
+    if (!jlog_file_pwrite(ctx->group, slots, GROUP_LEASE_SLOTS * sizeof(*slots),
+                          GROUP_SLOT_OFF(0)) ||
+        !jlog_file_pwrite(ctx->group, &hdr, sizeof(hdr), 0))
+      SYS_FAIL(JLOG_ERR_FILE_WRITE);
+  }
+  if (!jlog_file_pread(ctx->group, &hdr, sizeof(hdr), 0) ||
+      !jlog_file_pread(ctx->group, slots, GROUP_LEASE_SLOTS * sizeof(*slots),
+                       GROUP_SLOT_OFF(0)))
+    SYS_FAIL(JLOG_ERR_FILE_READ);
+  if (hdr.magic != GROUP_LEASE_MAGIC || hdr.nslots != GROUP_LEASE_SLOTS)
+    SYS_FAIL(JLOG_ERR_FILE_CORRUPT);
+  return 0;
+
+ finish:
+  jlog_file_unlock_range(ctx->group, 0, sizeof(hdr));
+  jlog_file_unlock(ctx->group);
+  return -1;
+}
+
+static void __jlog_group_unlock(jlog_ctx *ctx) {
+  jlog_file_unlock_range(ctx->group, 0, sizeof(struct _jlog_group_header));
+  jlog_file_unlock(ctx->group);
+}
+
+static int __jlog_group_put_slot(jlog_ctx *ctx, struct _jlog_group_slot *slots, u_int32_t i) {
+  if (!jlog_file_pwrite(ctx->group, &slots[i], sizeof(slots[i]), GROUP_SLOT_OFF(i))) {
+    ctx->last_error = JLOG_ERR_FILE_WRITE;
+    ctx->last_errno = errno;
+    return -1;
+  }
+  return 0;
+}
+
+/* a lease nobody is working on: given back, or its process is gone */
+static int __jlog_group_orphaned(jlog_ctx *ctx, struct _jlog_group_slot *slot, u_int32_t i) {
+  if (slot->state != JLOG_LEASE_HELD) return 0;
+  if (slot->pid == 0) return 1;
+  if (slot->pid == (u_int32_t)getpid()) return 0;
+  return jlog_file_range_locked(ctx->group, GROUP_SLOT_OFF(i), sizeof(*slot)) == 0;
+}
+
+int jlog_ctx_group_lease(jlog_ctx *ctx, int max, jlog_id *start, jlog_id *finish) {
+  struct _jlog_group_slot slots[GROUP_LEASE_SLOTS];
+  jlog_id chkpt, frontier;
+  u_int32_t i;
+  int count = 0;
+
+  if (ctx->group_leased || max < 1) {
+    ctx->last_error = JLOG_ERR_ILLEGAL_CHECKPOINT;
+    ctx->last_errno = max < 1 ? EINVAL : EBUSY;
+    return -1;
+  }
+  if (__jlog_group_lock(ctx, slots) != 0) return -1;
+  if (jlog_get_checkpoint(ctx, ctx->subscriber_name, &chkpt) != 0)
+    SYS_FAIL(JLOG_ERR_INVALID_SUBSCRIBER);
+
+  /* anything at or below the group checkpoint is history */
+  for (i = 0; i < GROUP_LEASE_SLOTS; i++) {
+    if (slots[i].state == JLOG_LEASE_FREE ||
+        JLOG_ID_BEFORE(&chkpt, &slots[i].finish)) continue;
+    memset(&slots[i], 0, sizeof(slots[i]));
+    if (__jlog_group_put_slot(ctx, slots, i) != 0) goto finish;
+  }
+
+  /* work abandoned by a dead or departed worker goes out first */
+  for (i = 0; i < GROUP_LEASE_SLOTS; i++) {
+    if (!__jlog_group_orphaned(ctx, &slots[i], i)) continue;
+    if (!jlog_file_lock_range(ctx->group, GROUP_SLOT_OFF(i), sizeof(slots[i]), 0))
+      continue;
+    slots[i].pid = getpid();
+    if (__jlog_group_put_slot(ctx, slots, i) != 0) goto finish;
+    goto leased;
+  }
+
+  /* otherwise carve the next range off past every outstanding lease */
+  frontier = chkpt;
+  for (i = 0; i < GROUP_LEASE_SLOTS; i++)
+    if (slots[i].state != JLOG_LEASE_FREE && JLOG_ID_BEFORE(&frontier, &slots[i].finish))
+      frontier = slots[i].finish;
+  for (i = 0; i < GROUP_LEASE_SLOTS; i++)
+    if (slots[i].state == JLOG_LEASE_FREE) break;
+  /* every slot is taken: nothing to hand out until the low end commits */
+  if (i == GROUP_LEASE_SLOTS) goto finish;
+  count = jlog_ctx_read_interval_after(ctx, &frontier, start, finish);
+  if (count <= 0) goto finish;
+  if (count > max) {
+    *finish = *start;
+    finish->marker += max - 1;
+  }
+  if (!jlog_file_lock_range(ctx->group, GROUP_SLOT_OFF(i), sizeof(slots[i]), 0))
+    SYS_FAIL(JLOG_ERR_LOCK);
+  slots[i].start = *start;
+  slots[i].finish = *finish;
+  slots[i].state = JLOG_LEASE_HELD;
+  slots[i].pid = getpid();
+  if (__jlog_group_put_slot(ctx, slots, i) != 0) {
+    jlog_file_unlock_range(ctx->group, GROUP_SLOT_OFF(i), sizeof(slots[i]));
+    goto finish;
+  }
+
+ leased:
+  ctx->group_leased = 1;
+  ctx->group_slot = i;
+  *start = slots[i].start;
+  *finish = slots[i].finish;
+  count = finish->marker - start->marker + 1;
+
+ finish:
+  __jlog_group_unlock(ctx);
+  if (ctx->last_error == JLOG_ERR_SUCCESS) return count;
+  return -1;
+}
+
+static int __jlog_group_settle(jlog_ctx *ctx, jlog_lease_state state) {
+  struct _jlog_group_slot slots[GROUP_LEASE_SLOTS];
+  jlog_id chkpt, advance, *low = NULL;
+  u_int32_t i, mine;
+
+  if (!ctx->group_leased) {
+    ctx->last_error = JLOG_ERR_ILLEGAL_CHECKPOINT;
+    ctx->last_errno = ENOENT;
+    return -1;
+  }
+  if (__jlog_group_lock(ctx, slots) != 0) return -1;
+  mine = ctx->group_slot;
+  slots[mine].state = state;
+  slots[mine].pid = 0;
+  if (__jlog_group_put_slot(ctx, slots, mine) != 0) goto finish;
+  ctx->group_leased = 0;
+  jlog_file_unlock_range(ctx->group, GROUP_SLOT_OFF(mine), sizeof(slots[mine]));
+  if (state != JLOG_LEASE_DONE) goto finish;
+
+  /* The leases tile everything from the checkpoint up, so the group
+   * has fully consumed through the last done range that starts below
+   * the earliest lease still outstanding. */
+  if (jlog_get_checkpoint(ctx, ctx->subscriber_name, &chkpt) != 0)
+    SYS_FAIL(JLOG_ERR_INVALID_SUBSCRIBER);
+  for (i = 0; i < GROUP_LEASE_SLOTS; i++)
+    if (slots[i].state == JLOG_LEASE_HELD &&
+        (!low || JLOG_ID_BEFORE(&slots[i].start, low)))
+      low = &slots[i].start;
+  advance = chkpt;
+  for (i = 0; i < GROUP_LEASE_SLOTS; i++)
+    if (slots[i].state == JLOG_LEASE_DONE &&
+        (!low || JLOG_ID_BEFORE(&slots[i].start, low)) &&
+        JLOG_ID_BEFORE(&advance, &slots[i].finish))
+      advance = slots[i].finish;
+  if (!JLOG_ID_BEFORE(&chkpt, &advance)) goto finish;
+  if (jlog_ctx_read_checkpoint(ctx, &advance) != 0) goto finish;
+  for (i = 0; i < GROUP_LEASE_SLOTS; i++) {
+    if (slots[i].state != JLOG_LEASE_DONE ||
+        JLOG_ID_BEFORE(&advance, &slots[i].finish)) continue;
+    memset(&slots[i], 0, sizeof(slots[i]));
+    if (__jlog_group_put_slot(ctx, slots, i) != 0) goto finish;
+  }
+
+ finish:
+  __jlog_group_unlock(ctx);
+  if (ctx->last_error == JLOG_ERR_SUCCESS) return 0;
+  return -1;
+}
+
+int jlog_ctx_group_commit(jlog_ctx *ctx) {
+  return __jlog_group_settle(ctx, JLOG_LEASE_DONE);
+}
+
+int jlog_ctx_group_release(jlog_ctx *ctx) {
+  return __jlog_group_settle(ctx, JLOG_LEASE_HELD);
+}
+
+static int is_datafile(const char *f, u_int32_t *logid) {
+  int i;
+  u_int32_t l = 0;
+  for(i=0; i<8; i++) {
+    if((f[i] >= '0' && f[i] <= '9') ||
+       (f[i] >= 'a' && f[i] <= 'f')) {
+      l <<= 4;
+      l |= (f[i] < 'a') ? (f[i] - '0') : (f[i] - 'a' + 10);
+    }
+    else
+      return 0;
+  }
+  if(f[i] != '\0') return 0;
+  if(logid) *logid = l;
+  return 1;
+}
+
+int jlog_clean(const char *file) {
+  int rv = -1;
+  u_int32_t earliest = 0;
+  jlog_ctx *log;
+  DIR *dir;
+  struct dirent *de;
+
+  log = jlog_new(file);
+  jlog_ctx_open_writer(log);
+  dir = opendir(file);
+  if(!dir) goto out;
+
+  earliest = 0;
+  if(jlog_pending_readers(log, 0, &earliest) < 0) goto out;
+
+  rv = 0;
+  while((de = readdir(dir)) != NULL) {
+    u_int32_t logid;
+    if(is_datafile(de->d_name, &logid) && logid < earliest) {
+      char fullfile[MAXPATHLEN];
+      char fullidx[MAXPATHLEN];
+      char fulltdx[MAXPATHLEN];
+
+      memset(fullfile, 0, sizeof(fullfile));
+      memset(fullidx, 0, sizeof(fullidx));
+      memset(fulltdx, 0, sizeof(fulltdx));
+      snprintf(fullfile, sizeof(fullfile), "%s/%s", file, de->d_name);
+      snprintf(fullidx, sizeof(fullidx), "%s/%s" INDEX_EXT, file, de->d_name);
+      snprintf(fulltdx, sizeof(fulltdx), "%s/%s" TIME_INDEX_EXT, file, de->d_name);
+      (void)unlink(fullfile);
+      (void)unlink(fullidx); /* this may not exist; don't care */
+      (void)unlink(fulltdx); /* nor this */
+      rv++;
+    }
+  }
+  closedir(dir);
+ out:
+  jlog_ctx_close(log);
+  return rv;
+}
+
+/* ------------------ jlog_ctx_export() and friends ----------- */
+
+/* The byte range [*from, *to) holding records first..end of the segment
+ * whose reader and index are open.  Records are contiguous on disk. */
+static int __jlog_record_range(jlog_ctx *ctx, u_int32_t first, u_int32_t end,
+                               u_int64_t *from, u_int64_t *to) {
+  jlog_message m;
+
+  if (!__jlog_index_offsets(ctx, ctx->index, ctx->data, from, 1, first - 1) ||
+      !__jlog_index_offsets(ctx, ctx->index, ctx->data, to, 1, end - 1))
+    SYS_FAIL(JLOG_ERR_IDX_READ);
+  if (!__jlog_pread_header(ctx, &m, *to, NULL))
+    SYS_FAIL(JLOG_ERR_FILE_READ);
+  if (m.header->reserved != ctx->meta->hdr_magic)
+    SYS_FAIL(JLOG_ERR_FILE_CORRUPT);
+  *to += HDR_SIZE(ctx) +
+         (IS_COMPRESS_MAGIC(ctx) ? m.header->compressed_len : m.header->mlen);
+  return 0;
+ finish:
+  return -1;
+}
+
+/* Check the headers of the whole records at the front of buf, noting
+ * their lengths; *used is where the first partial record, or the header
+ * of a following export, starts.  No payload may exceed max_len. */
+static int __jlog_scan_records(jlog_ctx *ctx, const char *buf, size_t have,
+                               u_int32_t max_len, size_t *lens, size_t *used,
+                               u_int64_t *max_seq) {
+  jlog_message m;
+  jlog_message_header_full full;
+  u_int32_t magic;
+  size_t off, len;
+  int n = 0;
+
+  *max_seq = 0;
+  for (off = 0; off + HDR_SIZE(ctx) <= have; off += len) {
+    memcpy(&magic, buf + off, sizeof(magic));
+    if (magic == EXPORT_MAGIC) break;
+    __jlog_unpack_header(ctx, &m, buf + off, &full);
+    if (m.header->reserved != ctx->meta->hdr_magic || m.header->mlen > max_len ||
+        (IS_COMPRESS_MAGIC(ctx) && m.header->compressed_len > max_len) ||
+        (HAS_FIXED_RECORDS(ctx) && m.header->mlen != ctx->meta_ext->record_size)) {
+      ctx->last_error = JLOG_ERR_FILE_CORRUPT;
+      ctx->last_errno = EINVAL;
+      return -1;
+    }
+    len = HDR_SIZE(ctx) +
+          (IS_COMPRESS_MAGIC(ctx) ? m.header->compressed_len : m.header->mlen);
+    if (off + len > have) break;
+    if (lens) lens[n] = len;
+    n++;
+    if (HAS_SEQUENCE(ctx) && full.ext.seq > *max_seq) *max_seq = full.ext.seq;
+  }
+  *used = off;
+  return n;
+}
+
+/* 1 when all of len moved, 0 on end of file before any did, -1 otherwise */
+static int __jlog_fd_read(int fd, void *buf, size_t len) {
+  size_t done = 0;
+  ssize_t rv;
+
+  while (done < len) {
+    rv = read(fd, (char *)buf + done, len - done);
+    if (rv == -1 && errno == EINTR) continue;
+    if (rv == 0 && done == 0) return 0;
+    if (rv == 0) errno = ECONNRESET;
+    if (rv <= 0) return -1;
+    done += rv;
+  }
+  return 1;
+}
+
+static int __jlog_fd_write(int fd, const void *buf, size_t len) {
+  size_t done = 0;
+  ssize_t rv;
+
+  while (done < len) {
+    rv = write(fd, (const char *)buf + done, len - done);
+    if (rv == -1 && errno == EINTR) continue;
+    if (rv <= 0) return -1;
+    done += rv;
+  }
+  return 1;
+}
+
+int jlog_ctx_export(jlog_ctx *ctx, const jlog_id *start, const jlog_id *finish,
+                    int fd) {
+  struct _jlog_export_header desc;
+  jlog_id last;
+  u_int64_t from, to;
+  u_int32_t log, first, end;
+  int closed, total = 0;
+
+  ctx->last_error = JLOG_ERR_SUCCESS;
+  if (ctx->context_mode != JLOG_READ) {
+    ctx->last_error = JLOG_ERR_ILLEGAL_WRITE;
+    ctx->last_errno = EPERM;
+    return -1;
+  }
+  if (JLOG_ID_BEFORE(finish, start)) {
+    ctx->last_error = JLOG_ERR_ILLEGAL_LOGID;
+    ctx->last_errno = EINVAL;
+    return -1;
+  }
+  desc.magic = EXPORT_MAGIC;
+  desc.hdr_magic = ctx->meta->hdr_magic;
+  desc.features = ctx->meta_ext->features & JLOG_FEATURES_HEADER;
+  desc.hdr_size = HDR_SIZE(ctx);
+  if (__jlog_fd_write(fd, &desc, sizeof(desc)) != 1)
+    SYS_FAIL(JLOG_ERR_FILE_WRITE);
+  for (log = start->log; log <= finish->log; log++) {
+    if (__jlog_resync_index(ctx, log, &last, &closed) != 0) {
+      /* a segment removed by clean or compaction has nothing to send */
+      if (ctx->last_error == JLOG_ERR_FILE_OPEN && log != finish->log) {
+        ctx->last_error = JLOG_ERR_SUCCESS;
+        continue;
+      }
+      return -1;
+    }
+    first = log == start->log && start->marker ? start->marker : 1;
+    end = log == finish->log ? finish->marker : last.marker;
+    if (end > last.marker) {
+      ctx->last_error = JLOG_ERR_ILLEGAL_LOGID;
+      ctx->last_errno = EINVAL;
+      return -1;
+    }
+    if (first > end) continue;
+    if (__jlog_record_range(ctx, first, end, &from, &to) != 0)
+      return -1;
+    if (!jlog_file_send(ctx->data, fd, from, to - from))
+      SYS_FAIL(JLOG_ERR_FILE_WRITE);
+    total += end - first + 1;
+  }
+  return total;
+ finish:
+  return -1;
+}
+
+/* Append whole records, already in on-disk form, splitting them across
+ * segments exactly as the writer would have. */
+static int __jlog_append_raw(jlog_ctx *ctx, const char *buf, const size_t *lens,
+                             int count, u_int64_t max_seq) {
+  off_t current_offset;
+  size_t len;
+  int i = 0, n;
+
+  pthread_mutex_lock(&ctx->write_lock);
+  if (_jlog_ctx_flush_pre_commit_buffer_no_lock(ctx) != 0) {
+    pthread_mutex_unlock(&ctx->write_lock);
+    return -1;
+  }
+  while (i < count) {
+    __jlog_open_writer(ctx);
+    if (!ctx->data) {
+      ctx->last_error = JLOG_ERR_FILE_OPEN;
+      ctx->last_errno = errno;
+      break;
+    }
+    if (!jlog_file_lock(ctx->data)) {
+      ctx->last_error = JLOG_ERR_LOCK;
+      ctx->last_errno = errno;
+      break;
+    }
+    if ((current_offset = jlog_file_size(ctx->data)) == -1) {
+      jlog_file_unlock(ctx->data);
+      SYS_FAIL(JLOG_ERR_FILE_SEEK);
+    }
+    if (__jlog_fixed_whole(ctx, &current_offset) != 0) {
+      jlog_file_unlock(ctx->data);
+      SYS_FAIL(JLOG_ERR_FILE_WRITE);
+    }
+    if (ctx->meta->unit_limit > current_offset) {
+      for (n = i, len = 0; n < count && current_offset + len < ctx->meta->unit_limit; n++)
+        len += lens[n];
+      if (!jlog_file_pwrite(ctx->data, buf, len, current_offset)) {
+        jlog_file_unlock(ctx->data);
+        SYS_FAIL(JLOG_ERR_FILE_WRITE);
+      }
+      /* imported records keep their sequence numbers */
+      if (HAS_SEQUENCE(ctx) && max_seq > ctx->meta_ext->last_seq)
+        ctx->meta_ext->last_seq = max_seq;
+      buf += len;
+      current_offset += len;
+      i = n;
+    }
+    jlog_file_unlock(ctx->data);
+    if (ctx->meta->unit_limit <= current_offset) {
+      __jlog_close_writer(ctx);
+      __jlog_metastore_atomic_increment(ctx);
+    }
+  }
+ finish:
+  pthread_mutex_unlock(&ctx->write_lock);
+  if (ctx->last_error == JLOG_ERR_SUCCESS) return 0;
+  return -1;
+}
+
+/* Check the header leading an export against our own record layout. */
+static int __jlog_import_check(jlog_ctx *ctx, const char *buf) {
+  struct _jlog_export_header desc;
+
+  memcpy(&desc, buf, sizeof(desc));
+  if (desc.hdr_magic != ctx->meta->hdr_magic ||
+      desc.features != (ctx->meta_ext->features & JLOG_FEATURES_HEADER) ||
+      desc.hdr_size != HDR_SIZE(ctx)) {
+    ctx->last_error = JLOG_ERR_FILE_CORRUPT;
+    ctx->last_errno = EINVAL;
+    return -1;
+  }
+  return 0;
+}
+
+int jlog_ctx_import(jlog_ctx *ctx, int fd) {
+  size_t cap = 1024 * 1024, have = 0, off, *lens = NULL;
+  char *buf = NULL;
+  u_int64_t max_seq;
+  u_int32_t magic;
+  ssize_t rv;
+  int nlens, total = 0, eof = 0, described = 0;
+
+  ctx->last_error = JLOG_ERR_SUCCESS;
+  if (ctx->context_mode != JLOG_APPEND) {
+    ctx->last_error = JLOG_ERR_ILLEGAL_WRITE;
+    ctx->last_errno = EPERM;
+    return -1;
+  }
+  buf = malloc(cap);
+  lens = malloc((cap / HDR_SIZE(ctx) + 1) * sizeof(*lens));
+  if (!buf || !lens) {
+    ctx->last_error = JLOG_ERR_FILE_READ;
+    ctx->last_errno = ENOMEM;
+    goto finish;
+  }
+  while (!eof) {
+    rv = read(fd, buf + have, cap - have);
+    if (rv == -1 && errno == EINTR) continue;
+    if (rv == -1) SYS_FAIL(JLOG_ERR_FILE_READ);
+    if (rv == 0) eof = 1;
+    have += rv;
+
+    for (;;) {
+      /* each export opens with the layout of its records */
+      if (have < sizeof(magic)) break;
+      memcpy(&magic, buf, sizeof(magic));
+      if (magic == EXPORT_MAGIC) {
+        if (have < sizeof(struct _jlog_export_header)) break;
+        if (__jlog_import_check(ctx, buf) != 0) goto finish;
+        described = 1;
+        off = sizeof(struct _jlog_export_header);
+      }
+      else if (!described) {
+        ctx->last_error = JLOG_ERR_FILE_CORRUPT;
+        ctx->last_errno = EINVAL;
+        goto finish;
+      }
+      else {
+        /* check the header of every whole record we hold, then append
+         * them; no record can be longer than a segment */
+        if ((nlens = __jlog_scan_records(ctx, buf, have, ctx->meta->unit_limit,
+                                         lens, &off, &max_seq)) < 0)
+          goto finish;
+        if (nlens == 0) break;
+        if (__jlog_append_raw(ctx, buf, lens, nlens, max_seq) != 0) goto finish;
+        total += nlens;
+      }
+      memmove(buf, buf + off, have - off);
+      have -= off;
+    }
+
+    if (have == cap) {
+      /* one record bigger than the whole buffer */
+      char *nbuf = realloc(buf, cap * 2);
+      size_t *nlen;
+      if (nbuf) buf = nbuf;
+      nlen = realloc(lens, (cap * 2 / HDR_SIZE(ctx) + 1) * sizeof(*lens));
+      if (nlen) lens = nlen;
+      if (!nbuf || !nlen) {
+        ctx->last_error = JLOG_ERR_FILE_READ;
+        ctx->last_errno = ENOMEM;
+        goto finish;
+      }
+      cap *= 2;
+    }
+  }
+  if (have) {
+    /* the stream ended part way through a record */
+    ctx->last_error = JLOG_ERR_FILE_CORRUPT;
+    ctx->last_errno = EINVAL;
+  }
+ finish:
+  free(buf);
+  free(lens);
+  if (ctx->last_error == JLOG_ERR_SUCCESS) return total;
+  return -1;
+}
+
+/* ------------------ jlog_ctx_ship() and friends ----------- */
+
+int jlog_ctx_ship(jlog_ctx *ctx, int fd, int hold) {
+  struct _jlog_replica_frame frame;
+  struct _jlog_replica_ack ack;
+  jlog_id begin, end, pending[REPLICA_WINDOW];
+  u_int64_t from, to;
+  int n, rv, head = 0, outstanding = 0, total = 0;
+
+  ctx->last_error = JLOG_ERR_SUCCESS;
+  if (ctx->context_mode != JLOG_READ) {
+    ctx->last_error = JLOG_ERR_ILLEGAL_WRITE;
+    ctx->last_errno = EPERM;
+    return -1;
+  }
+  for (;;) {
+    if ((n = jlog_ctx_read_interval(ctx, &begin, &end)) < 0)
+      return -1;
+    if (n == 0 && outstanding == 0) break;
+    if (n > 0) {
+      if (__jlog_record_range(ctx, begin.marker, end.marker, &from, &to) != 0)
+        return -1;
+      frame.magic = REPLICA_MAGIC;
+      frame.log = begin.log;
+      frame.first = begin.marker;
+      frame.last = end.marker;
+      frame.offset = from;
+      frame.bytes = to - from;
+      if (__jlog_fd_write(fd, &frame, sizeof(frame)) != 1 ||
+          !jlog_file_send(ctx->data, fd, from, to - from))
+        SYS_FAIL(JLOG_ERR_FILE_WRITE);
+      pending[(head + outstanding++) % REPLICA_WINDOW] = end;
+      total += n;
+      /* without a hold our position moves as soon as the bytes are out,
+       * so several frames can be in flight */
+      if (!hold && jlog_ctx_read_checkpoint(ctx, &end) != 0)
+        return -1;
+    }
+    if (n == 0 || hold || outstanding == REPLICA_WINDOW) {
+      if ((rv = __jlog_fd_read(fd, &ack, sizeof(ack))) != 1) {
+        if (rv == 0) errno = ECONNRESET;
+        SYS_FAIL(JLOG_ERR_FILE_READ);
+      }
+      if (ack.magic != REPLICA_MAGIC || ack.status != 0) {
+        ctx->last_error = ack.magic == REPLICA_MAGIC ? ack.status : JLOG_ERR_FILE_CORRUPT;
+        ctx->last_errno = EIO;
+        return -1;
+      }
+      if (ack.log != pending[head].log || ack.marker != pending[head].marker) {
+        ctx->last_error = JLOG_ERR_ILLEGAL_LOGID;
+        ctx->last_errno = EIO;
+        return -1;
+      }
+      if (hold && jlog_ctx_read_checkpoint(ctx, &pending[head]) != 0)
+        return -1;
+      head = (head + 1) % REPLICA_WINDOW;
+      outstanding--;
+    }
+  }
+  return total;
+ finish:
+  return -1;
+}
+
+/* Lay a leader's bytes down at the same offset of the same segment,
+ * moving the writer forward to that segment first if need be. */
+static int __jlog_place_records(jlog_ctx *ctx, u_int32_t log, u_int64_t offset,
+                                const char *buf, size_t len, u_int64_t max_seq) {
+  char file[MAXPATHLEN];
+  jlog_file *f = NULL;
+  off_t size;
+
+  pthread_mutex_lock(&ctx->write_lock);
+  if (_jlog_ctx_flush_pre_commit_buffer_no_lock(ctx) != 0) {
+    pthread_mutex_unlock(&ctx->write_lock);
+    return -1;
+  }
+  ctx->last_error = JLOG_ERR_SUCCESS;
+  while (ctx->meta->storage_log < log) {
+    __jlog_open_writer(ctx);
+    if (!ctx->data)
+      SYS_FAIL(JLOG_ERR_FILE_OPEN);
+    __jlog_close_writer(ctx);
+    if (__jlog_metastore_atomic_increment(ctx) != 0)
+      goto finish;
+  }
+  STRSETDATAFILE(ctx, file, log);
+  if ((f = jlog_file_open(file, O_CREAT, ctx->file_mode, ctx->multi_process)) == NULL)
+    SYS_FAIL(JLOG_ERR_FILE_OPEN);
+  if (!jlog_file_lock(f))
+    SYS_FAIL(JLOG_ERR_LOCK);
+  if ((size = jlog_file_size(f)) == -1) {
+    jlog_file_unlock(f);
+    SYS_FAIL(JLOG_ERR_FILE_SEEK);
+  }
+  if ((u_int64_t)size < offset) {
+    /* we have missed bytes the leader thinks we hold */
+    jlog_file_unlock(f);
+    ctx->last_error = JLOG_ERR_ILLEGAL_LOGID;
+    ctx->last_errno = EINVAL;
+    goto finish;
+  }
+  /* a resent frame overwrites bytes we have with the same bytes */
+  if (!jlog_file_pwrite(f, buf, len, offset) || !jlog_file_sync(f)) {
+    jlog_file_unlock(f);
+    SYS_FAIL(JLOG_ERR_FILE_WRITE);
+  }
+  if (HAS_SEQUENCE(ctx) && max_seq > ctx->meta_ext->last_seq)
+    ctx->meta_ext->last_seq = max_seq;
+  jlog_file_unlock(f);
+ finish:
+  if (f) jlog_file_close(f);
+  pthread_mutex_unlock(&ctx->write_lock);
+  if (ctx->last_error == JLOG_ERR_SUCCESS) return 0;
+  return -1;
+}
+
+int jlog_ctx_follow(jlog_ctx *ctx, int fd) {
+  struct _jlog_replica_frame frame;
+  struct _jlog_replica_ack ack;
+  char *buf = NULL;
+  size_t cap = 0, used;
+  u_int64_t max_seq;
+  int n, rv, in_frame = 0, total = 0;
+
+  ctx->last_error = JLOG_ERR_SUCCESS;
+  if (ctx->context_mode != JLOG_APPEND) {
+    ctx->last_error = JLOG_ERR_ILLEGAL_WRITE;
+    ctx->last_errno = EPERM;
+    return -1;
+  }
+  ack.magic = REPLICA_MAGIC;
+  for (;;) {
+    in_frame = 0;
+    if ((rv = __jlog_fd_read(fd, &frame, sizeof(frame))) == 0) break;
+    if (rv < 0)
+      SYS_FAIL(JLOG_ERR_FILE_READ);
+    in_frame = 1;
+    if (frame.magic != REPLICA_MAGIC || frame.first == 0 || frame.last < frame.first) {
+      ctx->last_error = JLOG_ERR_FILE_CORRUPT;
+      ctx->last_errno = EINVAL;
+      goto finish;
+    }
+    if (frame.bytes > cap) {
+      char *nbuf = realloc(buf, frame.bytes);
+      if (!nbuf) {
+        ctx->last_error = JLOG_ERR_FILE_READ;
+        ctx->last_errno = ENOMEM;
+        goto finish;
+      }
+      buf = nbuf;
+      cap = frame.bytes;
+    }
+    if (__jlog_fd_read(fd, buf, frame.bytes) != 1)
+      SYS_FAIL(JLOG_ERR_FILE_READ);
+    if ((n = __jlog_scan_records(ctx, buf, frame.bytes, UINT32_MAX, NULL, &used,
+                                 &max_seq)) < 0)
+      goto finish;
+    if (used != frame.bytes || n != (int)(frame.last - frame.first + 1)) {
+      ctx->last_error = JLOG_ERR_FILE_CORRUPT;
+      ctx->last_errno = EINVAL;
+      goto finish;
+    }
+    if (__jlog_place_records(ctx, frame.log, frame.offset, buf, frame.bytes, max_seq) != 0)
+      goto finish;
+    ack.log = frame.log;
+    ack.marker = frame.last;
+    ack.status = 0;
+    if (__jlog_fd_write(fd, &ack, sizeof(ack)) != 1)
+      SYS_FAIL(JLOG_ERR_FILE_WRITE);
+    total += n;
+  }
+ finish:
+  if (ctx->last_error != JLOG_ERR_SUCCESS && in_frame) {
+    /* best effort: tell the leader why we are going away */
+    ack.log = frame.log;
+    ack.marker = frame.last;
+    ack.status = ctx->last_error;
+    (void)__jlog_fd_write(fd, &ack, sizeof(ack));
+  }
+  free(buf);
+  if (ctx->last_error == JLOG_ERR_SUCCESS) return total;
+  return -1;
+}
+
+/* ------------------ jlog_ctx_snapshot() and friends ----------- */
+
+/* Copy the first len bytes of src (all of it for -1) to a new file. */
+static int __jlog_snapshot_copy(jlog_ctx *ctx, const char *src, const char *dst,
+                                off_t len) {
+  jlog_file *in;
+  int out, ok;
+
+  if ((in = jlog_file_open(src, 0, ctx->file_mode, 0)) == NULL)
+    return errno == ENOENT ? 0 : -1;
+  if (len < 0 && (len = jlog_file_size(in)) < 0) {
+    jlog_file_close(in);
+    return -1;
+  }
+  if ((out = open(dst, O_WRONLY|O_CREAT|O_EXCL, ctx->file_mode)) < 0) {
+    jlog_file_close(in);
+    return -1;
+  }
+  ok = jlog_file_send(in, out, 0, len) && fsync(out) == 0;
+  jlog_file_close(in);
+  close(out);
+  return ok ? 0 : -1;
+}
+
+/* Sealed files never change again, so they can be shared; a link that
+ * crosses filesystems becomes a copy. */
+static int __jlog_snapshot_link(jlog_ctx *ctx, const char *src, const char *dst) {
+  if (link(src, dst) == 0) return 0;
+  if (errno == ENOENT) return 0;
+  if (errno == EXDEV || errno == EPERM) return __jlog_snapshot_copy(ctx, src, dst, -1);
+  return -1;
+}
+
+static int __jlog_index_sealed(jlog_ctx *ctx, const char *idx) {
+  jlog_file *f;
+  u_int64_t entries;
+  u_int32_t marker;
+  int closed;
+
+  if ((f = jlog_file_open(idx, 0, ctx->file_mode, 0)) == NULL) return 0;
+  /* one that cannot be read is left out, like one still being built */
+  if (__jlog_index_tail(ctx, f, &entries, &marker, &closed) != 0) {
+    ctx->last_error = JLOG_ERR_SUCCESS;
+    closed = 0;
+  }
+  jlog_file_close(f);
+  return closed;
+}
+
+/* Remove a snapshot that failed part way, so that it can be retried; dest
+ * holds only what we put there. */
+static void __jlog_snapshot_discard(const char *dest) {
+  char file[MAXPATHLEN];
+  struct dirent *de;
+  DIR *dir;
+
+  if ((dir = opendir(dest)) != NULL) {
+    while ((de = readdir(dir)) != NULL) {
+      if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) continue;
+      if (snprintf(file, sizeof(file), "%s%c%s", dest, IFS_CH, de->d_name) <
+          (int)sizeof(file))
+        (void)unlink(file);
+    }
+    closedir(dir);
+  }
+  (void)rmdir(dest);
+}
+
+int jlog_ctx_snapshot(jlog_ctx *ctx, const char *dest) {
+  char src[MAXPATHLEN], dst[MAXPATHLEN];
+  jlog_file *active = NULL;
+  struct dirent *de;
+  DIR *dir = NULL;
+  off_t active_len;
+  u_int32_t log, storage_log;
+  int dirmode, fd, rv, locked_meta = 0;
+
+  ctx->last_error = JLOG_ERR_SUCCESS;
+  if (ctx->context_mode != JLOG_APPEND) {
+    ctx->last_error = JLOG_ERR_ILLEGAL_WRITE;
+    ctx->last_errno = EPERM;
+    return -1;
+  }
+  if (strlen(dest) > MAXLOGPATHLEN-1) {
+    ctx->last_error = JLOG_ERR_CREATE_PATHLEN;
+    ctx->last_errno = ENAMETOOLONG;
+    return -1;
+  }
+  dirmode = ctx->file_mode;
+  if(dirmode & 0400) dirmode |= 0100;
+  if(dirmode & 040) dirmode |= 010;
+  if(dirmode & 04) dirmode |= 01;
+  if (mkdir(dest, dirmode) == -1) {
+    ctx->last_error = errno == EEXIST ? JLOG_ERR_CREATE_EXISTS : JLOG_ERR_CREATE_MKDIR;
+    ctx->last_errno = errno;
+    return -1;
+  }
+  chmod(dest, dirmode);
+
+  /* quiesce: our own pending writes go out, then with the metastore
+   * locked nobody can start a segment and with the active segment locked
+   * nobody can append to it */
+  pthread_mutex_lock(&ctx->write_lock);
+  if (_jlog_ctx_flush_pre_commit_buffer_no_lock(ctx) != 0)
+    goto finish;
+  if (!jlog_file_lock(ctx->metastore))
+    SYS_FAIL(JLOG_ERR_LOCK);
+  locked_meta = 1;
+  if (__jlog_restore_metastore(ctx, 1, 0) != 0)
+    SYS_FAIL(JLOG_ERR_META_OPEN);
+  storage_log = ctx->meta->storage_log;
+  STRSETDATAFILE(ctx, src, storage_log);
+  if ((active = jlog_file_open(src, O_CREAT, ctx->file_mode, ctx->multi_process)) == NULL)
+    SYS_FAIL(JLOG_ERR_FILE_OPEN);
+  if (!jlog_file_lock(active)) {
+    jlog_file_close(active);
+    active = NULL;
+    SYS_FAIL(JLOG_ERR_LOCK);
+  }
+  if ((active_len = jlog_file_size(active)) < 0)
+    SYS_FAIL(JLOG_ERR_FILE_SEEK);
+
+  if ((dir = opendir(ctx->path)) == NULL)
+    SYS_FAIL(JLOG_ERR_OPEN);
+  while ((de = readdir(dir)) != NULL) {
+    char base[9] = "";
+    const char *ext = "";
+
+    snprintf(src, sizeof(src), "%s%c%s", ctx->path, IFS_CH, de->d_name);
+    snprintf(dst, sizeof(dst), "%s%c%s", dest, IFS_CH, de->d_name);
+    if (strlen(de->d_name) >= 8) {
+      memcpy(base, de->d_name, 8);
+      ext = de->d_name + 8;
+    }
+    rv = 0;
+    if (is_datafile(base, &log) && log <= storage_log) {
+      if (*ext == '\0')
+        rv = log < storage_log ? __jlog_snapshot_link(ctx, src, dst)
+                               : __jlog_snapshot_copy(ctx, src, dst, active_len);
+      /* an index still being built is left for the snapshot's readers */
+      else if (!strcmp(ext, INDEX_EXT) && log < storage_log &&
+               __jlog_index_sealed(ctx, src))
+        rv = __jlog_snapshot_link(ctx, src, dst);
+      else if (!strcmp(ext, TIME_INDEX_EXT) && log < storage_log)
+        rv = __jlog_snapshot_link(ctx, src, dst);
+    }
+    else if (!strcmp(de->d_name, METASTORE_FILE) ||
+             !strcmp(de->d_name, METASTORE_EXT_FILE) ||
+             !strcmp(de->d_name, RETENTION_FILE) || !strcmp(de->d_name, "pre_commit") ||
+             !strncmp(de->d_name, "cp.", 3) || !strncmp(de->d_name, "gl.", 3) ||
+             !strncmp(de->d_name, "ev.", 3)) {
+      rv = __jlog_snapshot_copy(ctx, src, dst, -1);
+    }
+    if (rv != 0)
+      SYS_FAIL(JLOG_ERR_FILE_WRITE);
+  }
+  /* make the new names durable too */
+  if ((fd = open(dest, O_RDONLY)) >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+
+ finish:
+  if (dir) closedir(dir);
+  if (active) {
+    jlog_file_unlock(active);
+    jlog_file_close(active);
+  }
+  if (locked_meta) jlog_file_unlock(ctx->metastore);
+  pthread_mutex_unlock(&ctx->write_lock);
+  if (ctx->last_error == JLOG_ERR_SUCCESS) return 0;
+  __jlog_snapshot_discard(dest);
+  return -1;
+}
+
+/* ------------------ jlog_ctx_compact() and friends ----------- */
+
+#define COMPACT_DATA_EXT ".cmp"
+#define COMPACT_INDEX_EXT ".cmx"
+
+typedef struct {
+  char key[JLOG_KEY_LEN];
+  jlog_id latest;
+} jlog_compact_key;
+
+typedef struct {
+  size_t rate;      /* bytes per second, 0 for no limit */
+  u_int64_t moved;
+  struct timeval began;
+} jlog_compact_throttle;
+
+static void __jlog_compact_throttle(jlog_compact_throttle *t, size_t bytes) {
+  struct timeval now;
+  double elapsed, due;
+
+  if (!t->rate) return;
+  t->moved += bytes;
+  gettimeofday(&now, NULL);
+  elapsed = (now.tv_sec - t->began.tv_sec) +
+            (now.tv_usec - t->began.tv_usec) / 1000000.0;
+  due = (double)t->moved / t->rate;
+  if (due > elapsed) usleep((useconds_t)((due - elapsed) * 1000000));
+}
+
+/* Open a segment and its index and read the index.  A missing segment
+ * is not an error: *count is left 0. */
+static int __jlog_compact_open(jlog_ctx *ctx, u_int32_t log,
+                               jlog_file **data, jlog_file **idx,
+                               u_int64_t **offs, u_int32_t *count, int *closed) {
+  char file[MAXPATHLEN];
+
+  *data = *idx = NULL;
+  *offs = NULL;
+  *count = 0;
+  *closed = 0;
+  STRSETDATAFILE(ctx, file, log);
+  if ((*data = jlog_file_open(file, 0, ctx->file_mode, ctx->multi_process)) == NULL) {
+    if (errno == ENOENT) return 0;
+    SYS_FAIL(JLOG_ERR_FILE_OPEN);
+  }
+  strcat(file, INDEX_EXT);
+  if ((*idx = jlog_file_open(file, 0, ctx->file_mode, ctx->multi_process)) == NULL) {
+    if (errno == ENOENT) return 0;
+    SYS_FAIL(JLOG_ERR_IDX_OPEN);
+  }
+  if (__jlog_index_extent(ctx, *idx, *data, count, closed) != 0)
+    return -1;
+  if (*count == 0) return 0;
+  if ((*offs = malloc(*count * sizeof(**offs))) == NULL)
+    SYS_FAIL(JLOG_ERR_IDX_READ);
+  if (!__jlog_index_offsets(ctx, *idx, *data, *offs, *count, 0))
+    SYS_FAIL(JLOG_ERR_IDX_READ);
+  return 0;
+ finish:
+  return -1;
+}
+
+/* Indexes are built by readers, so a writer asking about its old
+ * segments indexes them through a read context of its own. */
+static jlog_ctx *__jlog_compact_indexer(jlog_ctx *ctx) {
+  jlog_ctx *ix = jlog_new(ctx->path);
+
+  ix->context_mode = JLOG_READ;
+  ix->multi_process = ctx->multi_process;
+  if (__jlog_open_metastore(ix, 0) != 0 ||
+      __jlog_restore_metastore(ix, 0, 1) != 0) {
+    ctx->last_error = ix->last_error;
+    ctx->last_errno = ix->last_errno;
+    jlog_ctx_close(ix);
+    return NULL;
+  }
+  return ix;
+}
+
+static void __jlog_compact_close(jlog_file *data, jlog_file *idx, u_int64_t *offs) {
+  if (data) jlog_file_close(data);
+  if (idx) jlog_file_close(idx);
+  free(offs);
+}
+
+static int __jlog_compact_header(jlog_ctx *ctx, jlog_file *data, u_int64_t off,
+                                 jlog_message *m, jlog_message_header_full *full) {
+  char buf[MAX_HDR_SIZE];
+
+  if (!jlog_file_pread(data, buf, HDR_SIZE(ctx), off)) return -1;
+  __jlog_unpack_header(ctx, m, buf, full);
+  if (m->header->reserved != ctx->meta->hdr_magic) return -1;
+  return 0;
+}
+
+/* Rewrite one sealed segment keeping the records `keep` says to, then
+ * swap the new files in under the index lock. */
+static int __jlog_compact_segment(jlog_ctx *ctx, u_int32_t log, jlog_file *data,
+                                  jlog_file *idx, const u_int64_t *offs, u_int32_t count,
+                                  const u_int8_t *keep, jlog_compact_throttle *throttle) {
+  char file[MAXPATHLEN], tmpdata[MAXPATHLEN], tmpidx[MAXPATHLEN];
+  char idxfile[MAXPATHLEN], tdxfile[MAXPATHLEN];
+  jlog_file *out = NULL, *outidx = NULL;
+  u_int64_t *newoffs = NULL, pos = 0;
+  char *buf = NULL;
+  size_t buflen = 0, len;
+  jlog_message m;
+  u_int32_t i, kept = 0;
+
+  STRSETDATAFILE(ctx, file, log);
+  if (snprintf(tmpdata, sizeof(tmpdata), "%s" COMPACT_DATA_EXT, file) >= (int)sizeof(tmpdata) ||
+      snprintf(tmpidx, sizeof(tmpidx), "%s" COMPACT_INDEX_EXT, file) >= (int)sizeof(tmpidx) ||
+      snprintf(idxfile, sizeof(idxfile), "%s" INDEX_EXT, file) >= (int)sizeof(idxfile) ||
+      snprintf(tdxfile, sizeof(tdxfile), "%s" TIME_INDEX_EXT, file) >= (int)sizeof(tdxfile)) {
+    errno = ENAMETOOLONG;
+    SYS_FAIL(JLOG_ERR_FILE_OPEN);
+  }
+  for (i = 0; i < count; i++) kept += keep[i];
+
+  if (kept) {
+    if ((newoffs = malloc((kept + 2) * sizeof(*newoffs))) == NULL)
+      SYS_FAIL(JLOG_ERR_FILE_WRITE);
+    unlink(tmpdata);
+    unlink(tmpidx);
+    out = jlog_file_open(tmpdata, O_CREAT|O_EXCL, ctx->file_mode, ctx->multi_process);
+    outidx = jlog_file_open(tmpidx, O_CREAT|O_EXCL, ctx->file_mode, ctx->multi_process);
+    if (!out || !outidx)
+      SYS_FAIL(JLOG_ERR_FILE_OPEN);
+    for (i = 0, kept = 0; i < count; i++) {
+      if (!keep[i]) continue;
+      if (__jlog_compact_header(ctx, data, offs[i], &m, NULL) != 0)
+        SYS_FAIL(JLOG_ERR_FILE_CORRUPT);
+      len = HDR_SIZE(ctx) + (IS_COMPRESS_MAGIC(ctx) ? m.header->compressed_len : m.header->mlen);
+      if (len > buflen) {
+        char *nbuf = realloc(buf, len);
+        if (!nbuf) SYS_FAIL(JLOG_ERR_FILE_READ);
+        buf = nbuf;
+        buflen = len;
+      }
+      if (!jlog_file_pread(data, buf, len, offs[i]))
+        SYS_FAIL(JLOG_ERR_FILE_READ);
+      if (!jlog_file_pwrite(out, buf, len, pos))
+        SYS_FAIL(JLOG_ERR_FILE_WRITE);
+      newoffs[kept++] = pos;
+      pos += len;
+      __jlog_compact_throttle(throttle, 2 * len);
+    }
+    /* sealed, like the original */
+    if (!__jlog_index_seal(ctx, outidx, newoffs, kept))
+      SYS_FAIL(JLOG_ERR_IDX_WRITE);
+    if (!jlog_file_sync(out) || !jlog_file_sync(outidx))
+      SYS_FAIL(JLOG_ERR_FILE_WRITE);
+  }
+
+  /* resyncs and repairs take the index lock, so they see old or new */
+  if (!jlog_file_lock(idx))
+    SYS_FAIL(JLOG_ERR_LOCK);
+  if (jlog_file_size(idx) != __jlog_index_sealed_len(ctx, count)) {
+    /* somebody else has been at this segment; leave it */
+    jlog_file_unlock(idx);
+    kept = count;
+    goto finish;
+  }
+  if (kept) {
+    if (rename(tmpdata, file) != 0 || rename(tmpidx, idxfile) != 0) {
+      jlog_file_unlock(idx);
+      SYS_FAIL(JLOG_ERR_FILE_WRITE);
+    }
+    /* the time index and key summaries describe the old layout */
+    unlink(tdxfile);
+  } else {
+    __jlog_unlink_datafile(ctx, log);
+  }
+  jlog_file_unlock(idx);
+
+ finish:
+  if (out) jlog_file_close(out);
+  if (outidx) jlog_file_close(outidx);
+  if (ctx->last_error != JLOG_ERR_SUCCESS || kept == count) {
+    unlink(tmpdata);
+    unlink(tmpidx);
+  }
+  free(newoffs);
+  free(buf);
+  if (ctx->last_error == JLOG_ERR_SUCCESS) return count - kept;
+  return -1;
+}
+
+int jlog_ctx_compact(jlog_ctx *ctx, size_t bytes_per_sec) {
+  jlog_hash_table latest = JLOG_HASH_EMPTY;
+  jlog_compact_throttle throttle;
+  jlog_ctx *ix = NULL;
+  jlog_compact_key *ck;
+  jlog_file *data, *idx;
+  jlog_message m;
+  jlog_message_header_full full;
+  jlog_id first, *chkpts = NULL;
+  u_int64_t *offs;
+  u_int8_t *keep = NULL;
+  u_int32_t log, last, i, count;
+  char **subs = NULL;
+  int nsubs = 0, j, closed, busy, removed = 0, rv;
+  void *vp;
+
+  ctx->last_error = JLOG_ERR_SUCCESS;
+  if (ctx->context_mode != JLOG_APPEND) {
+    ctx->last_error = JLOG_ERR_ILLEGAL_WRITE;
+    ctx->last_errno = EPERM;
+    return -1;
+  }
+  /* without an index lock there is nothing to swap a rewrite in under */
+  if (!HAS_KEYS(ctx) || HAS_FIXED_RECORDS(ctx)) {
+    ctx->last_error = JLOG_ERR_NOT_SUPPORTED;
+    ctx->last_errno = EINVAL;
+    return -1;
+  }
+  memset(&throttle, 0, sizeof(throttle));
+  throttle.rate = bytes_per_sec;
+  gettimeofday(&throttle.began, NULL);
+  jlog_hash_init(&latest);
+
+  /* a segment with a subscriber inside it is left exactly as it is */
+  if ((nsubs = jlog_ctx_list_subscribers(ctx, &subs)) < 0)
+    SYS_FAIL(JLOG_ERR_INVALID_SUBSCRIBER);
+  if (nsubs && (chkpts = calloc(nsubs, sizeof(*chkpts))) == NULL)
+    SYS_FAIL(JLOG_ERR_FILE_READ);
+  for (j = 0; j < nsubs; j++)
+    if (jlog_get_checkpoint(ctx, subs[j], &chkpts[j]) != 0)
+      SYS_FAIL(JLOG_ERR_INVALID_SUBSCRIBER);
+  if (jlog_ctx_first_log_id(ctx, &first) != 0)
+    SYS_FAIL(JLOG_ERR_FILE_OPEN);
+  if ((ix = __jlog_compact_indexer(ctx)) == NULL)
+    goto finish;
+  last = ix->meta->storage_log;
+
+  /* find the latest record of every key, right up to the writer */
+  for (log = first.log; log <= last; log++) {
+    /* seals the segment if the writer has left it; gone is fine */
+    if (__jlog_resync_index(ix, log, NULL, &closed) != 0 &&
+        ix->last_error != JLOG_ERR_FILE_OPEN) {
+      ctx->last_error = ix->last_error;
+      ctx->last_errno = ix->last_errno;
+      goto finish;
+    }
+    if (__jlog_compact_open(ctx, log, &data, &idx, &offs, &count, &closed) != 0)
+      goto finish;
+    for (i = 0; i < count; i++) {
+      if (__jlog_compact_header(ctx, data, offs[i], &m, &full) != 0) {
+        if (closed) ctx->last_error = JLOG_ERR_FILE_CORRUPT;
+        break;
+      }
+      __jlog_compact_throttle(&throttle, HDR_SIZE(ctx));
+      if (full.ext.key[0] == '\0') continue;
+      if (jlog_hash_retrieve(&latest, full.ext.key, JLOG_KEY_LEN, &vp)) ck = vp;
+      else {
+        if ((ck = malloc(sizeof(*ck))) == NULL) {
+          ctx->last_error = JLOG_ERR_FILE_READ;
+          ctx->last_errno = ENOMEM;
+          break;
+        }
+        memcpy(ck->key, full.ext.key, JLOG_KEY_LEN);
+        jlog_hash_store(&latest, ck->key, JLOG_KEY_LEN, ck);
+      }
+      ck->latest.log = log;
+      ck->latest.marker = i + 1;
+    }
+    __jlog_compact_close(data, idx, offs);
+    if (ctx->last_error != JLOG_ERR_SUCCESS) goto finish;
+  }
+
+  /* then rewrite the sealed segments nobody is reading */
+  for (log = first.log; log < last; log++) {
+    for (busy = 0, j = 0; j < nsubs; j++)
+      if (chkpts[j].log == log) busy = 1;
+    if (busy) continue;
+    if (__jlog_compact_open(ctx, log, &data, &idx, &offs, &count, &closed) != 0)
+      goto finish;
+    rv = 0;
+    if (closed && (keep = calloc(count, 1)) != NULL) {
+      for (i = 0; i < count; i++) {
+        if (__jlog_compact_header(ctx, data, offs[i], &m, &full) != 0) {
+          ctx->last_error = JLOG_ERR_FILE_CORRUPT;
+          rv = -1;
+          break;
+        }
+        keep[i] = 1;
+        if (full.ext.key[0] != '\0' &&
+            jlog_hash_retrieve(&latest, full.ext.key, JLOG_KEY_LEN, &vp)) {
+          ck = vp;
+          keep[i] = ck->latest.log == log && ck->latest.marker == i + 1;
+        }
+        if (!keep[i]) rv = 1;
+      }
+      if (rv > 0) {
+        rv = __jlog_compact_segment(ctx, log, data, idx, offs, count, keep, &throttle);
+        if (rv > 0) removed += rv;
+      }
+    }
+    else if (closed) {
+      ctx->last_error = JLOG_ERR_FILE_READ;
+      ctx->last_errno = ENOMEM;
+      rv = -1;
+    }
+    free(keep);
+    keep = NULL;
+    __jlog_compact_close(data, idx, offs);
+    if (rv < 0) goto finish;
+  }
+
+ finish:
+  jlog_hash_destroy(&latest, NULL, free);
+  if (ix) jlog_ctx_close(ix);
+  if (subs) jlog_ctx_list_subscribers_dispose(ctx, subs);
+  free(chkpts);
+  if (ctx->last_error == JLOG_ERR_SUCCESS) return removed;
+  return -1;
+}
+
+/* ------------------ jlog_ctx_prepare() and friends ----------- */
+
+typedef struct {
+  u_int64_t next;
+  u_int32_t last;
+  u_int32_t storage_log;
+  int fixed;
+  int error;
+  int error_errno;
+} jlog_prepare_state;
+
+typedef struct {
+  jlog_prepare_state *st;
+  jlog_ctx *ix;
+  pthread_t thread;
+  int started;
+} jlog_prepare_worker;
+
+/* Whether the index of a sealed segment agrees with its records as far
+ * as it goes; the caller has inspected the segment, so the mapping is
+ * sound. */
+static int __jlog_prepare_index_ok(jlog_ctx *ix, u_int32_t log) {
+  jlog_message m;
+  u_int64_t *offs, entries, off = 0;
+  u_int32_t stride = IDX_STRIDE(ix), count, r;
+  size_t hdr_size = HDR_SIZE(ix);
+  int closed, ok = 0;
+
+  if (HAS_FIXED_RECORDS(ix)) {
+    /* no index, but every record must be of the one size */
+    if (__jlog_setup_reader(ix, log, 1) != 0 ||
+        ix->mmap_len % FIXED_RECORD_SIZE(ix))
+      return 0;
+    for (off = 0; off < ix->mmap_len; off += FIXED_RECORD_SIZE(ix)) {
+      __jlog_unpack_header(ix, &m, (char *)ix->mmap_base + off, NULL);
+      if (m.aligned_header.mlen != ix->meta_ext->record_size) return 0;
+    }
+    return 1;
+  }
+  __jlog_open_indexer(ix, log);
+  if (!ix->index || __jlog_index_tail(ix, ix->index, &entries, &count, &closed) != 0)
+    return 0;
+  if (entries == 0) return !closed;
+  if ((offs = malloc(entries * sizeof(*offs))) == NULL) return 1; /* resync checks the tail */
+  if (!__jlog_index_pread(ix, ix->index, offs, entries, 0) ||
+      __jlog_setup_reader(ix, log, 1) != 0)
+    goto done;
+  for (r = 0; off < ix->mmap_len; r++) {
+    if (r / stride >= entries && !closed) break;
+    if (r % stride == 0 && (r / stride >= entries || offs[r / stride] != off))
+      goto done;
+    if (off + hdr_size > ix->mmap_len) goto done;
+    __jlog_unpack_header(ix, &m, (char *)ix->mmap_base + off, NULL);
+    off += hdr_size + (IS_COMPRESS_MAGIC(ix) ? m.aligned_header.compressed_len
+                                             : m.aligned_header.mlen);
+  }
+  /* the close marker ends the index, and the segment */
+  ok = !closed || (off == ix->mmap_len && r == count);
+ done:
+  free(offs);
+  return ok;
+}
+
+/* Throw away the index of a sealed segment, repairing the segment first
+ * if it is damaged, as __jlog_resync_index does when it cannot index it. */
+static void __jlog_prepare_reindex(jlog_ctx *ix, u_int32_t log, int repair) {
+  char file[MAXPATHLEN];
+
+  if (HAS_FIXED_RECORDS(ix)) {
+    if (repair) jlog_repair_datafile(ix, log);
+  }
+  else {
+    __jlog_open_indexer(ix, log);
+    if (!ix->index || !jlog_file_lock(ix->index)) return;
+    if (repair) jlog_repair_datafile(ix, log);
+    jlog_file_truncate(ix->index, 0);
+    jlog_file_unlock(ix->index);
+  }
+  if (__jlog_time_index_filename(ix, log, file) == 0) unlink(file);
+}
+
+static void *__jlog_prepare_worker(void *arg) {
+  jlog_prepare_worker *w = arg;
+  jlog_prepare_state *st = w->st;
+  jlog_ctx *ix = w->ix;
+  u_int64_t next;
+  u_int32_t log;
+  int rv, closed;
+
+  while ((next = __sync_fetch_and_add(&st->next, 1)) <= st->last) {
+    log = next;
+    /* the segment being written may end part way through a record */
+    if (log < st->storage_log) {
+      rv = jlog_inspect_datafile(ix, log, 0);
+      if (rv > 0 || (rv == 0 && !__jlog_prepare_index_ok(ix, log))) {
+        __jlog_prepare_reindex(ix, log, rv > 0);
+        __sync_add_and_fetch(&st->fixed, 1);
+      }
+      __jlog_teardown_reader(ix);
+    }
+    /* a segment that has gone since the directory was read is no error */
+    if (__jlog_resync_index(ix, log, NULL, &closed) != 0 &&
+        ix->last_error != JLOG_ERR_FILE_OPEN &&
+        __sync_bool_compare_and_swap(&st->error, 0, ix->last_error))
+      st->error_errno = ix->last_errno;
+  }
+  return NULL;
+}
+
+int jlog_ctx_prepare(jlog_ctx *ctx, int nthreads) {
+  jlog_prepare_state st;
+  jlog_prepare_worker *w = NULL;
+  unsigned int ear, lat;
+  int i;
+
+  memset(&st, 0, sizeof(st));
+  ctx->last_error = JLOG_ERR_SUCCESS;
+  if (ctx->context_mode != JLOG_READ && ctx->context_mode != JLOG_APPEND) {
+    errno = EINVAL;
+    SYS_FAIL(JLOG_ERR_ILLEGAL_OPEN);
+  }
+  if (!__jlog_get_storage_bounds(ctx, &ear, &lat)) {
+    /* no segments, nothing to do */
+    ctx->last_error = JLOG_ERR_SUCCESS;
+    return 0;
+  }
+  st.next = ear;
+  st.last = lat;
+  st.storage_log = ctx->meta->storage_log;
+  if (nthreads < 1) nthreads = 1;
+  if ((u_int64_t)nthreads > (u_int64_t)lat - ear + 1) nthreads = lat - ear + 1;
+  if ((w = calloc(nthreads, sizeof(*w))) == NULL) {
+    errno = ENOMEM;
+    SYS_FAIL(JLOG_ERR_OPEN);
+  }
+  for (i = 0; i < nthreads; i++) {
+    w[i].st = &st;
+    if ((w[i].ix = __jlog_compact_indexer(ctx)) == NULL) goto finish;
+  }
+  for (i = 1; i < nthreads; i++)
+    w[i].started = pthread_create(&w[i].thread, NULL, __jlog_prepare_worker, &w[i]) == 0;
+  __jlog_prepare_worker(&w[0]);
+  for (i = 1; i < nthreads; i++)
+    if (w[i].started) pthread_join(w[i].thread, NULL);
+  if (st.error) {
+    ctx->last_error = st.error;
+    ctx->last_errno = st.error_errno;
+  }
+
+ finish:
+  if (w) {
+    for (i = 0; i < nthreads; i++)
+      if (w[i].ix) jlog_ctx_close(w[i].ix);
+    free(w);
+  }
+  if (ctx->last_error == JLOG_ERR_SUCCESS) return st.fixed;
+  return -1;
+}
+
+/* ------------------ jlog_ctx_subscriber_lag() and friends ----------- */
+
+typedef struct {
+  int counted;
+  u_int32_t messages;
+  u_int64_t bytes;
+  u_int32_t first_sec;    /* write time of message 1 */
+  u_int32_t first_usec;
+} jlog_lag_segment;
+
+/* Position the private reader on segment log and index it.  Returns 1
+ * if the segment is there, 0 if it is gone and -1 on error. */
+static int __jlog_lag_open(jlog_ctx *ctx, u_int32_t log, u_int32_t *messages) {
+  jlog_id last;
+  int closed;
+
+  if (__jlog_resync_index(ctx, log, &last, &closed) != 0) {
+    if (ctx->last_error != JLOG_ERR_FILE_OPEN &&
+        ctx->last_error != JLOG_ERR_IDX_OPEN) return -1;
+    ctx->last_error = JLOG_ERR_SUCCESS;
+    return 0;
+  }
+  *messages = last.marker;
+  return 1;
+}
+
+static int __jlog_lag_timestamp(jlog_ctx *ctx, u_int32_t marker,
+                                u_int32_t *sec, u_int32_t *usec) {
+  jlog_message m;
+
+  if (__jlog_read_header_at(ctx, marker, &m, NULL) != 0) return -1;
+  *sec = m.header->tv_sec;
+  *usec = m.header->tv_usec;
+  return 0;
+}
+
+static int __jlog_lag_segment(jlog_ctx *ctx, u_int32_t log, jlog_lag_segment *seg) {
+  off_t size;
+  int rv;
+
+  memset(seg, 0, sizeof(*seg));
+  seg->counted = 1;
+  if ((rv = __jlog_lag_open(ctx, log, &seg->messages)) <= 0) return rv;
+  if ((size = jlog_file_size(ctx->data)) < 0) SYS_FAIL(JLOG_ERR_FILE_SEEK);
+  seg->bytes = size;
+  if (seg->messages > 0 &&
+      __jlog_lag_timestamp(ctx, 1, &seg->first_sec, &seg->first_usec) != 0)
     return -1;
-  }
+  return 0;
+ finish:
+  return -1;
+}
 
-  __jlog_restore_metastore(ctx, 0, 1);
-  if(jlog_get_checkpoint(ctx, ctx->subscriber_name, &chkpt))
-    SYS_FAIL(JLOG_ERR_INVALID_SUBSCRIBER);
-  if(__jlog_find_first_log_after(ctx, &chkpt, start, finish) != 0)
-    goto finish; /* Leave whatever error was set in find_first_log_after */
-  if(start->log != chkpt.log) start->marker = 0;
-  else start->marker = chkpt.marker;
-  if(start->log != chkpt.log) {
-    /* We've advanced our checkpoint, let's not do this work again */
-    if(__jlog_set_checkpoint(ctx, ctx->subscriber_name, start) != 0)
-      SYS_FAIL(JLOG_ERR_CHECKPOINT);
-  }
-  /* Here 'start' is actually the checkpoint, so we must advance it one.
-     However, that may not be possible, if there are no messages, so first
-     make sure finish is bigger */
-  count = finish->marker - start->marker;
-  if(finish->marker > start->marker) start->marker++;
+/* The subscriber's position: its live one from the subscriber table when
+ * a lazy checkpoint has it ahead of the file, else its checkpoint. */
+static int __jlog_lag_position(jlog_ctx *ctx, const char *s, jlog_id *id) {
+  struct _jlog_subscriber_slot *slots;
+  u_int32_t i;
+  int found = 0;
 
-  /* If the count is less than zero, the checkpoint is off the end
-   * of the file. When this happens, we need to set it to the end of
-   * the file */
-  if (count < 0) {
-    fprintf(stderr, "need to repair checkpoint for %s - start (%08x:%08x) > finish (%08x:%08x)\n", ctx->path, 
-        start->log, start->marker, finish->log, finish->marker);
-    if(__jlog_set_checkpoint(ctx, ctx->subscriber_name, finish) != 0) {
-      fprintf(stderr, "failed repairing checkpoint for %s\n", ctx->path);
-      SYS_FAIL(JLOG_ERR_CHECKPOINT);
-    }
-    if(jlog_get_checkpoint(ctx, ctx->subscriber_name, &chkpt)) {
-      /* Should never happen */
-      SYS_FAIL(JLOG_ERR_INVALID_SUBSCRIBER);
+  if (__jlog_subtab_lock(ctx) == 0) {
+    slots = SUBTAB_SLOTS(ctx);
+    for (i = 0; i < SUBTAB(ctx)->nslots && !found; i++) {
+      if (slots[i].in_use && !strcmp(slots[i].name, s)) {
+        *id = __jlog_live_load(&slots[i].live);
+        found = 1;
+      }
     }
-    fprintf(stderr, "repaired checkpoint for %s: %08x:%08x\n", ctx->path, chkpt.log, chkpt.marker);
-    ctx->last_error = JLOG_ERR_SUCCESS;
-    count = 0;
+    jlog_file_unlock(ctx->subtab);
   }
+  if (found) return 0;
+  return jlog_get_checkpoint(ctx, s, id);
+}
 
-  /* We need to munmap it, so that we can remap it with more data if needed */
-  __jlog_teardown_reader(ctx);
+/* Sum what lag->subscriber has yet to read up to the end of segment end.
+ * The unread tail of its own segment is found through the index; every
+ * later segment counts whole and is counted once into segs, which starts
+ * at segment base. */
+static int __jlog_lag_compute(jlog_ctx *ctx, jlog_lag_segment *segs, u_int32_t base,
+                              u_int32_t end, jlog_subscriber_lag *lag) {
+  u_int32_t log, messages = 0;
+  u_int64_t off;
+  jlog_id *cp = &lag->checkpoint;
+  jlog_lag_segment *seg;
+  int rv;
+
+  lag->messages = lag->bytes = 0;
+  lag->oldest_sec = lag->oldest_usec = 0;
+  if (cp->log > end) return 0;
+  if ((rv = __jlog_lag_open(ctx, cp->log, &messages)) < 0) return -1;
+  if (rv > 0 && cp->marker < messages) {
+    if (!__jlog_index_offsets(ctx, ctx->index, ctx->data, &off, 1, cp->marker))
+      SYS_FAIL(JLOG_ERR_IDX_READ);
+    lag->messages = messages - cp->marker;
+    lag->bytes = jlog_file_size(ctx->data) - off;
+    if (__jlog_lag_timestamp(ctx, cp->marker + 1,
+                             &lag->oldest_sec, &lag->oldest_usec) != 0) return -1;
+  }
+  for (log = cp->log + 1; log <= end; log++) {
+    seg = &segs[log - base];
+    if (!seg->counted && __jlog_lag_segment(ctx, log, seg) != 0) return -1;
+    if (seg->messages && !lag->messages) {
+      lag->oldest_sec = seg->first_sec;
+      lag->oldest_usec = seg->first_usec;
+    }
+    lag->messages += seg->messages;
+    lag->bytes += seg->bytes;
+  }
+  return 0;
  finish:
-  if(ctx->last_error == JLOG_ERR_SUCCESS) return count;
   return -1;
 }
 
-int jlog_ctx_first_log_id(jlog_ctx *ctx, jlog_id *id) {
-  DIR *d;
-  struct dirent *de;
+static int __jlog_lag(jlog_ctx *ctx, jlog_subscriber_lag *lags, int count) {
+  struct _jlog_eviction ev;
+  jlog_lag_segment *segs = NULL;
+  jlog_ctx *ix;
+  u_int32_t base = 0;
+  int i, rv = -1;
+
   ctx->last_error = JLOG_ERR_SUCCESS;
-  u_int32_t log;
-  int found = 0;
+  if ((ix = __jlog_compact_indexer(ctx)) == NULL) return -1;
+  for (i = 0; i < count; i++) {
+    if (__jlog_lag_position(ctx, lags[i].subscriber, &lags[i].checkpoint) != 0) {
+      ctx->last_error = JLOG_ERR_INVALID_SUBSCRIBER;
+      goto out;
+    }
+    if (__jlog_read_eviction(ctx, lags[i].subscriber, &ev)) lags[i].evicted = ev.messages;
+    if (i == 0 || lags[i].checkpoint.log < base) base = lags[i].checkpoint.log;
+  }
+  if (count > 0 && base <= ix->meta->storage_log) {
+    segs = calloc(ix->meta->storage_log - base + 1, sizeof(*segs));
+    if (!segs) {
+      ctx->last_error = JLOG_ERR_FILE_READ;
+      ctx->last_errno = ENOMEM;
+      goto out;
+    }
+  }
+  for (i = 0; i < count; i++) {
+    if (__jlog_lag_compute(ix, segs, base, ix->meta->storage_log, &lags[i]) != 0) {
+      ctx->last_error = ix->last_error;
+      ctx->last_errno = ix->last_errno;
+      goto out;
+    }
+  }
+  rv = 0;
+ out:
+  free(segs);
+  jlog_ctx_close(ix);
+  return rv;
+}
 
-  id->log = 0xffffffff;
-  id->marker = 0;
-  d = opendir(ctx->path);
-  if (!d) return -1;
+int jlog_ctx_subscriber_lag(jlog_ctx *ctx, const char *subscriber,
+                            u_int64_t *messages, u_int64_t *bytes,
+                            struct timeval *oldest) {
+  jlog_subscriber_lag lag;
 
-  while ((de = readdir(d))) {
-    int i;
-    char *cp = de->d_name;
-    if(strlen(cp) != 8) continue;
-    log = 0;
-    for(i=0;i<8;i++) {
-      log <<= 4;
-      if(cp[i] >= '0' && cp[i] <= '9') log |= (cp[i] - '0');
-      else if(cp[i] >= 'a' && cp[i] <= 'f') log |= (cp[i] - 'a' + 0xa);
-      else if(cp[i] >= 'A' && cp[i] <= 'F') log |= (cp[i] - 'A' + 0xa);
-      else break;
-    }
-    if(i != 8) continue;
-    found = 1;
-    if(log < id->log) id->log = log;
+  lag.subscriber = (char *)subscriber;
+  if (jlog_ctx_subscriber_lag_detail(ctx, &lag) != 0) return -1;
+  if (messages) *messages = lag.messages;
+  if (bytes) *bytes = lag.bytes;
+  if (oldest) {
+    oldest->tv_sec = lag.oldest_sec;
+    oldest->tv_usec = lag.oldest_usec;
   }
-  if(!found) id->log = 0;
-  closedir(d);
   return 0;
 }
 
-int jlog_ctx_last_storage_log(jlog_ctx *ctx, uint32_t *logid) {
-  ctx->last_error = JLOG_ERR_SUCCESS;
-  if(ctx->context_mode != JLOG_READ) {
-    ctx->last_error = JLOG_ERR_ILLEGAL_WRITE;
-    ctx->last_errno = EPERM;
+int jlog_ctx_subscriber_lag_detail(jlog_ctx *ctx, jlog_subscriber_lag *lag) {
+  char *subscriber = lag->subscriber;
+
+  memset(lag, 0, sizeof(*lag));
+  lag->subscriber = subscriber;
+  return __jlog_lag(ctx, lag, 1);
+}
+
+int jlog_ctx_subscribers_lag(jlog_ctx *ctx, jlog_subscriber_lag **lags) {
+  jlog_subscriber_lag *list;
+  char **subs;
+  int i, n;
+
+  if ((n = jlog_ctx_list_subscribers(ctx, &subs)) < 0) {
+    ctx->last_error = JLOG_ERR_NOTDIR;
     return -1;
   }
-  if (__jlog_restore_metastore(ctx, 0, 1) != 0) return -1;
-  *logid = ctx->meta->storage_log;
-  return 0;
+  list = calloc(n + 1, sizeof(*list));
+  if (!list) {
+    jlog_ctx_list_subscribers_dispose(ctx, subs);
+    ctx->last_error = JLOG_ERR_FILE_READ;
+    ctx->last_errno = ENOMEM;
+    return -1;
+  }
+  /* the names move into the lag list */
+  for (i = 0; i < n; i++) list[i].subscriber = subs[i];
+  free(subs);
+  if (__jlog_lag(ctx, list, n) != 0) {
+    jlog_ctx_subscribers_lag_dispose(ctx, list, n);
+    return -1;
+  }
+  *lags = list;
+  return n;
 }
 
-int jlog_ctx_last_log_id(jlog_ctx *ctx, jlog_id *id) {
-  ctx->last_error = JLOG_ERR_SUCCESS;
-  if(ctx->context_mode != JLOG_READ) {
-    ctx->last_error = JLOG_ERR_ILLEGAL_WRITE;
-    ctx->last_errno = EPERM;
+void jlog_ctx_subscribers_lag_dispose(jlog_ctx *ctx, jlog_subscriber_lag *lags, int count) {
+  int i;
+
+  if (!lags) return;
+  for (i = 0; i < count; i++) free(lags[i].subscriber);
+  free(lags);
+}
+
+/* ------------------ jlog_ctx_enforce_retention() and friends ----------- */
+
+/* The eviction notice file of subscriber s.  It is updated in place
+ * under its lock and emptied, not removed, once taken, so that nobody
+ * waiting on the lock is left holding a file that is gone. */
+static jlog_file *__jlog_open_eviction(jlog_ctx *ctx, const char *s, int flags) {
+  char name[MAXPATHLEN];
+
+  compute_subscriber_filename(ctx, "ev", s, name);
+  return jlog_file_open(name, flags, ctx->file_mode, ctx->multi_process);
+}
+
+/* Returns 1 and fills ev when the notice file f holds a notice. */
+static int __jlog_pread_eviction(jlog_file *f, struct _jlog_eviction *ev) {
+  return jlog_file_size(f) >= (off_t)sizeof(*ev) &&
+         jlog_file_pread(f, ev, sizeof(*ev), 0);
+}
+
+/* Returns 1 and fills ev when subscriber s has an eviction notice. */
+static int __jlog_read_eviction(jlog_ctx *ctx, const char *s, struct _jlog_eviction *ev) {
+  jlog_file *f;
+  int rv = 0;
+
+  if ((f = __jlog_open_eviction(ctx, s, 0)) == NULL) return 0;
+  if (jlog_file_size(f) >= (off_t)sizeof(*ev) && jlog_file_lock(f)) {
+    rv = __jlog_pread_eviction(f, ev);
+    jlog_file_unlock(f);
+  }
+  jlog_file_close(f);
+  return rv;
+}
+
+/* What retention needs to evict one subscriber: the notice, locked
+ * before the checkpoint as a subscriber taking it locks them, and what
+ * to count the messages it skips with. */
+struct _jlog_evict {
+  jlog_file *notice;
+  jlog_ctx *ix;
+  jlog_lag_segment *segs;
+  u_int32_t base;
+  jlog_id to;
+};
+
+/* Checked under the subscriber's checkpoint lock: only a checkpoint
+ * still behind the cutoff is moved, and its notice is written first,
+ * counting from where it really is, so a crash cannot evict silently. */
+static int __jlog_evict_check(jlog_ctx *ctx, const jlog_id *cur, void *arg) {
+  struct _jlog_evict *e = arg;
+  struct _jlog_eviction ev;
+  jlog_subscriber_lag lag;
+
+  if (!JLOG_ID_BEFORE(cur, &e->to)) return 1;
+  memset(&lag, 0, sizeof(lag));
+  lag.checkpoint = *cur;
+  if (lag.checkpoint.log < e->base) {
+    /* nothing is left below base to count */
+    lag.checkpoint.log = e->base;
+    lag.checkpoint.marker = 0;
+  }
+  if (__jlog_lag_compute(e->ix, e->segs, e->base, e->to.log - 1, &lag) != 0) {
+    ctx->last_error = e->ix->last_error;
+    ctx->last_errno = e->ix->last_errno;
     return -1;
   }
-  if (__jlog_restore_metastore(ctx, 0, 1) != 0) return -1;
-  ___jlog_resync_index(ctx, ctx->meta->storage_log, id, NULL);
-  if(ctx->last_error == JLOG_ERR_SUCCESS) return 0;
+  if (__jlog_pread_eviction(e->notice, &ev)) {
+    ev.messages += lag.messages;
+  }
+  else {
+    ev.from = *cur;
+    ev.messages = lag.messages;
+  }
+  ev.to = e->to;
+  if (!jlog_file_pwrite(e->notice, &ev, sizeof(ev), 0) ||
+      (ctx->meta->safety == JLOG_SAFE && !jlog_file_sync(e->notice)))
+    SYS_FAIL(JLOG_ERR_FILE_WRITE);
+  return 0;
+ finish:
   return -1;
 }
 
-int jlog_ctx_advance_id(jlog_ctx *ctx, jlog_id *cur, 
-                        jlog_id *start, jlog_id *finish)
-{
+/* Move s's checkpoint forward to e->to unless it is there already,
+ * leaving it a notice. Both files are locked throughout, so neither a
+ * concurrent pass nor the subscriber can slip between the two. */
+static int __jlog_evict_subscriber(jlog_ctx *ctx, const char *s,
+                                   struct _jlog_evict *e) {
   int rv;
-  if(memcmp(cur, finish, sizeof(jlog_id))) {
-    start->marker++;
-  } else {
-    if((rv = __jlog_find_first_log_after(ctx, cur, start, finish)) != 0) {
-      return rv;
-    }
-    if(cur->log != start->log) {
-      start->marker = 1;
-    }
-    else start->marker = cur->marker;
+
+  if ((e->notice = __jlog_open_eviction(ctx, s, O_CREAT)) == NULL)
+    SYS_FAIL(JLOG_ERR_FILE_OPEN);
+  if (!jlog_file_lock(e->notice)) {
+    jlog_file_close(e->notice);
+    SYS_FAIL(JLOG_ERR_LOCK);
   }
-  return 0;
+  rv = __jlog_move_checkpoint(ctx, s, &e->to, __jlog_evict_check, e);
+  jlog_file_unlock(e->notice);
+  jlog_file_close(e->notice);
+  e->notice = NULL;
+  if (rv < 0 && ctx->last_error == JLOG_ERR_SUCCESS) SYS_FAIL(JLOG_ERR_CHECKPOINT);
+  return rv < 0 ? -1 : 0;
+ finish:
+  return -1;
 }
 
-static int is_datafile(const char *f, u_int32_t *logid) {
-  int i;
-  u_int32_t l = 0;
-  for(i=0; i<8; i++) {
-    if((f[i] >= '0' && f[i] <= '9') ||
-       (f[i] >= 'a' && f[i] <= 'f')) {
-      l <<= 4;
-      l |= (f[i] < 'a') ? (f[i] - '0') : (f[i] - 'a' + 10);
-    }
-    else
-      return 0;
+/* Fail the reader's next read once if retention evicted it, first making
+ * sure a checkpoint it wrote back over the eviction is moved on again. */
+static int __jlog_take_eviction(jlog_ctx *ctx) {
+  struct _jlog_eviction ev;
+  jlog_file *f;
+  jlog_id chkpt;
+
+  /* an empty notice is the common case, and needs no lock */
+  if ((f = __jlog_open_eviction(ctx, ctx->subscriber_name, 0)) == NULL) return 0;
+  if (jlog_file_size(f) < (off_t)sizeof(ev)) {
+    jlog_file_close(f);
+    return 0;
   }
-  if(f[i] != '\0') return 0;
-  if(logid) *logid = l;
-  return 1;
+  if (!jlog_file_lock(f)) {
+    jlog_file_close(f);
+    SYS_FAIL(JLOG_ERR_LOCK);
+  }
+  if (!__jlog_pread_eviction(f, &ev)) {
+    jlog_file_unlock(f);
+    jlog_file_close(f);
+    return 0;
+  }
+  if (jlog_get_checkpoint(ctx, ctx->subscriber_name, &chkpt) != 0)
+    ctx->last_error = JLOG_ERR_INVALID_SUBSCRIBER;
+  else if (JLOG_ID_BEFORE(&chkpt, &ev.to) &&
+           __jlog_set_checkpoint(ctx, ctx->subscriber_name, &ev.to) != 0)
+    ctx->last_error = JLOG_ERR_CHECKPOINT;
+  else if (!jlog_file_truncate(f, 0))
+    ctx->last_error = JLOG_ERR_FILE_WRITE;
+  else
+    ctx->last_error = JLOG_ERR_SUBSCRIBER_EVICTED;
+  ctx->last_errno = ctx->last_error == JLOG_ERR_SUBSCRIBER_EVICTED ? 0 : errno;
+  jlog_file_unlock(f);
+  jlog_file_close(f);
+ finish:
+  return -1;
 }
 
-int jlog_clean(const char *file) {
-  int rv = -1;
-  u_int32_t earliest = 0;
-  jlog_ctx *log;
-  DIR *dir;
-  struct dirent *de;
-
-  log = jlog_new(file);
-  jlog_ctx_open_writer(log);
-  dir = opendir(file);
-  if(!dir) goto out;
+/* The first segment the policy keeps, counting back from the one being
+ * written, which is always kept. */
+static u_int32_t __jlog_retention_cutoff(jlog_ctx *ctx, u_int32_t earliest) {
+  const struct _jlog_meta_info *meta = ctx->meta;
+  const struct _jlog_retention *policy = ctx->retention;
+  u_int32_t log, cutoff = earliest;
+  u_int64_t bytes = 0;
+  time_t oldest = policy->retain_age ? time(NULL) - policy->retain_age : 0;
+  char file[MAXPATHLEN];
+  struct stat sb;
 
-  earliest = 0;
-  if(jlog_pending_readers(log, 0, &earliest) < 0) goto out;
+  if (meta->storage_log < earliest) return earliest;
+  if (policy->retain_segments && meta->storage_log - earliest >= policy->retain_segments)
+    cutoff = meta->storage_log - policy->retain_segments + 1;
+  if (!policy->retain_bytes && !oldest) return cutoff;
+  for (log = meta->storage_log; log > cutoff; log--) {
+    memset(file, 0, sizeof(file));
+    STRSETDATAFILE(ctx, file, log - 1);
+    if (stat(file, &sb) != 0) continue;
+    bytes += sb.st_size;
+    if ((policy->retain_bytes && bytes > policy->retain_bytes) ||
+        (oldest && sb.st_mtime < oldest)) return log;
+  }
+  return cutoff;
+}
 
-  rv = 0;
-  while((de = readdir(dir)) != NULL) {
-    u_int32_t logid;
-    if(is_datafile(de->d_name, &logid) && logid < earliest) {
-      char fullfile[MAXPATHLEN];
-      char fullidx[MAXPATHLEN];
+int jlog_ctx_enforce_retention(jlog_ctx *ctx) {
+  struct _jlog_evict evict;
+  jlog_lag_segment *segs = NULL;
+  jlog_id *pos = NULL;
+  jlog_ctx *ix = NULL;
+  char **subs = NULL;
+  char file[MAXPATHLEN];
+  unsigned int earliest = 0, latest = 0;
+  u_int32_t cutoff, base, log;
+  int i, n = 0, removed = 0;
 
-      memset(fullfile, 0, sizeof(fullfile));
-      memset(fullidx, 0, sizeof(fullidx));
-      snprintf(fullfile, sizeof(fullfile), "%s/%s", file, de->d_name);
-      snprintf(fullidx, sizeof(fullidx), "%s/%s" INDEX_EXT, file, de->d_name);
-      (void)unlink(fullfile);
-      (void)unlink(fullidx); /* this may not exist; don't care */
-      rv++;
-    }
+  ctx->last_error = JLOG_ERR_SUCCESS;
+  if (ctx->context_mode != JLOG_READ && ctx->context_mode != JLOG_APPEND) {
+    ctx->last_error = JLOG_ERR_NOT_SUPPORTED;
+    return -1;
   }
-  closedir(dir);
- out:
-  jlog_ctx_close(log);
-  return rv;
+  /* a policy may have been set since this jlog was opened */
+  if (__jlog_map_retention(ctx, 0) != 0) return -1;
+  if (!HAS_RETENTION(ctx)) return 0;
+  if (!__jlog_get_storage_bounds(ctx, &earliest, &latest)) return -1;
+  cutoff = __jlog_retention_cutoff(ctx, earliest);
+  if (cutoff <= earliest) return 0;
+
+  if ((n = jlog_ctx_list_subscribers(ctx, &subs)) < 0) {
+    n = 0;
+    SYS_FAIL(JLOG_ERR_NOTDIR);
+  }
+  if (n > 0 && (pos = calloc(n, sizeof(*pos))) == NULL)
+    SYS_FAIL(JLOG_ERR_FILE_READ);
+  base = cutoff;
+  for (i = 0; i < n; i++) {
+    /* what the cp.* file holds, not a lazy checkpoint's live position:
+     * a subscriber restarting from the file must find its segment */
+    if (__jlog_get_checkpoint(ctx, subs[i], &pos[i]) != 0)
+      pos[i].log = cutoff; /* removed under us */
+    if (pos[i].log < base) base = pos[i].log;
+  }
+  /* a checkpoint may be moved back before it is looked at again */
+  if (base < cutoff && earliest < base) base = earliest;
+  if (base < cutoff) {
+    if ((ix = __jlog_compact_indexer(ctx)) == NULL) goto finish;
+    if ((segs = calloc(cutoff - base, sizeof(*segs))) == NULL)
+      SYS_FAIL(JLOG_ERR_FILE_READ);
+  }
+  memset(&evict, 0, sizeof(evict));
+  evict.ix = ix;
+  evict.segs = segs;
+  evict.base = base;
+  evict.to.log = cutoff;
+  for (i = 0; i < n; i++) {
+    /* pos is only a hint: the move looks again under the lock */
+    if (pos[i].log >= cutoff) continue;
+    if (__jlog_evict_subscriber(ctx, subs[i], &evict) != 0) goto finish;
+  }
+  /* the checkpoints freed most of these already unless nobody reads */
+  for (log = earliest; log < cutoff; log++) {
+    memset(file, 0, sizeof(file));
+    STRSETDATAFILE(ctx, file, log);
+    if (access(file, F_OK) != 0) continue;
+    __jlog_reclaim_datafile(ctx, log);
+    removed++;
+  }
+
+ finish:
+  if (ix) jlog_ctx_close(ix);
+  free(segs);
+  free(pos);
+  if (subs) jlog_ctx_list_subscribers_dispose(ctx, subs);
+  if (ctx->last_error == JLOG_ERR_SUCCESS) return removed;
+  return -1;
 }
 
 /* ------------------ jlog_ctx_repair() and friends ----------- */
@@ -2846,7 +6921,17 @@ static int __jlog_get_storage_bounds(jlog_ctx *ctx, unsigned int *earliest, unsi
   return b0;
 }
 
-static int validate_metastore(const struct _jlog_meta_info *info, struct _jlog_meta_info *out) {
+static int validate_meta_ext(const struct _jlog_meta_ext *ext, u_int32_t hdr_magic) {
+  if((ext->features & ~JLOG_FEATURES_KNOWN) != 0) return 0;
+  if((ext->features & JLOG_FEATURE_SPARSE_INDEX) && ext->index_stride < 2) return 0;
+  if((ext->features & JLOG_FEATURE_FIXED_RECORDS) &&
+     (ext->record_size == 0 || IS_COMPRESS_MAGIC_HDR(hdr_magic))) return 0;
+  return 1;
+}
+
+static int validate_metastore(const struct _jlog_meta_info *info,
+                              const struct _jlog_meta_ext *ext,
+                              struct _jlog_meta_info *out) {
   int valid = 1;
   if(info->hdr_magic == DEFAULT_HDR_MAGIC || IS_COMPRESS_MAGIC_HDR(info->hdr_magic)) {
     if(out) out->hdr_magic = info->hdr_magic;
@@ -2868,13 +6953,24 @@ static int validate_metastore(const struct _jlog_meta_info *info, struct _jlog_m
   else {
     valid = 0;
   }
+  if(ext && !validate_meta_ext(ext, info->hdr_magic)) {
+    valid = 0;
+  }
   return valid;
 }
 
-static int metastore_ok_p(jlog_ctx *ctx, char *ag, unsigned int lat, struct _jlog_meta_info *out) {
-  struct _jlog_meta_info current;
+static int metastore_ok_p(jlog_ctx *ctx, char *ag, unsigned int lat,
+                          struct _jlog_meta_info *out, int *ext_ok) {
+  struct {
+    struct _jlog_meta_info info;
+    struct _jlog_meta_ext ext;
+  } current;
+  /* the extended metastore is only ever named for the features it has */
+  size_t want = ext_ok ? sizeof(current) : sizeof(current.info);
+  if(ext_ok) *ext_ok = 0;
   if(out) {
     /* setup the real defaults */
+    memset(out, 0, sizeof(*out));
     out->storage_log = lat;
     out->unit_limit = 4*1024*1024;
     out->safety = 1;
@@ -2882,20 +6978,24 @@ static int metastore_ok_p(jlog_ctx *ctx, char *ag, unsigned int lat, struct _jlo
   }
   int fd = open(ag, O_RDONLY);
   if ( fd < 0 ) return 0;
-  if ( lseek(fd, 0, SEEK_END) != sizeof(current) ) {
+  if ( lseek(fd, 0, SEEK_END) != (off_t)want ) {
     (void)close(fd);
     return 0;
   }
   (void)lseek(fd, 0, SEEK_SET);
-  int rd = read(fd, &current, sizeof(current));
+  int rd = read(fd, &current, want);
   (void)close(fd);
   fd = -1;
-  if ( rd != sizeof(current) )
+  if ( rd != (int)want )
     return 0;
 
   /* validate */
-  int valid = validate_metastore(&current, out);
-  if(current.storage_log != lat) {
+  int valid = validate_metastore(&current.info, NULL, out);
+  if(ext_ok) {
+    *ext_ok = validate_meta_ext(&current.ext, out ? out->hdr_magic : current.info.hdr_magic);
+    if(!*ext_ok) valid = 0;
+  }
+  if(current.info.storage_log != lat) {
     // we don't need to set out->storage_log, as it was set at the outset of this function
     valid = 0;
   }
@@ -2903,6 +7003,7 @@ static int metastore_ok_p(jlog_ctx *ctx, char *ag, unsigned int lat, struct _jlo
 }
 
 static int repair_metastore(jlog_ctx *ctx, const char *pth, unsigned int lat) {
+  struct stat sb;
   if ( pth == NULL ) pth = ctx->path;
   if ( pth == NULL || pth[0] == '\0' ) {
     FASSERT(ctx, 0, "invalid metastore path");
@@ -2913,22 +7014,35 @@ static int repair_metastore(jlog_ctx *ctx, const char *pth, unsigned int lat) {
     FASSERT(ctx, 0, "invalid metastore path length");
     return 0;
   }
-  size_t leen2 = leen + strlen("metastore") + 4; 
+  size_t leen2 = leen + strlen(METASTORE_EXT_FILE) + 4;
   char *ag = (char *)calloc(leen2, sizeof(char));
   if ( ag == NULL )             /* out of memory, so bail */
     return 0;
-  (void)snprintf(ag, leen2-1, "%s%cmetastore", pth, IFS_CH);
+  (void)snprintf(ag, leen2-1, "%s%c%s", pth, IFS_CH, METASTORE_EXT_FILE);
+  int has_ext = stat(ag, &sb) == 0;
+  if ( !has_ext )
+    (void)snprintf(ag, leen2-1, "%s%c%s", pth, IFS_CH, METASTORE_FILE);
   struct _jlog_meta_info out;
-  int b = metastore_ok_p(ctx, ag, lat, &out);
+  int ext_ok = 0;
+  int b = metastore_ok_p(ctx, ag, lat, &out, has_ext ? &ext_ok : NULL);
   FASSERT(ctx, b, "metastore integrity check failed");
-  if(b != 0) return 1;
-  int fd = open(ag, O_RDWR|O_CREAT, DEFAULT_FILE_MODE);
+  if(b != 0) {
+    free((void *)ag);
+    return 1;
+  }
+  /* defaults are no stand-in for the features a jlog was created with */
+  if(has_ext && !ext_ok) {
+    free((void *)ag);
+    FASSERT(ctx, 0, "cannot repair the features of an extended metastore");
+    return 0;
+  }
+  int fd = open(ag, has_ext ? O_RDWR : O_RDWR|O_CREAT, DEFAULT_FILE_MODE);
   free((void *)ag);
   ag = NULL;
   FASSERT(ctx, fd >= 0, "cannot create new metastore file");
   if ( fd < 0 )
     return 0;
-  if(ftruncate(fd, sizeof(out)) != 0) {
+  if(!has_ext && ftruncate(fd, sizeof(out)) != 0) {
     FASSERT(ctx, 0, "ftruncate failed (non-fatal)");
   }
   int wr = write(fd, &out, sizeof(out));
@@ -3067,6 +7181,9 @@ static int analyze_datafile(jlog_ctx *ctx, u_int32_t logid) {
     STRSETDATAFILE(ctx, idxfile, logid);
     strcat(idxfile, INDEX_EXT);
     unlink(idxfile);
+    STRSETDATAFILE(ctx, idxfile, logid);
+    strcat(idxfile, TIME_INDEX_EXT);
+    unlink(idxfile);
   }
   return rv;
 }
@@ -3092,10 +7209,12 @@ static int repair_data_files(jlog_ctx *log) {
     if(is_datafile(de->d_name, &logid)) {
       char fullfile[MAXPATHLEN];
       char fullidx[MAXPATHLEN];
+      char fulltdx[MAXPATHLEN];
       struct stat st;
       int readers;
       snprintf(fullfile, sizeof(fullfile), "%s/%s", log->path, de->d_name);
       snprintf(fullidx, sizeof(fullidx), "%s/%s" INDEX_EXT, log->path, de->d_name);
+      snprintf(fulltdx, sizeof(fulltdx), "%s/%s" TIME_INDEX_EXT, log->path, de->d_name);
       if(stat(fullfile, &st) == 0) {
         readers = __jlog_pending_readers(log, logid);
         if(analyze_datafile(log, logid) < 0) {
@@ -3104,6 +7223,7 @@ static int repair_data_files(jlog_ctx *log) {
         if(readers == 0) {
           unlink(fullfile);
           unlink(fullidx);
+          unlink(fulltdx);
         }
       }
     }
@@ -3138,6 +7258,24 @@ int jlog_ctx_repair(jlog_ctx *ctx, int aggressive) {
     // step 4: attempt to repair the checkpoint file. It might not need
     // any repair, in which case nothing will happen
     int b2 = repair_checkpointfile(ctx, pth, ear, lat);
+    // the subscriber table caches the checkpoints; mark it to be rebuilt
+    // from them on next use, in place as lazy readers map their slots
+    char tab[MAXPATHLEN];
+    jlog_file *stale;
+    __jlog_close_subtab(ctx);
+    (void)snprintf(tab, sizeof(tab), "%s%c%s", pth, IFS_CH, SUBSCRIBER_TABLE_FILE);
+    if ((stale = jlog_file_open(tab, 0, ctx->file_mode, ctx->multi_process)) != NULL) {
+      u_int32_t zero = 0;
+      if (jlog_file_lock(stale)) {
+        (void) jlog_file_pwrite(stale, &zero, sizeof(zero), 0);
+        jlog_file_unlock(stale);
+      }
+      jlog_file_close(stale);
+    }
+    /* and the published index length may describe indexes since rebuilt */
+    __jlog_close_index_length(ctx);
+    (void)snprintf(tab, sizeof(tab), "%s%c%s", pth, IFS_CH, INDEX_LENGTH_FILE);
+    (void)unlink(tab);
 
     // if aggressive repair is not authorized, fail
     if ( aggressive != 0 ) {
@@ -56,6 +56,10 @@ struct _jlog_message_header;
 struct _jlog_id;
 
 typedef struct _jlog_ctx jlog_ctx;
+typedef struct _jlog_prefetch jlog_prefetch;
+typedef struct _jlog_fanout jlog_fanout;
+typedef struct _jlog_shared jlog_shared;
+typedef struct _jlog_cursor jlog_cursor;
 
 typedef struct _jlog_message_header {
   u_int32_t reserved;
@@ -72,6 +76,15 @@ typedef struct _jlog_message_header_compressed {
   u_int32_t compressed_len;
 } jlog_message_header_compressed;
 
+#define JLOG_KEY_LEN 8
+
+/* Follows the base header of every record when the jlog was created with
+ * sequence numbers or keys enabled */
+typedef struct _jlog_message_header_ext {
+  u_int64_t seq;
+  char key[JLOG_KEY_LEN]; /* NUL padded */
+} jlog_message_header_ext;
+
 typedef struct _jlog_id {
   u_int32_t log;
   u_int32_t marker;
@@ -86,6 +99,35 @@ typedef struct _jlog_message {
   jlog_message_header_compressed aligned_header;
 } jlog_message;
 
+typedef struct _jlog_batch {
+  jlog_id first;
+  jlog_id last;
+  int count;
+  jlog_message *messages;
+} jlog_batch;
+
+/* How far a subscriber is behind the end of the log */
+typedef struct _jlog_subscriber_lag {
+  char *subscriber;
+  jlog_id checkpoint;      /* its position */
+  u_int64_t messages;      /* unread messages */
+  u_int64_t bytes;         /* on-disk bytes of those messages */
+  u_int32_t oldest_sec;    /* write time of the first unread, 0 if none */
+  u_int32_t oldest_usec;
+  u_int64_t evicted;       /* messages retention skipped it past, not yet
+                              reported to it by a read */
+} jlog_subscriber_lag;
+
+/* Selects records of a keyed jlog by key; an empty filter selects all */
+typedef struct _jlog_filter {
+  const char *const *keys; /* any of these keys exactly (a tag set) */
+  int nkeys;
+  const char *prefix;      /* or any key starting with this */
+} jlog_filter;
+
+/* return 0 to checkpoint past the batch, anything else to detach */
+typedef int (*jlog_fanout_func)(void *closure, const jlog_batch *batch);
+
 typedef enum {
   JLOG_BEGIN,
   JLOG_END
@@ -129,6 +171,7 @@ typedef enum {
   JLOG_ERR_CHECKPOINT,
   JLOG_ERR_NOT_SUPPORTED,
   JLOG_ERR_CLOSE_LOGID,
+  JLOG_ERR_SUBSCRIBER_EVICTED,
 } jlog_err;
 
 typedef enum {
@@ -141,6 +184,14 @@ typedef enum {
   JLOG_READ_METHOD_PREAD
 } jlog_read_method_type;
 
+/* How files are locked against other processes (see
+ * jlog_ctx_set_lock_backend); 0 is single-process mode. */
+typedef enum {
+  JLOG_LOCK_FCNTL = 1,
+  JLOG_LOCK_OFD,
+  JLOG_LOCK_SHARED_MUTEX
+} jlog_lock_backend;
+
 typedef void (*jlog_error_func) (void *ctx, const char *msg, ...);
 
 JLOG_API(jlog_ctx *) jlog_new(const char *path);
@@ -151,6 +202,32 @@ JLOG_API(int)       jlog_ctx_init(jlog_ctx *ctx);
 JLOG_API(int)       jlog_get_checkpoint(jlog_ctx *ctx, const char *s, jlog_id *id);
 JLOG_API(int)       jlog_ctx_list_subscribers_dispose(jlog_ctx *ctx, char **subs);
 JLOG_API(int)       jlog_ctx_list_subscribers(jlog_ctx *ctx, char ***subs);
+/**
+ * Measure how far `subscriber` is behind: its unread messages, their size
+ * on disk and the write time of the first of them (zeroed if it is caught
+ * up).  Whole segments are counted from their indexes and sizes, so this
+ * costs a few reads per segment behind rather than a walk of the records.
+ * A subscriber with a lazy checkpoint is measured from its live position.
+ * `ctx` may be in any mode.
+ */
+JLOG_API(int)       jlog_ctx_subscriber_lag(jlog_ctx *ctx, const char *subscriber,
+                                            u_int64_t *messages, u_int64_t *bytes,
+                                            struct timeval *oldest);
+/**
+ * Measure the subscriber named by `lag->subscriber` as
+ * `jlog_ctx_subscriber_lag` does, filling in the rest of `lag`, the
+ * messages retention evicted it past included.
+ */
+JLOG_API(int)       jlog_ctx_subscriber_lag_detail(jlog_ctx *ctx, jlog_subscriber_lag *lag);
+/**
+ * Measure every subscriber as `jlog_ctx_subscriber_lag` does, counting each
+ * segment once for all of them.  Free the list with
+ * `jlog_ctx_subscribers_lag_dispose`.
+ * @return the number of subscribers, -1 on error
+ */
+JLOG_API(int)       jlog_ctx_subscribers_lag(jlog_ctx *ctx, jlog_subscriber_lag **lags);
+JLOG_API(void)      jlog_ctx_subscribers_lag_dispose(jlog_ctx *ctx, jlog_subscriber_lag *lags,
+                                                     int count);
 
 JLOG_API(int)       jlog_ctx_err(jlog_ctx *ctx);
 JLOG_API(const char *) jlog_ctx_err_string(jlog_ctx *ctx);
@@ -164,6 +241,37 @@ JLOG_API(int)       jlog_ctx_alter_journal_size(jlog_ctx *ctx, size_t size);
 JLOG_API(int)       jlog_ctx_repair(jlog_ctx *ctx, int aggressive);
 JLOG_API(int)       jlog_ctx_alter_safety(jlog_ctx *ctx, jlog_safety safety);
 JLOG_API(int)       jlog_ctx_alter_read_method(jlog_ctx *ctx, jlog_read_method_type method);
+/**
+ * Bound the disk the jlog may use, whatever its subscribers have read.
+ * Once its segments exceed `max_bytes` in total, are older than `max_age`
+ * seconds or number more than `max_segments`, the oldest are deleted;
+ * any subscriber still behind them is moved past them and its next
+ * `jlog_ctx_read_interval` fails once with JLOG_ERR_SUBSCRIBER_EVICTED,
+ * the messages it lost being reported by `jlog_ctx_subscriber_lag` until
+ * then.  The segment being written is always kept.  0 leaves a limit off.
+ * The policy is stored beside the metastore, so like
+ * `jlog_ctx_alter_safety` this is called in JLOG_NEW or JLOG_APPEND mode;
+ * writers enforce it each time they start a new segment, and pick up a
+ * policy first set after they opened the jlog then too.
+ */
+JLOG_API(int)       jlog_ctx_set_retention(jlog_ctx *ctx, u_int64_t max_bytes,
+                                           u_int32_t max_age, u_int32_t max_segments);
+/**
+ * Enforce the retention policy now, e.g. from a reclaimer process while
+ * writers are idle.  `ctx` may be a reader or a writer.
+ * @return the number of segments deleted, -1 on error
+ */
+JLOG_API(int)       jlog_ctx_enforce_retention(jlog_ctx *ctx);
+/**
+ * Get a jlog ready to read after a crash or a move, across `nthreads`
+ * threads (the calling thread included).  Every sealed segment is
+ * inspected and its index checked against its records; a damaged segment
+ * is repaired and a wrong index thrown away.  Then every index is brought
+ * up to date, so the first reader finds them built.  `ctx` may be a reader
+ * or a writer.
+ * @return the number of segments repaired or reindexed, -1 on error
+ */
+JLOG_API(int)       jlog_ctx_prepare(jlog_ctx *ctx, int nthreads);
 
 /**
  * Control whether this jlog process should use multi-process safe file locks when performing 
@@ -175,6 +283,21 @@ JLOG_API(int)       jlog_ctx_alter_read_method(jlog_ctx *ctx, jlog_read_method_t
  */
 JLOG_API(int)       jlog_ctx_set_multi_process(jlog_ctx *ctx, uint8_t mproc);
 
+/**
+ * Choose how this context locks files against other processes.
+ * JLOG_LOCK_FCNTL (the default) takes an fcntl record lock on every
+ * acquisition.  JLOG_LOCK_OFD takes open file description locks instead,
+ * which other processes' fcntl locks still exclude, so it can be chosen
+ * per process.  JLOG_LOCK_SHARED_MUTEX is chosen for a jlog when it is
+ * created (call this before `jlog_ctx_init`): its files are then locked by
+ * robust process-shared mutexes in a small mapped "locks" file, which cost
+ * no system call when uncontended and are recovered if their holder dies.
+ * Every process opening such a jlog locks it that way, whatever it chose;
+ * platforms without robust mutexes cannot open it.  Implies multi-process
+ * mode.
+ */
+JLOG_API(int)       jlog_ctx_set_lock_backend(jlog_ctx *ctx, jlog_lock_backend backend);
+
 /**
  * must be called after jlog_new and before the 'open' functions
  * defaults to using JLOG_COMPRESSION_LZ4
@@ -197,6 +320,72 @@ JLOG_API(int)       jlog_ctx_set_use_compression(jlog_ctx *ctx, uint8_t use);
  */
 JLOG_API(int)       jlog_ctx_set_compression_provider(jlog_ctx *ctx, jlog_compression_provider_choice provider);
 
+/**
+ * Decompress the messages of a `jlog_ctx_bulk_read_messages` call on a compressed jlog
+ * across `nthreads` threads (the calling thread included).  The call still returns only
+ * once every message in the batch is ready.  0 or 1 (the default) decompresses serially
+ * on the calling thread.  This has no effect on uncompressed jlogs.
+ */
+JLOG_API(int)       jlog_ctx_set_decompression_threads(jlog_ctx *ctx, int nthreads);
+/**
+ * Unlink the segments this context's checkpoints free on a background
+ * thread instead of inline, so moving a checkpoint past the end of a
+ * segment costs no filesystem work.  One thread serves every context in
+ * the process and unlinks at most `segments_per_sec` segments a second
+ * (0 for no limit; the most recent setting wins).  `jlog_ctx_close` waits
+ * for the queue to empty; a process that exits without closing may leave
+ * freed segments behind for `jlogctl repair` to clean up.
+ */
+JLOG_API(int)       jlog_ctx_set_async_reclaim(jlog_ctx *ctx, int enable, u_int32_t segments_per_sec);
+/**
+ * Wait until every segment queued for background reclamation is unlinked.
+ */
+JLOG_API(void)      jlog_reclaim_drain(void);
+
+/**
+ * Stamp every record of a new jlog with a global, monotonic 64-bit sequence
+ * number (starting at 1) that `jlog_message_seq` reports for the messages
+ * read back, and that `jlog_ctx_seek_seq` can locate directly.  Like
+ * compression, this must be chosen before `jlog_ctx_init` and cannot be
+ * changed afterwards.
+ */
+JLOG_API(int)       jlog_ctx_set_sequence_numbers(jlog_ctx *ctx, int enable);
+/**
+ * Give every record of a new jlog a key of up to JLOG_KEY_LEN bytes in its
+ * header, set with `jlog_ctx_write_message_key` and reported by
+ * `jlog_message_key`, so that `jlog_ctx_bulk_read_filtered` can select
+ * records without touching the payloads of the rest.  Must be chosen
+ * before `jlog_ctx_init`.
+ */
+JLOG_API(int)       jlog_ctx_set_record_keys(jlog_ctx *ctx, int enable);
+/**
+ * Index the segments of a new jlog with 32-bit offsets instead of 64-bit
+ * ones, halving the index that readers page in.  Every record must start
+ * within 4G of its segment's beginning, which holds when the unit limit
+ * plus the pre-commit buffer stays below that.  Must be chosen before
+ * `jlog_ctx_init`; readers pick the width up from the metastore.
+ */
+JLOG_API(int)       jlog_ctx_set_compact_index(jlog_ctx *ctx, int enable);
+/**
+ * Index only every `stride`th record of a new jlog (1 or 0 for all of
+ * them), for logs that are read in order.  Intervals, bulk and cursor
+ * reads cost about the same; a single message is found by walking up to
+ * `stride - 1` record headers from the entry before it.  Must be chosen
+ * before `jlog_ctx_init`.
+ */
+JLOG_API(int)       jlog_ctx_set_sparse_index(jlog_ctx *ctx, u_int32_t stride);
+/**
+ * Make every record of a new jlog `size` bytes long (0 for any length).
+ * Record k of a segment then starts at a multiple of the record size, so
+ * no index files are kept: readers find records by arithmetic and count
+ * them from the segment's length.  Writes of any other length fail with
+ * JLOG_ERR_ILLEGAL_WRITE.  A record torn by a writer that died is cut off
+ * by the next write; reading one that is not fails with
+ * JLOG_ERR_FILE_CORRUPT.  Cannot be combined with compression or
+ * `jlog_ctx_compact`.  Must be chosen before `jlog_ctx_init`.
+ */
+JLOG_API(int)       jlog_ctx_set_fixed_records(jlog_ctx *ctx, u_int32_t size);
+
 /**
  * Turn on the use of a pre-commit buffer.  This will gain you increased throughput through reduction of 
  * `pwrite/v` syscalls.  Note however, care must be taken.  This is only safe for single writer
@@ -240,11 +429,44 @@ JLOG_API(int)       jlog_ctx_remove_subscriber(jlog_ctx *ctx, const char *subscr
 
 JLOG_API(int)       jlog_ctx_write(jlog_ctx *ctx, const void *message, size_t mess_len);
 JLOG_API(int)       jlog_ctx_write_message(jlog_ctx *ctx, jlog_message *msg, struct timeval *when);
+/**
+ * Write a message with a key of at most JLOG_KEY_LEN bytes; the jlog must
+ * have been created with keys.
+ */
+JLOG_API(int)       jlog_ctx_write_message_key(jlog_ctx *ctx, jlog_message *msg, struct timeval *when,
+                                               const void *key, size_t key_len);
 JLOG_API(int)       jlog_ctx_read_interval(jlog_ctx *ctx,
                                            jlog_id *first_mess, jlog_id *last_mess);
 JLOG_API(int)       jlog_ctx_read_message(jlog_ctx *ctx, const jlog_id *, jlog_message *);
 JLOG_API(int)       jlog_ctx_bulk_read_messages(jlog_ctx *ctx, const jlog_id *, const int, jlog_message *);
+/**
+ * Like `jlog_ctx_bulk_read_messages`, but of the `count` messages from
+ * `start` only those whose key passes `filter` are returned, in order,
+ * with their ids in `ids` (if not NULL).  Keys are checked in the record
+ * headers, so the payloads of other messages are never read or
+ * decompressed, and blocks of a sealed segment whose key summary rules
+ * out a match are skipped without reading their headers.  Checkpoint at
+ * the end of the interval as usual.
+ * @return number of messages returned, -1 on error
+ */
+JLOG_API(int)       jlog_ctx_bulk_read_filtered(jlog_ctx *ctx, const jlog_filter *filter,
+                                                const jlog_id *start, int count,
+                                                jlog_message *messages, jlog_id *ids);
 JLOG_API(int)       jlog_ctx_read_checkpoint(jlog_ctx *ctx, const jlog_id *checkpoint);
+/**
+ * Make this reader's `jlog_ctx_read_checkpoint` calls update its position in
+ * memory and in the shared subscriber table only; a background thread writes
+ * the checkpoint file `interval_ms` after the first unwritten checkpoint, or
+ * as soon as `messages` messages (or a segment boundary) have been
+ * checkpointed, whichever comes first.  Either limit may be 0 to leave it
+ * out; both 0 turns lazy checkpoints off again.  Seeks and other ways of
+ * setting the checkpoint, and `jlog_ctx_close`, persist at once.  Segments
+ * are only freed once the checkpoints past them are written.  After a crash
+ * the subscriber resumes from the last written checkpoint, so up to
+ * `interval_ms` worth or `messages` messages may be delivered again.
+ */
+JLOG_API(int)       jlog_ctx_set_lazy_checkpoint(jlog_ctx *ctx, u_int32_t interval_ms,
+                                                 u_int32_t messages);
 JLOG_API(int)       jlog_snprint_logid(char *buff, int n, const jlog_id *checkpoint);
 
 JLOG_API(int)       jlog_pending_readers(jlog_ctx *ctx, u_int32_t log, u_int32_t *earliest_ptr);
@@ -255,5 +477,229 @@ JLOG_API(int)       jlog_ctx_last_storage_log(jlog_ctx *ctx, uint32_t *logid);
 JLOG_API(int)       jlog_ctx_advance_id(jlog_ctx *ctx, jlog_id *cur, 
                                         jlog_id *start, jlog_id *finish);
 JLOG_API(int)       jlog_clean(const char *path);
+/**
+ * Send the records from start to finish inclusive, which may span
+ * segments, to a file descriptor exactly as they lie on disk, after a
+ * short header describing their layout.  The bytes are copied in the
+ * kernel where the platform allows (sendfile(2)).  Requires a reader
+ * context; no checkpoint is moved.
+ * @return number of records sent, -1 on error
+ */
+JLOG_API(int)       jlog_ctx_export(jlog_ctx *ctx, const jlog_id *start,
+                                    const jlog_id *finish, int fd);
+/**
+ * Append the records of an export stream, which may hold several exports
+ * back to back, read from a file descriptor until end of file.  The
+ * target must have been created with the same compression and features
+ * as the source; a stream whose records are laid out differently is
+ * refused with JLOG_ERR_FILE_CORRUPT.  Each record's header is checked
+ * before it is appended, and records keep their timestamps, keys and
+ * sequence numbers.  Requires a writer context.
+ * @return number of records appended, -1 on error (records appended
+ *         before a bad header was met are kept)
+ */
+JLOG_API(int)       jlog_ctx_import(jlog_ctx *ctx, int fd);
+/**
+ * Ship everything the context's subscriber has not yet read to a follower
+ * on a connected stream socket (see jlog_ctx_follow), returning once the
+ * follower has acknowledged all of it.  Each segment's records go out as
+ * they lie on disk, from the same offset, so the follower's segments are
+ * byte for byte the leader's.  Call it again to ship what has been
+ * written since.  Requires a reader context.
+ * @param[in] hold when non-zero the subscriber's checkpoint only moves as
+ *            the follower acknowledges durable positions, so segments are
+ *            kept until the follower has them; otherwise it moves as data
+ *            is sent and several frames may be in flight
+ * @return number of records shipped, -1 on error
+ */
+JLOG_API(int)       jlog_ctx_ship(jlog_ctx *ctx, int fd, int hold);
+/**
+ * Apply what a leader's jlog_ctx_ship sends over fd until the leader
+ * closes the connection, syncing each frame to disk before acknowledging
+ * it.  The follower must have been created with the same compression
+ * and features as the leader, and should not be written to otherwise.
+ * Requires a writer context.
+ * @return number of records applied, -1 on error
+ */
+JLOG_API(int)       jlog_ctx_follow(jlog_ctx *ctx, int fd);
+/**
+ * Make a consistent, readable copy of the jlog in a new directory.
+ * Writers are held off only while it is made: sealed segments and their
+ * indexes are hard linked (copied across filesystems), and the active
+ * segment up to its current length, the metastore and the subscriber
+ * checkpoints are copied, so the cost does not grow with the log.
+ * Requires a writer context; its pre-commit buffer is flushed first.
+ * @param[in] dest a path that does not exist yet
+ * @return 0 on success, -1 on error (dest is removed again)
+ */
+JLOG_API(int)       jlog_ctx_snapshot(jlog_ctx *ctx, const char *dest);
+/**
+ * Compact a keyed jlog: rewrite its sealed segments so that only the
+ * latest record for each key remains (records without a key are kept).
+ * Segments holding a subscriber's checkpoint are left untouched, as is
+ * the segment being written, though newer records there still supersede
+ * older ones elsewhere.  Segments left empty are removed.  Record order is
+ * preserved, but markers within a rewritten segment change, so readers
+ * positioned in it while it is swapped may see superseded records.
+ * Requires a writer context, and is not supported with fixed records.
+ * @param[in] bytes_per_sec limits the I/O of the pass, 0 for no limit
+ * @return number of records removed, -1 on error
+ */
+JLOG_API(int)       jlog_ctx_compact(jlog_ctx *ctx, size_t bytes_per_sec);
+
+/**
+ * Find the first message written at or after `when`, assuming messages are
+ * written in time order.  Segments are binary searched by their first
+ * message, then a sealed segment's sparse time index narrows the search
+ * before the headers themselves are probed.  If every message is older,
+ * `id` is set just past the last one.  Requires a reader context.
+ */
+JLOG_API(int)       jlog_ctx_seek_time(jlog_ctx *ctx, const struct timeval *when, jlog_id *id);
+/**
+ * Find the record with sequence number `seq`, or the first one after it if
+ * it is gone or was never written.  Segments are binary searched by their
+ * first sequence number and the record is then addressed directly.  If
+ * every record is older, `id` is set just past the last one.  Requires a
+ * reader context on a jlog with sequence numbers.
+ */
+JLOG_API(int)       jlog_ctx_seek_seq(jlog_ctx *ctx, u_int64_t seq, jlog_id *id);
+/**
+ * The sequence number of a message read from `ctx` (or through a cursor
+ * or prefetch on it), found in the extension header behind `m->header`;
+ * valid for as long as the message itself.
+ * @return the sequence number, 0 if the jlog has none
+ */
+JLOG_API(u_int64_t) jlog_message_seq(jlog_ctx *ctx, const jlog_message *m);
+/**
+ * The key of a message read from `ctx`, like `jlog_message_seq`: the
+ * JLOG_KEY_LEN bytes it was written with, NUL padded (and so not
+ * terminated when the key fills them).
+ * @return the key, NULL if the jlog has none
+ */
+JLOG_API(const char *) jlog_message_key(jlog_ctx *ctx, const jlog_message *m);
+/**
+ * Position `subscriber` (the reader's own if NULL) so that the next read
+ * starts at the first message at or after `when`.
+ */
+JLOG_API(int)       jlog_ctx_set_subscriber_checkpoint_time(jlog_ctx *ctx, const char *subscriber,
+                                                            const struct timeval *when);
+
+/**
+ * Treat the reader's subscriber as a consumer group: any number of
+ * processes may open readers on it and lease disjoint ranges of at most
+ * `max` messages.  Ranges abandoned by a process that exited (or gave them
+ * back) are leased again first, so delivery is at least once.  Only one
+ * lease may be outstanding per context.
+ * @return count of messages leased, 0 if nothing is available, -1 on error
+ */
+JLOG_API(int)       jlog_ctx_group_lease(jlog_ctx *ctx, int max, jlog_id *start, jlog_id *finish);
+/**
+ * Mark the current lease processed.  The subscriber's checkpoint advances
+ * through every processed range below the earliest lease still out.
+ */
+JLOG_API(int)       jlog_ctx_group_commit(jlog_ctx *ctx);
+/**
+ * Give the current lease back unprocessed for another worker to take.
+ */
+JLOG_API(int)       jlog_ctx_group_release(jlog_ctx *ctx);
+
+/**
+ * Start a read-ahead pipeline for an open reader.  A background thread with
+ * its own reader walks forward from the subscriber's current checkpoint and
+ * stages up to `depth` (2 if less) batches of at most `batch_size` messages,
+ * so the next batch is read and decompressed while the caller processes the
+ * current one.  The prefetcher never checkpoints: call
+ * `jlog_ctx_read_checkpoint(ctx, &batch->last)` once a batch is processed.
+ * `ctx` must not be used for other reads while the prefetcher is running.
+ * @return the prefetcher, or NULL with the error set on `ctx`
+ */
+JLOG_API(jlog_prefetch *) jlog_prefetch_new(jlog_ctx *ctx, int batch_size, int depth);
+/**
+ * Take the next staged batch, waiting up to `timeout_ms` (-1 forever, 0 not
+ * at all).  The batch stays valid until handed back with
+ * `jlog_prefetch_release`.
+ * @return message count, 0 if nothing arrived in time, -1 on a read error
+ *         (reported through jlog_ctx_err on the reader ctx)
+ */
+JLOG_API(int)       jlog_prefetch_next(jlog_prefetch *pf, jlog_batch **batch, int timeout_ms);
+JLOG_API(void)      jlog_prefetch_release(jlog_prefetch *pf, jlog_batch *batch);
+JLOG_API(void)      jlog_prefetch_destroy(jlog_prefetch *pf);
+
+/**
+ * Create a reader that reads and decompresses the log once on behalf of
+ * many subscribers.  `ctx` comes straight from jlog_new (its read method,
+ * decompression threads and multi-process setting are inherited) and
+ * receives any errors.  Batches hold at most `batch_size` messages and at
+ * most `window` of them are kept, which bounds how far the fastest
+ * subscriber can get ahead of the slowest.
+ * @return the fan-out reader, or NULL with the error set on `ctx`
+ */
+JLOG_API(jlog_fanout *) jlog_fanout_new(jlog_ctx *ctx, int batch_size, int window);
+/**
+ * Attach `subscriber` before jlog_fanout_start.  `func` runs on a thread of
+ * the subscriber's own with every batch past its checkpoint; the batch is
+ * only valid during the call.  When `func` returns 0 the subscriber is
+ * checkpointed past the batch; otherwise it is detached where it stands.
+ */
+JLOG_API(int)       jlog_fanout_add_subscriber(jlog_fanout *fo, const char *subscriber,
+                                               jlog_fanout_func func, void *closure);
+/**
+ * Start reading from the earliest checkpoint among the subscribers.
+ */
+JLOG_API(int)       jlog_fanout_start(jlog_fanout *fo);
+/**
+ * Stop reading and wait for any callbacks in progress.
+ * @return 0, or -1 if a read or checkpoint failed (see jlog_ctx_err)
+ */
+JLOG_API(int)       jlog_fanout_stop(jlog_fanout *fo);
+JLOG_API(void)      jlog_fanout_destroy(jlog_fanout *fo);
+
+/**
+ * Share an open reader among the threads of a worker pool.  Each thread
+ * reads through a `jlog_cursor` of its own; segments are mapped once for
+ * all of them, and reads take no lock except when a cursor moves to a
+ * segment, or past the end of the segment being written as it last saw
+ * it.  Records are always read from the mapping, whatever the read method.
+ * `ctx` must not be used directly until the handle is destroyed, which
+ * must wait for every cursor to be destroyed.
+ * @return the shared reader, or NULL with the error set on `ctx`
+ */
+JLOG_API(jlog_shared *) jlog_shared_new(jlog_ctx *ctx);
+JLOG_API(void)      jlog_shared_destroy(jlog_shared *sh);
+/**
+ * Create a cursor for one thread; a cursor is not itself thread safe.
+ * @return the cursor, or NULL if memory ran out
+ */
+JLOG_API(jlog_cursor *) jlog_cursor_new(jlog_shared *sh);
+/**
+ * Destroy a cursor, giving back any range it still holds.
+ */
+JLOG_API(void)      jlog_cursor_destroy(jlog_cursor *c);
+/**
+ * Lease the next range of at most `max` messages of the subscriber's
+ * stream, disjoint from every other cursor's.  Ranges given back are
+ * leased again first.  Only one lease may be outstanding per cursor.
+ * @return count of messages leased, 0 if nothing is available, -1 on error
+ */
+JLOG_API(int)       jlog_cursor_next(jlog_cursor *c, int max, jlog_id *start, jlog_id *finish);
+/**
+ * Mark the cursor's lease processed.  The subscriber's checkpoint advances
+ * through every processed range below the earliest lease still out.
+ */
+JLOG_API(int)       jlog_cursor_commit(jlog_cursor *c);
+/**
+ * Give the cursor's lease back unprocessed for another cursor to take.
+ */
+JLOG_API(int)       jlog_cursor_release(jlog_cursor *c);
+/**
+ * Read a message as `jlog_ctx_read_message` does.  The message is valid
+ * until the next read through this cursor or its destruction.
+ */
+JLOG_API(int)       jlog_cursor_read_message(jlog_cursor *c, const jlog_id *id, jlog_message *m);
+/**
+ * The error (a jlog_err) and errno of the cursor's last failed call.
+ */
+JLOG_API(int)       jlog_cursor_err(jlog_cursor *c);
+JLOG_API(int)       jlog_cursor_errno(jlog_cursor *c);
 
 #endif
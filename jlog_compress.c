@@ -31,6 +31,7 @@
 
 
 #include <stdio.h>
+#include <pthread.h>
 #include "jlog_config.h"
 #include "jlog_compress.h"
 #include "jlog_private.h"
@@ -103,3 +104,133 @@ jlog_decompress(const char *source, const size_t source_bytes, char *dest, size_
   }
   return rv;
 }
+
+struct jlog_decompress_pool {
+  pthread_mutex_t lock;
+  pthread_cond_t work_cv;
+  pthread_cond_t done_cv;
+  pthread_t *workers;
+  int nworkers;
+  int shutdown;
+  /* the batch currently being worked on */
+  jlog_decompress_job *jobs;
+  int count;
+  int next;
+  int chunk;
+  int pending;
+  int failed;
+};
+
+/* claim and run chunks of the current batch until it is exhausted;
+ * called with pool->lock held and returns with it held */
+static void
+jlog_decompress_pool_drain(jlog_decompress_pool *pool)
+{
+  while (pool->jobs != NULL && pool->next < pool->count) {
+    int i, start = pool->next, end = start + pool->chunk, failed = 0;
+    jlog_decompress_job *jobs = pool->jobs;
+    if (end > pool->count) end = pool->count;
+    pool->next = end;
+    pthread_mutex_unlock(&pool->lock);
+    for (i = start; i < end; i++) {
+      jobs[i].rv = jlog_decompress(jobs[i].source, jobs[i].source_bytes,
+                                   jobs[i].dest, jobs[i].dest_bytes);
+      if (jobs[i].rv < 0) failed = 1;
+    }
+    pthread_mutex_lock(&pool->lock);
+    if (failed) pool->failed = 1;
+    pool->pending -= (end - start);
+    if (pool->pending == 0) pthread_cond_broadcast(&pool->done_cv);
+  }
+}
+
+static void *
+jlog_decompress_pool_worker(void *arg)
+{
+  jlog_decompress_pool *pool = arg;
+
+  pthread_mutex_lock(&pool->lock);
+  while (!pool->shutdown) {
+    if (pool->jobs == NULL || pool->next >= pool->count) {
+      pthread_cond_wait(&pool->work_cv, &pool->lock);
+      continue;
+    }
+    jlog_decompress_pool_drain(pool);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+jlog_decompress_pool *
+jlog_decompress_pool_create(int nthreads)
+{
+  jlog_decompress_pool *pool;
+  int i;
+
+  if (nthreads < 1) nthreads = 1;
+  pool = calloc(1, sizeof(*pool));
+  if (pool == NULL) return NULL;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work_cv, NULL);
+  pthread_cond_init(&pool->done_cv, NULL);
+  pool->workers = calloc(nthreads, sizeof(pthread_t));
+  if (pool->workers == NULL) {
+    jlog_decompress_pool_destroy(pool);
+    return NULL;
+  }
+  /* the caller of jlog_decompress_pool_run is the Nth thread */
+  for (i = 0; i < nthreads - 1; i++) {
+    if (pthread_create(&pool->workers[i], NULL, jlog_decompress_pool_worker, pool) != 0) break;
+    pool->nworkers++;
+  }
+  return pool;
+}
+
+void
+jlog_decompress_pool_destroy(jlog_decompress_pool *pool)
+{
+  int i;
+
+  if (pool == NULL) return;
+  pthread_mutex_lock(&pool->lock);
+  pool->shutdown = 1;
+  pthread_cond_broadcast(&pool->work_cv);
+  pthread_mutex_unlock(&pool->lock);
+  for (i = 0; i < pool->nworkers; i++) {
+    pthread_join(pool->workers[i], NULL);
+  }
+  pthread_cond_destroy(&pool->done_cv);
+  pthread_cond_destroy(&pool->work_cv);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->workers);
+  free(pool);
+}
+
+int
+jlog_decompress_pool_run(jlog_decompress_pool *pool, jlog_decompress_job *jobs, int count)
+{
+  int failed;
+
+  if (count <= 0) return 0;
+  pthread_mutex_lock(&pool->lock);
+  pool->jobs = jobs;
+  pool->count = count;
+  pool->next = 0;
+  pool->pending = count;
+  pool->failed = 0;
+  /* hand out a few chunks per thread so uneven message sizes balance out */
+  pool->chunk = count / ((pool->nworkers + 1) * 4);
+  if (pool->chunk < 1) pool->chunk = 1;
+  pthread_cond_broadcast(&pool->work_cv);
+
+  jlog_decompress_pool_drain(pool);
+  while (pool->pending > 0) {
+    pthread_cond_wait(&pool->done_cv, &pool->lock);
+  }
+  failed = pool->failed;
+  pool->jobs = NULL;
+  pool->count = 0;
+  pool->next = 0;
+  pthread_mutex_unlock(&pool->lock);
+  return failed ? -1 : 0;
+}
@@ -73,5 +73,37 @@ int jlog_compress(const char *source, const size_t source_bytes, char **dest, si
  */
 int jlog_decompress(const char *source, const size_t source_bytes, char *dest, size_t dest_bytes);
 
+/**
+ * one unit of work for a jlog_decompress_pool; rv is set to the
+ * jlog_decompress return value once the job has run
+ */
+typedef struct jlog_decompress_job {
+  const char *source;
+  size_t source_bytes;
+  char *dest;
+  size_t dest_bytes;
+  int rv;
+} jlog_decompress_job;
+
+typedef struct jlog_decompress_pool jlog_decompress_pool;
+
+/**
+ * create a pool of worker threads for decompressing batches of messages.
+ * the calling thread participates in every batch, so a pool of N threads
+ * starts N-1 workers.  returns NULL on failure.
+ */
+jlog_decompress_pool *jlog_decompress_pool_create(int nthreads);
+
+/**
+ * stop and join the workers and free the pool
+ */
+void jlog_decompress_pool_destroy(jlog_decompress_pool *pool);
+
+/**
+ * decompress all jobs, spreading them across the pool.  returns once every
+ * job has completed: 0 if all succeeded, < 0 if any failed
+ */
+int jlog_decompress_pool_run(jlog_decompress_pool *pool, jlog_decompress_job *jobs, int count);
+
 
 #endif
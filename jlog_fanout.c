@@ -0,0 +1,420 @@
+/*
+ * Copyright (c) 2016, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *    * Neither the name Circonus, Inc. nor the names
+ *      of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written
+ *      permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * One reader, many subscribers.  A pump thread walks the log once from
+ * the earliest checkpoint among the attached subscribers and stages each
+ * batch (copied out of its reader, as the prefetcher does) in a ring of
+ * `window` slots.  Every subscriber has its own thread which hands the
+ * batches, trimmed to what lies past its own checkpoint, to its callback
+ * and then checkpoints through a private context that never maps data.
+ * The pump reuses a slot only once every attached subscriber is done
+ * with it, so a slow subscriber lets the others run at most `window`
+ * batches ahead before it holds them back.
+ */
+
+#include "jlog_config.h"
+#include "jlog_private.h"
+#include <pthread.h>
+#if HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#if HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+
+#define JLOG_FANOUT_IDLE_USEC 10000
+
+typedef struct {
+  jlog_batch batch;
+  char *data;
+  size_t data_len;
+} jlog_fanout_slot;
+
+typedef struct {
+  jlog_fanout *fo;
+  jlog_ctx *ctx;     /* checkpoints only */
+  jlog_fanout_func func;
+  void *closure;
+  jlog_id chkpt;
+  u_int64_t next;    /* batch number to deliver next */
+  int attached;
+  int error;
+  int error_errno;
+  pthread_t thread;
+  int thread_started;
+} jlog_fanout_sub;
+
+struct _jlog_fanout {
+  jlog_ctx *ctx;     /* settings and error reporting */
+  jlog_ctx *reader;  /* private to the pump thread */
+  pthread_t thread;
+  int thread_started;
+  pthread_mutex_t lock;
+  pthread_cond_t cv;
+  int running;
+  int stop;
+  int pump_done;
+  int error;
+  int error_errno;
+  int batch_size;
+  int window;
+  u_int64_t produced;
+  jlog_id cursor;
+  jlog_fanout_slot *slots;
+  jlog_fanout_sub **subs;
+  int nsubs;
+};
+
+static void
+__jlog_fanout_deadline(struct timespec *ts, long usec) {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  now.tv_usec += usec;
+  now.tv_sec += now.tv_usec / 1000000;
+  now.tv_usec %= 1000000;
+  ts->tv_sec = now.tv_sec;
+  ts->tv_nsec = now.tv_usec * 1000;
+}
+
+static void *
+__jlog_fanout_pump(void *arg) {
+  jlog_fanout *fo = arg;
+  jlog_fanout_slot *slot;
+  jlog_id start, finish;
+  struct timespec ts;
+  u_int64_t oldest;
+  int i, attached, count;
+
+  pthread_mutex_lock(&fo->lock);
+  while(!fo->stop) {
+    oldest = fo->produced;
+    attached = 0;
+    for(i=0; i<fo->nsubs; i++) {
+      if(!fo->subs[i]->attached) continue;
+      attached++;
+      if(fo->subs[i]->next < oldest) oldest = fo->subs[i]->next;
+    }
+    if(attached == 0) break;
+    if(fo->produced - oldest >= (u_int64_t)fo->window) {
+      pthread_cond_wait(&fo->cv, &fo->lock);
+      continue;
+    }
+    /* no attached subscriber can still be looking at this slot */
+    slot = &fo->slots[fo->produced % fo->window];
+    pthread_mutex_unlock(&fo->lock);
+
+    count = jlog_ctx_read_interval_after(fo->reader, &fo->cursor, &start, &finish);
+    if(count > fo->batch_size) count = fo->batch_size;
+    if(count > 0 &&
+       (jlog_ctx_bulk_read_messages(fo->reader, &start, count,
+                                    slot->batch.messages) != 0 ||
+        __jlog_batch_stage(&slot->batch, count, &slot->data, &slot->data_len) != 0)) {
+      if(jlog_ctx_err(fo->reader) == JLOG_ERR_SUCCESS) {
+        fo->reader->last_error = JLOG_ERR_FILE_READ;
+        fo->reader->last_errno = ENOMEM;
+      }
+      count = -1;
+    }
+
+    pthread_mutex_lock(&fo->lock);
+    if(count < 0) {
+      fo->error = jlog_ctx_err(fo->reader);
+      fo->error_errno = jlog_ctx_errno(fo->reader);
+      break;
+    }
+    if(count == 0) {
+      /* caught up with the writer; poll until something new lands */
+      __jlog_fanout_deadline(&ts, JLOG_FANOUT_IDLE_USEC);
+      if(!fo->stop) pthread_cond_timedwait(&fo->cv, &fo->lock, &ts);
+      continue;
+    }
+    slot->batch.first = start;
+    slot->batch.last = start;
+    slot->batch.last.marker += count - 1;
+    fo->cursor = slot->batch.last;
+    fo->produced++;
+    pthread_cond_broadcast(&fo->cv);
+  }
+  fo->pump_done = 1;
+  pthread_cond_broadcast(&fo->cv);
+  pthread_mutex_unlock(&fo->lock);
+  return NULL;
+}
+
+static void *
+__jlog_fanout_deliver(void *arg) {
+  jlog_fanout_sub *sub = arg;
+  jlog_fanout *fo = sub->fo;
+  jlog_batch view;
+  u_int32_t skip;
+  int rv;
+
+  pthread_mutex_lock(&fo->lock);
+  while(1) {
+    while(sub->next == fo->produced && !fo->stop && !fo->pump_done)
+      pthread_cond_wait(&fo->cv, &fo->lock);
+    if(fo->stop || sub->next == fo->produced) break;
+    view = fo->slots[sub->next % fo->window].batch;
+    pthread_mutex_unlock(&fo->lock);
+
+    /* drop whatever this subscriber has already checkpointed past */
+    rv = 0;
+    if(!JLOG_ID_BEFORE(&sub->chkpt, &view.last)) view.count = 0;
+    else if(!JLOG_ID_BEFORE(&sub->chkpt, &view.first)) {
+      skip = sub->chkpt.marker - view.first.marker + 1;
+      view.first.marker += skip;
+      view.messages += skip;
+      view.count -= skip;
+    }
+    if(view.count > 0) {
+      rv = sub->func(sub->closure, &view);
+      if(rv == 0) {
+        if(jlog_ctx_read_checkpoint(sub->ctx, &view.last) != 0) {
+          sub->error = jlog_ctx_err(sub->ctx);
+          sub->error_errno = jlog_ctx_errno(sub->ctx);
+          rv = -1;
+        }
+        else sub->chkpt = view.last;
+      }
+    }
+
+    pthread_mutex_lock(&fo->lock);
+    sub->next++;
+    pthread_cond_broadcast(&fo->cv);
+    if(rv != 0) break;
+  }
+  sub->attached = 0;
+  pthread_cond_broadcast(&fo->cv);
+  pthread_mutex_unlock(&fo->lock);
+  return NULL;
+}
+
+jlog_fanout *jlog_fanout_new(jlog_ctx *ctx, int batch_size, int window) {
+  jlog_fanout *fo;
+  int i;
+
+  ctx->last_error = JLOG_ERR_SUCCESS;
+  if(ctx->context_mode != JLOG_NEW) {
+    ctx->last_error = JLOG_ERR_ILLEGAL_OPEN;
+    ctx->last_errno = EEXIST;
+    return NULL;
+  }
+  if(batch_size < 1 || window < 1) {
+    ctx->last_error = JLOG_ERR_ILLEGAL_INIT;
+    ctx->last_errno = EINVAL;
+    return NULL;
+  }
+
+  fo = calloc(1, sizeof(*fo));
+  if(fo == NULL) goto oom;
+  fo->ctx = ctx;
+  fo->batch_size = batch_size;
+  fo->window = window;
+  pthread_mutex_init(&fo->lock, NULL);
+  pthread_cond_init(&fo->cv, NULL);
+  fo->slots = calloc(window, sizeof(*fo->slots));
+  if(fo->slots == NULL) goto oom;
+  for(i=0; i<window; i++) {
+    fo->slots[i].batch.messages = calloc(batch_size, sizeof(jlog_message));
+    if(fo->slots[i].batch.messages == NULL) goto oom;
+  }
+  return fo;
+
+ oom:
+  ctx->last_error = JLOG_ERR_OPEN;
+  ctx->last_errno = ENOMEM;
+  jlog_fanout_destroy(fo);
+  return NULL;
+}
+
+int jlog_fanout_add_subscriber(jlog_fanout *fo, const char *subscriber,
+                               jlog_fanout_func func, void *closure) {
+  jlog_fanout_sub *sub, **subs;
+
+  fo->ctx->last_error = JLOG_ERR_SUCCESS;
+  if(fo->running || func == NULL) {
+    fo->ctx->last_error = JLOG_ERR_ILLEGAL_INIT;
+    fo->ctx->last_errno = EINVAL;
+    return -1;
+  }
+  subs = realloc(fo->subs, (fo->nsubs + 1) * sizeof(*subs));
+  sub = calloc(1, sizeof(*sub));
+  if(subs) fo->subs = subs;
+  if(subs == NULL || sub == NULL || (sub->ctx = jlog_new(fo->ctx->path)) == NULL) {
+    free(sub);
+    fo->ctx->last_error = JLOG_ERR_OPEN;
+    fo->ctx->last_errno = ENOMEM;
+    return -1;
+  }
+  sub->ctx->multi_process = fo->ctx->multi_process;
+  if(jlog_ctx_open_reader(sub->ctx, subscriber) != 0) {
+    fo->ctx->last_error = jlog_ctx_err(sub->ctx);
+    fo->ctx->last_errno = jlog_ctx_errno(sub->ctx);
+    jlog_ctx_close(sub->ctx);
+    free(sub);
+    return -1;
+  }
+  sub->fo = fo;
+  sub->func = func;
+  sub->closure = closure;
+  fo->subs[fo->nsubs++] = sub;
+  return 0;
+}
+
+int jlog_fanout_start(jlog_fanout *fo) {
+  jlog_ctx *ctx = fo->ctx;
+  jlog_fanout_sub *sub;
+  int i, rv;
+
+  ctx->last_error = JLOG_ERR_SUCCESS;
+  if(fo->running || fo->nsubs == 0) {
+    ctx->last_error = JLOG_ERR_ILLEGAL_INIT;
+    ctx->last_errno = EINVAL;
+    return -1;
+  }
+  for(i=0; i<fo->nsubs; i++) {
+    sub = fo->subs[i];
+    if(jlog_get_checkpoint(sub->ctx, sub->ctx->subscriber_name, &sub->chkpt) != 0) {
+      ctx->last_error = JLOG_ERR_INVALID_SUBSCRIBER;
+      ctx->last_errno = jlog_ctx_errno(sub->ctx);
+      return -1;
+    }
+    if(i == 0 || JLOG_ID_BEFORE(&sub->chkpt, &fo->cursor)) fo->cursor = sub->chkpt;
+    sub->next = 0;
+    sub->attached = 1;
+    sub->error = JLOG_ERR_SUCCESS;
+  }
+
+  if(fo->reader == NULL) {
+    fo->reader = jlog_new(ctx->path);
+    if(fo->reader == NULL) {
+      ctx->last_error = JLOG_ERR_OPEN;
+      ctx->last_errno = ENOMEM;
+      return -1;
+    }
+    fo->reader->multi_process = ctx->multi_process;
+    jlog_ctx_set_decompression_threads(fo->reader, ctx->decompress_threads);
+    jlog_ctx_alter_read_method(fo->reader, ctx->read_method);
+    if(jlog_ctx_open_reader(fo->reader, fo->subs[0]->ctx->subscriber_name) != 0) {
+      ctx->last_error = jlog_ctx_err(fo->reader);
+      ctx->last_errno = jlog_ctx_errno(fo->reader);
+      jlog_ctx_close(fo->reader);
+      fo->reader = NULL;
+      return -1;
+    }
+  }
+
+  fo->produced = 0;
+  fo->stop = fo->pump_done = 0;
+  fo->error = JLOG_ERR_SUCCESS;
+  fo->running = 1;
+  if((rv = pthread_create(&fo->thread, NULL, __jlog_fanout_pump, fo)) != 0)
+    goto fail;
+  fo->thread_started = 1;
+  for(i=0; i<fo->nsubs; i++) {
+    sub = fo->subs[i];
+    if((rv = pthread_create(&sub->thread, NULL, __jlog_fanout_deliver, sub)) != 0) {
+      /* nobody will ever consume for it, so don't let it hold the pump */
+      pthread_mutex_lock(&fo->lock);
+      sub->attached = 0;
+      pthread_mutex_unlock(&fo->lock);
+      goto fail;
+    }
+    sub->thread_started = 1;
+  }
+  return 0;
+
+ fail:
+  jlog_fanout_stop(fo);
+  ctx->last_error = JLOG_ERR_OPEN;
+  ctx->last_errno = rv;
+  return -1;
+}
+
+int jlog_fanout_stop(jlog_fanout *fo) {
+  jlog_ctx *ctx = fo->ctx;
+  int i;
+
+  ctx->last_error = JLOG_ERR_SUCCESS;
+  if(!fo->running) return 0;
+  pthread_mutex_lock(&fo->lock);
+  fo->stop = 1;
+  pthread_cond_broadcast(&fo->cv);
+  pthread_mutex_unlock(&fo->lock);
+  if(fo->thread_started) pthread_join(fo->thread, NULL);
+  fo->thread_started = 0;
+  for(i=0; i<fo->nsubs; i++) {
+    if(fo->subs[i]->thread_started) pthread_join(fo->subs[i]->thread, NULL);
+    fo->subs[i]->thread_started = 0;
+  }
+  fo->running = 0;
+
+  if(fo->error != JLOG_ERR_SUCCESS) {
+    ctx->last_error = fo->error;
+    ctx->last_errno = fo->error_errno;
+    return -1;
+  }
+  for(i=0; i<fo->nsubs; i++) {
+    if(fo->subs[i]->error != JLOG_ERR_SUCCESS) {
+      ctx->last_error = fo->subs[i]->error;
+      ctx->last_errno = fo->subs[i]->error_errno;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void jlog_fanout_destroy(jlog_fanout *fo) {
+  int i;
+
+  if(fo == NULL) return;
+  jlog_fanout_stop(fo);
+  if(fo->reader) jlog_ctx_close(fo->reader);
+  for(i=0; i<fo->nsubs; i++) {
+    jlog_ctx_close(fo->subs[i]->ctx);
+    free(fo->subs[i]);
+  }
+  free(fo->subs);
+  if(fo->slots) {
+    for(i=0; i<fo->window; i++) {
+      free(fo->slots[i].batch.messages);
+      free(fo->slots[i].data);
+    }
+    free(fo->slots);
+  }
+  pthread_cond_destroy(&fo->cv);
+  pthread_mutex_destroy(&fo->lock);
+  free(fo);
+}
@@ -39,24 +39,85 @@
 #endif
 
 #include "jlog_config.h"
+#include "jlog.h"
 #include "jlog_hash.h"
 #include "jlog_io.h"
 #include <assert.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <poll.h>
 #include <sys/mman.h>
+#include <sys/param.h>
 #include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+
+/* Open files are shared by (st_dev, st_ino) through a table split into
+ * shards, each with its own lock.  No filesystem call is made holding a
+ * shard lock except the close(2)s of a file's last reference, which must
+ * not race a reopen of the same file (closing any descriptor of a file
+ * drops the process's fcntl locks on it). */
+#define JLOG_FILE_SHARDS 16
+
+typedef struct {
+  pthread_mutex_t lock;
+  jlog_hash_table files;
+} jlog_file_shard;
 
-static pthread_mutex_t jlog_files_lock = PTHREAD_MUTEX_INITIALIZER;
-static jlog_hash_table jlog_files = JLOG_HASH_EMPTY;
+static jlog_file_shard jlog_file_shards[JLOG_FILE_SHARDS];
+static pthread_once_t jlog_file_shards_once = PTHREAD_ONCE_INIT;
 
 typedef struct {
   dev_t st_dev;
   ino_t st_ino;
 } jlog_file_id;
 
+/* A jlog created with JLOG_LOCK_SHARED_MUTEX has a "locks" file: this
+ * header and a fixed array of slots, each a robust process-shared mutex
+ * that stands in for the fcntl lock of one file in the directory.  Slots
+ * are handed out and swept under an fcntl lock on the table; locking a
+ * file once it has its slot touches only the mutex. */
+#define LOCK_TABLE_FILE "locks"
+#define LOCK_TABLE_MAGIC 0x6b636c6a
+#define LOCK_TABLE_SLOTS 1024
+
+struct _jlog_lock_table_header {
+  u_int32_t magic;
+  u_int32_t nslots;
+  u_int32_t slot_size;  /* processes must agree on the mutex layout */
+  u_int32_t reserved;
+};
+
+struct _jlog_lock_slot {
+  u_int64_t dev;        /* both 0 when the slot is free */
+  u_int64_t ino;
+  u_int32_t gen;        /* bumped when the slot is taken back */
+  u_int32_t reserved;
+  pthread_mutex_t mutex;
+};
+
+typedef struct {
+  jlog_file_id id;
+  int fd;
+  int refcnt;
+  char *dir;
+  void *base;
+  size_t len;
+  u_int32_t nslots;
+  struct _jlog_lock_slot *slots;
+  pthread_mutex_t lock;  /* fcntl on fd only excludes other processes */
+} jlog_lock_table;
+
+static pthread_mutex_t jlog_lock_tables_lock = PTHREAD_MUTEX_INITIALIZER;
+static jlog_hash_table jlog_lock_tables = JLOG_HASH_EMPTY;
+
 struct _jlog_file {
   jlog_file_id id;
   int fd;
@@ -64,87 +125,465 @@ struct _jlog_file {
   int locked;
   pthread_mutex_t lock;
   uint8_t multi_process;
+  int *spare_fds;  /* of openers that lost a race to open this file */
+  int nspare;
+  jlog_lock_table *table;
+  struct _jlog_lock_slot *slot;
+  u_int32_t gen;
 };
 
-jlog_file *jlog_file_open(const char *path, int flags, int mode, int multi_process)
+#if defined(HAVE_PTHREAD_MUTEXATTR_SETROBUST)
+#define HAVE_LOCK_TABLE 1
+#endif
+
+static int jlog_lock_table_path(const char *path, char *dir, size_t dirlen,
+                                char *file, size_t filelen)
 {
-  struct stat sb;
+  const char *sl = strrchr(path, '/');
+  int n;
+
+  if (sl) n = snprintf(dir, dirlen, "%.*s", (int)(sl - path), path);
+  else n = snprintf(dir, dirlen, ".");
+  if (n < 0 || (size_t)n >= dirlen) return 0;
+  if (sl == path) snprintf(dir, dirlen, "/");
+  n = snprintf(file, filelen, "%s/%s", dir, LOCK_TABLE_FILE);
+  return n > 0 && (size_t)n < filelen;
+}
+
+static int jlog_lock_table_fcntl(int fd, int type)
+{
+  struct flock fl;
+  int frv;
+
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type = type;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = 0;
+  fl.l_len = sizeof(struct _jlog_lock_table_header);
+  while ((frv = fcntl(fd, F_SETLKW, &fl)) == -1 && errno == EINTR) ;
+  return frv == 0;
+}
+
+int jlog_file_create_lock_table(const char *dir, int mode)
+{
+#ifdef HAVE_LOCK_TABLE
+  char file[MAXPATHLEN], tmp[MAXPATHLEN];
+  struct _jlog_lock_table_header hdr;
+  struct _jlog_lock_slot *slots;
+  pthread_mutexattr_t attr;
+  size_t len;
+  void *base;
+  u_int32_t i;
+  int fd, ok = 0;
+
+  if (snprintf(file, sizeof(file), "%s/%s", dir, LOCK_TABLE_FILE) >= (int)sizeof(file) ||
+      snprintf(tmp, sizeof(tmp), "%s.tmp", file) >= (int)sizeof(tmp)) {
+    errno = ENAMETOOLONG;
+    return 0;
+  }
+  len = sizeof(hdr) + LOCK_TABLE_SLOTS * sizeof(*slots);
+  while ((fd = open(tmp, O_RDWR|O_CREAT|O_TRUNC, mode)) == -1 && errno == EINTR) ;
+  if (fd == -1) return 0;
+  if (ftruncate(fd, len) != 0) goto out;
+  base = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED) goto out;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+  slots = (struct _jlog_lock_slot *)((char *)base + sizeof(hdr));
+  for (i = 0; i < LOCK_TABLE_SLOTS; i++)
+    if (pthread_mutex_init(&slots[i].mutex, &attr) != 0) break;
+  pthread_mutexattr_destroy(&attr);
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = LOCK_TABLE_MAGIC;
+  hdr.nslots = LOCK_TABLE_SLOTS;
+  hdr.slot_size = sizeof(*slots);
+  memcpy(base, &hdr, sizeof(hdr));
+  ok = i == LOCK_TABLE_SLOTS && msync(base, len, MS_SYNC) == 0;
+  munmap(base, len);
+  /* it only appears once complete */
+  if (ok) ok = rename(tmp, file) == 0;
+ out:
+  while (close(fd) == -1 && errno == EINTR) ;
+  if (!ok) unlink(tmp);
+  return ok;
+#else
+  (void)dir;
+  (void)mode;
+  errno = ENOTSUP;
+  return 0;
+#endif
+}
+
+/* Find the lock table of the directory holding path, if it has one.
+ * Returns 1 with *tp set (NULL if there is none), 0 on error. */
+static int jlog_lock_table_attach(const char *path, jlog_lock_table **tp)
+{
+  char dir[MAXPATHLEN], file[MAXPATHLEN];
+  struct _jlog_lock_table_header *hdr;
+  jlog_lock_table *t;
   jlog_file_id id;
-  jlog_file *f = NULL;
+  struct stat sb;
+  union {
+    jlog_lock_table *t;
+    void *vptr;
+  } pun;
+  void *base;
+  int fd, rv;
+
+  *tp = NULL;
+  if (!jlog_lock_table_path(path, dir, sizeof(dir), file, sizeof(file))) return 0;
+  while ((rv = stat(file, &sb)) == -1 && errno == EINTR) ;
+  if (rv != 0) return errno == ENOENT;
+  memset(&id, 0, sizeof(id));
+  id.st_dev = sb.st_dev;
+  id.st_ino = sb.st_ino;
+  if (pthread_mutex_lock(&jlog_lock_tables_lock) != 0) return 0;
+  if (jlog_hash_retrieve(&jlog_lock_tables, (void *)&id, sizeof(id), &pun.vptr)) {
+    pun.t->refcnt++;
+    *tp = pun.t;
+    pthread_mutex_unlock(&jlog_lock_tables_lock);
+    return 1;
+  }
+#ifndef HAVE_LOCK_TABLE
+  /* every process using this jlog must lock it the same way */
+  pthread_mutex_unlock(&jlog_lock_tables_lock);
+  errno = ENOTSUP;
+  return 0;
+#else
+  /* the first open of a jlog's table, so rare enough to map it locked */
+  while ((fd = open(file, O_RDWR)) == -1 && errno == EINTR) ;
+  if (fd == -1) {
+    pthread_mutex_unlock(&jlog_lock_tables_lock);
+    return 0;
+  }
+  if (fstat(fd, &sb) != 0 || sb.st_size < (off_t)sizeof(*hdr)) goto fail;
+  base = mmap(NULL, sb.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED) goto fail;
+  hdr = base;
+  if (hdr->magic != LOCK_TABLE_MAGIC ||
+      hdr->slot_size != sizeof(struct _jlog_lock_slot) ||
+      sizeof(*hdr) + (size_t)hdr->nslots * hdr->slot_size > (size_t)sb.st_size) {
+    munmap(base, sb.st_size);
+    errno = EINVAL;
+    goto fail;
+  }
+  if (!(t = calloc(1, sizeof(*t))) || !(t->dir = strdup(dir))) {
+    free(t);
+    munmap(base, sb.st_size);
+    goto fail;
+  }
+  t->id = id;
+  t->fd = fd;
+  t->refcnt = 1;
+  t->base = base;
+  t->len = sb.st_size;
+  t->nslots = hdr->nslots;
+  t->slots = (struct _jlog_lock_slot *)((char *)base + sizeof(*hdr));
+  pthread_mutex_init(&t->lock, NULL);
+  if (!jlog_hash_store(&jlog_lock_tables, (void *)&t->id, sizeof(t->id), t)) {
+    pthread_mutex_destroy(&t->lock);
+    munmap(base, sb.st_size);
+    free(t->dir);
+    free(t);
+    goto fail;
+  }
+  *tp = t;
+  pthread_mutex_unlock(&jlog_lock_tables_lock);
+  return 1;
+ fail:
+  rv = errno;
+  while (close(fd) == -1 && errno == EINTR) ;
+  pthread_mutex_unlock(&jlog_lock_tables_lock);
+  errno = rv;
+  return 0;
+#endif
+}
+
+static void jlog_lock_table_release(jlog_lock_table *t)
+{
+  pthread_mutex_lock(&jlog_lock_tables_lock);
+  if (--t->refcnt > 0) {
+    pthread_mutex_unlock(&jlog_lock_tables_lock);
+    return;
+  }
+  assert(jlog_hash_delete(&jlog_lock_tables, (void *)&t->id, sizeof(t->id),
+                          NULL, NULL));
+  pthread_mutex_unlock(&jlog_lock_tables_lock);
+  munmap(t->base, t->len);
+  while (close(t->fd) == -1 && errno == EINTR) ;
+  pthread_mutex_destroy(&t->lock);
+  free(t->dir);
+  free(t);
+}
+
+#ifdef HAVE_LOCK_TABLE
+static int jlog_ino_cmp(const void *a, const void *b)
+{
+  u_int64_t x = *(const u_int64_t *)a, y = *(const u_int64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+/* Take back the slots of files no longer in the directory that nobody
+ * holds.  A process still locking such a file through its old slot sees
+ * the generation change and comes back for a new one. */
+static void jlog_lock_table_sweep(jlog_lock_table *t)
+{
+  struct _jlog_lock_slot *slot;
+  struct dirent *de;
+  u_int64_t *live = NULL, *grown;
+  size_t n = 0, cap = 0;
+  u_int32_t i;
+  DIR *d;
+  int rv;
+
+  if (!(d = opendir(t->dir))) return;
+  while ((de = readdir(d)) != NULL) {
+    if (n == cap) {
+      cap = cap ? cap * 2 : 256;
+      if (!(grown = realloc(live, cap * sizeof(*live)))) break;
+      live = grown;
+    }
+    live[n++] = de->d_ino;
+  }
+  closedir(d);
+  if (live) qsort(live, n, sizeof(*live), jlog_ino_cmp);
+  for (i = 0; i < t->nslots; i++) {
+    slot = &t->slots[i];
+    if (slot->ino == 0 && slot->dev == 0) continue;
+    if (live && bsearch(&slot->ino, live, n, sizeof(*live), jlog_ino_cmp)) continue;
+    rv = pthread_mutex_trylock(&slot->mutex);
+    if (rv == EOWNERDEAD) rv = pthread_mutex_consistent(&slot->mutex);
+    if (rv != 0) continue;
+    slot->dev = slot->ino = 0;
+    slot->gen++;
+    pthread_mutex_unlock(&slot->mutex);
+  }
+  free(live);
+}
+
+/* Point f at its slot, taking a free one if it has none yet. */
+static int jlog_lock_table_slot(jlog_file *f)
+{
+  jlog_lock_table *t = f->table;
+  struct _jlog_lock_slot *found = NULL, *slot;
+  u_int64_t dev = f->id.st_dev, ino = f->id.st_ino;
+  int pass, save;
+  u_int32_t i;
+
+  if (pthread_mutex_lock(&t->lock) != 0) return 0;
+  if (!jlog_lock_table_fcntl(t->fd, F_WRLCK)) {
+    save = errno;
+    pthread_mutex_unlock(&t->lock);
+    errno = save;
+    return 0;
+  }
+  for (i = 0; i < t->nslots && !found; i++) {
+    slot = &t->slots[i];
+    if (slot->dev == dev && slot->ino == ino) found = slot;
+  }
+  for (pass = 0; pass < 2 && !found; pass++) {
+    if (pass) jlog_lock_table_sweep(t);
+    for (i = 0; i < t->nslots && !found; i++) {
+      slot = &t->slots[i];
+      if (slot->dev == 0 && slot->ino == 0) {
+        slot->dev = dev;
+        slot->ino = ino;
+        found = slot;
+      }
+    }
+  }
+  if (found) {
+    f->slot = found;
+    f->gen = found->gen;
+  }
+  jlog_lock_table_fcntl(t->fd, F_UNLCK);
+  pthread_mutex_unlock(&t->lock);
+  if (!found) errno = ENOLCK;
+  return found != NULL;
+}
+
+static int jlog_lock_table_lock(jlog_file *f)
+{
+  int rv;
+
+  for (;;) {
+    if (!f->slot && !jlog_lock_table_slot(f)) return 0;
+    rv = pthread_mutex_lock(&f->slot->mutex);
+    /* a holder died; like a dead process's fcntl lock, it is simply ours */
+    if (rv == EOWNERDEAD) rv = pthread_mutex_consistent(&f->slot->mutex);
+    if (rv != 0) {
+      errno = rv;
+      return 0;
+    }
+    if (f->slot->gen == f->gen && f->slot->ino == (u_int64_t)f->id.st_ino &&
+        f->slot->dev == (u_int64_t)f->id.st_dev) return 1;
+    pthread_mutex_unlock(&f->slot->mutex);
+    f->slot = NULL;
+  }
+}
+#endif
+
+static void jlog_file_shards_init(void)
+{
+  int i;
+
+  for (i = 0; i < JLOG_FILE_SHARDS; i++) {
+    pthread_mutex_init(&jlog_file_shards[i].lock, NULL);
+    jlog_hash_init(&jlog_file_shards[i].files);
+  }
+}
+
+static jlog_file_shard *jlog_file_shard_of(const jlog_file_id *id)
+{
+  u_int64_t h = ((u_int64_t)id->st_ino * 0x9e3779b97f4a7c15ULL) ^ (u_int64_t)id->st_dev;
+
+  pthread_once(&jlog_file_shards_once, jlog_file_shards_init);
+  return &jlog_file_shards[(h >> 32) % JLOG_FILE_SHARDS];
+}
+
+/* Take a reference to the open file id, if there is one. */
+static jlog_file *jlog_file_lookup(jlog_file_shard *shard, const jlog_file_id *id)
+{
   union {
     jlog_file *f;
     void *vptr;
   } pun;
+
+  if (!jlog_hash_retrieve(&shard->files, (void *)id, sizeof(jlog_file_id), &pun.vptr))
+    return NULL;
+  pun.f->refcnt++;
+  return pun.f;
+}
+
+static void jlog_file_free(jlog_file *f)
+{
+  if (f->table) jlog_lock_table_release(f->table);
+  pthread_mutex_destroy(&(f->lock));
+  free(f->spare_fds);
+  free(f);
+}
+
+jlog_file *jlog_file_open(const char *path, int flags, int mode, int multi_process)
+{
+  struct stat sb;
+  jlog_file_id id;
+  jlog_file_shard *shard;
+  jlog_file *f = NULL, *had;
+  int *spare;
   int fd, realflags = O_RDWR, rv;
 
   if (flags & O_CREAT) realflags |= O_CREAT;
   if (flags & O_EXCL) realflags |= O_EXCL;
 
-  if (pthread_mutex_lock(&jlog_files_lock) != 0) return NULL;
-
+  /* the common case: the file is open already */
   while ((rv = stat(path, &sb)) == -1 && errno == EINTR);
   if (rv == 0) {
-    if (!S_ISREG(sb.st_mode)) goto out;
+    if (!S_ISREG(sb.st_mode)) return NULL;
     memset(&id, 0, sizeof(id));
     id.st_dev = sb.st_dev;
     id.st_ino = sb.st_ino;
-    if (jlog_hash_retrieve(&jlog_files, (void *)&id, sizeof(jlog_file_id),
-                           &pun.vptr))
-    {
-      if (!(flags & O_EXCL)) {
-        f = pun.f;
-        f->refcnt++;
-      } else {
-        errno = EEXIST;
-      }
-      goto out;
+    shard = jlog_file_shard_of(&id);
+    if (pthread_mutex_lock(&shard->lock) != 0) return NULL;
+    f = jlog_file_lookup(shard, &id);
+    pthread_mutex_unlock(&shard->lock);
+    if (f && (flags & O_EXCL)) {
+      jlog_file_close(f);
+      errno = EEXIST;
+      return NULL;
     }
+    if (f) return f;
   }
 
   while ((fd = open(path, realflags, mode)) == -1 && errno == EINTR);
-  if (fd == -1) goto out;
+  if (fd == -1) return NULL;
   while ((rv = fstat(fd, &sb)) == -1 && errno == EINTR);
   if (rv != 0) {
     while (close(fd) == -1 && errno == EINTR) ;
-    goto out;
+    return NULL;
   }
+  memset(&id, 0, sizeof(id));
   id.st_dev = sb.st_dev;
   id.st_ino = sb.st_ino;
-  if (!(f = malloc(sizeof(jlog_file)))) {
+  if (!(f = calloc(1, sizeof(jlog_file)))) {
     while (close(fd) == -1 && errno == EINTR) ;
-    goto out;
+    return NULL;
   }
-  memset(f, 0, sizeof(jlog_file));
   f->id = id;
   f->fd = fd;
   f->refcnt = 1;
   f->locked = 0;
   f->multi_process = multi_process;
-  pthread_mutex_init(&(f->lock), NULL);
-  if (!jlog_hash_store(&jlog_files, (void *)&f->id, sizeof(jlog_file_id), f)) {
-    while (close(f->fd) == -1 && errno == EINTR) ;
+  /* the jlog's lock table, when it has one, overrides this process's choice */
+  if (multi_process && !jlog_lock_table_attach(path, &f->table)) {
+    while (close(fd) == -1 && errno == EINTR) ;
     free(f);
-    f = NULL;
+    return NULL;
+  }
+  if (f->table) f->multi_process = JLOG_LOCK_SHARED_MUTEX;
+  else if (f->multi_process == JLOG_LOCK_SHARED_MUTEX) f->multi_process = JLOG_LOCK_FCNTL;
+  pthread_mutex_init(&(f->lock), NULL);
+
+  shard = jlog_file_shard_of(&id);
+  if (pthread_mutex_lock(&shard->lock) != 0) {
+    while (close(fd) == -1 && errno == EINTR) ;
+    jlog_file_free(f);
+    return NULL;
   }
-out:
-  pthread_mutex_unlock(&jlog_files_lock);
+  if ((had = jlog_file_lookup(shard, &id)) != NULL) {
+    /* another thread opened it meanwhile.  Closing our descriptor now
+     * could drop the fcntl lock it holds through its own, so ours stays
+     * open as long as the file does. */
+    if ((spare = realloc(had->spare_fds, (had->nspare + 1) * sizeof(*spare))) != NULL) {
+      had->spare_fds = spare;
+      had->spare_fds[had->nspare++] = fd;
+      fd = -1;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    if (fd != -1) while (close(fd) == -1 && errno == EINTR) ;
+    jlog_file_free(f);
+    return had;
+  }
+  if (!jlog_hash_store(&shard->files, (void *)&f->id, sizeof(jlog_file_id), f)) {
+    pthread_mutex_unlock(&shard->lock);
+    while (close(fd) == -1 && errno == EINTR) ;
+    jlog_file_free(f);
+    return NULL;
+  }
+  pthread_mutex_unlock(&shard->lock);
   return f;
 }
 
 int jlog_file_close(jlog_file *f)
 {
-  if (pthread_mutex_lock(&jlog_files_lock) != 0) return 0;
-  if (--f->refcnt == 0) {
-    assert(jlog_hash_delete(&jlog_files, (void *)&f->id, sizeof(jlog_file_id),
+  jlog_file_shard *shard = jlog_file_shard_of(&f->id);
+  int i, last;
+
+  if (pthread_mutex_lock(&shard->lock) != 0) return 0;
+  if ((last = (--f->refcnt == 0))) {
+    assert(jlog_hash_delete(&shard->files, (void *)&f->id, sizeof(jlog_file_id),
                             NULL, NULL));
     while (close(f->fd) == -1 && errno == EINTR) ;
-    pthread_mutex_destroy(&(f->lock));
-    free(f);
+    for (i = 0; i < f->nspare; i++)
+      while (close(f->spare_fds[i]) == -1 && errno == EINTR) ;
   }
-  pthread_mutex_unlock(&jlog_files_lock);  
+  pthread_mutex_unlock(&shard->lock);
+  if (last) jlog_file_free(f);
   return 1;
 }
 
+/* Open file description locks belong to the descriptor rather than the
+ * process, so closing some other descriptor of the file cannot drop them;
+ * the threads sharing f->fd are still kept apart by f->lock. */
+static int jlog_file_fcntl_cmd(jlog_file *f)
+{
+#ifdef F_OFD_SETLKW
+  if (f->multi_process == JLOG_LOCK_OFD) return F_OFD_SETLKW;
+#endif
+  (void)f;
+  return F_SETLKW;
+}
+
 int jlog_file_lock(jlog_file *f)
 {
   struct flock fl;
@@ -152,6 +591,17 @@ int jlog_file_lock(jlog_file *f)
 
   if (pthread_mutex_lock(&(f->lock)) != 0) return 0;
 
+#ifdef HAVE_LOCK_TABLE
+  if (f->table) {
+    if (!jlog_lock_table_lock(f)) {
+      int save = errno;
+      pthread_mutex_unlock(&(f->lock));
+      errno = save;
+      return 0;
+    }
+  }
+  else
+#endif
   if (f->multi_process != 0) {
     memset(&fl, 0, sizeof(fl));
     fl.l_type = F_WRLCK;
@@ -159,7 +609,7 @@ int jlog_file_lock(jlog_file *f)
     fl.l_start = 0;
     fl.l_len = 0;
 
-    while ((frv = fcntl(f->fd, F_SETLKW, &fl)) == -1 && (errno == EINTR || errno == EAGAIN)) ;
+    while ((frv = fcntl(f->fd, jlog_file_fcntl_cmd(f), &fl)) == -1 && (errno == EINTR || errno == EAGAIN)) ;
     if (frv != 0) {
       int save = errno;
       pthread_mutex_unlock(&(f->lock));
@@ -179,6 +629,13 @@ int jlog_file_unlock(jlog_file *f)
 
   if (!f->locked) return 0;
 
+#ifdef HAVE_LOCK_TABLE
+  if (f->table) {
+    pthread_mutex_unlock(&f->slot->mutex);
+    f->locked = 0;
+  }
+  else
+#endif
   if (f->multi_process != 0) {
     memset(&fl, 0, sizeof(fl));
     fl.l_type = F_UNLCK;
@@ -186,7 +643,7 @@ int jlog_file_unlock(jlog_file *f)
     fl.l_start = 0;
     fl.l_len = 0;
 
-    while ((frv = fcntl(f->fd, F_SETLKW, &fl)) == -1 && (errno == EINTR || errno == EAGAIN)) ;
+    while ((frv = fcntl(f->fd, jlog_file_fcntl_cmd(f), &fl)) == -1 && (errno == EINTR || errno == EAGAIN)) ;
     if (frv != 0) return 0;
     f->locked = 0;
   }
@@ -194,6 +651,52 @@ int jlog_file_unlock(jlog_file *f)
   return 1;
 }
 
+int jlog_file_lock_range(jlog_file *f, off_t offset, off_t len, int wait)
+{
+  struct flock fl;
+  int frv;
+
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type = F_WRLCK;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = offset;
+  fl.l_len = len;
+
+  while ((frv = fcntl(f->fd, wait ? F_SETLKW : F_SETLK, &fl)) == -1 && errno == EINTR) ;
+  return frv == 0;
+}
+
+int jlog_file_unlock_range(jlog_file *f, off_t offset, off_t len)
+{
+  struct flock fl;
+  int frv;
+
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type = F_UNLCK;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = offset;
+  fl.l_len = len;
+
+  while ((frv = fcntl(f->fd, F_SETLK, &fl)) == -1 && errno == EINTR) ;
+  return frv == 0;
+}
+
+int jlog_file_range_locked(jlog_file *f, off_t offset, off_t len)
+{
+  struct flock fl;
+  int frv;
+
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type = F_WRLCK;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = offset;
+  fl.l_len = len;
+
+  while ((frv = fcntl(f->fd, F_GETLK, &fl)) == -1 && errno == EINTR) ;
+  if (frv != 0) return -1;
+  return fl.l_type != F_UNLCK;
+}
+
 int jlog_file_pread(jlog_file *f, void *buf, size_t nbyte, off_t offset)
 {
   while (nbyte > 0) {
@@ -218,6 +721,55 @@ int jlog_file_pwrite(jlog_file *f, const void *buf, size_t nbyte, off_t offset)
   return 1;
 }
 
+static int jlog_file_wait_writable(int fd)
+{
+  struct pollfd pfd;
+  pfd.fd = fd;
+  pfd.events = POLLOUT;
+  while (poll(&pfd, 1, -1) == -1)
+    if (errno != EINTR) return 0;
+  return 1;
+}
+
+int jlog_file_send(jlog_file *f, int out_fd, off_t offset, size_t nbyte)
+{
+  char buf[65536];
+  size_t len, done;
+  ssize_t rv;
+
+#if defined(HAVE_SYS_SENDFILE_H) && defined(HAVE_SENDFILE)
+  while (nbyte > 0) {
+    rv = sendfile(out_fd, f->fd, &offset, nbyte);
+    if (rv == -1 && errno == EINTR) continue;
+    if (rv == -1 && errno == EAGAIN) {
+      if (!jlog_file_wait_writable(out_fd)) return 0;
+      continue;
+    }
+    /* not every descriptor takes sendfile; copy the rest by hand */
+    if (rv == -1 && (errno == EINVAL || errno == ENOSYS)) break;
+    if (rv <= 0) return 0;
+    nbyte -= rv;
+  }
+#endif
+  while (nbyte > 0) {
+    len = nbyte < sizeof(buf) ? nbyte : sizeof(buf);
+    if (!jlog_file_pread(f, buf, len, offset)) return 0;
+    for (done = 0; done < len; ) {
+      rv = write(out_fd, buf + done, len - done);
+      if (rv == -1 && errno == EINTR) continue;
+      if (rv == -1 && errno == EAGAIN) {
+        if (!jlog_file_wait_writable(out_fd)) return 0;
+        continue;
+      }
+      if (rv <= 0) return 0;
+      done += rv;
+    }
+    nbyte -= len;
+    offset += len;
+  }
+  return 1;
+}
+
 int jlog_file_pwritev_verify_return_value(jlog_file *f, const struct iovec *vecs, int iov_count, off_t offset,
                                           size_t expected_length) {
   ssize_t rv = 0;
@@ -49,12 +49,22 @@ typedef struct _jlog_file jlog_file;
  *
  * since a jlog_file is a shared handle potentially used by many threads,
  * the underlying open mode is always O_RDWR; only the O_CREAT and O_EXCL
- * flags are honored
+ * flags are honored.  multi_process is 0 or a jlog_lock_backend; a file
+ * in a directory with a lock table is always locked through the table
  * @return pointer to jlog_file on success, NULL on failure
  * @internal
  */
 jlog_file *jlog_file_open(const char *path, int flags, int mode, int multi_process);
 
+/**
+ * creates the lock table that makes every process lock the files of the
+ * directory dir with robust process-shared mutexes (JLOG_LOCK_SHARED_MUTEX)
+ * instead of fcntl
+ * @return 1 on success, 0 on failure (ENOTSUP without robust mutexes)
+ * @internal
+ */
+int jlog_file_create_lock_table(const char *dir, int mode);
+
 /**
  * closes a jlog_file
  * @return 1 on success, 0 on failure
@@ -76,6 +86,29 @@ int jlog_file_lock(jlog_file *f);
  */
 int jlog_file_unlock(jlog_file *f);
 
+/**
+ * takes an fcntl write lock on a byte range of a jlog_file; unlike
+ * jlog_file_lock this only excludes other processes, never other threads
+ * @param[in] wait whether to block until the range is free
+ * @return 1 on success, 0 on failure (EAGAIN or EACCES if held and !wait)
+ * @internal
+ */
+int jlog_file_lock_range(jlog_file *f, off_t offset, off_t len, int wait);
+
+/**
+ * drops an fcntl lock taken with jlog_file_lock_range
+ * @return 1 on success, 0 on failure
+ * @internal
+ */
+int jlog_file_unlock_range(jlog_file *f, off_t offset, off_t len);
+
+/**
+ * tests for another process's fcntl lock over a byte range
+ * @return 1 if one is held, 0 if not, -1 on failure
+ * @internal
+ */
+int jlog_file_range_locked(jlog_file *f, off_t offset, off_t len);
+
 /**
  * preads from a jlog_file, retries EINTR
  * @return 1 if the read was fully satisfied, 0 otherwise
@@ -83,6 +116,14 @@ int jlog_file_unlock(jlog_file *f);
  */
 int jlog_file_pread(jlog_file *f, void *buf, size_t nbyte, off_t offset);
 
+/**
+ * copies a byte range of a jlog_file to a descriptor, in the kernel with
+ * sendfile(2) where it can, retrying EINTR and waiting out EAGAIN
+ * @return 1 if the range was fully sent, 0 otherwise
+ * @internal
+ */
+int jlog_file_send(jlog_file *f, int out_fd, off_t offset, size_t nbyte);
+
 /**
  * pwrites to a jlog_file, retries EINTR
  * @return 1 if the write was fully satisfied, 0 otherwise
@@ -0,0 +1,321 @@
+/*
+ * Copyright (c) 2016, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *    * Neither the name Circonus, Inc. nor the names
+ *      of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written
+ *      permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * A read-ahead pipeline over jlog_ctx_bulk_read_messages.  A background
+ * thread owns a private reader on the same jlog and subscriber, walks
+ * forward from the subscriber's checkpoint with its own cursor, and
+ * stages whole batches (copied out of the reader's buffers) in a small
+ * ring so that the I/O and decompression of batch N+1 overlaps with the
+ * consumer's processing of batch N.  The prefetcher never checkpoints;
+ * that stays with the consumer and its own ctx.
+ */
+
+#include "jlog_config.h"
+#include "jlog_private.h"
+#include <pthread.h>
+#if HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#if HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+
+#define JLOG_PREFETCH_IDLE_USEC 10000
+#define JLOG_PREFETCH_MAX_DEPTH 8
+
+typedef enum {
+  SLOT_FREE = 0,
+  SLOT_READY,
+  SLOT_HELD
+} jlog_prefetch_slot_state;
+
+typedef struct {
+  jlog_prefetch_slot_state state;
+  jlog_batch batch;
+  char *data;
+  size_t data_len;
+} jlog_prefetch_slot;
+
+struct _jlog_prefetch {
+  jlog_ctx *ctx;    /* the consumer's reader */
+  jlog_ctx *reader; /* private to the prefetch thread */
+  pthread_t thread;
+  int thread_started;
+  pthread_mutex_t lock;
+  pthread_cond_t cv;
+  int stop;
+  int error;
+  int error_errno;
+  int batch_size;
+  int depth;
+  int fill;
+  int take;
+  jlog_id cursor;
+  jlog_prefetch_slot slots[JLOG_PREFETCH_MAX_DEPTH];
+};
+
+static void
+__jlog_prefetch_deadline(struct timespec *ts, long usec) {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  now.tv_usec += usec;
+  now.tv_sec += now.tv_usec / 1000000;
+  now.tv_usec %= 1000000;
+  ts->tv_sec = now.tv_sec;
+  ts->tv_nsec = now.tv_usec * 1000;
+}
+
+/* Move the messages a reader handed back into storage owned by the
+ * batch; the reader's buffers (or mapping) are reused on the next read.
+ * Headers carrying an extension are kept, with it, ahead of the payloads. */
+int
+__jlog_batch_stage(jlog_batch *batch, int count, char **data, size_t *data_len) {
+  jlog_message *m = batch->messages;
+  jlog_message_header_full *full;
+  size_t total = 0, off = 0;
+  int i, ext = count > 0 && m[0].header != &m[0].aligned_header;
+
+  if(ext) off = count * sizeof(*full);
+  total = off;
+  for(i=0; i<count; i++) total += m[i].mess_len;
+  if(total > *data_len) {
+    char *d = realloc(*data, total);
+    if(d == NULL) return -1;
+    *data = d;
+    *data_len = total;
+  }
+  full = (jlog_message_header_full *)*data;
+  for(i=0; i<count; i++) {
+    if(ext) {
+      memcpy(&full[i], m[i].header, sizeof(full[i]));
+      m[i].header = &full[i].hdr;
+    }
+    memcpy(*data + off, m[i].mess, m[i].mess_len);
+    m[i].mess = *data + off;
+    off += m[i].mess_len;
+  }
+  batch->count = count;
+  return 0;
+}
+
+static void *
+__jlog_prefetch_thread(void *arg) {
+  jlog_prefetch *pf = arg;
+  jlog_prefetch_slot *slot;
+  jlog_id start, finish;
+  struct timespec ts;
+  int count;
+
+  pthread_mutex_lock(&pf->lock);
+  while(!pf->stop) {
+    slot = &pf->slots[pf->fill];
+    if(slot->state != SLOT_FREE) {
+      pthread_cond_wait(&pf->cv, &pf->lock);
+      continue;
+    }
+    pthread_mutex_unlock(&pf->lock);
+
+    count = jlog_ctx_read_interval_after(pf->reader, &pf->cursor, &start, &finish);
+    if(count > pf->batch_size) count = pf->batch_size;
+    if(count > 0 &&
+       (jlog_ctx_bulk_read_messages(pf->reader, &start, count,
+                                    slot->batch.messages) != 0 ||
+        __jlog_batch_stage(&slot->batch, count, &slot->data, &slot->data_len) != 0)) {
+      if(jlog_ctx_err(pf->reader) == JLOG_ERR_SUCCESS) {
+        pf->reader->last_error = JLOG_ERR_FILE_READ;
+        pf->reader->last_errno = ENOMEM;
+      }
+      count = -1;
+    }
+
+    pthread_mutex_lock(&pf->lock);
+    if(count < 0) {
+      pf->error = jlog_ctx_err(pf->reader);
+      pf->error_errno = jlog_ctx_errno(pf->reader);
+      pthread_cond_broadcast(&pf->cv);
+      break;
+    }
+    if(count == 0) {
+      /* caught up with the writer; poll until something new lands */
+      __jlog_prefetch_deadline(&ts, JLOG_PREFETCH_IDLE_USEC);
+      if(!pf->stop) pthread_cond_timedwait(&pf->cv, &pf->lock, &ts);
+      continue;
+    }
+    slot->batch.first = start;
+    slot->batch.last = start;
+    slot->batch.last.marker += count - 1;
+    pf->cursor = slot->batch.last;
+    slot->state = SLOT_READY;
+    pf->fill = (pf->fill + 1) % pf->depth;
+    pthread_cond_broadcast(&pf->cv);
+  }
+  pthread_mutex_unlock(&pf->lock);
+  return NULL;
+}
+
+jlog_prefetch *jlog_prefetch_new(jlog_ctx *ctx, int batch_size, int depth) {
+  jlog_prefetch *pf;
+  int i;
+
+  ctx->last_error = JLOG_ERR_SUCCESS;
+  if(ctx->context_mode != JLOG_READ) {
+    ctx->last_error = JLOG_ERR_ILLEGAL_WRITE;
+    ctx->last_errno = EPERM;
+    return NULL;
+  }
+  if(batch_size < 1 || depth < 0 || depth > JLOG_PREFETCH_MAX_DEPTH) {
+    ctx->last_error = JLOG_ERR_ILLEGAL_INIT;
+    ctx->last_errno = EINVAL;
+    return NULL;
+  }
+  if(depth < 2) depth = 2;
+
+  pf = calloc(1, sizeof(*pf));
+  if(pf == NULL) {
+    ctx->last_error = JLOG_ERR_OPEN;
+    ctx->last_errno = ENOMEM;
+    return NULL;
+  }
+  pf->ctx = ctx;
+  pf->batch_size = batch_size;
+  pf->depth = depth;
+  pthread_mutex_init(&pf->lock, NULL);
+  pthread_cond_init(&pf->cv, NULL);
+  for(i=0; i<depth; i++) {
+    pf->slots[i].batch.messages = calloc(batch_size, sizeof(jlog_message));
+    if(pf->slots[i].batch.messages == NULL) {
+      ctx->last_error = JLOG_ERR_OPEN;
+      ctx->last_errno = ENOMEM;
+      goto fail;
+    }
+  }
+
+  if(jlog_get_checkpoint(ctx, ctx->subscriber_name, &pf->cursor) != 0) {
+    ctx->last_error = JLOG_ERR_INVALID_SUBSCRIBER;
+    goto fail;
+  }
+  pf->reader = jlog_new(ctx->path);
+  if(pf->reader == NULL) {
+    ctx->last_error = JLOG_ERR_OPEN;
+    ctx->last_errno = ENOMEM;
+    goto fail;
+  }
+  pf->reader->multi_process = ctx->multi_process;
+  jlog_ctx_set_decompression_threads(pf->reader, ctx->decompress_threads);
+  jlog_ctx_alter_read_method(pf->reader, ctx->read_method);
+  if(jlog_ctx_open_reader(pf->reader, ctx->subscriber_name) != 0) {
+    ctx->last_error = jlog_ctx_err(pf->reader);
+    ctx->last_errno = jlog_ctx_errno(pf->reader);
+    goto fail;
+  }
+  if(pthread_create(&pf->thread, NULL, __jlog_prefetch_thread, pf) != 0) {
+    ctx->last_error = JLOG_ERR_OPEN;
+    ctx->last_errno = errno;
+    goto fail;
+  }
+  pf->thread_started = 1;
+  return pf;
+
+ fail:
+  jlog_prefetch_destroy(pf);
+  return NULL;
+}
+
+int jlog_prefetch_next(jlog_prefetch *pf, jlog_batch **batch, int timeout_ms) {
+  jlog_prefetch_slot *slot;
+  struct timespec ts;
+  int rv = 0;
+
+  *batch = NULL;
+  pf->ctx->last_error = JLOG_ERR_SUCCESS;
+  if(timeout_ms > 0) __jlog_prefetch_deadline(&ts, (long)timeout_ms * 1000);
+  pthread_mutex_lock(&pf->lock);
+  while(1) {
+    slot = &pf->slots[pf->take];
+    if(slot->state == SLOT_READY) {
+      slot->state = SLOT_HELD;
+      pf->take = (pf->take + 1) % pf->depth;
+      *batch = &slot->batch;
+      rv = slot->batch.count;
+      break;
+    }
+    if(pf->error != JLOG_ERR_SUCCESS) {
+      pf->ctx->last_error = pf->error;
+      pf->ctx->last_errno = pf->error_errno;
+      rv = -1;
+      break;
+    }
+    if(timeout_ms == 0) break;
+    if(timeout_ms < 0) pthread_cond_wait(&pf->cv, &pf->lock);
+    else if(pthread_cond_timedwait(&pf->cv, &pf->lock, &ts) == ETIMEDOUT) break;
+  }
+  pthread_mutex_unlock(&pf->lock);
+  return rv;
+}
+
+void jlog_prefetch_release(jlog_prefetch *pf, jlog_batch *batch) {
+  int i;
+
+  if(batch == NULL) return;
+  pthread_mutex_lock(&pf->lock);
+  for(i=0; i<pf->depth; i++) {
+    if(&pf->slots[i].batch == batch && pf->slots[i].state == SLOT_HELD) {
+      pf->slots[i].state = SLOT_FREE;
+      pthread_cond_broadcast(&pf->cv);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&pf->lock);
+}
+
+void jlog_prefetch_destroy(jlog_prefetch *pf) {
+  int i;
+
+  if(pf == NULL) return;
+  if(pf->thread_started) {
+    pthread_mutex_lock(&pf->lock);
+    pf->stop = 1;
+    pthread_cond_broadcast(&pf->cv);
+    pthread_mutex_unlock(&pf->lock);
+    pthread_join(pf->thread, NULL);
+  }
+  if(pf->reader) jlog_ctx_close(pf->reader);
+  for(i=0; i<pf->depth; i++) {
+    free(pf->slots[i].batch.messages);
+    free(pf->slots[i].data);
+  }
+  pthread_cond_destroy(&pf->cv);
+  pthread_mutex_destroy(&pf->lock);
+  free(pf);
+}
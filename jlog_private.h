@@ -46,6 +46,24 @@
 #define DEFAULT_SAFETY JLOG_ALMOST_SAFE
 #define DEFAULT_READ_MESSAGE_TYPE JLOG_READ_METHOD_MMAP
 #define INDEX_EXT ".idx"
+#define TIME_INDEX_EXT ".tdx"
+#define TIME_INDEX_MAGIC 0x7864746a
+#define TIME_INDEX_INTERVAL 256
+#define GROUP_LEASE_MAGIC 0x6c70726a
+#define GROUP_LEASE_SLOTS 64
+#define REPLICA_MAGIC 0x7065726a
+#define EXPORT_MAGIC 0x7078656a
+#define REPLICA_WINDOW 16
+#define SUBSCRIBER_TABLE_FILE "subscribers"
+#define SUBSCRIBER_TABLE_MAGIC 0x6274736a
+#define SUBSCRIBER_TABLE_SLOTS 16
+#define SUBSCRIBER_NAME_MAX 240
+#define INDEX_LENGTH_FILE "idxlen"
+#define INDEX_LENGTH_MAGIC 0x6c78646a
+#define METASTORE_FILE "metastore"
+#define METASTORE_EXT_FILE "metastore2"
+#define RETENTION_FILE "retention"
+#define RETENTION_MAGIC 0x7465726a
 #define MAXLOGPATHLEN (MAXPATHLEN - (8+sizeof(INDEX_EXT)))
 
 static const char __jlog_hexchars[] = "0123456789abcdef";
@@ -65,6 +83,159 @@ struct _jlog_meta_info {
   u_int32_t hdr_magic;
 };
 
+/* A jlog created with any of the features below keeps its metastore in
+ * METASTORE_EXT_FILE instead, with these fields following the ones above.
+ * Having no "metastore", it is refused by libraries that predate them
+ * rather than repaired back to the old format and misread. */
+struct _jlog_meta_ext {
+  u_int32_t features;
+  u_int32_t index_stride;     /* records per entry of a sparse index */
+  u_int64_t last_seq;
+  u_int32_t record_size;      /* payload bytes of every record, when fixed */
+  u_int32_t reserved;
+};
+
+/* The retention policy ("retention"), kept apart from the metastore so
+ * that any jlog can have one; 0 leaves a limit off */
+struct _jlog_retention {
+  u_int32_t magic;
+  u_int32_t retain_age;       /* seconds */
+  u_int64_t retain_bytes;
+  u_int32_t retain_segments;
+  u_int32_t reserved;
+};
+
+#define JLOG_FEATURE_SEQUENCE 0x00000001
+#define JLOG_FEATURE_KEYS     0x00000002
+#define JLOG_FEATURE_COMPACT_INDEX 0x00000004
+#define JLOG_FEATURE_SPARSE_INDEX  0x00000008
+#define JLOG_FEATURE_FIXED_RECORDS 0x00000010
+#define JLOG_FEATURES_KNOWN   (JLOG_FEATURE_SEQUENCE|JLOG_FEATURE_KEYS|\
+                               JLOG_FEATURE_COMPACT_INDEX|JLOG_FEATURE_SPARSE_INDEX|\
+                               JLOG_FEATURE_FIXED_RECORDS)
+/* those that change the layout of a record header */
+#define JLOG_FEATURES_HEADER  (JLOG_FEATURE_SEQUENCE|JLOG_FEATURE_KEYS)
+
+/* A closed segment's sparse time index ("<segment>.tdx"): this header
+ * followed by one entry for every `interval` messages, starting at 1 */
+struct _jlog_time_index_header {
+  u_int32_t magic;
+  u_int32_t interval;
+};
+
+struct _jlog_time_index_entry {
+  u_int32_t marker;
+  u_int32_t tv_sec;
+  u_int32_t tv_usec;
+  u_int32_t keys;   /* summary of the block's keys, when the jlog has them */
+};
+
+/* A consumer group's lease table ("gl.<hex subscriber>"): this header
+ * followed by GROUP_LEASE_SLOTS slots.  A leased slot is owned by the
+ * process holding an fcntl lock over its bytes. */
+struct _jlog_group_header {
+  u_int32_t magic;
+  u_int32_t nslots;
+};
+
+typedef enum {
+  JLOG_LEASE_FREE = 0,
+  JLOG_LEASE_HELD,
+  JLOG_LEASE_DONE
+} jlog_lease_state;
+
+struct _jlog_group_slot {
+  jlog_id start;
+  jlog_id finish;
+  u_int32_t state;
+  u_int32_t pid;    /* 0 once given back unprocessed */
+};
+
+/* The last index extended ("idxlen"), published under a sequence lock:
+ * seq is odd while a publisher is writing the fields.  Readers that find
+ * the index and segment still at the published lengths need not take the
+ * index lock to learn where the index ends. */
+struct _jlog_index_length {
+  u_int32_t magic;
+  u_int32_t seq;
+  u_int32_t log;
+  u_int32_t closed;
+  u_int32_t marker;     /* records they cover */
+  u_int32_t reserved;
+  u_int64_t index_len;  /* bytes of offsets, close marker included */
+  u_int64_t data_len;   /* bytes of the segment they cover */
+};
+
+/* The subscriber table ("subscribers"): this header followed by nslots
+ * slots, one per cp.* file.  The cp.* files stay authoritative; the table
+ * caches their contents and the lowest checkpointed log so that trimming
+ * and listing need not open every checkpoint.  overflow is set while some
+ * subscriber's name does not fit a slot, and the table is then bypassed.
+ * The table never shrinks, and gen changes whenever a subscriber may have
+ * changed slots, so that a lazy reader can keep its slot mapped. */
+struct _jlog_subscriber_table {
+  u_int32_t magic;
+  u_int32_t nslots;
+  u_int32_t used;
+  u_int32_t overflow;
+  u_int32_t low;      /* lowest checkpointed log when used != 0 */
+  u_int32_t gen;
+};
+
+struct _jlog_subscriber_slot {
+  jlog_id id;       /* as in the cp.* file */
+  jlog_id live;     /* ahead of id while a lazy checkpoint is unpersisted;
+                     * stored whole, without the table lock, by that reader */
+  u_int32_t in_use;
+  u_int32_t reserved;
+  char name[SUBSCRIBER_NAME_MAX];
+};
+
+/* An eviction notice ("ev.<hex subscriber>"): retention moved the
+ * subscriber's checkpoint from `from` to `to`, past `messages` it had not
+ * read.  Notices accumulate until the subscriber's next read. */
+struct _jlog_eviction {
+  jlog_id from;
+  jlog_id to;
+  u_int64_t messages;
+};
+
+/* Leads every export: the layout of the records that follow, which the
+ * importing jlog must share.  Exports may be sent back to back. */
+struct _jlog_export_header {
+  u_int32_t magic;
+  u_int32_t hdr_magic;
+  u_int32_t features;   /* JLOG_FEATURES_HEADER bits only */
+  u_int32_t hdr_size;
+};
+
+/* A replication frame: the raw bytes of records first..last of segment
+ * log, which start at offset in the leader's data file.  The follower
+ * answers each with an ack carrying the id it has made durable. */
+struct _jlog_replica_frame {
+  u_int32_t magic;
+  u_int32_t log;
+  u_int32_t first;
+  u_int32_t last;
+  u_int64_t offset;
+  u_int64_t bytes;
+};
+
+struct _jlog_replica_ack {
+  u_int32_t magic;
+  u_int32_t log;
+  u_int32_t marker;
+  u_int32_t status;   /* 0, or the follower's jlog_err */
+};
+
+/* A record header with its extension, as handed back by reads of a jlog
+ * with sequence numbers or keys: jlog_message.header points at hdr, and
+ * the accessors find ext right behind it */
+typedef struct _jlog_message_header_full {
+  jlog_message_header_compressed hdr;
+  jlog_message_header_ext ext;
+} jlog_message_header_full;
+
 struct _jlog_ctx {
   struct _jlog_meta_info *meta;
   pthread_mutex_t write_lock;
@@ -80,6 +251,12 @@ struct _jlog_ctx {
   size_t    desired_pre_commit_buffer_len;
   uint32_t  *pre_commit_pointer;
   struct _jlog_meta_info pre_init; /* only used before we're opened */
+  struct _jlog_meta_ext *meta_ext;
+  struct _jlog_meta_ext pre_init_ext; /* before we're opened, or all zero */
+  struct _jlog_retention *retention;
+  struct _jlog_retention pre_init_retention;
+  int       meta_has_ext;
+  int       retention_is_mapped;
   jlog_mode context_mode;
   char      *path;
   int       file_mode;
@@ -88,6 +265,7 @@ struct _jlog_ctx {
   jlog_file *index;
   jlog_file *checkpoint;
   jlog_file *metastore;
+  jlog_file *retainstore;
   jlog_file *pre_commit;
   void     *mmap_base;
   size_t    mmap_len;
@@ -111,10 +289,55 @@ struct _jlog_ctx {
    */
   size_t    mess_data_size;
   char      *mess_data;
+
+  /**
+   * Bulk reads of compressed logs can spread decompression over a pool
+   * of threads; the pool is created on first use.
+   */
+  int       decompress_threads;
+  struct jlog_decompress_pool *decompress_pool;
+  struct jlog_decompress_job *decompress_jobs;
+  int       decompress_jobs_len;
+
+  /**
+   * On a jlog with sequence numbers or keys, the headers of the messages
+   * last read, with their extensions; overwritten by the next read, like
+   * mess_data.
+   */
+  jlog_message_header_full *ext_headers;
+  int       ext_headers_len;
+
+  /* consumer group membership; at most one lease outstanding */
+  jlog_file *group;
+  int       group_leased;
+  u_int32_t group_slot;
+
+  /* see jlog_ctx_set_lazy_checkpoint; lazy_persister marks the private
+   * reader its thread persists with */
+  struct _jlog_lazy_checkpoint *lazy;
+  int       lazy_persister;
+
+  /* segments freed by checkpoints go to the background reclaimer */
+  int       async_reclaim;
+  u_int32_t reclaim_rate;
+
+  /* this context's mapping of the subscriber table; see __jlog_subtab_lock */
+  jlog_file *subtab;
+  void     *subtab_map;
+  size_t    subtab_len;
+  time_t    subtab_mtime;   /* the directory's when last reconciled */
+
+  /* this context's mapping of the published index length */
+  jlog_file *idxlen;
+  struct _jlog_index_length *idxlen_map;
+  int       idxlen_failed;
 };
 
 /* macros */
 
+#define JLOG_ID_BEFORE(a, b) \
+  ((a)->log < (b)->log || ((a)->log == (b)->log && (a)->marker < (b)->marker))
+
 #define STRLOGID(s, logid) do { \
   int __i; \
   for(__i=0;__i<8;__i++) \
@@ -165,6 +388,49 @@ JLOG_API(int) jlog_inspect_datafile(jlog_ctx *ctx, u_int32_t log, int verbose);
  */
 JLOG_API(int) jlog_idx_details(jlog_ctx *ctx, u_int32_t log,
                                u_int32_t *marker, int *closed);
+/**
+ * like jlog_ctx_read_interval, but starting after an arbitrary position
+ * rather than the subscriber's checkpoint; no checkpoint is modified
+ * @return count of messages in the interval, -1 on error
+ * @internal
+ */
+JLOG_API(int) jlog_ctx_read_interval_after(jlog_ctx *ctx, const jlog_id *after,
+                                           jlog_id *start, jlog_id *finish);
+/**
+ * copies the first `count` messages of a bulk read into `*data` (grown
+ * as needed) so the batch outlives the reader's buffers
+ * @return 0 OK, -1 out of memory
+ * @internal
+ */
+JLOG_API(int) __jlog_batch_stage(jlog_batch *batch, int count,
+                                 char **data, size_t *data_len);
+/**
+ * hands the segment `file` (and its index files) to the process's
+ * background reclaimer, pacing it to `segments_per_sec` (0 for no limit)
+ * @return 0 queued, -1 if the caller must unlink it itself
+ * @internal
+ */
+JLOG_API(int) __jlog_reclaim_enqueue(const char *file, u_int32_t segments_per_sec);
+/**
+ * resyncs the index of segment `log`, then maps the segment read-only and
+ * copies out the `*count` offsets of its index; `*sealed` is set if the
+ * index is closed.  Release with munmap(*base, *len) and free(*offsets).
+ * @return 0 OK, -1 error (set on ctx)
+ * @internal
+ */
+JLOG_API(int) __jlog_segment_map(jlog_ctx *ctx, u_int32_t log, void **base,
+                                 size_t *len, u_int64_t **offsets,
+                                 u_int32_t *count, int *sealed);
+/**
+ * decodes the record at `off` of a segment mapped by __jlog_segment_map
+ * into `m`, decompressing into `*buf` (grown as needed) on a compressed
+ * jlog; safe to call from any thread
+ * @return 0 OK, -1 if the record is damaged or memory ran out
+ * @internal
+ */
+JLOG_API(int) __jlog_segment_message(jlog_ctx *ctx, const void *base, size_t len,
+                                     u_int64_t off, jlog_message *m,
+                                     char **buf, size_t *buf_len);
 
 
 #ifdef _WIN32
@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2016, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *    * Neither the name Circonus, Inc. nor the names
+ *      of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written
+ *      permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Deferred segment reclamation.  Contexts that opt in with
+ * jlog_ctx_set_async_reclaim hand the names of segments their checkpoints
+ * have freed to one background thread per process, which unlinks them (and
+ * their index files) in batches, optionally paced, so the reader that moves
+ * a checkpoint over a segment boundary does not wait on the filesystem.
+ */
+
+#include "jlog_config.h"
+#include "jlog_private.h"
+#include <pthread.h>
+#if HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct jlog_reclaim_item {
+  struct jlog_reclaim_item *next;
+  char file[1];
+} jlog_reclaim_item;
+
+static pthread_mutex_t reclaim_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reclaim_work_cv = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t reclaim_done_cv = PTHREAD_COND_INITIALIZER;
+static jlog_reclaim_item *reclaim_head;
+static jlog_reclaim_item **reclaim_tail = &reclaim_head;
+static int reclaim_busy;
+static u_int32_t reclaim_rate;  /* segments per second, 0 for no limit */
+static int reclaim_running;
+static pthread_once_t reclaim_once = PTHREAD_ONCE_INIT;
+
+/* Keep the lock consistent across fork; the thread does not survive in the
+ * child, and whatever was queued is left to the parent's. */
+static void __jlog_reclaim_prepare(void) { pthread_mutex_lock(&reclaim_lock); }
+static void __jlog_reclaim_parent(void) { pthread_mutex_unlock(&reclaim_lock); }
+static void __jlog_reclaim_child(void) {
+  jlog_reclaim_item *item;
+
+  while ((item = reclaim_head) != NULL) {
+    reclaim_head = item->next;
+    free(item);
+  }
+  reclaim_tail = &reclaim_head;
+  reclaim_busy = 0;
+  reclaim_running = 0;
+  pthread_mutex_unlock(&reclaim_lock);
+}
+static void __jlog_reclaim_init(void) {
+  pthread_atfork(__jlog_reclaim_prepare, __jlog_reclaim_parent, __jlog_reclaim_child);
+}
+
+static void
+__jlog_reclaim_unlink(const char *file) {
+  char name[MAXPATHLEN];
+  int len = strlen(file);
+
+  unlink(file);
+  if ((size_t)len + sizeof(INDEX_EXT) > sizeof(name)) return;
+  memcpy(name, file, len);
+  memcpy(name + len, INDEX_EXT, sizeof(INDEX_EXT));
+  unlink(name);
+  memcpy(name + len, TIME_INDEX_EXT, sizeof(TIME_INDEX_EXT));
+  unlink(name);
+}
+
+static void *
+__jlog_reclaim_thread(void *arg) {
+  jlog_reclaim_item *batch, *item;
+  struct timeval began, now;
+  u_int32_t rate, done;
+  double elapsed, due;
+
+  (void)arg;
+  pthread_mutex_lock(&reclaim_lock);
+  for (;;) {
+    while (reclaim_head == NULL)
+      pthread_cond_wait(&reclaim_work_cv, &reclaim_lock);
+    /* take everything queued so far as one batch */
+    batch = reclaim_head;
+    reclaim_head = NULL;
+    reclaim_tail = &reclaim_head;
+    reclaim_busy = 1;
+    rate = reclaim_rate;
+    pthread_mutex_unlock(&reclaim_lock);
+
+    gettimeofday(&began, NULL);
+    for (done = 0; (item = batch) != NULL; done++) {
+      batch = item->next;
+      if (rate && done) {
+        gettimeofday(&now, NULL);
+        elapsed = (now.tv_sec - began.tv_sec) +
+                  (now.tv_usec - began.tv_usec) / 1000000.0;
+        due = (double)done / rate;
+        if (due > elapsed) usleep((useconds_t)((due - elapsed) * 1000000));
+      }
+      __jlog_reclaim_unlink(item->file);
+      free(item);
+    }
+
+    pthread_mutex_lock(&reclaim_lock);
+    reclaim_busy = 0;
+    if (reclaim_head == NULL) pthread_cond_broadcast(&reclaim_done_cv);
+  }
+  return NULL;
+}
+
+/* Queue the segment `file` for unlinking.  Returns -1 if it could not be
+ * queued, in which case the caller should unlink it itself. */
+int
+__jlog_reclaim_enqueue(const char *file, u_int32_t segments_per_sec) {
+  jlog_reclaim_item *item;
+  pthread_t thread;
+  size_t len = strlen(file);
+
+  item = malloc(sizeof(*item) + len);
+  if (item == NULL) return -1;
+  memcpy(item->file, file, len + 1);
+  item->next = NULL;
+
+  pthread_once(&reclaim_once, __jlog_reclaim_init);
+  pthread_mutex_lock(&reclaim_lock);
+  if (!reclaim_running) {
+    if (pthread_create(&thread, NULL, __jlog_reclaim_thread, NULL) != 0) {
+      pthread_mutex_unlock(&reclaim_lock);
+      free(item);
+      return -1;
+    }
+    pthread_detach(thread);
+    reclaim_running = 1;
+  }
+  reclaim_rate = segments_per_sec;
+  *reclaim_tail = item;
+  reclaim_tail = &item->next;
+  pthread_cond_signal(&reclaim_work_cv);
+  pthread_mutex_unlock(&reclaim_lock);
+  return 0;
+}
+
+void
+jlog_reclaim_drain(void) {
+  pthread_mutex_lock(&reclaim_lock);
+  if (reclaim_running) {
+    while (reclaim_head != NULL || reclaim_busy)
+      pthread_cond_wait(&reclaim_done_cv, &reclaim_lock);
+  }
+  pthread_mutex_unlock(&reclaim_lock);
+}
@@ -0,0 +1,381 @@
+/*
+ * Copyright (c) 2016, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *    * Neither the name Circonus, Inc. nor the names
+ *      of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written
+ *      permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * A reader shared by the threads of a worker pool.  The jlog_shared owns
+ * one reader context and, under its lock, hands out disjoint ranges of
+ * the subscriber's stream, checkpointing through each range below the
+ * earliest one still being worked on.  Segments are mapped once, with a
+ * copy of their index, into refcounted snapshots that never change; the
+ * open segment gets a new snapshot when a cursor asks past the end of the
+ * last one.  Each worker reads through a cursor of its own, which keeps
+ * a reference to the snapshot it is in and its own decompression buffer,
+ * so reads within a snapshot take no lock at all.
+ */
+
+#include "jlog_config.h"
+#include "jlog_private.h"
+#include <pthread.h>
+#include <sys/mman.h>
+#if HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct jlog_segment {
+  u_int32_t log;
+  int refcnt;            /* the cache holds one while it is current */
+  int sealed;            /* the index is closed: no newer snapshot follows */
+  void *base;
+  size_t len;
+  u_int64_t *offsets;
+  u_int32_t count;
+  struct jlog_segment *next;
+} jlog_segment;
+
+typedef enum {
+  RANGE_LEASED = 0,
+  RANGE_RETURNED,
+  RANGE_DONE
+} jlog_shared_range_state;
+
+typedef struct {
+  jlog_id start;
+  jlog_id finish;
+  jlog_shared_range_state state;
+} jlog_shared_range;
+
+struct _jlog_shared {
+  jlog_ctx *ctx;
+  pthread_mutex_t lock;
+  jlog_segment *segments; /* the current snapshot of each segment in use */
+  jlog_id next;           /* ranges are handed out after this */
+  int next_valid;
+  jlog_shared_range *ranges; /* leased, in the order handed out */
+  int nranges;
+  int aranges;
+};
+
+struct _jlog_cursor {
+  jlog_shared *sh;
+  jlog_segment *seg;
+  char *buf;
+  size_t buf_len;
+  jlog_id lease_start;
+  int leased;
+  int last_error;
+  int last_errno;
+};
+
+static void
+__jlog_segment_release(jlog_segment *seg) {
+  if(__sync_sub_and_fetch(&seg->refcnt, 1) > 0) return;
+  if(seg->base) munmap(seg->base, seg->len);
+  free(seg->offsets);
+  free(seg);
+}
+
+/* Drop the cache's hold on segments before every range still leased or
+ * yet to be; called with the lock held. */
+static void
+__jlog_shared_trim(jlog_shared *sh) {
+  jlog_segment **sp = &sh->segments, *seg;
+  u_int32_t low = sh->nranges ? sh->ranges[0].start.log : sh->next.log;
+
+  while((seg = *sp) != NULL) {
+    if(seg->log < low) {
+      *sp = seg->next;
+      __jlog_segment_release(seg);
+    }
+    else sp = &seg->next;
+  }
+}
+
+/* A reference to a snapshot of segment log covering marker if it exists,
+ * else the newest there is. */
+static jlog_segment *
+__jlog_shared_segment(jlog_cursor *c, u_int32_t log, u_int32_t marker) {
+  jlog_shared *sh = c->sh;
+  jlog_segment **sp, *seg, *fresh;
+
+  pthread_mutex_lock(&sh->lock);
+  for(sp = &sh->segments; (seg = *sp) != NULL; sp = &seg->next)
+    if(seg->log == log) break;
+  if(seg == NULL || (!seg->sealed && marker > seg->count)) {
+    if((fresh = calloc(1, sizeof(*fresh))) == NULL) {
+      c->last_error = JLOG_ERR_FILE_READ;
+      c->last_errno = ENOMEM;
+      pthread_mutex_unlock(&sh->lock);
+      return NULL;
+    }
+    if(__jlog_segment_map(sh->ctx, log, &fresh->base, &fresh->len,
+                          &fresh->offsets, &fresh->count, &fresh->sealed) != 0) {
+      c->last_error = sh->ctx->last_error;
+      c->last_errno = sh->ctx->last_errno;
+      free(fresh);
+      pthread_mutex_unlock(&sh->lock);
+      return NULL;
+    }
+    fresh->log = log;
+    fresh->refcnt = 1;
+    if(seg) {
+      fresh->next = seg->next;
+      *sp = fresh;
+      __jlog_segment_release(seg);
+    }
+    else {
+      fresh->next = sh->segments;
+      sh->segments = fresh;
+    }
+    seg = fresh;
+  }
+  __sync_add_and_fetch(&seg->refcnt, 1);
+  pthread_mutex_unlock(&sh->lock);
+  return seg;
+}
+
+jlog_shared *
+jlog_shared_new(jlog_ctx *ctx) {
+  jlog_shared *sh;
+
+  if(ctx->context_mode != JLOG_READ) {
+    ctx->last_error = JLOG_ERR_ILLEGAL_OPEN;
+    ctx->last_errno = EINVAL;
+    return NULL;
+  }
+  if((sh = calloc(1, sizeof(*sh))) == NULL) {
+    ctx->last_error = JLOG_ERR_OPEN;
+    ctx->last_errno = ENOMEM;
+    return NULL;
+  }
+  sh->ctx = ctx;
+  pthread_mutex_init(&sh->lock, NULL);
+  return sh;
+}
+
+void
+jlog_shared_destroy(jlog_shared *sh) {
+  jlog_segment *seg;
+
+  if(sh == NULL) return;
+  while((seg = sh->segments) != NULL) {
+    sh->segments = seg->next;
+    __jlog_segment_release(seg);
+  }
+  pthread_mutex_destroy(&sh->lock);
+  free(sh->ranges);
+  free(sh);
+}
+
+jlog_cursor *
+jlog_cursor_new(jlog_shared *sh) {
+  jlog_cursor *c;
+
+  if((c = calloc(1, sizeof(*c))) == NULL) return NULL;
+  c->sh = sh;
+  return c;
+}
+
+void
+jlog_cursor_destroy(jlog_cursor *c) {
+  if(c == NULL) return;
+  if(c->leased) jlog_cursor_release(c);
+  if(c->seg) __jlog_segment_release(c->seg);
+  free(c->buf);
+  free(c);
+}
+
+int
+jlog_cursor_err(jlog_cursor *c) {
+  return c->last_error;
+}
+
+int
+jlog_cursor_errno(jlog_cursor *c) {
+  return c->last_errno;
+}
+
+int
+jlog_cursor_next(jlog_cursor *c, int max, jlog_id *start, jlog_id *finish) {
+  jlog_shared *sh = c->sh;
+  jlog_shared_range *r;
+  int i, count;
+
+  c->last_error = JLOG_ERR_SUCCESS;
+  if(c->leased || max < 1) {
+    c->last_error = JLOG_ERR_ILLEGAL_CHECKPOINT;
+    c->last_errno = EINVAL;
+    return -1;
+  }
+  pthread_mutex_lock(&sh->lock);
+  /* ranges given back go out again first */
+  for(i=0; i<sh->nranges; i++) {
+    r = &sh->ranges[i];
+    if(r->state != RANGE_RETURNED) continue;
+    r->state = RANGE_LEASED;
+    *start = r->start;
+    *finish = r->finish;
+    pthread_mutex_unlock(&sh->lock);
+    c->lease_start = *start;
+    c->leased = 1;
+    return finish->marker - start->marker + 1;
+  }
+  if(!sh->next_valid) {
+    if(jlog_get_checkpoint(sh->ctx, sh->ctx->subscriber_name, &sh->next) != 0) {
+      c->last_error = JLOG_ERR_INVALID_SUBSCRIBER;
+      c->last_errno = sh->ctx->last_errno;
+      pthread_mutex_unlock(&sh->lock);
+      return -1;
+    }
+    sh->next_valid = 1;
+  }
+  if((count = jlog_ctx_read_interval_after(sh->ctx, &sh->next, start, finish)) < 0) {
+    c->last_error = sh->ctx->last_error;
+    c->last_errno = sh->ctx->last_errno;
+    pthread_mutex_unlock(&sh->lock);
+    return -1;
+  }
+  if(count == 0) {
+    pthread_mutex_unlock(&sh->lock);
+    return 0;
+  }
+  if(count > max) {
+    finish->log = start->log;
+    finish->marker = start->marker + max - 1;
+    count = max;
+  }
+  if(sh->nranges == sh->aranges) {
+    int n = sh->aranges ? sh->aranges * 2 : 8;
+    if((r = realloc(sh->ranges, n * sizeof(*r))) == NULL) {
+      c->last_error = JLOG_ERR_CHECKPOINT;
+      c->last_errno = ENOMEM;
+      pthread_mutex_unlock(&sh->lock);
+      return -1;
+    }
+    sh->ranges = r;
+    sh->aranges = n;
+  }
+  r = &sh->ranges[sh->nranges++];
+  r->start = *start;
+  r->finish = *finish;
+  r->state = RANGE_LEASED;
+  sh->next = *finish;
+  __jlog_shared_trim(sh);
+  pthread_mutex_unlock(&sh->lock);
+  c->lease_start = *start;
+  c->leased = 1;
+  return count;
+}
+
+/* Settle the cursor's lease: processed, or given back to be leased again */
+static int
+__jlog_cursor_settle(jlog_cursor *c, int processed) {
+  jlog_shared *sh = c->sh;
+  jlog_id done = { 0, 0 };
+  int i, n = 0, rv = 0;
+
+  c->last_error = JLOG_ERR_SUCCESS;
+  if(!c->leased) {
+    c->last_error = JLOG_ERR_ILLEGAL_CHECKPOINT;
+    c->last_errno = EINVAL;
+    return -1;
+  }
+  c->leased = 0;
+  pthread_mutex_lock(&sh->lock);
+  for(i=0; i<sh->nranges; i++)
+    if(!memcmp(&sh->ranges[i].start, &c->lease_start, sizeof(jlog_id))) break;
+  if(i < sh->nranges)
+    sh->ranges[i].state = processed ? RANGE_DONE : RANGE_RETURNED;
+  while(n < sh->nranges && sh->ranges[n].state == RANGE_DONE)
+    done = sh->ranges[n++].finish;
+  if(n > 0) {
+    memmove(sh->ranges, sh->ranges + n, (sh->nranges - n) * sizeof(*sh->ranges));
+    sh->nranges -= n;
+    if(jlog_ctx_read_checkpoint(sh->ctx, &done) != 0) {
+      c->last_error = sh->ctx->last_error;
+      c->last_errno = sh->ctx->last_errno;
+      rv = -1;
+    }
+  }
+  pthread_mutex_unlock(&sh->lock);
+  return rv;
+}
+
+int
+jlog_cursor_commit(jlog_cursor *c) {
+  return __jlog_cursor_settle(c, 1);
+}
+
+int
+jlog_cursor_release(jlog_cursor *c) {
+  return __jlog_cursor_settle(c, 0);
+}
+
+int
+jlog_cursor_read_message(jlog_cursor *c, const jlog_id *id, jlog_message *m) {
+  jlog_segment *seg = c->seg;
+  u_int64_t off;
+
+  c->last_error = JLOG_ERR_SUCCESS;
+  if(id->marker < 1) {
+    c->last_error = JLOG_ERR_ILLEGAL_LOGID;
+    c->last_errno = EINVAL;
+    return -1;
+  }
+  if(seg == NULL || seg->log != id->log ||
+     (id->marker > seg->count && !seg->sealed)) {
+    if((seg = __jlog_shared_segment(c, id->log, id->marker)) == NULL) return -1;
+    if(c->seg) __jlog_segment_release(c->seg);
+    c->seg = seg;
+  }
+  if(id->marker > seg->count) {
+    /* one past a closed index is its close tag; not a real offset */
+    c->last_error = (seg->sealed && id->marker == seg->count + 1) ?
+                    JLOG_ERR_CLOSE_LOGID : JLOG_ERR_ILLEGAL_LOGID;
+    c->last_errno = 0;
+    return -1;
+  }
+  off = seg->offsets[id->marker - 1];
+  if(off == 0 && id->marker != 1) {
+    c->last_error = JLOG_ERR_IDX_CORRUPT;
+    c->last_errno = 0;
+    return -1;
+  }
+  if(__jlog_segment_message(c->sh->ctx, seg->base, seg->len, off, m,
+                            &c->buf, &c->buf_len) != 0) {
+    c->last_error = JLOG_ERR_FILE_CORRUPT;
+    c->last_errno = errno;
+    return -1;
+  }
+  return 0;
+}
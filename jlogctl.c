@@ -44,6 +44,14 @@
 #if HAVE_DIRENT_H
 #include <dirent.h>
 #endif
+#if HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#if HAVE_TIME_H
+#include <time.h>
+#endif
+#include <sys/socket.h>
+#include <sys/un.h>
 
 static int verbose = 0;
 static int show_progress = 0;
@@ -60,6 +68,8 @@ static char *remove_subscriber = NULL;
 static char *update_subscriber = NULL;
 static jlog_id new_checkpoint;
 static int set_checkpoint_flag = 0;
+static struct timeval new_checkpoint_time;
+static int set_checkpoint_time_flag = 0;
 
 static void usage(const char *progin) {
   const char *prog = strrchr(progin, '/');
@@ -67,11 +77,16 @@ static void usage(const char *progin) {
   printf("Usage:\n");
   printf("\n=== Subscriber Management ===\n\n");
   printf("%s subscriber [-j <jlogpath>] [-v]\n", prog);
-  printf("\t-a <sub> [-C <8x:8x>]\t\tAdd a subscriber (at checkpoint)\n");
-  printf("\t-u <sub> -C <8x:8x>\t\tUpdate a subscriber to checkpoint\n");
+  printf("\t-a <sub> [-C <8x:8x>|-T <time>]\tAdd a subscriber (at checkpoint)\n");
+  printf("\t-u <sub> -C <8x:8x>|-T <time>\tUpdate a subscriber to checkpoint\n");
+  printf("\t\t<time> is epoch seconds[.frac] or YYYY-MM-DD[THH:MM[:SS]] local\n");
   printf("\t-e <sub>\t\t\tErase a subscriber\n");
   printf("\t-l\t\t\t\tList subscribers (default behavior)\n");
   printf("\t-p <sub>\t\t\tShow perspective of subscriber\n");
+  printf("\n");
+  printf("%s lag [-j <jlogpath>] [-s <sub>] [-J] [-v]\tUnread messages, bytes and age\n", prog);
+  printf("\t\t\t\t\tone tab separated line (-J: JSON object)\n");
+  printf("\t\t\t\t\tper subscriber; -v adds a header\n");
   printf("\n=== Data Management ===\n\n");
   printf("%s clean [-j <jlogpath>] [-v]\tRemove unsubscribed data\n", prog);
   printf("\n");
@@ -79,10 +94,35 @@ static void usage(const char *progin) {
   printf("\t-i\t\t\t\tShow index information\n");
   printf("\t-d\t\t\t\tAnalyze datafiles\n");
   printf("\t-r\t\t\t\tAnalyze and repair datafiles\n");
+  printf("\t-P, --parallel <n>\t\tInspect, repair and index every\n");
+  printf("\t\t\t\t\tsegment first on <n> threads\n");
+  printf("\n");
+  printf("%s compact [-j <jlogpath>] [-v] [-r <KB/s>]\tKeep only the latest record per key\n", prog);
+  printf("\t\t\t\t\tin segments no subscriber is reading\n");
+  printf("\n");
+  printf("%s snapshot [-j <jlogpath>] -d <destpath> [-v]\tConsistent copy of a live jlog\n", prog);
+  printf("\n=== Replication ===\n\n");
+  printf("%s follow -j <jlogpath> -u <socket> [-v]\tApply a leader's records\n", prog);
+  printf("%s ship -j <jlogpath> -u <socket> [-v]\tShip records to a follower\n", prog);
+  printf("\t-s <sub>\t\t\tsubscriber to ship as (replica)\n");
+  printf("\t-H\t\t\t\thold segments until the follower has them\n");
+  printf("\t-i <ms>\t\t\t\tpoll interval once caught up (1000)\n");
   printf("\n=== Administrative ===\n\n");
-  printf("%s create -j <jlogpath> [-v] [-s <segsize>] [-p <precommit>] [-c <on|off]\n", prog);
+  printf("%s create -j <jlogpath> [-v] [-s <segsize>] [-p <precommit>] [-c <on|off] [-S] [-K]\n", prog);
+  printf("\t[-B <bytes>] [-A <seconds>] [-N <segments>] [-M] [-X] [-I <stride>] [-F <size>]\n");
+  printf("\t-S\tstamp records with sequence numbers\n");
+  printf("\t-K\tgive records keys for filtered reads\n");
+  printf("\t-X\tindex segments with 32-bit offsets\n");
+  printf("\t-I\tindex only every <stride>th record\n");
+  printf("\t-F\tall records are <size> bytes, found without an index\n");
+  printf("\t-B\tretain at most this many bytes of segments (0 for no limit)\n");
+  printf("\t-A\tretain segments written in the last this many seconds\n");
+  printf("\t-N\tretain at most this many segments\n");
+  printf("\t\tretention moves lagging subscribers past what it deletes\n");
+  printf("\t-M\tlock with robust shared mutexes instead of fcntl\n");
   printf("\n");
   printf("%s alter [-j <jlogpath>] [-v] [-s <segsize>] [-p <precommit>] [-c <on|off]\n", prog);
+  printf("\t[-B <bytes>] [-A <seconds>] [-N <segments>]\n");
   printf("\n");
   printf("%s meta [-j <jlogpath>] [-c|-f|-l|-m|-p|-s]\n", prog);
   printf("\t-c\tshow compression setting\n");
@@ -195,6 +235,9 @@ static void analyze_datafile(jlog_ctx *ctx, u_int32_t logid) {
       STRSETDATAFILE(ctx, idxfile, logid);
       strcat(idxfile, INDEX_EXT);
       unlink(idxfile);
+      STRSETDATAFILE(ctx, idxfile, logid);
+      strcat(idxfile, TIME_INDEX_EXT);
+      unlink(idxfile);
     }
   }
 }
@@ -246,6 +289,15 @@ static void process_jlog(const char *file, const char *sub) {
                   sub, new_checkpoint.log, new_checkpoint.marker);
         }
       }
+      if(set_checkpoint_time_flag) {
+        jlog_ctx *reader = jlog_new(file);
+        if(jlog_ctx_open_reader(reader, add_subscriber) ||
+           jlog_ctx_set_subscriber_checkpoint_time(reader, NULL, &new_checkpoint_time)) {
+          fprintf(stderr, "error setting checkpoint %s by time: %s\n",
+                  add_subscriber, jlog_ctx_err_string(reader));
+        }
+        jlog_ctx_close(reader);
+      }
       jlog_id start = { 0, 0};
       if(jlog_get_checkpoint(log, add_subscriber, &start)) {
         fprintf(stderr, "Error reading checkpoint\n");
@@ -270,6 +322,13 @@ static void process_jlog(const char *file, const char *sub) {
         return;
       }
     }
+    if(set_checkpoint_time_flag) {
+      if(jlog_ctx_set_subscriber_checkpoint_time(log, NULL, &new_checkpoint_time)) {
+        fprintf(stderr, "error setting checkpoint %s by time: %s\n",
+                update_subscriber, jlog_ctx_err_string(log));
+        return;
+      }
+    }
     if(jlog_get_checkpoint(log, NULL, &changed)) {
       fprintf(stderr, "Error reading checkpoint\n");
     }
@@ -344,10 +403,12 @@ static void process_jlog(const char *file, const char *sub) {
       if(is_datafile(de->d_name, &logid)) {
         char fullfile[MAXPATHLEN];
         char fullidx[MAXPATHLEN];
+        char fulltdx[MAXPATHLEN];
         struct stat st;
         int readers;
         snprintf(fullfile, sizeof(fullfile), "%s/%s", file, de->d_name);
         snprintf(fullidx, sizeof(fullidx), "%s/%s" INDEX_EXT, file, de->d_name);
+        snprintf(fulltdx, sizeof(fulltdx), "%s/%s" TIME_INDEX_EXT, file, de->d_name);
         if(stat(fullfile, &st)) {
           if(!quiet) printf("\t%8s [error statting file: %s\n", de->d_name, strerror(errno));
         } else {
@@ -356,7 +417,9 @@ static void process_jlog(const char *file, const char *sub) {
                             de->d_name, (unsigned long long)st.st_size, readers);
           if(show_index_info && !quiet) {
             struct stat sb;
-            if (stat(fullidx, &sb)) {
+            /* fixed records are counted from the segment itself */
+            if (!(log->meta_ext->features & JLOG_FEATURE_FIXED_RECORDS) &&
+                stat(fullidx, &sb)) {
               printf("\t\t idx: none\n");
             } else {
               u_int32_t marker;
@@ -373,6 +436,7 @@ static void process_jlog(const char *file, const char *sub) {
           if((readers == 0) && cleanup) {
             unlink(fullfile);
             unlink(fullidx);
+            unlink(fulltdx);
           }
         }
       }
@@ -392,13 +456,42 @@ set_checkpoint(const char *h) {
   if(*endptr != '\0') return -1;
   return 0;
 }
+static int
+set_checkpoint_time(const char *h) {
+  char *endptr;
+  struct tm tm;
+  int n = 0;
+
+  memset(&new_checkpoint_time, 0, sizeof(new_checkpoint_time));
+  if(strchr(h, '-') == NULL) {
+    double t = strtod(h, &endptr);
+    if(endptr == h || *endptr != '\0' || t < 0) return -1;
+    new_checkpoint_time.tv_sec = (time_t)t;
+    new_checkpoint_time.tv_usec = (suseconds_t)((t - (double)new_checkpoint_time.tv_sec) * 1000000.0);
+    return 0;
+  }
+  memset(&tm, 0, sizeof(tm));
+  if(sscanf(h, "%d-%d-%d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &n) != 3) return -1;
+  if(h[n] == 'T' || h[n] == ' ') {
+    int m = 0;
+    if(sscanf(h + n + 1, "%d:%d%n:%d%n", &tm.tm_hour, &tm.tm_min, &m, &tm.tm_sec, &m) < 2)
+      return -1;
+    n += 1 + m;
+  }
+  if(h[n] != '\0') return -1;
+  tm.tm_year -= 1900;
+  tm.tm_mon -= 1;
+  tm.tm_isdst = -1;
+  if((new_checkpoint_time.tv_sec = mktime(&tm)) == (time_t)-1) return -1;
+  return 0;
+}
 int main_subscriber(const char *prog, int argc, char **argv) {
   const char *jlog = ".";
   int option_index = 0;
   int c;
   const char *subscriber = NULL;
   int optcnt = 0;
-  while((c = getopt_long(argc,argv,"j:a:e:u:C:p:lv",NULL,&option_index)) != EOF) {
+  while((c = getopt_long(argc,argv,"j:a:e:u:C:T:p:lv",NULL,&option_index)) != EOF) {
     switch(c) {
       case 'j':
         jlog = optarg;
@@ -410,6 +503,13 @@ int main_subscriber(const char *prog, int argc, char **argv) {
         }
         set_checkpoint_flag = 1;
         break;
+      case 'T':
+        if(set_checkpoint_time(optarg) != 0) {
+          fprintf(stderr, "Invalid argument to -T\n");
+          exit(-1);
+        }
+        set_checkpoint_time_flag = 1;
+        break;
       case 'a':
        add_subscriber = optarg;
        optcnt++;
@@ -444,7 +544,9 @@ int main_subscriber(const char *prog, int argc, char **argv) {
     usage(prog);
     exit(-1);
   }
-  if(optcnt > 1 || (set_checkpoint_flag && !(add_subscriber || update_subscriber))) {
+  if(optcnt > 1 || (set_checkpoint_flag && set_checkpoint_time_flag) ||
+     ((set_checkpoint_flag || set_checkpoint_time_flag) &&
+      !(add_subscriber || update_subscriber))) {
     fprintf(stderr, "invalid option combination\n");
     usage(prog);
     exit(-1);
@@ -455,15 +557,26 @@ int main_subscriber(const char *prog, int argc, char **argv) {
   return 0;
 }
 int main_data(const char *prog, int argc, char **argv) {
+  static const struct option longopts[] = {
+    { "parallel", required_argument, NULL, 'P' },
+    { NULL, 0, NULL, 0 }
+  };
   const char *jlog = ".";
   int option_index = 0;
-  int c;
+  int c, parallel = 0;
   show_files = 1;
-  while((c = getopt_long(argc,argv,"j:irdv",NULL,&option_index)) != EOF) {
+  while((c = getopt_long(argc,argv,"j:irdvP:",longopts,&option_index)) != EOF) {
     switch(c) {
       case 'j':
         jlog = optarg;
         break;
+      case 'P':
+        parallel = atoi(optarg);
+        if(parallel < 1) {
+          fprintf(stderr, "Invalid argument to --parallel\n");
+          exit(-1);
+        }
+        break;
       case 'v':
        verbose++;
        break;
@@ -487,6 +600,23 @@ int main_data(const char *prog, int argc, char **argv) {
     usage(prog);
     exit(-1);
   }
+  if(parallel) {
+    jlog_ctx *log = jlog_new(jlog);
+    int fixed;
+    if(jlog_ctx_open_writer(log) != 0) {
+      fprintf(stderr, "error opening '%s': %s\n", jlog, jlog_ctx_err_string(log));
+      exit(-1);
+    }
+    if((fixed = jlog_ctx_prepare(log, parallel)) < 0) {
+      fprintf(stderr, "error preparing '%s': %s\n", jlog, jlog_ctx_err_string(log));
+      jlog_ctx_close(log);
+      exit(-1);
+    }
+    printf("%d segments repaired or reindexed\n", fixed);
+    jlog_ctx_close(log);
+    /* the segments were inspected and repaired on the way */
+    analyze_datafiles = repair_datafiles = 0;
+  }
   process_jlog(jlog, NULL);
   ownership_check(jlog);
   return 0;
@@ -520,6 +650,293 @@ int main_clean(const char *prog, int argc, char **argv) {
   ownership_check(jlog);
   return 0;
 }
+int main_compact(const char *prog, int argc, char **argv) {
+  const char *jlog = ".";
+  size_t rate = 0;
+  int option_index = 0;
+  int c, removed;
+  jlog_ctx *log;
+  while((c = getopt_long(argc,argv,"j:r:v",NULL,&option_index)) != EOF) {
+    switch(c) {
+      case 'j':
+        jlog = optarg;
+        break;
+      case 'r':
+        rate = (size_t)atol(optarg) * 1024;
+        break;
+      case 'v':
+       verbose++;
+       break;
+      default:
+       usage(prog);
+       exit(-1);
+    }
+  }
+  if(optind != argc) {
+    fprintf(stderr, "extraneous arguments: %s\n", argv[optind]);
+    usage(prog);
+    exit(-1);
+  }
+  log = jlog_new(jlog);
+  if(jlog_ctx_open_writer(log) != 0) {
+    fprintf(stderr, "Failed to open jlog '%s': %s\n", jlog, jlog_ctx_err_string(log));
+    return -1;
+  }
+  if((removed = jlog_ctx_compact(log, rate)) < 0) {
+    fprintf(stderr, "Failed to compact jlog '%s': %s\n", jlog, jlog_ctx_err_string(log));
+    jlog_ctx_close(log);
+    return -1;
+  }
+  if(verbose) printf("removed %d superseded records\n", removed);
+  jlog_ctx_close(log);
+  ownership_check(jlog);
+  return 0;
+}
+int main_snapshot(const char *prog, int argc, char **argv) {
+  const char *jlog = ".", *dest = NULL;
+  int option_index = 0;
+  int c;
+  jlog_ctx *log;
+  while((c = getopt_long(argc,argv,"j:d:v",NULL,&option_index)) != EOF) {
+    switch(c) {
+      case 'j':
+        jlog = optarg;
+        break;
+      case 'd':
+        dest = optarg;
+        break;
+      case 'v':
+       verbose++;
+       break;
+      default:
+       usage(prog);
+       exit(-1);
+    }
+  }
+  if(optind != argc || !dest) {
+    usage(prog);
+    exit(-1);
+  }
+  log = jlog_new(jlog);
+  if(jlog_ctx_open_writer(log) != 0) {
+    fprintf(stderr, "Failed to open jlog '%s': %s\n", jlog, jlog_ctx_err_string(log));
+    return -1;
+  }
+  if(jlog_ctx_snapshot(log, dest) != 0) {
+    fprintf(stderr, "Failed to snapshot jlog '%s' to '%s': %s\n", jlog, dest, jlog_ctx_err_string(log));
+    jlog_ctx_close(log);
+    return -1;
+  }
+  jlog_ctx_close(log);
+  if(verbose) printf("snapshot of %s in %s\n", jlog, dest);
+  return 0;
+}
+static void lag_json_string(const char *str) {
+  putchar('"');
+  for(; *str; str++) {
+    if(*str == '"' || *str == '\\') printf("\\%c", *str);
+    else if((unsigned char)*str < 0x20) printf("\\u%04x", (unsigned char)*str);
+    else putchar(*str);
+  }
+  putchar('"');
+}
+int main_lag(const char *prog, int argc, char **argv) {
+  const char *jlog = ".", *sub = NULL;
+  int option_index = 0;
+  int c, i, n, json = 0;
+  jlog_ctx *log;
+  jlog_subscriber_lag one, *lags = NULL;
+  struct timeval now;
+  double age;
+  while((c = getopt_long(argc,argv,"j:s:Jv",NULL,&option_index)) != EOF) {
+    switch(c) {
+      case 'j':
+        jlog = optarg;
+        break;
+      case 's':
+        sub = optarg;
+        break;
+      case 'J':
+        json = 1;
+        break;
+      case 'v':
+       verbose++;
+       break;
+      default:
+       usage(prog);
+       exit(-1);
+    }
+  }
+  if(optind != argc) {
+    fprintf(stderr, "extraneous arguments: %s\n", argv[optind]);
+    usage(prog);
+    exit(-1);
+  }
+  log = jlog_new(jlog);
+  if(sub) {
+    one.subscriber = (char *)sub;
+    if(jlog_ctx_subscriber_lag_detail(log, &one) != 0) {
+      fprintf(stderr, "Failed to measure '%s' in jlog '%s': %s\n", sub, jlog, jlog_ctx_err_string(log));
+      jlog_ctx_close(log);
+      return -1;
+    }
+    lags = &one;
+    n = 1;
+  }
+  else if((n = jlog_ctx_subscribers_lag(log, &lags)) < 0) {
+    fprintf(stderr, "Failed to measure jlog '%s': %s\n", jlog, jlog_ctx_err_string(log));
+    jlog_ctx_close(log);
+    return -1;
+  }
+  gettimeofday(&now, NULL);
+  if(!json && verbose)
+    printf("# subscriber\tcheckpoint\tmessages\tbytes\toldest\tage\tevicted\n");
+  for(i=0; i<n; i++) {
+    age = 0;
+    if(lags[i].oldest_sec)
+      age = (now.tv_sec - (double)lags[i].oldest_sec) +
+            (now.tv_usec - (double)lags[i].oldest_usec) / 1000000.0;
+    if(age < 0) age = 0;
+    if(json) {
+      printf("{\"subscriber\":");
+      lag_json_string(lags[i].subscriber);
+      printf(",\"checkpoint\":\"%08x:%08x\",\"messages\":%llu,\"bytes\":%llu,"
+             "\"oldest\":%u.%06u,\"age\":%.6f,\"evicted\":%llu}\n",
+             lags[i].checkpoint.log, lags[i].checkpoint.marker,
+             (unsigned long long)lags[i].messages, (unsigned long long)lags[i].bytes,
+             lags[i].oldest_sec, lags[i].oldest_usec, age,
+             (unsigned long long)lags[i].evicted);
+    }
+    else {
+      printf("%s\t%08x:%08x\t%llu\t%llu\t%u.%06u\t%.6f\t%llu\n", lags[i].subscriber,
+             lags[i].checkpoint.log, lags[i].checkpoint.marker,
+             (unsigned long long)lags[i].messages, (unsigned long long)lags[i].bytes,
+             lags[i].oldest_sec, lags[i].oldest_usec, age,
+             (unsigned long long)lags[i].evicted);
+    }
+  }
+  if(!sub) jlog_ctx_subscribers_lag_dispose(log, lags, n);
+  jlog_ctx_close(log);
+  return 0;
+}
+static int replica_socket(const char *path, struct sockaddr_un *sun) {
+  int fd;
+  if(strlen(path) >= sizeof(sun->sun_path)) {
+    fprintf(stderr, "socket path too long: %s\n", path);
+    return -1;
+  }
+  memset(sun, 0, sizeof(*sun));
+  sun->sun_family = AF_UNIX;
+  strcpy(sun->sun_path, path);
+  if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    fprintf(stderr, "socket: %s\n", strerror(errno));
+  return fd;
+}
+int main_ship(const char *prog, int argc, char **argv) {
+  const char *jlog = ".", *sock = NULL, *sub = "replica";
+  struct sockaddr_un sun;
+  int option_index = 0, interval = 1000, hold = 0;
+  int c, fd, shipped;
+  jlog_ctx *log;
+  while((c = getopt_long(argc,argv,"j:u:s:i:Hv",NULL,&option_index)) != EOF) {
+    switch(c) {
+      case 'j': jlog = optarg; break;
+      case 'u': sock = optarg; break;
+      case 's': sub = optarg; break;
+      case 'i': interval = atoi(optarg); break;
+      case 'H': hold = 1; break;
+      case 'v':
+       verbose++;
+       break;
+      default:
+       usage(prog);
+       exit(-1);
+    }
+  }
+  if(optind != argc || !sock) {
+    usage(prog);
+    exit(-1);
+  }
+  /* the shipper's position is an ordinary subscriber */
+  log = jlog_new(jlog);
+  if(jlog_ctx_open_writer(log) != 0) {
+    fprintf(stderr, "Failed to open jlog '%s': %s\n", jlog, jlog_ctx_err_string(log));
+    return -1;
+  }
+  if(jlog_ctx_add_subscriber(log, sub, JLOG_BEGIN) != 0 &&
+     jlog_ctx_err(log) != JLOG_ERR_SUBSCRIBER_EXISTS) {
+    fprintf(stderr, "Failed to add subscriber '%s': %s\n", sub, jlog_ctx_err_string(log));
+    return -1;
+  }
+  jlog_ctx_close(log);
+
+  if((fd = replica_socket(sock, &sun)) < 0) return -1;
+  if(connect(fd, (struct sockaddr *)&sun, sizeof(sun)) != 0) {
+    fprintf(stderr, "connect %s: %s\n", sock, strerror(errno));
+    return -1;
+  }
+  log = jlog_new(jlog);
+  if(jlog_ctx_open_reader(log, sub) != 0) {
+    fprintf(stderr, "Failed to open jlog '%s': %s\n", jlog, jlog_ctx_err_string(log));
+    return -1;
+  }
+  while((shipped = jlog_ctx_ship(log, fd, hold)) >= 0) {
+    if(verbose && shipped) printf("shipped %d records\n", shipped);
+    if(!shipped) usleep(interval * 1000);
+  }
+  fprintf(stderr, "Failed to ship jlog '%s': %s\n", jlog, jlog_ctx_err_string(log));
+  jlog_ctx_close(log);
+  close(fd);
+  return -1;
+}
+int main_follow(const char *prog, int argc, char **argv) {
+  const char *jlog = ".", *sock = NULL;
+  struct sockaddr_un sun;
+  int option_index = 0;
+  int c, fd, conn, applied;
+  jlog_ctx *log;
+  while((c = getopt_long(argc,argv,"j:u:v",NULL,&option_index)) != EOF) {
+    switch(c) {
+      case 'j': jlog = optarg; break;
+      case 'u': sock = optarg; break;
+      case 'v':
+       verbose++;
+       break;
+      default:
+       usage(prog);
+       exit(-1);
+    }
+  }
+  if(optind != argc || !sock) {
+    usage(prog);
+    exit(-1);
+  }
+  log = jlog_new(jlog);
+  if(jlog_ctx_open_writer(log) != 0) {
+    fprintf(stderr, "Failed to open jlog '%s': %s\n", jlog, jlog_ctx_err_string(log));
+    return -1;
+  }
+  if((fd = replica_socket(sock, &sun)) < 0) return -1;
+  unlink(sock);
+  if(bind(fd, (struct sockaddr *)&sun, sizeof(sun)) != 0 || listen(fd, 1) != 0) {
+    fprintf(stderr, "listen %s: %s\n", sock, strerror(errno));
+    return -1;
+  }
+  /* one leader at a time; a leader that reconnects resumes from its
+   * own checkpoint */
+  while((conn = accept(fd, NULL, NULL)) >= 0 || errno == EINTR) {
+    if(conn < 0) continue;
+    applied = jlog_ctx_follow(log, conn);
+    if(applied < 0)
+      fprintf(stderr, "Failed to follow into '%s': %s\n", jlog, jlog_ctx_err_string(log));
+    else if(verbose)
+      printf("applied %d records\n", applied);
+    close(conn);
+  }
+  fprintf(stderr, "accept %s: %s\n", sock, strerror(errno));
+  jlog_ctx_close(log);
+  return -1;
+}
 int main_repair(const char *prog, int argc, char **argv) {
   const char *jlog = ".";
   int option_index = 0;
@@ -619,6 +1036,22 @@ int main_meta(const char *prog, int argc, char **argv) {
              log->pre_commit_buffer_len ?
                log->pre_commit_buffer_len - sizeof(*log->pre_commit_pointer) : 0);
       printf("segmentsize    %u\n", log->meta->unit_limit);
+      printf("features       %08x\n", log->meta_ext->features);
+      if(log->meta_ext->features & JLOG_FEATURE_SEQUENCE)
+        printf("lastseq        %llu\n", (unsigned long long)log->meta_ext->last_seq);
+      if(log->meta_ext->features & JLOG_FEATURE_SPARSE_INDEX)
+        printf("indexstride    %u\n", log->meta_ext->index_stride);
+      if(log->meta_ext->features & JLOG_FEATURE_FIXED_RECORDS)
+        printf("recordsize     %u\n", log->meta_ext->record_size);
+      if(log->retention->retain_bytes || log->retention->retain_age || log->retention->retain_segments)
+        printf("retention      %llu bytes, %u seconds, %u segments\n",
+               (unsigned long long)log->retention->retain_bytes,
+               log->retention->retain_age, log->retention->retain_segments);
+      {
+        char locks[MAXPATHLEN];
+        snprintf(locks, sizeof(locks), "%s%clocks", jlog, IFS_CH);
+        printf("locking        %s\n", access(locks, F_OK) == 0 ? "mutex" : "fcntl");
+      }
       break;
     case SHOW_STORAGELOG: printf("%08x\n", log->meta->storage_log); break;
     case SHOW_MAGIC: printf("%08x\n", log->meta->hdr_magic); break;
@@ -652,8 +1085,16 @@ int main_alter(const char *prog, int create, int argc, char **argv) {
   int segment_size = -1;
   int precommit_size = -1;
   int use_compression = -1;
+  int use_sequence = 0;
+  int use_keys = 0;
+  int use_mutex = 0;
+  int use_compact_index = 0;
+  int index_stride = 0;
+  int record_size = 0;
+  long long retain_bytes = -1;
+  long retain_age = -1, retain_segments = -1;
   int optcnt = create;
-  while((c = getopt_long(argc,argv,"c:s:p:j:vm",NULL,&option_index)) != EOF) {
+  while((c = getopt_long(argc,argv,"c:s:p:j:vmSKMXI:F:B:A:N:",NULL,&option_index)) != EOF) {
     switch(c) {
       case 'j':
         jlog = optarg;
@@ -669,6 +1110,60 @@ int main_alter(const char *prog, int create, int argc, char **argv) {
        precommit_size = atoi(optarg);
        optcnt++;
        break;
+      case 'S':
+       if(!create) {
+         fprintf(stderr, "sequence numbers can only be chosen at create\n");
+         exit(-1);
+       }
+       use_sequence = 1;
+       break;
+      case 'K':
+       if(!create) {
+         fprintf(stderr, "keys can only be chosen at create\n");
+         exit(-1);
+       }
+       use_keys = 1;
+       break;
+      case 'M':
+       if(!create) {
+         fprintf(stderr, "the lock backend can only be chosen at create\n");
+         exit(-1);
+       }
+       use_mutex = 1;
+       break;
+      case 'X':
+       if(!create) {
+         fprintf(stderr, "the index width can only be chosen at create\n");
+         exit(-1);
+       }
+       use_compact_index = 1;
+       break;
+      case 'I':
+       if(!create) {
+         fprintf(stderr, "the index stride can only be chosen at create\n");
+         exit(-1);
+       }
+       index_stride = atoi(optarg);
+       break;
+      case 'F':
+       if(!create) {
+         fprintf(stderr, "the record size can only be chosen at create\n");
+         exit(-1);
+       }
+       record_size = atoi(optarg);
+       break;
+      case 'B':
+       retain_bytes = strtoll(optarg, NULL, 10);
+       optcnt++;
+       break;
+      case 'A':
+       retain_age = strtol(optarg, NULL, 10);
+       optcnt++;
+       break;
+      case 'N':
+       retain_segments = strtol(optarg, NULL, 10);
+       optcnt++;
+       break;
       case 'c':
        if(!strcmp(optarg, "on")) {
          use_compression = 1; 
@@ -698,6 +1193,12 @@ int main_alter(const char *prog, int create, int argc, char **argv) {
   }
   jlog_ctx *log = jlog_new(jlog);
   if(create) {
+    jlog_ctx_set_sequence_numbers(log, use_sequence);
+    jlog_ctx_set_record_keys(log, use_keys);
+    jlog_ctx_set_compact_index(log, use_compact_index);
+    jlog_ctx_set_sparse_index(log, index_stride);
+    jlog_ctx_set_fixed_records(log, record_size);
+    if(use_mutex) jlog_ctx_set_lock_backend(log, JLOG_LOCK_SHARED_MUTEX);
     if(jlog_ctx_init(log) != 0) {
       fprintf(stderr, "Failed to initialize jlog '%s': %s\n", jlog, jlog_ctx_err_string(log));
       return -1;
@@ -715,6 +1216,16 @@ int main_alter(const char *prog, int create, int argc, char **argv) {
   if(use_compression >= 0) {
     jlog_ctx_set_use_compression(log, use_compression);
   }
+  if(retain_bytes >= 0 || retain_age >= 0 || retain_segments >= 0) {
+    if(jlog_ctx_set_retention(log,
+         retain_bytes >= 0 ? (u_int64_t)retain_bytes : log->retention->retain_bytes,
+         retain_age >= 0 ? (u_int32_t)retain_age : log->retention->retain_age,
+         retain_segments >= 0 ? (u_int32_t)retain_segments : log->retention->retain_segments) != 0) {
+      fprintf(stderr, "Failed to set retention of jlog '%s': %s\n", jlog, jlog_ctx_err_string(log));
+      jlog_ctx_close(log);
+      return -1;
+    }
+  }
   if(precommit_size >= 0) {
     jlog_ctx_flush_pre_commit_buffer(log);
   }
@@ -763,6 +1274,21 @@ int main(int argc, char **argv) {
     else if(!strcmp(argv[1], "meta")) {
       return main_meta(argv[0], argc-1, argv+1);
     }
+    else if(!strcmp(argv[1], "snapshot")) {
+      return main_snapshot(argv[0], argc-1, argv+1);
+    }
+    else if(!strcmp(argv[1], "ship")) {
+      return main_ship(argv[0], argc-1, argv+1);
+    }
+    else if(!strcmp(argv[1], "follow")) {
+      return main_follow(argv[0], argc-1, argv+1);
+    }
+    else if(!strcmp(argv[1], "lag")) {
+      return main_lag(argv[0], argc-1, argv+1);
+    }
+    else if(!strcmp(argv[1], "compact")) {
+      return main_compact(argv[0], argc-1, argv+1);
+    }
     else if(!strcmp(argv[1], "repair")) {
       return main_repair(argv[0], argc-1, argv+1);
     }
@@ -34,6 +34,7 @@
 #include <getopt.h>
 #include "jlog.h"
 #include "jlog_compress.h"
+#include "jlog_private.h"
 
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
@@ -55,6 +56,11 @@ extern int creat(const char *, int);
 #include <errno.h>
 #endif
 
+#include <sys/wait.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
 #ifndef MIN
 #define  MIN(x, y)               ((x) < (y) ? (x) : (y))
 #endif
@@ -108,15 +114,44 @@ inline hrtime_t my_gethrtime() {
 #define LOGNAME    "/tmp/jtest.foo"
 jlog_ctx *ctx;
 static size_t default_pre_commit_size = 1024*128;
+static int decompress_threads = 0;
+static int sequenced = 0;
+static int keyed = 0;
+static int compact_index = 0;
+static int index_stride = 0;
+static int record_size = 0;
+static int mutex_locks = 0;
 
 void usage() {
   fprintf(stderr,
           "options:\n"
-          "\tinit [-p <path>] [-s <subscriber>] [-j <journalsize>]\n"
-          "\tinit_compressed [-p <path>] [-s <subscriber>] [-j <journalsize>]\n"
+          "\tinit [-p <path>] [-s <subscriber>] [-j <journalsize>] [-S] [-K] [-M] [-X] [-I <stride>] [-F <size>]\n"
+          "\tinit_compressed [-p <path>] [-s <subscriber>] [-j <journalsize>] [-S] [-K] [-M] [-X] [-I <stride>] [-F <size>]\n"
           "\tread [-p <path>] [-n <count>] [-s <subscriber>]\n"
-          "\tbulk_read [-p <path>] [-n <count>] [-s <subscriber>]\n"
+          "\tbulk_read [-p <path>] [-n <count>] [-s <subscriber>] [-t <threads>]\n"
+          "\tprefetch_read [-p <path>] [-n <count>] [-s <subscriber>] [-t <threads>]\n"
           "\twrite [-p <path>] [-l <len>] [-n <count>]\n"
+          "\tfanout_read [-p <path>] [-n <count>] [-s <subscriber>]\n"
+          "\tgroup_read [-p <path>] [-n <count>] [-s <subscriber>]\n"
+          "\tseek_time [-p <path>] [-n <count>] [-s <subscriber>]\n"
+          "\tseek_seq [-p <path>] [-n <count>] [-s <subscriber>]\n"
+          "\tfilter_read [-p <path>] [-n <count>] [-s <subscriber>]\n"
+          "\tcompact [-p <path>] [-n <count>] [-s <subscriber>]\n"
+          "\tsnapshot [-p <path>] [-n <count>] [-s <subscriber>]\n"
+          "\tsubscribers [-p <path>] [-n <count>] [-s <subscriber>]\n"
+          "\treclaim [-p <path>] [-n <count>] [-s <subscriber>]\n"
+          "\tlazy_checkpoint [-p <path>] [-n <count>] [-s <subscriber>]\n"
+          "\tlag [-p <path>] [-n <count>]\n"
+          "\tretention [-p <path>] [-n <count>] [-s <subscriber>]\n"
+          "\tlocks [-p <path>] [-n <count>] [-s <subscriber>]\n"
+          "\tindex_length [-p <path>] [-n <count>]\n"
+          "\tshared_read [-p <path>] [-n <count>] [-s <subscriber>]\n"
+          "\tprepare [-p <path>] [-n <count>] [-s <subscriber>]\n"
+          "\tindex_width [-p <path>] [-n <count>] [-s <subscriber>]\n"
+          "\tfixed_records [-p <path>] [-n <count>] [-s <subscriber>]\n"
+          "\treplicate [-p <path>] [-n <count>] [-s <subscriber>] [-j <journalsize>] [-S] [-K]\n"
+          "\treplicate_compressed [-p <path>] [-n <count>] [-s <subscriber>] [-j <journalsize>] [-S] [-K]\n"
+          "\texport [-p <path>] [-n <count>] [-s <subscriber>] [-j <journalsize>] [-S] [-K]\n"
           "\trepair [-p <path>]\n"
           "\ttwo_checkpoints [-p <path>] [-n <count>] [-s <subscriber>]\n"
           "\tresize_pre_commit [-p <path>] [-l <new_size>]\n");
@@ -136,6 +171,12 @@ print_rate(hrtime_t s, hrtime_t f, uint64_t cnt) {
 void jcreate(const char *path, const char *subscriber, int compressed, int jsize) {
   ctx = jlog_new(path);
   jlog_ctx_set_use_compression(ctx, compressed);
+  jlog_ctx_set_sequence_numbers(ctx, sequenced);
+  jlog_ctx_set_record_keys(ctx, keyed);
+  jlog_ctx_set_compact_index(ctx, compact_index);
+  jlog_ctx_set_sparse_index(ctx, index_stride);
+  jlog_ctx_set_fixed_records(ctx, record_size);
+  if(mutex_locks) jlog_ctx_set_lock_backend(ctx, JLOG_LOCK_SHARED_MUTEX);
   jlog_ctx_alter_journal_size(ctx, jsize);
   if(jlog_ctx_init(ctx) != 0) {
     fprintf(stderr, "jlog_ctx_init failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
@@ -317,6 +358,7 @@ void jopenr_bulk_read(const char *s, int expect, const char *path) {
   jlog_message *messages;
 
   ctx = jlog_new(path);
+  jlog_ctx_set_decompression_threads(ctx, decompress_threads);
   if(jlog_ctx_open_reader(ctx, s) != 0) {
     fprintf(stderr, "jlog_ctx_open_reader failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
     exit(-1);
@@ -361,135 +403,1998 @@ void jopenr_bulk_read(const char *s, int expect, const char *path) {
   jlog_ctx_close(ctx);
 }
 
-void jopenr_two_checks(const char *sub, const char *check_sub, int expect, const char *path) {
-  char begins[20], ends[20];
-  jlog_id begin, end, checkpoint;
-  int count, pass = 0, orig_expect = expect;
-  jlog_message message;
+void jopenr_prefetch_read(const char *s, int expect, const char *path) {
+  char begins[20];
+  jlog_id id;
+  jlog_batch *batch;
+  jlog_prefetch *pf;
+  int i, count;
 
   ctx = jlog_new(path);
-  if(jlog_ctx_open_reader(ctx, sub) != 0) {
+  jlog_ctx_set_decompression_threads(ctx, decompress_threads);
+  if(jlog_ctx_open_reader(ctx, s) != 0) {
     fprintf(stderr, "jlog_ctx_open_reader failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
     exit(-1);
   }
+  if((pf = jlog_prefetch_new(ctx, 100, 3)) == NULL) {
+    fprintf(stderr, "jlog_prefetch_new failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+    exit(-1);
+  }
+  while(expect > 0) {
+    if((count = jlog_prefetch_next(pf, &batch, 1000)) == -1) {
+      fprintf(stderr, "jlog_prefetch_next failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+      exit(-1);
+    }
+    if(count == 0) {
+      fprintf(stderr, "prefetch_read: timed out with %d to go\n", expect);
+      exit(-1);
+    }
+    id = batch->first;
+    for(i=0; i<count && expect > 0; i++, JLOG_ID_ADVANCE(&id)) {
+      jlog_message *message = &batch->messages[i];
+      expect--;
+      jlog_snprint_logid(begins, sizeof(begins), &id);
+      fprintf(stderr, "[%7d] prefetch_read: [%s] - %d\n\t'%.*s'\n", expect, begins,
+              message->mess_len, message->mess_len, (char *)message->mess);
+    }
+    /* only checkpoint what was actually consumed */
+    id.marker--;
+    if(jlog_ctx_read_checkpoint(ctx, &id) != 0) {
+      fprintf(stderr, "checkpoint failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+    } else {
+      fprintf(stderr, "\tcheckpointed...\n");
+    }
+    jlog_prefetch_release(pf, batch);
+  }
+  jlog_prefetch_destroy(pf);
+  jlog_ctx_close(ctx);
+}
 
-  /* add our special trailing check point subscriber */
-  if (jlog_ctx_add_subscriber(ctx, check_sub, JLOG_BEGIN) != 0 && errno != EEXIST) {
-    fprintf(stderr, "jlog_ctx_add_subscriber failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+#define FANOUT_SUBS 4
+
+typedef struct {
+  int seen;
+  int slow;
+  int bad;
+  jlog_id last;
+} jfanout_state;
+
+static int jfanout_cb(void *closure, const jlog_batch *batch) {
+  jfanout_state *st = closure;
+  jlog_id id = batch->first;
+  int i;
+
+  if(batch->first.log < st->last.log ||
+     (batch->first.log == st->last.log && batch->first.marker <= st->last.marker))
+    st->bad++;
+  for(i=0; i<batch->count; i++, JLOG_ID_ADVANCE(&id))
+    if(batch->messages[i].mess_len != 50) st->bad++;
+  st->last = batch->last;
+  __sync_add_and_fetch(&st->seen, batch->count);
+  if(st->slow) usleep(2000);
+  return 0;
+}
+
+void jopenr_fanout_read(const char *s, int expect, const char *path) {
+  char names[FANOUT_SUBS][64];
+  jfanout_state state[FANOUT_SUBS];
+  jlog_fanout *fo;
+  jlog_ctx *reader;
+  jlog_id begin, end;
+  int i, done, waited, failed = 0;
+
+  /* the named subscriber plus a few more starting from the beginning */
+  ctx = jlog_new(path);
+  if(jlog_ctx_open_writer(ctx) != 0) {
+    fprintf(stderr, "jlog_ctx_open_writer failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
     exit(-1);
   }
+  memset(state, 0, sizeof(state));
+  for(i=0; i<FANOUT_SUBS; i++) {
+    if(i == 0) snprintf(names[i], sizeof(names[i]), "%s", s);
+    else snprintf(names[i], sizeof(names[i]), "%s.fan%d", s, i);
+    if(i && jlog_ctx_add_subscriber(ctx, names[i], JLOG_BEGIN) != 0 && errno != EEXIST) {
+      fprintf(stderr, "jlog_ctx_add_subscriber failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+      exit(-1);
+    }
+  }
+  jlog_ctx_close(ctx);
 
-  /* now move the checkpoint subscriber to where the real reader is */
-  if (jlog_get_checkpoint(ctx, sub, &checkpoint) != 0) {
-    fprintf(stderr, "jlog_get_checkpoint failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+  ctx = jlog_new(path);
+  jlog_ctx_set_decompression_threads(ctx, decompress_threads);
+  if((fo = jlog_fanout_new(ctx, 50, 2)) == NULL) {
+    fprintf(stderr, "jlog_fanout_new failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
     exit(-1);
   }
-  
-  if (jlog_ctx_set_subscriber_checkpoint(ctx, check_sub, &checkpoint) != 0) {
-    fprintf(stderr, "jlog_ctx_set_subscriber_checkpoint failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+  state[1].slow = 1;
+  for(i=0; i<FANOUT_SUBS; i++) {
+    if(jlog_fanout_add_subscriber(fo, names[i], jfanout_cb, &state[i]) != 0) {
+      fprintf(stderr, "jlog_fanout_add_subscriber failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+      exit(-1);
+    }
+  }
+  if(jlog_fanout_start(fo) != 0) {
+    fprintf(stderr, "jlog_fanout_start failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
     exit(-1);
   }
+  for(waited = 0; waited < 10000; waited += 10) {
+    for(done = 0, i=0; i<FANOUT_SUBS; i++)
+      if(__sync_add_and_fetch(&state[i].seen, 0) >= expect) done++;
+    if(done == FANOUT_SUBS) break;
+    usleep(10000);
+  }
+  if(jlog_fanout_stop(fo) != 0) {
+    fprintf(stderr, "jlog_fanout_stop failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+    failed = 1;
+  }
+  jlog_fanout_destroy(fo);
+  jlog_ctx_close(ctx);
 
- AGAIN:
-  pass++;
-  /* now we can read and eventually rewind to wherever checkpoint is */
-  while(expect > 0) {
-    if((count = jlog_ctx_read_interval(ctx, &begin, &end)) == -1) {
-      fprintf(stderr, "jlog_ctx_read_interval failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+  for(i=0; i<FANOUT_SUBS; i++) {
+    fprintf(stderr, "fanout_read: %s saw %d\n", names[i], state[i].seen);
+    if(state[i].seen != expect || state[i].bad) failed = 1;
+    reader = jlog_new(path);
+    if(jlog_ctx_open_reader(reader, names[i]) != 0 ||
+       jlog_ctx_read_interval(reader, &begin, &end) != 0) {
+      fprintf(stderr, "fanout_read: %s not checkpointed to the end\n", names[i]);
+      failed = 1;
+    }
+    jlog_ctx_close(reader);
+  }
+
+  ctx = jlog_new(path);
+  if(jlog_ctx_open_writer(ctx) == 0)
+    for(i=1; i<FANOUT_SUBS; i++) jlog_ctx_remove_subscriber(ctx, names[i]);
+  jlog_ctx_close(ctx);
+  if(failed) exit(-1);
+  fprintf(stderr, "fanout_read: ok\n");
+}
+
+#define GROUP_WORKERS 3
+
+typedef struct {
+  jlog_id start;
+  jlog_id finish;
+} jgroup_range;
+
+static void jgroup_worker(const char *s, const char *path, int fd, int crash) {
+  jlog_message messages[37];
+  jgroup_range range;
+  jlog_ctx *reader;
+  int n, idle = 0;
+
+  reader = jlog_new(path);
+  if(jlog_ctx_open_reader(reader, s) != 0) {
+    fprintf(stderr, "jlog_ctx_open_reader failed: %d %s\n", jlog_ctx_err(reader), jlog_ctx_err_string(reader));
+    _exit(1);
+  }
+  while(idle < 50) {
+    n = jlog_ctx_group_lease(reader, 37, &range.start, &range.finish);
+    if(n < 0) {
+      fprintf(stderr, "jlog_ctx_group_lease failed: %d %s\n", jlog_ctx_err(reader), jlog_ctx_err_string(reader));
+      _exit(1);
+    }
+    if(n == 0) {
+      idle++;
+      usleep(10000);
+      continue;
+    }
+    idle = 0;
+    /* die holding the lease; someone else must pick it up */
+    if(crash) _exit(0);
+    if(jlog_ctx_bulk_read_messages(reader, &range.start, n, messages) != 0) {
+      fprintf(stderr, "bulk read failed: %d %s\n", jlog_ctx_err(reader), jlog_ctx_err_string(reader));
+      _exit(1);
+    }
+    if(write(fd, &range, sizeof(range)) != sizeof(range)) _exit(1);
+    if(jlog_ctx_group_commit(reader) != 0) {
+      fprintf(stderr, "jlog_ctx_group_commit failed: %d %s\n", jlog_ctx_err(reader), jlog_ctx_err_string(reader));
+      _exit(1);
+    }
+  }
+  jlog_ctx_close(reader);
+  _exit(0);
+}
+
+static int jgroup_cmp(const void *a, const void *b) {
+  const jgroup_range *ra = a, *rb = b;
+  if(ra->start.log != rb->start.log) return ra->start.log < rb->start.log ? -1 : 1;
+  if(ra->start.marker != rb->start.marker) return ra->start.marker < rb->start.marker ? -1 : 1;
+  return 0;
+}
+
+void jgroup_read(const char *s, int expect, const char *path) {
+  jgroup_range *ranges = NULL;
+  jlog_id begin, end;
+  pid_t pids[GROUP_WORKERS];
+  int fds[2], i, status, n = 0, alloc = 0, total = 0, failed = 0;
+
+  if(pipe(fds) != 0) {
+    perror("pipe");
+    exit(-1);
+  }
+  for(i=0; i<GROUP_WORKERS; i++) {
+    if((pids[i] = fork()) == 0) {
+      close(fds[0]);
+      /* stagger so the first worker reliably abandons a lease */
+      if(i) usleep(50000);
+      jgroup_worker(s, path, fds[1], i == 0);
+    }
+  }
+  close(fds[1]);
+  while(1) {
+    if(n == alloc) {
+      alloc = alloc ? alloc * 2 : 64;
+      ranges = realloc(ranges, alloc * sizeof(*ranges));
+    }
+    if(read(fds[0], &ranges[n], sizeof(*ranges)) != sizeof(*ranges)) break;
+    n++;
+  }
+  close(fds[0]);
+  for(i=0; i<GROUP_WORKERS; i++) {
+    if(waitpid(pids[i], &status, 0) != pids[i] || !WIFEXITED(status) || WEXITSTATUS(status)) {
+      fprintf(stderr, "group_read: worker %d failed\n", i);
+      failed = 1;
+    }
+  }
+
+  qsort(ranges, n, sizeof(*ranges), jgroup_cmp);
+  for(i=0; i<n; i++) {
+    total += ranges[i].finish.marker - ranges[i].start.marker + 1;
+    if(i && ranges[i].start.log == ranges[i-1].finish.log &&
+       ranges[i].start.marker <= ranges[i-1].finish.marker) {
+      fprintf(stderr, "group_read: ranges overlap at %d\n", i);
+      failed = 1;
+    }
+  }
+  fprintf(stderr, "group_read: %d messages in %d leases\n", total, n);
+  if(total != expect) failed = 1;
+  free(ranges);
+
+  ctx = jlog_new(path);
+  if(jlog_ctx_open_reader(ctx, s) != 0 ||
+     jlog_ctx_read_interval(ctx, &begin, &end) != 0) {
+    fprintf(stderr, "group_read: group not checkpointed to the end\n");
+    failed = 1;
+  }
+  jlog_ctx_close(ctx);
+  if(failed) exit(-1);
+  fprintf(stderr, "group_read: ok\n");
+}
+
+#define SEEK_TIME_BASE 1000000000
+
+static int jseek_check(jlog_ctx *reader, int target, int expect) {
+  char ids[20];
+  struct timeval when = { SEEK_TIME_BASE + target, 0 };
+  jlog_message message;
+  jlog_id id;
+
+  if(jlog_ctx_seek_time(reader, &when, &id) != 0) {
+    fprintf(stderr, "jlog_ctx_seek_time failed: %d %s\n", jlog_ctx_err(reader), jlog_ctx_err_string(reader));
+    return -1;
+  }
+  jlog_snprint_logid(ids, sizeof(ids), &id);
+  if(expect < 0) {
+    /* past the end: there must be nothing to read there */
+    if(jlog_ctx_read_message(reader, &id, &message) == 0) {
+      fprintf(stderr, "seek_time: %d found [%s] past the end\n", target, ids);
+      return -1;
+    }
+    fprintf(stderr, "seek_time: %d -> [%s] (end)\n", target, ids);
+    return 0;
+  }
+  if(jlog_ctx_read_message(reader, &id, &message) != 0) {
+    fprintf(stderr, "seek_time: %d -> [%s] read failed: %d %s\n", target, ids,
+            jlog_ctx_err(reader), jlog_ctx_err_string(reader));
+    return -1;
+  }
+  if(message.header->tv_sec != SEEK_TIME_BASE + expect) {
+    fprintf(stderr, "seek_time: %d -> [%s] has time %u, expected %u\n", target, ids,
+            message.header->tv_sec, SEEK_TIME_BASE + expect);
+    return -1;
+  }
+  fprintf(stderr, "seek_time: %d -> [%s]\n", target, ids);
+  return 0;
+}
+
+void jseek_time(const char *s, int count, const char *path) {
+  jlog_ctx *reader;
+  jlog_message m;
+  jlog_id begin, end;
+  struct timeval when;
+  char payload[32];
+  int i, failed = 0;
+
+  ctx = jlog_new(path);
+  if(jlog_ctx_open_writer(ctx) != 0) {
+    fprintf(stderr, "jlog_ctx_open_writer failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+    exit(-1);
+  }
+  /* one message every other second so we can also seek into the gaps */
+  for(i=0; i<count; i++) {
+    when.tv_sec = SEEK_TIME_BASE + 2 * i;
+    when.tv_usec = 0;
+    snprintf(payload, sizeof(payload), "%d", i);
+    m.mess = payload;
+    m.mess_len = strlen(payload);
+    if(jlog_ctx_write_message(ctx, &m, &when) != 0) {
+      fprintf(stderr, "jlog_ctx_write_message failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
       exit(-1);
     }
-    jlog_snprint_logid(begins, sizeof(begins), &begin);
-    jlog_snprint_logid(ends, sizeof(ends), &end);
-    /* printf("reader [%s]  (%s, %s] count: %d\n", s, begins, ends, count); */
-    if(count > 0) {
-      int i;
-      count = MIN(count, expect);
-      for(i=0; i<count; i++, JLOG_ID_ADVANCE(&begin)) {
-        end = begin;
-        if(jlog_ctx_read_message(ctx, &begin, &message) != 0) {
-          fprintf(stderr, "read failed: %d\n", jlog_ctx_err(ctx));
-        } else {
-          expect--;
-          jlog_snprint_logid(begins, sizeof(begins), &begin);
-          fprintf(stderr, "[%7d] read: [%s]\n\t'%.*s'\n", expect, begins,
-                  message.mess_len, (char *)message.mess);
-        }
-      }
-      if(jlog_ctx_read_checkpoint(ctx, &end) != 0) {
-        fprintf(stderr, "checkpoint failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
-      } else {
-        fprintf(stderr, "\tcheckpointed...\n");
-      }
+  }
+  jlog_ctx_close(ctx);
+
+  reader = jlog_new(path);
+  if(jlog_ctx_open_reader(reader, s) != 0) {
+    fprintf(stderr, "jlog_ctx_open_reader failed: %d %s\n", jlog_ctx_err(reader), jlog_ctx_err_string(reader));
+    exit(-1);
+  }
+  failed |= jseek_check(reader, 0, 0);
+  failed |= jseek_check(reader, 1, 2);
+  failed |= jseek_check(reader, count, count);
+  failed |= jseek_check(reader, count + 1, count + 2);
+  failed |= jseek_check(reader, 2 * count - 2, 2 * count - 2);
+  failed |= jseek_check(reader, 2 * count - 1, -1);
+
+  /* rewind the subscriber to the middle and read from there */
+  when.tv_sec = SEEK_TIME_BASE + count;
+  when.tv_usec = 0;
+  if(jlog_ctx_set_subscriber_checkpoint_time(reader, NULL, &when) != 0 ||
+     jlog_ctx_read_interval(reader, &begin, &end) <= 0 ||
+     jlog_ctx_read_message(reader, &begin, &m) != 0 ||
+     m.header->tv_sec != SEEK_TIME_BASE + count) {
+    fprintf(stderr, "seek_time: checkpoint by time failed: %d %s\n",
+            jlog_ctx_err(reader), jlog_ctx_err_string(reader));
+    failed = 1;
+  }
+  jlog_ctx_close(reader);
+  if(failed) exit(-1);
+  fprintf(stderr, "seek_time: ok\n");
+}
+
+void jseek_seq(const char *s, int count, const char *path) {
+  jlog_ctx *reader;
+  jlog_message m, *messages;
+  jlog_id id, begin, end;
+  char payload[32], ids[20];
+  u_int64_t first = 0, target;
+  int i, n, failed = 0;
+
+  ctx = jlog_new(path);
+  if(jlog_ctx_open_writer(ctx) != 0) {
+    fprintf(stderr, "jlog_ctx_open_writer failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+    exit(-1);
+  }
+  for(i=0; i<count; i++) {
+    snprintf(payload, sizeof(payload), "%d", i);
+    m.mess = payload;
+    m.mess_len = strlen(payload);
+    if(jlog_ctx_write_message(ctx, &m, NULL) != 0) {
+      fprintf(stderr, "jlog_ctx_write_message failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+      exit(-1);
     }
   }
+  jlog_ctx_close(ctx);
 
-  /* move checkpoint to our original position */
-  if (jlog_get_checkpoint(ctx, check_sub, &checkpoint) != 0) {
-    fprintf(stderr, "jlog_get_checkpoint failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+  reader = jlog_new(path);
+  if(jlog_ctx_open_reader(reader, s) != 0) {
+    fprintf(stderr, "jlog_ctx_open_reader failed: %d %s\n", jlog_ctx_err(reader), jlog_ctx_err_string(reader));
     exit(-1);
   }
-      
-  if (jlog_ctx_read_checkpoint(ctx, &checkpoint) != 0) {
-    fprintf(stderr, "checkpoint failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
-  } else {
-    fprintf(stderr, "\trewound checkpoint...\n");
-    expect = orig_expect;
+  /* the subscriber was added before the writes, so starts at the first */
+  if(jlog_ctx_read_interval(reader, &begin, &end) <= 0 ||
+     jlog_ctx_read_message(reader, &begin, &m) != 0) {
+    fprintf(stderr, "seek_seq: cannot read the first record: %d %s\n",
+            jlog_ctx_err(reader), jlog_ctx_err_string(reader));
+    exit(-1);
+  }
+  first = jlog_message_seq(reader, &m);
+  for(i=0; i<=10 && !failed; i++) {
+    target = first + (u_int64_t)(count - 1) * i / 10;
+    if(jlog_ctx_seek_seq(reader, target, &id) != 0 ||
+       jlog_ctx_read_message(reader, &id, &m) != 0) {
+      fprintf(stderr, "seek_seq: %llu failed: %d %s\n", (unsigned long long)target,
+              jlog_ctx_err(reader), jlog_ctx_err_string(reader));
+      failed = 1;
+      break;
+    }
+    jlog_snprint_logid(ids, sizeof(ids), &id);
+    snprintf(payload, sizeof(payload), "%d", (int)(target - first));
+    if(jlog_message_seq(reader, &m) != target || m.mess_len != strlen(payload) ||
+       memcmp(m.mess, payload, m.mess_len)) {
+      fprintf(stderr, "seek_seq: %llu -> [%s] has seq %llu\n", (unsigned long long)target,
+              ids, (unsigned long long)jlog_message_seq(reader, &m));
+      failed = 1;
+    }
+    fprintf(stderr, "seek_seq: %llu -> [%s]\n", (unsigned long long)target, ids);
+  }
+  /* past the end */
+  if(jlog_ctx_seek_seq(reader, first + count, &id) != 0 ||
+     jlog_ctx_read_message(reader, &id, &m) == 0) {
+    fprintf(stderr, "seek_seq: found a record past the end\n");
+    failed = 1;
+  }
+  /* bulk reads carry the sequence too */
+  if((n = jlog_ctx_read_interval(reader, &begin, &end)) > 0) {
+    messages = calloc(n, sizeof(*messages));
+    if(jlog_ctx_bulk_read_messages(reader, &begin, n, messages) != 0) {
+      fprintf(stderr, "bulk read failed: %d %s\n", jlog_ctx_err(reader), jlog_ctx_err_string(reader));
+      failed = 1;
+    }
+    for(i=1; i<n && !failed; i++) {
+      if(jlog_message_seq(reader, &messages[i]) !=
+         jlog_message_seq(reader, &messages[i-1]) + 1) {
+        fprintf(stderr, "seek_seq: bulk read seq gap at %d\n", i);
+        failed = 1;
+      }
+    }
+    free(messages);
   }
+  jlog_ctx_close(reader);
+  if(failed) exit(-1);
+  fprintf(stderr, "seek_seq: ok\n");
+}
 
-  if (pass < 2) {
-    goto AGAIN;
+/* runs of one key, long enough to fill whole blocks, plus a rare one */
+static const char *jfilter_key(int i) {
+  static const char *keys[] = { "alpha", "beta", "gamma", "delta" };
+  if(i % 997 == 0) return "rare";
+  return keys[(i / 700) % 4];
+}
+
+void jfilter_read(const char *s, int count, const char *path) {
+  const char *beta[] = { "beta" }, *some[] = { "rare", "delta" };
+  jlog_filter filters[4];
+  int expect[4], got[4];
+  jlog_message m, *messages;
+  jlog_id begin, end, *ids;
+  char payload[32];
+  int i, f, n, total, failed = 0;
+
+  memset(filters, 0, sizeof(filters));
+  filters[1].keys = beta;
+  filters[1].nkeys = 1;
+  filters[2].prefix = "ga";
+  filters[3].keys = some;
+  filters[3].nkeys = 2;
+  memset(expect, 0, sizeof(expect));
+  memset(got, 0, sizeof(got));
+
+  ctx = jlog_new(path);
+  if(jlog_ctx_open_writer(ctx) != 0) {
+    fprintf(stderr, "jlog_ctx_open_writer failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+    exit(-1);
+  }
+  for(i=0; i<count; i++) {
+    const char *key = jfilter_key(i);
+    snprintf(payload, sizeof(payload), "%d", i);
+    m.mess = payload;
+    m.mess_len = strlen(payload);
+    if(jlog_ctx_write_message_key(ctx, &m, NULL, key, strlen(key)) != 0) {
+      fprintf(stderr, "jlog_ctx_write_message_key failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+      exit(-1);
+    }
+    expect[0]++;
+    if(!strcmp(key, "beta")) expect[1]++;
+    if(!strncmp(key, "ga", 2)) expect[2]++;
+    if(!strcmp(key, "rare") || !strcmp(key, "delta")) expect[3]++;
   }
+  jlog_ctx_close(ctx);
 
-  fprintf(stderr, "\tpass 2 complete");
+  ctx = jlog_new(path);
+  if(jlog_ctx_open_reader(ctx, s) != 0) {
+    fprintf(stderr, "jlog_ctx_open_reader failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+    exit(-1);
+  }
+  while((total = jlog_ctx_read_interval(ctx, &begin, &end)) > 0) {
+    messages = calloc(total, sizeof(*messages));
+    ids = calloc(total, sizeof(*ids));
+    for(f=0; f<4; f++) {
+      if((n = jlog_ctx_bulk_read_filtered(ctx, &filters[f], &begin, total, messages, ids)) < 0) {
+        fprintf(stderr, "jlog_ctx_bulk_read_filtered failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+        exit(-1);
+      }
+      for(i=0; i<n; i++) {
+        /* every record handed back is intact and carries the key it was written with */
+        snprintf(payload, sizeof(payload), "%.*s", messages[i].mess_len, (char *)messages[i].mess);
+        if(strncmp(jlog_message_key(ctx, &messages[i]), jfilter_key(atoi(payload)), JLOG_KEY_LEN) ||
+           (i && ids[i].marker <= ids[i-1].marker)) {
+          fprintf(stderr, "filter_read: filter %d returned '%s' with key %.8s\n", f, payload,
+                  jlog_message_key(ctx, &messages[i]));
+          failed = 1;
+        }
+      }
+      got[f] += n;
+    }
+    free(messages);
+    free(ids);
+    if(jlog_ctx_read_checkpoint(ctx, &end) != 0) {
+      fprintf(stderr, "checkpoint failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+      exit(-1);
+    }
+  }
   jlog_ctx_close(ctx);
+  for(f=0; f<4; f++) {
+    fprintf(stderr, "filter_read: filter %d matched %d of %d expected\n", f, got[f], expect[f]);
+    if(got[f] != expect[f]) failed = 1;
+  }
+  if(failed) exit(-1);
+  fprintf(stderr, "filter_read: ok\n");
 }
 
+#define COMPACT_KEYS 50
 
-int main(int argc, char **argv) {
-  int i, len = -1, count = -1;
-  int jsize = 1024000;
-  const char *path = LOGNAME;
-  const char *subscriber = SUBSCRIBER;
-  const char *command;
-  if(argc < 2) {
-    usage();
+void jcompact(const char *s, int count, const char *path) {
+  jlog_message m;
+  jlog_id begin, end, first;
+  char payload[32], key[16];
+  int i, n, last = -1, removed, total = 0, failed = 0;
+  char *seen;
+
+  ctx = jlog_new(path);
+  if(jlog_ctx_open_writer(ctx) != 0) {
+    fprintf(stderr, "jlog_ctx_open_writer failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
     exit(-1);
   }
-  command = argv[1];
-  while(-1 != (i = getopt(argc-1, argv+1, "p:n:l:s:j:"))) {
-    switch(i) {
-    case 'p': path = optarg; break;
-    case 's': subscriber = optarg; break;
-    case 'l': len = atoi(optarg); break;
-    case 'n': count = atoi(optarg); break;
-    case 'j': jsize = atoi(optarg); break;
-    default: usage(); exit(-1);
+  for(i=0; i<count; i++) {
+    snprintf(payload, sizeof(payload), "%d", i);
+    snprintf(key, sizeof(key), "k%d", i % COMPACT_KEYS);
+    m.mess = payload;
+    m.mess_len = strlen(payload);
+    if(jlog_ctx_write_message_key(ctx, &m, NULL, key, strlen(key)) != 0) {
+      fprintf(stderr, "jlog_ctx_write_message_key failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+      exit(-1);
     }
   }
-#if _WIN32
-  mem_init();
-#endif
-  if(!strcmp(command, "init") || !strcmp(command, "init_compressed")) {
-    int compress = strcmp(command, "init_compressed") == 0;
-    jcreate(path, subscriber, compress, jsize);
-    exit(0);
-  } else if(!strcmp(command, "write")) {
-    char *message;
-    if(len < 0) len = 100;
-    if(count < 0) count = 1;
-    message = malloc(len+1);
-    memset(message, 'X', len-1);
-    message[len-1] = '\n';
-    message[len] = '\0';
-    jopenw(message, count, path);
-    exit(0);
-  } else if(!strcmp(command, "read")) {
-    if(count < 0) count = 1;
-    jopenr(subscriber, count, path);
-    exit(0);
-  } else if(!strcmp(command, "bulk_read")) {
-    if(count < 0) count = 1;
-    jopenr_bulk_read(subscriber, count, path);
+  if((removed = jlog_ctx_compact(ctx, 0)) < 0) {
+    fprintf(stderr, "jlog_ctx_compact failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+    exit(-1);
+  }
+  fprintf(stderr, "compact: removed %d of %d\n", removed, count);
+  if(removed == 0) failed = 1;
+  jlog_ctx_close(ctx);
+
+  /* the subscriber sits in the first segment, the writer in the last:
+   * everything between holds only the latest record of each key */
+  seen = calloc(count, 1);
+  ctx = jlog_new(path);
+  if(jlog_ctx_open_reader(ctx, s) != 0) {
+    fprintf(stderr, "jlog_ctx_open_reader failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+    exit(-1);
+  }
+  if(jlog_ctx_first_log_id(ctx, &first) != 0 ||
+     jlog_ctx_last_log_id(ctx, &end) != 0) {
+    fprintf(stderr, "log ids failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+    exit(-1);
+  }
+  n = end.log;
+  while((i = jlog_ctx_read_interval(ctx, &begin, &end)) > 0) {
+    for(; begin.marker <= end.marker; begin.marker++) {
+      if(jlog_ctx_read_message(ctx, &begin, &m) != 0) {
+        fprintf(stderr, "jlog_ctx_read_message failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+        exit(-1);
+      }
+      snprintf(payload, sizeof(payload), "%.*s", m.mess_len, (char *)m.mess);
+      i = atoi(payload);
+      if(i <= last) {
+        fprintf(stderr, "compact: %d read after %d\n", i, last);
+        failed = 1;
+      }
+      if(i + COMPACT_KEYS < count && begin.log != first.log && begin.log != (u_int32_t)n) {
+        fprintf(stderr, "compact: superseded %d survived in %08x\n", i, begin.log);
+        failed = 1;
+      }
+      last = i;
+      seen[i] = 1;
+      total++;
+    }
+    if(jlog_ctx_read_checkpoint(ctx, &end) != 0) {
+      fprintf(stderr, "checkpoint failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+      exit(-1);
+    }
+  }
+  jlog_ctx_close(ctx);
+  for(i=count-COMPACT_KEYS; i<count; i++) {
+    if(i >= 0 && !seen[i]) {
+      fprintf(stderr, "compact: latest record %d is missing\n", i);
+      failed = 1;
+    }
+  }
+  if(total != count - removed) {
+    fprintf(stderr, "compact: read %d, expected %d\n", total, count - removed);
+    failed = 1;
+  }
+  free(seen);
+
+  /* the caught up subscriber frees the first segment; after that, and
+   * throttled or not, another pass has nothing left to do */
+  ctx = jlog_new(path);
+  if(jlog_ctx_open_writer(ctx) != 0 || jlog_ctx_compact(ctx, 0) < 0 ||
+     (removed = jlog_ctx_compact(ctx, 1024 * 1024)) < 0) {
+    fprintf(stderr, "jlog_ctx_compact failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+    exit(-1);
+  }
+  if(removed != 0) {
+    fprintf(stderr, "compact: last pass removed %d\n", removed);
+    failed = 1;
+  }
+  jlog_ctx_close(ctx);
+  if(failed) exit(-1);
+  fprintf(stderr, "compact: ok\n");
+}
+
+/* reads (and checkpoints past) everything a subscriber has left */
+static int jexport_digest(const char *path, const char *s, u_int64_t *digest) {
+  jlog_ctx *reader;
+  jlog_message m;
+  jlog_id begin, end;
+  const char *key;
+  u_int64_t seq;
+  int n, total = 0;
+  size_t i;
+
+  *digest = 14695981039346656037ULL;
+#define DIGEST(p, len) for(i=0; i<(len); i++) *digest = (*digest ^ ((const u_int8_t *)(p))[i]) * 1099511628211ULL
+  reader = jlog_new(path);
+  if(jlog_ctx_open_reader(reader, s) != 0) {
+    fprintf(stderr, "jlog_ctx_open_reader failed: %d %s\n", jlog_ctx_err(reader), jlog_ctx_err_string(reader));
+    exit(-1);
+  }
+  while((n = jlog_ctx_read_interval(reader, &begin, &end)) > 0) {
+    for(; begin.marker <= end.marker; begin.marker++) {
+      if(jlog_ctx_read_message(reader, &begin, &m) != 0) {
+        fprintf(stderr, "jlog_ctx_read_message failed: %d %s\n", jlog_ctx_err(reader), jlog_ctx_err_string(reader));
+        exit(-1);
+      }
+      DIGEST(m.mess, m.mess_len);
+      seq = jlog_message_seq(reader, &m);
+      if((key = jlog_message_key(reader, &m)) != NULL) DIGEST(key, JLOG_KEY_LEN);
+      DIGEST(&seq, sizeof(seq));
+      DIGEST(&m.header->tv_sec, sizeof(m.header->tv_sec));
+      DIGEST(&m.header->tv_usec, sizeof(m.header->tv_usec));
+      total++;
+    }
+    jlog_ctx_read_checkpoint(reader, &end);
+  }
+#undef DIGEST
+  jlog_ctx_close(reader);
+  return total;
+}
+
+void jexport(const char *s, int count, const char *path, int jsize) {
+  jlog_ctx *reader;
+  jlog_message m;
+  jlog_id begin, end;
+  char payload[64], dest[256];
+  u_int64_t want, got[2];
+  int i, n, p[2], status, compressed, imported[2] = { 0, 0 }, failed = 0;
+  pid_t pid;
+
+  ctx = jlog_new(path);
+  if(jlog_ctx_open_writer(ctx) != 0) {
+    fprintf(stderr, "jlog_ctx_open_writer failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+    exit(-1);
+  }
+  for(i=0; i<count; i++) {
+    /* records of varying length, so ranges never line up by accident */
+    snprintf(payload, sizeof(payload), "%d:%.*s", i, i % 37, "abcdefghijklmnopqrstuvwxyz0123456789");
+    snprintf(dest, sizeof(dest), "x%d", i % 7);
+    m.mess = payload;
+    m.mess_len = strlen(payload);
+    if((keyed ? jlog_ctx_write_message_key(ctx, &m, NULL, dest, strlen(dest))
+              : jlog_ctx_write_message(ctx, &m, NULL)) != 0) {
+      fprintf(stderr, "jlog_ctx_write_message failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+      exit(-1);
+    }
+  }
+  jlog_ctx_close(ctx);
+
+  /* import into a plain and a compressed jlog: whichever matches the
+   * source must come out identical, and a mismatch must be refused */
+  signal(SIGPIPE, SIG_IGN);
+  for(compressed=0; compressed<2; compressed++) {
+    snprintf(dest, sizeof(dest), "%s.import%d", path, compressed);
+    jcreate(dest, s, compressed, jsize);
+    if(pipe(p) != 0) {
+      perror("pipe");
+      exit(-1);
+    }
+    if((pid = fork()) == 0) {
+      close(p[1]);
+      ctx = jlog_new(dest);
+      if(jlog_ctx_open_writer(ctx) != 0) {
+        fprintf(stderr, "jlog_ctx_open_writer failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+        exit(3);
+      }
+      if((n = jlog_ctx_import(ctx, p[0])) < 0) {
+        fprintf(stderr, "jlog_ctx_import: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+        exit(jlog_ctx_err(ctx) == JLOG_ERR_FILE_CORRUPT ? 2 : 3);
+      }
+      jlog_ctx_close(ctx);
+      exit(n == count ? 0 : 1);
+    }
+    close(p[0]);
+    reader = jlog_new(path);
+    if(jlog_ctx_open_reader(reader, s) != 0 ||
+       jlog_ctx_read_interval(reader, &begin, &end) <= 0 ||
+       jlog_ctx_last_log_id(reader, &end) != 0) {
+      fprintf(stderr, "export setup failed: %d %s\n", jlog_ctx_err(reader), jlog_ctx_err_string(reader));
+      exit(-1);
+    }
+    n = jlog_ctx_export(reader, &begin, &end, p[1]);
+    close(p[1]);
+    jlog_ctx_close(reader);
+    waitpid(pid, &status, 0);
+    if(!WIFEXITED(status) || (WEXITSTATUS(status) != 0 && WEXITSTATUS(status) != 2)) {
+      fprintf(stderr, "export: import into %s failed\n", dest);
+      failed = 1;
+    }
+    else if(WEXITSTATUS(status) == 0) {
+      if(n != count) {
+        fprintf(stderr, "export: exported %d of %d\n", n, count);
+        failed = 1;
+      }
+      if(jexport_digest(dest, s, &got[compressed]) != count) {
+        fprintf(stderr, "export: %s holds the wrong number of records\n", dest);
+        failed = 1;
+      }
+      imported[compressed] = 1;
+    }
+  }
+  if(jexport_digest(path, s, &want) != count) {
+    fprintf(stderr, "export: source holds the wrong number of records\n");
+    failed = 1;
+  }
+  for(compressed=0; compressed<2; compressed++) {
+    if(imported[compressed] && got[compressed] != want) {
+      fprintf(stderr, "export: import%d differs from the source\n", compressed);
+      failed = 1;
+    }
+  }
+  if(!imported[0] && !imported[1]) failed = 1;
+  if(failed) exit(-1);
+  fprintf(stderr, "export: ok\n");
+}
+
+/* reads a jlog expecting payloads first, first+1, ... in order */
+static int jsnapshot_prefix(const char *path, const char *s, int first) {
+  jlog_ctx *reader;
+  jlog_message m;
+  jlog_id begin, end;
+  char payload[32];
+  int n, total = 0;
+
+  reader = jlog_new(path);
+  if(jlog_ctx_open_reader(reader, s) != 0) {
+    fprintf(stderr, "jlog_ctx_open_reader failed: %d %s\n", jlog_ctx_err(reader), jlog_ctx_err_string(reader));
+    exit(-1);
+  }
+  while((n = jlog_ctx_read_interval(reader, &begin, &end)) > 0) {
+    for(; begin.marker <= end.marker; begin.marker++) {
+      if(jlog_ctx_read_message(reader, &begin, &m) != 0) {
+        fprintf(stderr, "jlog_ctx_read_message failed: %d %s\n", jlog_ctx_err(reader), jlog_ctx_err_string(reader));
+        exit(-1);
+      }
+      snprintf(payload, sizeof(payload), "%.*s", m.mess_len, (char *)m.mess);
+      if(atoi(payload) != first + total) {
+        fprintf(stderr, "snapshot: %s record %d is '%s'\n", path, total, payload);
+        jlog_ctx_close(reader);
+        return -1;
+      }
+      total++;
+    }
+    jlog_ctx_read_checkpoint(reader, &end);
+  }
+  jlog_ctx_close(reader);
+  return total;
+}
+
+void jsnapshot(const char *s, int count, const char *path) {
+  char payload[32], dest[256], seg[2][300];
+  struct stat sa, sb;
+  int i, n, p[2], status, shared = 0, failed = 0;
+  pid_t pid;
+
+  snprintf(dest, sizeof(dest), "%s.snapshot", path);
+  if(pipe(p) != 0) {
+    perror("pipe");
+    exit(-1);
+  }
+  /* a writer that is half way through when the snapshot is taken */
+  if((pid = fork()) == 0) {
+    close(p[0]);
+    ctx = jlog_new(path);
+    if(jlog_ctx_open_writer(ctx) != 0) {
+      fprintf(stderr, "jlog_ctx_open_writer failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+      exit(-1);
+    }
+    for(i=0; i<count; i++) {
+      snprintf(payload, sizeof(payload), "%d", i);
+      if(jlog_ctx_write(ctx, payload, strlen(payload)) != 0) {
+        fprintf(stderr, "jlog_ctx_write failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+        exit(-1);
+      }
+      if(i == count / 2 && write(p[1], "", 1) != 1) exit(-1);
+    }
+    jlog_ctx_close(ctx);
+    exit(0);
+  }
+  close(p[1]);
+  ctx = jlog_new(path);
+  if(jlog_ctx_open_writer(ctx) != 0) {
+    fprintf(stderr, "jlog_ctx_open_writer failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+    exit(-1);
+  }
+  if(read(p[0], payload, 1) != 1 || jlog_ctx_snapshot(ctx, dest) != 0) {
+    fprintf(stderr, "jlog_ctx_snapshot failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+    exit(-1);
+  }
+  jlog_ctx_close(ctx);
+  close(p[0]);
+  waitpid(pid, &status, 0);
+  if(!WIFEXITED(status) || WEXITSTATUS(status) != 0) failed = 1;
+
+  /* sealed segments are shared rather than copied */
+  for(i=0; ; i++) {
+    snprintf(seg[0], sizeof(seg[0]), "%s/%08x", path, i);
+    snprintf(seg[1], sizeof(seg[1]), "%s/%08x", dest, i);
+    if(stat(seg[1], &sb) != 0) break;
+    if(stat(seg[0], &sa) == 0 && sa.st_ino == sb.st_ino) shared++;
+  }
+  if(shared == 0) {
+    fprintf(stderr, "snapshot: no segment is shared, use a smaller -j\n");
+    failed = 1;
+  }
+
+  /* the snapshot is a whole, untorn prefix that takes new writes */
+  n = jsnapshot_prefix(dest, s, 0);
+  fprintf(stderr, "snapshot: %d of %d records, %d segments shared\n", n, count, shared);
+  if(n <= count / 2 || n > count) failed = 1;
+  ctx = jlog_new(dest);
+  snprintf(payload, sizeof(payload), "%d", n);
+  if(jlog_ctx_open_writer(ctx) != 0 || jlog_ctx_write(ctx, payload, strlen(payload)) != 0) {
+    fprintf(stderr, "snapshot: write failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+    failed = 1;
+  }
+  jlog_ctx_close(ctx);
+  if(jsnapshot_prefix(dest, s, n) != 1) failed = 1;
+  if(jsnapshot_prefix(path, s, 0) != count) failed = 1;
+  if(failed) exit(-1);
+  fprintf(stderr, "snapshot: ok\n");
+}
+
+/* a reader handing freed segments to the background reclaimer reads as
+ * before, and its segments are all gone once it closes */
+void jreclaim(const char *s, int count, const char *path) {
+  jlog_id begin, end;
+  char payload[] = "reclaimed", file[300];
+  struct stat sb;
+  int i, n, total = 0, segments = 0, failed = 0;
+
+  jopenw(payload, count, path);
+  ctx = jlog_new(path);
+  jlog_ctx_set_async_reclaim(ctx, 1, 100);
+  if(jlog_ctx_open_reader(ctx, s) != 0) {
+    fprintf(stderr, "jlog_ctx_open_reader failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+    exit(-1);
+  }
+  while((n = jlog_ctx_read_interval(ctx, &begin, &end)) > 0) {
+    total += n;
+    if(jlog_ctx_read_checkpoint(ctx, &end) != 0) {
+      fprintf(stderr, "checkpoint failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+      exit(-1);
+    }
+  }
+  jlog_ctx_close(ctx);
+  for(i=0; i<(int)end.log; i++) {
+    snprintf(file, sizeof(file), "%s/%08x", path, i);
+    if(stat(file, &sb) == 0) segments++;
+  }
+  fprintf(stderr, "reclaim: read %d of %d, %d of %u segments left\n", total, count, segments, end.log);
+  if(total != count || end.log == 0 || segments != 0) failed = 1;
+  if(failed) exit(-1);
+  fprintf(stderr, "reclaim: ok\n");
+}
+
+static int jlazy_read_all(jlog_ctx *reader, jlog_id *last) {
+  jlog_id begin, end;
+  int n, total = 0;
+
+  while((n = jlog_ctx_read_interval(reader, &begin, &end)) > 0) {
+    total += n;
+    if(jlog_ctx_read_checkpoint(reader, &end) != 0) {
+      fprintf(stderr, "checkpoint failed: %d %s\n", jlog_ctx_err(reader), jlog_ctx_err_string(reader));
+      exit(-1);
+    }
+    *last = end;
+  }
+  if(n < 0) {
+    fprintf(stderr, "jlog_ctx_read_interval failed: %d %s\n", jlog_ctx_err(reader), jlog_ctx_err_string(reader));
+    exit(-1);
+  }
+  return total;
+}
+
+/* checkpoints held in memory are written within the interval, free the
+ * segments behind them once written, and are written on close */
+void jlazy_checkpoint(const char *s, int count, const char *path) {
+  jlog_ctx *reader, *other;
+  jlog_id last, live, durable;
+  char payload[] = "lazy", file[300];
+  struct stat sb;
+  int i, n, failed = 0;
+
+  jopenw(payload, count, path);
+  reader = jlog_new(path);
+  if(jlog_ctx_open_reader(reader, s) != 0 ||
+     jlog_ctx_set_lazy_checkpoint(reader, 100, 0) != 0) {
+    fprintf(stderr, "lazy reader failed: %d %s\n", jlog_ctx_err(reader), jlog_ctx_err_string(reader));
+    exit(-1);
+  }
+  memset(&last, 0, sizeof(last));
+  if((n = jlazy_read_all(reader, &last)) != count) {
+    fprintf(stderr, "lazy_checkpoint: read %d of %d\n", n, count);
+    failed = 1;
+  }
+  usleep(300000);
+  other = jlog_new(path);
+  jlog_get_checkpoint(reader, s, &live);
+  if(jlog_get_checkpoint(other, s, &durable) != 0 ||
+     durable.log != live.log || durable.marker != live.marker) {
+    fprintf(stderr, "lazy_checkpoint: %08x:%08x persisted, %08x:%08x read\n",
+            durable.log, durable.marker, live.log, live.marker);
+    failed = 1;
+  }
+  for(i=0; i<(int)last.log; i++) {
+    snprintf(file, sizeof(file), "%s/%08x", path, i);
+    if(stat(file, &sb) == 0) {
+      fprintf(stderr, "lazy_checkpoint: segment %08x not freed\n", i);
+      failed = 1;
+    }
+  }
+
+  /* within one segment and the interval, only close writes it */
+  jlog_ctx_set_lazy_checkpoint(reader, 60000, 0);
+  jopenw(payload, 10, path);
+  n = jlazy_read_all(reader, &last);
+  jlog_get_checkpoint(reader, s, &live);
+  jlog_get_checkpoint(other, s, &durable);
+  if(n != 10 || (durable.log == live.log && durable.marker == live.marker)) {
+    fprintf(stderr, "lazy_checkpoint: read %d, %08x:%08x persisted early\n",
+            n, durable.log, durable.marker);
+    /* a new segment is persisted at once */
+    if(live.log == last.log && live.marker == last.marker) failed = 1;
+  }
+  jlog_ctx_close(reader);
+  jlog_get_checkpoint(other, s, &durable);
+  if(durable.log != live.log || durable.marker != live.marker) {
+    fprintf(stderr, "lazy_checkpoint: close did not persist\n");
+    failed = 1;
+  }
+  jlog_ctx_close(other);
+  if(failed) exit(-1);
+  fprintf(stderr, "lazy_checkpoint: ok\n");
+}
+
+#define LAG_SUBSCRIBER "lagging"
+
+static int jlag_check(const char *path, const char *s, u_int64_t expect,
+                      u_int64_t expect_bytes, time_t written) {
+  jlog_ctx *c = jlog_new(path);
+  jlog_subscriber_lag *lags;
+  u_int64_t messages, bytes;
+  struct timeval oldest;
+  int i, n, failed = 0;
+
+  if(jlog_ctx_subscriber_lag(c, s, &messages, &bytes, &oldest) != 0) {
+    fprintf(stderr, "jlog_ctx_subscriber_lag failed: %d %s\n", jlog_ctx_err(c), jlog_ctx_err_string(c));
+    exit(-1);
+  }
+  fprintf(stderr, "lag: %s behind by %llu messages, %llu bytes\n", s,
+          (unsigned long long)messages, (unsigned long long)bytes);
+  if(messages != expect || (expect_bytes && bytes != expect_bytes) ||
+     (expect == 0 && (bytes != 0 || oldest.tv_sec != 0)) ||
+     (expect != 0 && (oldest.tv_sec < written - 1 || oldest.tv_sec > time(NULL)))) {
+    fprintf(stderr, "lag: expected %llu messages, %llu bytes\n",
+            (unsigned long long)expect, (unsigned long long)expect_bytes);
+    failed = 1;
+  }
+  if((n = jlog_ctx_subscribers_lag(c, &lags)) < 0) {
+    fprintf(stderr, "jlog_ctx_subscribers_lag failed: %d %s\n", jlog_ctx_err(c), jlog_ctx_err_string(c));
+    exit(-1);
+  }
+  for(i=0; i<n; i++) {
+    if(!strcmp(lags[i].subscriber, s) &&
+       (lags[i].messages != messages || lags[i].bytes != bytes ||
+        lags[i].oldest_sec != (u_int32_t)oldest.tv_sec)) {
+      fprintf(stderr, "lag: bulk lag of %s differs\n", s);
+      failed = 1;
+    }
+  }
+  jlog_ctx_subscribers_lag_dispose(c, lags, n);
+  jlog_ctx_close(c);
+  return failed;
+}
+
+/* lag is counted in messages and bytes from indexes and segment sizes */
+void jlag(const char *s, int count, const char *path) {
+  jlog_ctx *reader;
+  jlog_id begin, end;
+  char payload[] = "how far behind", file[300];
+  struct stat sb;
+  u_int64_t total = 0, rec = 0;
+  time_t written = time(NULL);
+  int i, n, read = 0, failed = 0;
+
+  ctx = jlog_new(path);
+  jlog_ctx_add_subscriber(ctx, LAG_SUBSCRIBER, JLOG_BEGIN);
+  jlog_ctx_close(ctx);
+  jopenw(payload, count, path);
+  for(i=0; ; i++) {
+    snprintf(file, sizeof(file), "%s/%08x", path, i);
+    if(stat(file, &sb) != 0) break;
+    total += sb.st_size;
+  }
+  /* uncompressed records of one payload all take the same space */
+  if(total % count == 0) rec = total / count;
+  failed |= jlag_check(path, LAG_SUBSCRIBER, count, total, written);
+
+  /* stop a third of the way in, part way through a segment */
+  reader = jlog_new(path);
+  if(jlog_ctx_open_reader(reader, LAG_SUBSCRIBER) != 0) {
+    fprintf(stderr, "jlog_ctx_open_reader failed: %d %s\n", jlog_ctx_err(reader), jlog_ctx_err_string(reader));
+    exit(-1);
+  }
+  while(read < count / 3 && (n = jlog_ctx_read_interval(reader, &begin, &end)) > 0) {
+    if(read + n > count / 3) {
+      end = begin;
+      end.marker += count / 3 - read - 1;
+      n = count / 3 - read;
+    }
+    read += n;
+    jlog_ctx_read_checkpoint(reader, &end);
+  }
+  failed |= jlag_check(path, LAG_SUBSCRIBER, count - read, rec * (count - read), written);
+
+  /* a lazy checkpoint is measured where the reader really is */
+  jlog_ctx_set_lazy_checkpoint(reader, 60000, 0);
+  while((n = jlog_ctx_read_interval(reader, &begin, &end)) > 0) {
+    read += n;
+    jlog_ctx_read_checkpoint(reader, &end);
+  }
+  failed |= jlag_check(path, LAG_SUBSCRIBER, 0, 0, written);
+  jlog_ctx_close(reader);
+  if(read != count) failed = 1;
+  if(failed) exit(-1);
+  fprintf(stderr, "lag: ok\n");
+}
+
+#define RETAIN_SEGMENTS 3
+
+/* a subscriber retention leaves behind is moved on and told once */
+void jretention(const char *s, int count, const char *path) {
+  jlog_ctx *reader;
+  jlog_subscriber_lag *lags;
+  jlog_id begin, end;
+  char payload[] = "retained for a while", file[300];
+  struct stat sb;
+  u_int64_t messages = 0, evicted = 0;
+  u_int32_t last = 0;
+  int i, n, read = 0, segments = 0, failed = 0;
+
+  ctx = jlog_new(path);
+  if(jlog_ctx_open_writer(ctx) != 0 ||
+     jlog_ctx_set_retention(ctx, 0, 0, RETAIN_SEGMENTS) != 0) {
+    fprintf(stderr, "jlog_ctx_set_retention failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+    exit(-1);
+  }
+  jlog_ctx_close(ctx);
+  jopenw(payload, count, path);
+
+  reader = jlog_new(path);
+  if(jlog_ctx_open_reader(reader, s) != 0 ||
+     jlog_ctx_last_storage_log(reader, &last) != 0) {
+    fprintf(stderr, "jlog_ctx_open_reader failed: %d %s\n", jlog_ctx_err(reader), jlog_ctx_err_string(reader));
+    exit(-1);
+  }
+  for(i=0; i<=(int)last; i++) {
+    snprintf(file, sizeof(file), "%s/%08x", path, i);
+    if(stat(file, &sb) == 0) segments++;
+  }
+  if((n = jlog_ctx_subscribers_lag(reader, &lags)) < 0) {
+    fprintf(stderr, "jlog_ctx_subscribers_lag failed: %d %s\n", jlog_ctx_err(reader), jlog_ctx_err_string(reader));
+    exit(-1);
+  }
+  for(i=0; i<n; i++) {
+    if(strcmp(lags[i].subscriber, s)) continue;
+    messages = lags[i].messages;
+    evicted = lags[i].evicted;
+  }
+  jlog_ctx_subscribers_lag_dispose(reader, lags, n);
+  fprintf(stderr, "retention: %d of %u segments kept, %s evicted past %llu, %llu left\n",
+          segments, last + 1, s, (unsigned long long)evicted, (unsigned long long)messages);
+  if(segments > RETAIN_SEGMENTS || last < RETAIN_SEGMENTS || evicted == 0 ||
+     messages + evicted != (u_int64_t)count)
+    failed = 1;
+
+  if(jlog_ctx_read_interval(reader, &begin, &end) != -1 ||
+     jlog_ctx_err(reader) != JLOG_ERR_SUBSCRIBER_EVICTED) {
+    fprintf(stderr, "retention: eviction not reported\n");
+    failed = 1;
+  }
+  while((n = jlog_ctx_read_interval(reader, &begin, &end)) > 0) {
+    read += n;
+    jlog_ctx_read_checkpoint(reader, &end);
+  }
+  if(n < 0) {
+    fprintf(stderr, "jlog_ctx_read_interval failed: %d %s\n", jlog_ctx_err(reader), jlog_ctx_err_string(reader));
+    failed = 1;
+  }
+  jlog_ctx_close(reader);
+  fprintf(stderr, "retention: read %d after eviction\n", read);
+  if((u_int64_t)read != messages) failed = 1;
+  if(failed) exit(-1);
+  fprintf(stderr, "retention: ok\n");
+}
+
+#define LOCK_WRITERS 4
+
+static void jlocks_writer(const char *path, int count, const char *payload) {
+  jlog_ctx *w = jlog_new(path);
+  int i;
+
+  if(jlog_ctx_open_writer(w) != 0) {
+    fprintf(stderr, "jlog_ctx_open_writer failed: %d %s\n", jlog_ctx_err(w), jlog_ctx_err_string(w));
+    _exit(1);
+  }
+  for(i=0; count < 0 || i<count; i++) {
+    if(jlog_ctx_write(w, payload, strlen(payload)) != 0) {
+      fprintf(stderr, "jlog_ctx_write failed: %d %s\n", jlog_ctx_err(w), jlog_ctx_err_string(w));
+      _exit(1);
+    }
+  }
+  jlog_ctx_close(w);
+  _exit(0);
+}
+
+/* writers in several processes share the jlog; one is killed mid-write,
+ * perhaps holding a lock, and the rest must neither block nor interleave */
+void jlocks(const char *s, int count, const char *path) {
+  const char payload[] = "locked against the others";
+  jlog_message m;
+  jlog_id begin, end;
+  pid_t pids[LOCK_WRITERS], victim;
+  int i, n, status, total = 0, bad = 0, failed = 0;
+  char file[300];
+  struct stat sb;
+
+  snprintf(file, sizeof(file), "%s/locks", path);
+  fprintf(stderr, "locks: %s lock table\n", stat(file, &sb) == 0 ? "with a" : "without a");
+  if((victim = fork()) == 0) jlocks_writer(path, -1, payload);
+  for(i=0; i<LOCK_WRITERS; i++)
+    if((pids[i] = fork()) == 0) jlocks_writer(path, count / LOCK_WRITERS, payload);
+  usleep(20000);
+  kill(victim, SIGKILL);
+  waitpid(victim, &status, 0);
+  for(i=0; i<LOCK_WRITERS; i++) {
+    waitpid(pids[i], &status, 0);
+    if(!WIFEXITED(status) || WEXITSTATUS(status) != 0) failed = 1;
+  }
+
+  ctx = jlog_new(path);
+  if(jlog_ctx_open_reader(ctx, s) != 0) {
+    fprintf(stderr, "jlog_ctx_open_reader failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+    exit(-1);
+  }
+  while((n = jlog_ctx_read_interval(ctx, &begin, &end)) > 0) {
+    for(i=0; i<n; i++, JLOG_ID_ADVANCE(&begin)) {
+      if(jlog_ctx_read_message(ctx, &begin, &m) != 0 ||
+         m.mess_len != sizeof(payload) - 1 || memcmp(m.mess, payload, m.mess_len))
+        bad++;
+      total++;
+    }
+    jlog_ctx_read_checkpoint(ctx, &end);
+  }
+  jlog_ctx_close(ctx);
+  fprintf(stderr, "locks: read %d (%d from the killed writer), %d damaged\n",
+          total, total - (count / LOCK_WRITERS) * LOCK_WRITERS, bad);
+  if(n < 0 || bad || total < (count / LOCK_WRITERS) * LOCK_WRITERS) failed = 1;
+  if(failed) exit(-1);
+  fprintf(stderr, "locks: ok\n");
+}
+
+#define INDEX_ROUNDS 10
+
+/* Drain a reader, checking every message; returns how many it read. */
+static int jindex_length_drain(jlog_ctx *r, const char *payload, int *bad) {
+  jlog_id begin, end;
+  jlog_message m;
+  int n, total = 0;
+
+  while((n = jlog_ctx_read_interval(r, &begin, &end)) > 0) {
+    for(; n > 0; n--, begin.marker++) {
+      if(jlog_ctx_read_message(r, &begin, &m) != 0 ||
+         m.mess_len != strlen(payload) || memcmp(m.mess, payload, m.mess_len))
+        (*bad)++;
+      total++;
+    }
+    jlog_ctx_read_checkpoint(r, &end);
+  }
+  if(n < 0) (*bad)++;
+  return total;
+}
+
+void jindex_length(const char *s, int count, const char *path) {
+  jlog_ctx *w, *ra, *rb;
+  struct _jlog_index_length il;
+  char payload[] = "indexed once", file[300];
+  struct stat sb;
+  int fd, i, j, read_a = 0, read_b = 0, bad = 0, stale = 0;
+
+  ctx = jlog_new(path);
+  jlog_ctx_add_subscriber(ctx, "idx_a", JLOG_BEGIN);
+  jlog_ctx_add_subscriber(ctx, "idx_b", JLOG_BEGIN);
+  jlog_ctx_close(ctx);
+  w = jlog_new(path);
+  ra = jlog_new(path);
+  rb = jlog_new(path);
+  if(jlog_ctx_open_writer(w) != 0 || jlog_ctx_open_reader(ra, "idx_a") != 0 ||
+     jlog_ctx_open_reader(rb, "idx_b") != 0) {
+    fprintf(stderr, "jlog_ctx_open failed\n");
+    exit(-1);
+  }
+  for(i=0; i<INDEX_ROUNDS; i++) {
+    for(j=0; j<count / INDEX_ROUNDS; j++)
+      jlog_ctx_write(w, payload, strlen(payload));
+    /* the first reader indexes what was written and publishes how far */
+    read_a += jindex_length_drain(ra, payload, &bad);
+    snprintf(file, sizeof(file), "%s/idxlen", path);
+    if((fd = open(file, O_RDONLY)) < 0 || read(fd, &il, sizeof(il)) != sizeof(il)) {
+      fprintf(stderr, "index_length: cannot read %s\n", file);
+      exit(-1);
+    }
+    close(fd);
+    snprintf(file, sizeof(file), "%s/%08x.idx", path, il.log);
+    if(il.magic != INDEX_LENGTH_MAGIC || (il.seq & 1) ||
+       stat(file, &sb) != 0 || (u_int64_t)sb.st_size != il.index_len)
+      stale++;
+    /* and the second finds it so without extending it */
+    read_b += jindex_length_drain(rb, payload, &bad);
+  }
+  jlog_ctx_close(ra);
+  jlog_ctx_close(rb);
+  jlog_ctx_close(w);
+  fprintf(stderr, "index_length: read %d and %d, %d damaged, %d stale\n",
+          read_a, read_b, bad, stale);
+  if(read_a != read_b || read_a != (count / INDEX_ROUNDS) * INDEX_ROUNDS ||
+     bad || stale)
+    exit(-1);
+  fprintf(stderr, "index_length: ok\n");
+}
+
+#define SHARED_WORKERS 4
+
+typedef struct {
+  jlog_shared *sh;
+  int count;
+  int *seen;       /* per message, bumped once its range is committed */
+  int *committed;  /* messages committed by all workers */
+  int bad;
+} jshared_worker_state;
+
+static void *jshared_worker(void *arg) {
+  jshared_worker_state *st = arg;
+  jlog_cursor *c = jlog_cursor_new(st->sh);
+  jlog_id begin, end, id;
+  jlog_message m;
+  char buf[32];
+  int n, i, leases = 0, got[100];
+
+  while(__sync_add_and_fetch(st->committed, 0) < st->count) {
+    if((n = jlog_cursor_next(c, 100, &begin, &end)) < 0) {
+      fprintf(stderr, "jlog_cursor_next failed: %d %s\n", jlog_cursor_err(c),
+              jlog_err_string(jlog_cursor_err(c)));
+      st->bad++;
+      break;
+    }
+    if(n == 0) {
+      usleep(1000);
+      continue;
+    }
+    for(i=0, id=begin; i<n; i++, JLOG_ID_ADVANCE(&id)) {
+      got[i] = -1;
+      if(jlog_cursor_read_message(c, &id, &m) != 0 || m.mess_len >= sizeof(buf)) {
+        st->bad++;
+        continue;
+      }
+      memcpy(buf, m.mess, m.mess_len);
+      buf[m.mess_len] = '\0';
+      if(sscanf(buf, "shared %d", &got[i]) != 1 || got[i] < 0 || got[i] >= st->count)
+        got[i] = -1, st->bad++;
+    }
+    /* give every fifth range back for someone else to read again */
+    if(++leases % 5 == 0) {
+      jlog_cursor_release(c);
+      continue;
+    }
+    for(i=0; i<n; i++)
+      if(got[i] >= 0) __sync_add_and_fetch(&st->seen[got[i]], 1);
+    __sync_add_and_fetch(st->committed, n);
+    if(jlog_cursor_commit(c) != 0) st->bad++;
+  }
+  jlog_cursor_destroy(c);
+  return NULL;
+}
+
+void jshared_read(const char *s, int count, const char *path) {
+  jshared_worker_state state[SHARED_WORKERS];
+  pthread_t threads[SHARED_WORKERS];
+  jlog_ctx *w, *r;
+  jlog_shared *sh;
+  jlog_id begin, end;
+  char payload[32];
+  int i, committed = 0, missed = 0, bad = 0, left;
+  int *seen = calloc(count, sizeof(int));
+
+  w = jlog_new(path);
+  r = jlog_new(path);
+  if(jlog_ctx_open_writer(w) != 0 || jlog_ctx_open_reader(r, s) != 0) {
+    fprintf(stderr, "jlog_ctx_open failed\n");
+    exit(-1);
+  }
+  if((sh = jlog_shared_new(r)) == NULL) {
+    fprintf(stderr, "jlog_shared_new failed: %d %s\n", jlog_ctx_err(r), jlog_ctx_err_string(r));
+    exit(-1);
+  }
+  for(i=0; i<SHARED_WORKERS; i++) {
+    state[i].sh = sh;
+    state[i].count = count;
+    state[i].seen = seen;
+    state[i].committed = &committed;
+    state[i].bad = 0;
+    pthread_create(&threads[i], NULL, jshared_worker, &state[i]);
+  }
+  /* the workers read the segment being written as it grows */
+  for(i=0; i<count; i++) {
+    snprintf(payload, sizeof(payload), "shared %d", i);
+    if(jlog_ctx_write(w, payload, strlen(payload)) != 0) {
+      fprintf(stderr, "jlog_ctx_write failed: %d %s\n", jlog_ctx_err(w), jlog_ctx_err_string(w));
+      exit(-1);
+    }
+  }
+  for(i=0; i<SHARED_WORKERS; i++) {
+    pthread_join(threads[i], NULL);
+    bad += state[i].bad;
+  }
+  jlog_shared_destroy(sh);
+  for(i=0; i<count; i++) if(seen[i] != 1) missed++;
+  /* and the subscriber was checkpointed past all of it */
+  left = jlog_ctx_read_interval(r, &begin, &end);
+  jlog_ctx_close(r);
+  jlog_ctx_close(w);
+  free(seen);
+  fprintf(stderr, "shared_read: %d committed, %d not read exactly once, %d damaged, %d left\n",
+          committed, missed, bad, left);
+  if(committed != count || missed || bad || left != 0) exit(-1);
+  fprintf(stderr, "shared_read: ok\n");
+}
+
+void jprepare(const char *s, int count, const char *path) {
+  jlog_ctx *r;
+  jlog_id begin, end;
+  char payload[] = "prepared in parallel", file[300], junk[10];
+  u_int64_t bogus[4] = { 8, 16, 24, 32 };
+  u_int32_t last = 0, log, marker;
+  int fd, n, fixed, expect_fixed, closed, read = 0, unindexed = 0, failed = 0;
+
+  jopenw(payload, count, path);
+  r = jlog_new(path);
+  if(jlog_ctx_open_reader(r, s) != 0 || jlog_ctx_last_storage_log(r, &last) != 0 || last < 3) {
+    fprintf(stderr, "jlog_ctx_open_reader failed: %d %s\n", jlog_ctx_err(r), jlog_ctx_err_string(r));
+    exit(-1);
+  }
+  /* fixed records have no index to be wrong, only the torn segment */
+  expect_fixed = (r->meta_ext->features & JLOG_FEATURE_FIXED_RECORDS) ? 1 : 2;
+  /* as after a crash: no indexes, one of them wrong and a torn segment */
+  for(log = 0; log <= last; log++) {
+    snprintf(file, sizeof(file), "%s/%08x.idx", path, log);
+    unlink(file);
+  }
+  snprintf(file, sizeof(file), "%s/idxlen", path);
+  unlink(file);
+  snprintf(file, sizeof(file), "%s/%08x.idx", path, 1);
+  if((fd = open(file, O_CREAT|O_WRONLY, 0640)) < 0 || write(fd, bogus, sizeof(bogus)) != sizeof(bogus)) {
+    fprintf(stderr, "prepare: cannot write %s\n", file);
+    exit(-1);
+  }
+  close(fd);
+  snprintf(file, sizeof(file), "%s/%08x", path, 2);
+  memset(junk, 0xff, sizeof(junk));
+  if((fd = open(file, O_WRONLY|O_APPEND)) < 0 || write(fd, junk, sizeof(junk)) != sizeof(junk)) {
+    fprintf(stderr, "prepare: cannot write %s\n", file);
+    exit(-1);
+  }
+  close(fd);
+
+  if((fixed = jlog_ctx_prepare(r, 4)) < 0) {
+    fprintf(stderr, "jlog_ctx_prepare failed: %d %s\n", jlog_ctx_err(r), jlog_ctx_err_string(r));
+    exit(-1);
+  }
+  for(log = 0; log <= last; log++) {
+    if(jlog_idx_details(r, log, &marker, &closed) != 0 ||
+       (marker == 0 && log < last) || closed != (log < last))
+      unindexed++;
+  }
+  while((n = jlog_ctx_read_interval(r, &begin, &end)) > 0) {
+    read += n;
+    jlog_ctx_read_checkpoint(r, &end);
+  }
+  jlog_ctx_close(r);
+  fprintf(stderr, "prepare: %d of %u segments fixed, %d not indexed, read %d\n",
+          fixed, last + 1, unindexed, read);
+  /* repair keeps what precedes the torn tail but for its last record */
+  if(fixed != expect_fixed || unindexed || n < 0 || read != count - 1) failed = 1;
+  if(failed) exit(-1);
+  fprintf(stderr, "prepare: ok\n");
+}
+
+void jindex_width(const char *s, int count, const char *path) {
+  jlog_ctx *r;
+  jlog_id begin, end, id;
+  jlog_message m;
+  char payload[] = "narrow index", file[300];
+  struct stat sb;
+  u_int32_t last = 0, log, marker, stride = 1;
+  size_t width, entries;
+  long long bytes = 0;
+  int closed, n, read = 0, bad = 0;
+
+  jopenw(payload, count, path);
+  r = jlog_new(path);
+  if(jlog_ctx_open_reader(r, s) != 0 || jlog_ctx_last_storage_log(r, &last) != 0) {
+    fprintf(stderr, "jlog_ctx_open_reader failed: %d %s\n", jlog_ctx_err(r), jlog_ctx_err_string(r));
+    exit(-1);
+  }
+  width = (r->meta_ext->features & JLOG_FEATURE_COMPACT_INDEX) ? 4 : 8;
+  if(r->meta_ext->features & JLOG_FEATURE_SPARSE_INDEX) stride = r->meta_ext->index_stride;
+  /* read everything back one message at a time, through the index */
+  while((n = jlog_ctx_read_interval(r, &begin, &end)) > 0) {
+    for(id = begin; id.marker <= end.marker; id.marker++) {
+      if(jlog_ctx_read_message(r, &id, &m) != 0 ||
+         m.mess_len != strlen(payload) || memcmp(m.mess, payload, m.mess_len))
+        bad++;
+      else
+        read++;
+    }
+    jlog_ctx_read_checkpoint(r, &end);
+  }
+  for(log = 0; log <= last; log++) {
+    snprintf(file, sizeof(file), "%s/%08x.idx", path, log);
+    if(stat(file, &sb) != 0) continue;
+    if(jlog_idx_details(r, log, &marker, &closed) != 0) {
+      bad++;
+      continue;
+    }
+    /* every stride'th offset, then the count (when sparse) and a 0 */
+    entries = (marker + stride - 1) / stride;
+    if(closed) entries += stride > 1 ? 2 : 1;
+    if((size_t)sb.st_size != entries * width) bad++;
+    bytes += sb.st_size;
+  }
+  jlog_ctx_close(r);
+  fprintf(stderr, "index_width: %zu byte entries every %u, %lld index bytes for %d messages, %d bad\n",
+          width, stride, bytes, read, bad);
+  if(n < 0 || bad || read != count) exit(-1);
+  fprintf(stderr, "index_width: ok\n");
+}
+
+void jfixed_records(const char *s, int count, const char *path) {
+  jlog_ctx *r;
+  jlog_id begin, end;
+  jlog_message *m;
+  char file[300], *payload;
+  struct stat sb;
+  u_int32_t size, last = 0, log, marker, total = 0;
+  int closed, i, n, want, read = 0, bad = 0, indexes = 0;
+
+  ctx = jlog_new(path);
+  jlog_ctx_set_multi_process(ctx, 0);
+  if(jlog_ctx_open_writer(ctx) != 0) {
+    fprintf(stderr, "jlog_ctx_open_writer failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+    exit(-1);
+  }
+  size = ctx->meta_ext->record_size;
+  if(!(ctx->meta_ext->features & JLOG_FEATURE_FIXED_RECORDS) || size < sizeof(int)) {
+    fprintf(stderr, "fixed_records: init the jlog with -F <size> of at least %zu\n", sizeof(int));
+    exit(-1);
+  }
+  payload = calloc(1, size + 1);
+  /* a record of any other size is turned away */
+  if(jlog_ctx_write(ctx, payload, size + 1) == 0 ||
+     jlog_ctx_err(ctx) != JLOG_ERR_ILLEGAL_WRITE)
+    bad++;
+  for(i = 0; i < count; i++) {
+    memcpy(payload, &i, sizeof(i));
+    if(jlog_ctx_write(ctx, payload, size) != 0) bad++;
+  }
+  jlog_ctx_close(ctx);
+
+  r = jlog_new(path);
+  m = calloc(count, sizeof(*m));
+  if(jlog_ctx_open_reader(r, s) != 0) {
+    fprintf(stderr, "jlog_ctx_open_reader failed: %d %s\n", jlog_ctx_err(r), jlog_ctx_err_string(r));
+    exit(-1);
+  }
+  /* segments counted from their lengths, before reading reclaims them */
+  if(jlog_ctx_last_storage_log(r, &last) != 0) bad++;
+  for(log = 0; log <= last; log++) {
+    snprintf(file, sizeof(file), "%s/%08x.idx", path, log);
+    if(stat(file, &sb) == 0) indexes++;
+    snprintf(file, sizeof(file), "%s/%08x", path, log);
+    if(stat(file, &sb) != 0) continue;
+    if(jlog_idx_details(r, log, &marker, &closed) != 0) bad++;
+    else total += marker;
+  }
+  /* intervals sized from the segments, read in bulk and then singly */
+  while((n = jlog_ctx_read_interval(r, &begin, &end)) > 0) {
+    if(jlog_ctx_bulk_read_messages(r, &begin, n, m) != 0) {
+      bad++;
+      break;
+    }
+    for(i = 0; i < n; i++, read++)
+      if(m[i].mess_len != size || memcmp(m[i].mess, &read, sizeof(read))) bad++;
+    want = read - 1;
+    if(jlog_ctx_read_message(r, &end, &m[0]) != 0 ||
+       m[0].mess_len != size || memcmp(m[0].mess, &want, sizeof(want)))
+      bad++;
+    jlog_ctx_read_checkpoint(r, &end);
+  }
+  jlog_ctx_close(r);
+  free(payload);
+  free(m);
+  fprintf(stderr, "fixed_records: %u byte records, %d messages, %d index files, %d bad\n",
+          size, read, indexes, bad);
+  if(n < 0 || bad || indexes || read != count || total != (u_int32_t)count) exit(-1);
+  fprintf(stderr, "fixed_records: ok\n");
+}
+
+#define TABLE_SUBSCRIBERS 40
+
+static int jsubscribers_count(const char *path) {
+  jlog_ctx *c = jlog_new(path);
+  char **subs;
+  int n = jlog_ctx_list_subscribers(c, &subs);
+  if(n >= 0) jlog_ctx_list_subscribers_dispose(c, subs);
+  jlog_ctx_close(c);
+  return n;
+}
+
+void jsubscribers(const char *s, int count, const char *path) {
+  jlog_id begin, end, last;
+  char name[32], first[300], payload[] = "subscribers";
+  struct stat sb;
+  int i, failed = 0;
+  u_int32_t earliest;
+
+  ctx = jlog_new(path);
+  for(i=0; i<TABLE_SUBSCRIBERS; i++) {
+    snprintf(name, sizeof(name), "table%02d", i);
+    if(jlog_ctx_add_subscriber(ctx, name, JLOG_BEGIN) != 0) {
+      fprintf(stderr, "jlog_ctx_add_subscriber failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+      exit(-1);
+    }
+  }
+  jlog_ctx_close(ctx);
+  jopenw(payload, count, path);
+
+  /* the first reader to catch up frees nothing while the others lag */
+  ctx = jlog_new(path);
+  if(jlog_ctx_open_reader(ctx, s) != 0) {
+    fprintf(stderr, "jlog_ctx_open_reader failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+    exit(-1);
+  }
+  memset(&last, 0, sizeof(last));
+  while(jlog_ctx_read_interval(ctx, &begin, &end) > 0) {
+    jlog_ctx_read_checkpoint(ctx, &end);
+    last = end;
+  }
+  jlog_ctx_close(ctx);
+  end = last;
+  if(end.log == 0) {
+    fprintf(stderr, "subscribers: one segment only, use a smaller -j\n");
+    exit(-1);
+  }
+  snprintf(first, sizeof(first), "%s/%08x", path, 0);
+  if((i = jsubscribers_count(path)) != TABLE_SUBSCRIBERS + 1) {
+    fprintf(stderr, "subscribers: listed %d\n", i);
+    failed = 1;
+  }
+
+  ctx = jlog_new(path);
+  for(i=0; i<TABLE_SUBSCRIBERS; i++) {
+    if(stat(first, &sb) != 0) {
+      fprintf(stderr, "subscribers: segment freed with %d readers behind\n", TABLE_SUBSCRIBERS - i);
+      failed = 1;
+    }
+    snprintf(name, sizeof(name), "table%02d", i);
+    if(jlog_ctx_set_subscriber_checkpoint(ctx, name, &end) != 0) {
+      fprintf(stderr, "checkpoint failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+      exit(-1);
+    }
+  }
+  if(stat(first, &sb) == 0) {
+    fprintf(stderr, "subscribers: segment kept with every reader past it\n");
+    failed = 1;
+  }
+  for(i=0; i<TABLE_SUBSCRIBERS; i+=2) {
+    snprintf(name, sizeof(name), "table%02d", i);
+    if(jlog_ctx_remove_subscriber(ctx, name) != 1) failed = 1;
+  }
+  jlog_ctx_close(ctx);
+
+  /* a lost table is rebuilt from the checkpoints */
+  snprintf(first, sizeof(first), "%s/subscribers", path);
+  unlink(first);
+  if((i = jsubscribers_count(path)) != TABLE_SUBSCRIBERS / 2 + 1) {
+    fprintf(stderr, "subscribers: listed %d after rebuild\n", i);
+    failed = 1;
+  }
+  ctx = jlog_new(path);
+  if(jlog_pending_readers(ctx, end.log, &earliest) != TABLE_SUBSCRIBERS / 2 + 1 ||
+     earliest != end.log || jlog_pending_readers(ctx, end.log - 1, NULL) != 0) {
+    fprintf(stderr, "subscribers: pending readers wrong\n");
+    failed = 1;
+  }
+  for(i=1; i<TABLE_SUBSCRIBERS; i+=2) {
+    snprintf(name, sizeof(name), "table%02d", i);
+    if(jlog_ctx_remove_subscriber(ctx, name) != 1) failed = 1;
+  }
+  jlog_ctx_close(ctx);
+  if((i = jsubscribers_count(path)) != 1) {
+    fprintf(stderr, "subscribers: listed %d at the end\n", i);
+    failed = 1;
+  }
+  if(failed) exit(-1);
+  fprintf(stderr, "subscribers: ok\n");
+}
+
+#define REPLICA_SUBSCRIBER "replica"
+
+static int jreplicate_same(const char *a, const char *b) {
+  char ba[4096], bb[4096];
+  FILE *fa, *fb;
+  size_t na, nb;
+  int same = 1;
+
+  fa = fopen(a, "rb");
+  fb = fopen(b, "rb");
+  if(!fa || !fb) same = 0;
+  while(same && (na = fread(ba, 1, sizeof(ba), fa)) > 0) {
+    nb = fread(bb, 1, sizeof(bb), fb);
+    if(na != nb || memcmp(ba, bb, na)) same = 0;
+  }
+  if(same && fread(bb, 1, 1, fb) != 0) same = 0;
+  if(fa) fclose(fa);
+  if(fb) fclose(fb);
+  return same;
+}
+
+void jreplicate(const char *s, int count, const char *path, int compressed, int jsize) {
+  jlog_ctx *reader;
+  jlog_message m;
+  char payload[64], dest[256], seg[2][300];
+  u_int64_t want, got;
+  int i, n, round, written = 0, sv[2], status, failed = 0;
+  u_int32_t log;
+  pid_t pid;
+
+  snprintf(dest, sizeof(dest), "%s.replica", path);
+  jcreate(path, s, compressed, jsize);
+  jcreate(dest, s, compressed, jsize);
+  ctx = jlog_new(path);
+  if(jlog_ctx_open_writer(ctx) != 0 ||
+     jlog_ctx_add_subscriber(ctx, REPLICA_SUBSCRIBER, JLOG_BEGIN) != 0) {
+    fprintf(stderr, "leader setup failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+    exit(-1);
+  }
+
+  if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+    perror("socketpair");
+    exit(-1);
+  }
+  if((pid = fork()) == 0) {
+    close(sv[0]);
+    jlog_ctx_close(ctx);
+    ctx = jlog_new(dest);
+    if(jlog_ctx_open_writer(ctx) != 0) {
+      fprintf(stderr, "jlog_ctx_open_writer failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+      exit(-1);
+    }
+    if((n = jlog_ctx_follow(ctx, sv[1])) < 0)
+      fprintf(stderr, "jlog_ctx_follow failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+    jlog_ctx_close(ctx);
+    exit(n == count ? 0 : 1);
+  }
+  close(sv[1]);
+
+  /* write and ship in rounds, alternately holding for acknowledgement */
+  for(round=0; round<4; round++) {
+    int batch = round < 3 ? count / 4 : count - written;
+    for(i=0; i<batch; i++, written++) {
+      snprintf(payload, sizeof(payload), "%d:%.*s", written, written % 29, "abcdefghijklmnopqrstuvwxyz012");
+      m.mess = payload;
+      m.mess_len = strlen(payload);
+      if((keyed ? jlog_ctx_write_message_key(ctx, &m, NULL, payload, 3)
+                : jlog_ctx_write_message(ctx, &m, NULL)) != 0) {
+        fprintf(stderr, "jlog_ctx_write_message failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+        exit(-1);
+      }
+    }
+    jlog_ctx_flush_pre_commit_buffer(ctx);
+    reader = jlog_new(path);
+    if(jlog_ctx_open_reader(reader, REPLICA_SUBSCRIBER) != 0) {
+      fprintf(stderr, "jlog_ctx_open_reader failed: %d %s\n", jlog_ctx_err(reader), jlog_ctx_err_string(reader));
+      exit(-1);
+    }
+    if((n = jlog_ctx_ship(reader, sv[0], round % 2 == 0)) != batch) {
+      fprintf(stderr, "replicate: round %d shipped %d of %d: %d %s\n", round, n, batch,
+              jlog_ctx_err(reader), jlog_ctx_err_string(reader));
+      failed = 1;
+    }
+    jlog_ctx_close(reader);
+  }
+  jlog_ctx_close(ctx);
+  close(sv[0]);
+  waitpid(pid, &status, 0);
+  if(!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "replicate: follower failed\n");
+    failed = 1;
+  }
+
+  /* every segment the follower has is the leader's, byte for byte */
+  for(log=0; ; log++) {
+    snprintf(seg[0], sizeof(seg[0]), "%s/%08x", path, log);
+    snprintf(seg[1], sizeof(seg[1]), "%s/%08x", dest, log);
+    if(access(seg[0], F_OK) != 0) break;
+    if(!jreplicate_same(seg[0], seg[1])) {
+      fprintf(stderr, "replicate: segment %08x differs\n", log);
+      failed = 1;
+    }
+  }
+  if(log < 2) {
+    fprintf(stderr, "replicate: only %u segments, use a smaller -j\n", log);
+    failed = 1;
+  }
+  if(jexport_digest(path, s, &want) != count || jexport_digest(dest, s, &got) != count ||
+     want != got) {
+    fprintf(stderr, "replicate: follower does not read back as the leader\n");
+    failed = 1;
+  }
+  if(failed) exit(-1);
+  fprintf(stderr, "replicate: ok\n");
+}
+
+void jopenr_two_checks(const char *sub, const char *check_sub, int expect, const char *path) {
+  char begins[20], ends[20];
+  jlog_id begin, end, checkpoint;
+  int count, pass = 0, orig_expect = expect;
+  jlog_message message;
+
+  ctx = jlog_new(path);
+  if(jlog_ctx_open_reader(ctx, sub) != 0) {
+    fprintf(stderr, "jlog_ctx_open_reader failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+    exit(-1);
+  }
+
+  /* add our special trailing check point subscriber */
+  if (jlog_ctx_add_subscriber(ctx, check_sub, JLOG_BEGIN) != 0 && errno != EEXIST) {
+    fprintf(stderr, "jlog_ctx_add_subscriber failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+    exit(-1);
+  }
+
+  /* now move the checkpoint subscriber to where the real reader is */
+  if (jlog_get_checkpoint(ctx, sub, &checkpoint) != 0) {
+    fprintf(stderr, "jlog_get_checkpoint failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+    exit(-1);
+  }
+  
+  if (jlog_ctx_set_subscriber_checkpoint(ctx, check_sub, &checkpoint) != 0) {
+    fprintf(stderr, "jlog_ctx_set_subscriber_checkpoint failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+    exit(-1);
+  }
+
+ AGAIN:
+  pass++;
+  /* now we can read and eventually rewind to wherever checkpoint is */
+  while(expect > 0) {
+    if((count = jlog_ctx_read_interval(ctx, &begin, &end)) == -1) {
+      fprintf(stderr, "jlog_ctx_read_interval failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+      exit(-1);
+    }
+    jlog_snprint_logid(begins, sizeof(begins), &begin);
+    jlog_snprint_logid(ends, sizeof(ends), &end);
+    /* printf("reader [%s]  (%s, %s] count: %d\n", s, begins, ends, count); */
+    if(count > 0) {
+      int i;
+      count = MIN(count, expect);
+      for(i=0; i<count; i++, JLOG_ID_ADVANCE(&begin)) {
+        end = begin;
+        if(jlog_ctx_read_message(ctx, &begin, &message) != 0) {
+          fprintf(stderr, "read failed: %d\n", jlog_ctx_err(ctx));
+        } else {
+          expect--;
+          jlog_snprint_logid(begins, sizeof(begins), &begin);
+          fprintf(stderr, "[%7d] read: [%s]\n\t'%.*s'\n", expect, begins,
+                  message.mess_len, (char *)message.mess);
+        }
+      }
+      if(jlog_ctx_read_checkpoint(ctx, &end) != 0) {
+        fprintf(stderr, "checkpoint failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+      } else {
+        fprintf(stderr, "\tcheckpointed...\n");
+      }
+    }
+  }
+
+  /* move checkpoint to our original position */
+  if (jlog_get_checkpoint(ctx, check_sub, &checkpoint) != 0) {
+    fprintf(stderr, "jlog_get_checkpoint failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+    exit(-1);
+  }
+      
+  if (jlog_ctx_read_checkpoint(ctx, &checkpoint) != 0) {
+    fprintf(stderr, "checkpoint failed: %d %s\n", jlog_ctx_err(ctx), jlog_ctx_err_string(ctx));
+  } else {
+    fprintf(stderr, "\trewound checkpoint...\n");
+    expect = orig_expect;
+  }
+
+  if (pass < 2) {
+    goto AGAIN;
+  }
+
+  fprintf(stderr, "\tpass 2 complete");
+  jlog_ctx_close(ctx);
+}
+
+
+int main(int argc, char **argv) {
+  int i, len = -1, count = -1;
+  int jsize = 1024000;
+  const char *path = LOGNAME;
+  const char *subscriber = SUBSCRIBER;
+  const char *command;
+  if(argc < 2) {
+    usage();
+    exit(-1);
+  }
+  command = argv[1];
+  while(-1 != (i = getopt(argc-1, argv+1, "p:n:l:s:j:t:SKMXI:F:"))) {
+    switch(i) {
+    case 'p': path = optarg; break;
+    case 's': subscriber = optarg; break;
+    case 'l': len = atoi(optarg); break;
+    case 'n': count = atoi(optarg); break;
+    case 'j': jsize = atoi(optarg); break;
+    case 't': decompress_threads = atoi(optarg); break;
+    case 'S': sequenced = 1; break;
+    case 'K': keyed = 1; break;
+    case 'M': mutex_locks = 1; break;
+    case 'X': compact_index = 1; break;
+    case 'I': index_stride = atoi(optarg); break;
+    case 'F': record_size = atoi(optarg); break;
+    default: usage(); exit(-1);
+    }
+  }
+#if _WIN32
+  mem_init();
+#endif
+  if(!strcmp(command, "init") || !strcmp(command, "init_compressed")) {
+    int compress = strcmp(command, "init_compressed") == 0;
+    jcreate(path, subscriber, compress, jsize);
+    exit(0);
+  } else if(!strcmp(command, "write")) {
+    char *message;
+    if(len < 0) len = 100;
+    if(count < 0) count = 1;
+    message = malloc(len+1);
+    memset(message, 'X', len-1);
+    message[len-1] = '\n';
+    message[len] = '\0';
+    jopenw(message, count, path);
+    exit(0);
+  } else if(!strcmp(command, "read")) {
+    if(count < 0) count = 1;
+    jopenr(subscriber, count, path);
+    exit(0);
+  } else if(!strcmp(command, "bulk_read")) {
+    if(count < 0) count = 1;
+    jopenr_bulk_read(subscriber, count, path);
+    exit(0);
+  } else if(!strcmp(command, "prefetch_read")) {
+    if(count < 0) count = 1;
+    jopenr_prefetch_read(subscriber, count, path);
+    exit(0);
+  } else if(!strcmp(command, "fanout_read")) {
+    if(count < 0) count = 1000;
+    jopenr_fanout_read(subscriber, count, path);
+    exit(0);
+  } else if(!strcmp(command, "group_read")) {
+    if(count < 0) count = 1000;
+    jgroup_read(subscriber, count, path);
+    exit(0);
+  } else if(!strcmp(command, "seek_time")) {
+    if(count < 0) count = 1000;
+    jseek_time(subscriber, count, path);
+    exit(0);
+  } else if(!strcmp(command, "seek_seq")) {
+    if(count < 0) count = 1000;
+    jseek_seq(subscriber, count, path);
+    exit(0);
+  } else if(!strcmp(command, "filter_read")) {
+    if(count < 0) count = 1000;
+    jfilter_read(subscriber, count, path);
+    exit(0);
+  } else if(!strcmp(command, "compact")) {
+    if(count < 0) count = 1000;
+    jcompact(subscriber, count, path);
+    exit(0);
+  } else if(!strcmp(command, "export")) {
+    if(count < 0) count = 1000;
+    jexport(subscriber, count, path, jsize);
+    exit(0);
+  } else if(!strcmp(command, "snapshot")) {
+    if(count < 0) count = 1000;
+    jsnapshot(subscriber, count, path);
+    exit(0);
+  } else if(!strcmp(command, "subscribers")) {
+    if(count < 0) count = 1000;
+    jsubscribers(subscriber, count, path);
+    exit(0);
+  } else if(!strcmp(command, "reclaim")) {
+    if(count < 0) count = 1000;
+    jreclaim(subscriber, count, path);
+    exit(0);
+  } else if(!strcmp(command, "lazy_checkpoint")) {
+    if(count < 0) count = 1000;
+    jlazy_checkpoint(subscriber, count, path);
+    exit(0);
+  } else if(!strcmp(command, "lag")) {
+    if(count < 0) count = 1000;
+    jlag(subscriber, count, path);
+    exit(0);
+  } else if(!strcmp(command, "locks")) {
+    if(count < 0) count = 1000;
+    jlocks(subscriber, count, path);
+    exit(0);
+  } else if(!strcmp(command, "index_length")) {
+    if(count < 0) count = 1000;
+    jindex_length(subscriber, count, path);
+    exit(0);
+  } else if(!strcmp(command, "shared_read")) {
+    if(count < 0) count = 1000;
+    jshared_read(subscriber, count, path);
+    exit(0);
+  } else if(!strcmp(command, "prepare")) {
+    if(count < 0) count = 1000;
+    jprepare(subscriber, count, path);
+    exit(0);
+  } else if(!strcmp(command, "index_width")) {
+    if(count < 0) count = 1000;
+    jindex_width(subscriber, count, path);
+    exit(0);
+  } else if(!strcmp(command, "fixed_records")) {
+    if(count < 0) count = 1000;
+    jfixed_records(subscriber, count, path);
+    exit(0);
+  } else if(!strcmp(command, "retention")) {
+    if(count < 0) count = 1000;
+    jretention(subscriber, count, path);
+    exit(0);
+  } else if(!strcmp(command, "replicate") || !strcmp(command, "replicate_compressed")) {
+    if(count < 0) count = 1000;
+    jreplicate(subscriber, count, path, strcmp(command, "replicate_compressed") == 0, jsize);
     exit(0);
   } else if(!strcmp(command, "repair")) {
     jrepair(path);
@@ -66,7 +66,8 @@ cdef extern from "jlog.h":
     JLOG_ERR_SUBSCRIBER_EXISTS,
     JLOG_ERR_CHECKPOINT,
     JLOG_ERR_NOT_SUPPORTED,
-    JLOG_ERR_CLOSE_LOGID
+    JLOG_ERR_CLOSE_LOGID,
+    JLOG_ERR_SUBSCRIBER_EVICTED
 
   ctypedef enum jlog_compression_provider_choice:
     JLOG_COMPRESSION_NULL = 0,
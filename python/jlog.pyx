@@ -42,6 +42,7 @@ JLOG_ERR_SUBSCRIBER_EXISTS = cjlog.JLOG_ERR_SUBSCRIBER_EXISTS
 JLOG_ERR_CHECKPOINT = cjlog.JLOG_ERR_CHECKPOINT
 JLOG_ERR_NOT_SUPPORTED = cjlog.JLOG_ERR_NOT_SUPPORTED
 JLOG_ERR_CLOSE_LOGID = cjlog.JLOG_ERR_CLOSE_LOGID
+JLOG_ERR_SUBSCRIBER_EVICTED = cjlog.JLOG_ERR_SUBSCRIBER_EVICTED
 
 class JLogError(Exception):
   def __init__(self, message, reason = None):